@@ -0,0 +1,189 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+/* sched_setaffinity() and the CPU_* macros are GNU extensions */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "affinity.h"
+#include "sysfs.h"
+#include "logging.h"
+#include "utils.h"
+
+/* From <numaif.h>, which is only available with libnuma installed */
+#define MPOL_PREFERRED				1
+
+static int getNumaNodeCount(void) {
+	int nodeCount = 0;
+	char path[64];
+	while (nodeCount < 1024) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", nodeCount);
+		if (!doesFileExist(path)) {
+			break;
+		}
+		nodeCount++;
+	}
+	return nodeCount;
+}
+
+/* Determines the NUMA node that the controller of the given block device is
+ * attached to. The whole disk's sysfs directory is walked upwards until a
+ * numa_node attribute is found (usually that of the PCI device). Returns -1
+ * if the node cannot be determined. */
+int getDeviceNumaNode(const char *aDevice) {
+	char path[PATH_MAX];
+	if (!getWholeDiskSysfsPath(aDevice, path, sizeof(path) - 16)) {
+		return -1;
+	}
+
+	while (strlen(path) > strlen("/sys/devices")) {
+		char attributePath[PATH_MAX + 16];
+		snprintf(attributePath, sizeof(attributePath), "%s/numa_node", path);
+		long numaNode;
+		if (readSysfsInteger(attributePath, &numaNode)) {
+			return (int)numaNode;
+		}
+		snprintf(attributePath, sizeof(attributePath), "%s/device/numa_node", path);
+		if (readSysfsInteger(attributePath, &numaNode)) {
+			return (int)numaNode;
+		}
+
+		char *lastSlash = strrchr(path, '/');
+		if (!lastSlash) {
+			break;
+		}
+		*lastSlash = 0;
+	}
+	return -1;
+}
+
+/* Parses a sysfs CPU list such as "0-7,16-23" */
+static bool parseCpuList(const char *aCpuList, cpu_set_t *aCpuSet) {
+	CPU_ZERO(aCpuSet);
+	const char *cur = aCpuList;
+	while (*cur) {
+		char *endPtr;
+		long first = strtol(cur, &endPtr, 10);
+		if (endPtr == cur) {
+			return false;
+		}
+		long last = first;
+		if (*endPtr == '-') {
+			cur = endPtr + 1;
+			last = strtol(cur, &endPtr, 10);
+			if (endPtr == cur) {
+				return false;
+			}
+		}
+		for (long cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++) {
+			CPU_SET(cpu, aCpuSet);
+		}
+		cur = endPtr;
+		if (*cur == ',') {
+			cur++;
+		} else if (*cur != 0) {
+			return false;
+		}
+	}
+	return CPU_COUNT(aCpuSet) > 0;
+}
+
+/* Pins the calling process to the CPUs of the given NUMA node and makes the
+ * kernel prefer that node's memory for all subsequent page faults. Since
+ * allocChunk() touches the whole buffer right away, this places the copy
+ * buffers on that node. */
+bool bindToNumaNode(int aNumaNode) {
+	char path[64];
+	char cpuList[1024];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", aNumaNode);
+	if (!readSysfsString(path, cpuList, sizeof(cpuList))) {
+		logmsg(LLVL_ERROR, "Cannot read CPU list of NUMA node %d from %s.\n", aNumaNode, path);
+		return false;
+	}
+
+	cpu_set_t cpuSet;
+	if (!parseCpuList(cpuList, &cpuSet)) {
+		logmsg(LLVL_ERROR, "Cannot parse CPU list '%s' of NUMA node %d.\n", cpuList, aNumaNode);
+		return false;
+	}
+	if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == -1) {
+		logmsg(LLVL_ERROR, "Cannot pin process to CPUs %s of NUMA node %d: %s\n", cpuList, aNumaNode, strerror(errno));
+		return false;
+	}
+
+	unsigned long nodeMask[16] = { 0 };
+	const int bitsPerWord = 8 * sizeof(unsigned long);
+	if (aNumaNode >= (int)(sizeof(nodeMask) * 8)) {
+		logmsg(LLVL_WARN, "NUMA node %d out of range for memory policy, only CPUs were pinned.\n", aNumaNode);
+		return true;
+	}
+	nodeMask[aNumaNode / bitsPerWord] |= 1UL << (aNumaNode % bitsPerWord);
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodeMask, sizeof(nodeMask) * 8) == -1) {
+		logmsg(LLVL_WARN, "Cannot set memory policy for NUMA node %d, only CPUs were pinned: %s\n", aNumaNode, strerror(errno));
+		return true;
+	}
+
+	logmsg(LLVL_INFO, "Copy process and buffers placed on NUMA node %d (CPUs %s).\n", aNumaNode, cpuList);
+	return true;
+}
+
+/* Applies the NUMA placement requested on the command line (or determined
+ * automatically from the device). Failure to place is not fatal, the
+ * conversion merely runs slower. */
+void placeOnDeviceNumaNode(const char *aDevice, int aRequestedNode) {
+	if (aRequestedNode == NUMA_NODE_NONE) {
+		return;
+	}
+
+	int nodeCount = getNumaNodeCount();
+	if (nodeCount < 2) {
+		logmsg(LLVL_DEBUG, "System has %d NUMA node(s), no placement necessary.\n", nodeCount);
+		return;
+	}
+
+	int numaNode = aRequestedNode;
+	if (numaNode == NUMA_NODE_AUTO) {
+		numaNode = getDeviceNumaNode(aDevice);
+		if (numaNode < 0) {
+			logmsg(LLVL_DEBUG, "Cannot determine NUMA node of %s, no placement performed.\n", aDevice);
+			return;
+		}
+		logmsg(LLVL_DEBUG, "%s is attached to NUMA node %d.\n", aDevice, numaNode);
+	}
+
+	if (numaNode >= nodeCount) {
+		logmsg(LLVL_WARN, "NUMA node %d requested, but system only has %d nodes. No placement performed.\n", numaNode, nodeCount);
+		return;
+	}
+	bindToNumaNode(numaNode);
+}
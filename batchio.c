@@ -0,0 +1,112 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include "batchio.h"
+#include "sysfs.h"
+#include "logging.h"
+#include "utils.h"
+
+/* Reading and writing the same spinning disk alternately makes the heads seek
+ * between read and write pointer for every chunk; on top of that, the kernel
+ * writes back the dm-crypt device while the next chunk is read. In batched
+ * mode, several chunks are read, then written and flushed in one go. */
+
+static bool onSameDisk(const char *aDevice1, const char *aDevice2) {
+	if (!strcmp(aDevice1, aDevice2)) {
+		return true;
+	}
+	char path1[PATH_MAX], path2[PATH_MAX];
+	return getWholeDiskSysfsPath(aDevice1, path1, sizeof(path1)) && getWholeDiskSysfsPath(aDevice2, path2, sizeof(path2)) && !strcmp(path1, path2);
+}
+
+/* Decides whether reads and writes are batched. Automatically, they are if
+ * the data is read from and written to the same rotational disk. */
+bool batchIoWanted(const struct conversionParameters *aParameters) {
+	if (aParameters->engine == ENGINE_SPLICE) {
+		/* Only the header window is read ahead when splicing */
+		return false;
+	}
+	switch (aParameters->batchIo) {
+		case BATCHIO_ON:
+			return true;
+		case BATCHIO_OFF:
+			return false;
+		case BATCHIO_AUTO:
+			break;
+	}
+	return isRotationalDevice(aParameters->rawDevice) && onSameDisk(aParameters->rawDevice, aParameters->readDevice);
+}
+
+/* Measures the sequential transfer rate and the seek time of the read device
+ * and derives the number of chunks per batch from them, so that seeking
+ * between reading and writing costs at most BATCHIO_SEEK_OVERHEAD of the
+ * time. Returns 0 if reads and writes are not batched. */
+int batchIoPlan(const struct conversionParameters *aParameters, struct conversionProcess *aConvProcess) {
+	int maxChunks = aParameters->batchWindow / aParameters->blocksize;
+	if (maxChunks < 3) {
+		logmsg(LLVL_WARN, "Batch window of %" PRIu64 " MiB holds less than three chunks of %d MiB, not batching I/O.\n", aParameters->batchWindow / 1024 / 1024, aParameters->blocksize / 1024 / 1024);
+		return 0;
+	}
+
+	/* The second buffer is unused before copying starts */
+	struct chunk *buffer = &aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex];
+	struct ioBackend *backend = &aConvProcess->readBackend;
+	uint32_t sequentialBytes = (buffer->size < BATCHIO_MEASURE_BYTES) ? buffer->size : BATCHIO_MEASURE_BYTES;
+	if (aConvProcess->readDevSize < 2 * (uint64_t)sequentialBytes) {
+		return maxChunks;
+	}
+
+	double startTime = getTime();
+	bool success = chunkReadFrom(buffer, backend, aConvProcess->readDevSize / 2, sequentialBytes) == sequentialBytes;
+	double sequentialTime = getTime() - startTime;
+
+	uint64_t seed = aConvProcess->readDevSize;
+	startTime = getTime();
+	for (int i = 0; success && (i < BATCHIO_MEASURE_SEEKS); i++) {
+		seed = (seed * 6364136223846793005ULL) + 1442695040888963407ULL;
+		uint64_t offset = ((seed >> 16) % (aConvProcess->readDevSize / 4096)) * 4096;
+		success = chunkReadFrom(buffer, backend, offset, 4096) == 4096;
+	}
+	double seekTime = (getTime() - startTime) / BATCHIO_MEASURE_SEEKS;
+	buffer->used = 0;
+	if (!success || (sequentialTime <= 0)) {
+		logmsg(LLVL_WARN, "Cannot measure seek time of %s, batching %d chunks.\n", aParameters->readDevice, maxChunks);
+		return maxChunks;
+	}
+
+	/* Reading and writing a batch of B bytes each takes 2 B / rate and two
+	 * seeks, one to the write pointer and one back */
+	double rate = sequentialBytes / sequentialTime;
+	double batchBytes = seekTime * rate * (1 - BATCHIO_SEEK_OVERHEAD) / BATCHIO_SEEK_OVERHEAD;
+	int chunks = 1 + (int)((batchBytes + aParameters->blocksize - 1) / aParameters->blocksize);
+	chunks = (chunks < 3) ? 3 : chunks;
+	chunks = (chunks > maxChunks) ? maxChunks : chunks;
+	logmsg(LLVL_INFO, "Rotational disk: %.0f MiB/s sequential, %.1f ms per seek; reading and writing %d MiB at once.\n", rate / 1024 / 1024, seekTime * 1000, (chunks - 1) * (aParameters->blocksize / 1024 / 1024));
+	return chunks;
+}
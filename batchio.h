@@ -0,0 +1,49 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __BATCHIO_H__
+#define __BATCHIO_H__
+
+#include <stdbool.h>
+
+#include "parameters.h"
+#include "engine.h"
+
+#define BATCHIO_DEFAULT_WINDOW			(512 * 1024 * 1024)
+
+/* Data read sequentially to measure the transfer rate */
+#define BATCHIO_MEASURE_BYTES			(16 * 1024 * 1024)
+
+/* Number of random reads to measure the seek time */
+#define BATCHIO_MEASURE_SEEKS			16
+
+/* Fraction of the time that may be spent seeking between reading and
+ * writing */
+#define BATCHIO_SEEK_OVERHEAD			0.02
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool batchIoWanted(const struct conversionParameters *aParameters);
+int batchIoPlan(const struct conversionParameters *aParameters, struct conversionProcess *aConvProcess);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
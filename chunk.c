@@ -31,6 +31,8 @@
 #include "logging.h"
 #include "chunk.h"
 #include "random.h"
+#include "crashpoint.h"
+#include "probes.h"
 
 bool allocChunk(struct chunk *aChunk, uint32_t aSize) {
 	memset(aChunk, 0, sizeof(struct chunk));
@@ -57,16 +59,52 @@ static bool checkedSeek(int aFd, off_t aOffset, const char *aCaller) {
 	return true;
 }
 
-ssize_t chunkReadAt(struct chunk *aChunk, int aFd, uint64_t aOffset, uint32_t aSize) {
-	ssize_t bytesRead;
-	if (!checkedSeek(aFd, aOffset, "chunkReadAt")) {
+static ssize_t fdReadAt(struct ioBackend *aBackend, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	aOffset += aBackend->offset;
+	if (!checkedSeek(aBackend->fd, aOffset, "chunkReadAt")) {
 		return -1;
 	}
+	return read(aBackend->fd, aData, aLength);
+}
+
+static ssize_t fdWriteAt(struct ioBackend *aBackend, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	aOffset += aBackend->offset;
+	if (!checkedSeek(aBackend->fd, aOffset, "chunkWriteAt")) {
+		return -1;
+	}
+	CRASHPOINT("chunk write");
+	ssize_t bytesWritten = write(aBackend->fd, aData, aLength);
+	CRASHPOINT("chunk written");
+	return bytesWritten;
+}
+
+static bool fdFlush(struct ioBackend *aBackend) {
+	CRASHPOINT("fsync");
+	return fsync(aBackend->fd) == 0;
+}
+
+/* Initializes a backend that performs I/O on an open file descriptor */
+void initFdBackend(struct ioBackend *aBackend, int aFd) {
+	memset(aBackend, 0, sizeof(struct ioBackend));
+	aBackend->name = "fd";
+	aBackend->readAt = fdReadAt;
+	aBackend->writeAt = fdWriteAt;
+	aBackend->flush = fdFlush;
+	aBackend->fd = aFd;
+}
+
+ssize_t chunkReadFrom(struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset, uint32_t aSize) {
+	ssize_t bytesRead;
 	if (aSize > aChunk->size) {
 		logmsg(LLVL_CRITICAL, "chunkReadAt: Refusing to read %u bytes with only a %u bytes large buffer.\n", aSize, aChunk->size);
 		return -1;
 	}
-	bytesRead = read(aFd, aChunk->data, aSize);
+	PROBE2(chunk__read__start, aOffset, aSize);
+	uint64_t startTime = PROBE_TIMER_START(chunk__read__done);
+	bytesRead = aBackend->readAt(aBackend, aChunk->data, aSize, aOffset);
+	if (PROBE_ENABLED(chunk__read__done)) {
+		PROBE4(chunk__read__done, aOffset, aSize, bytesRead, PROBE_TIMER_ELAPSED(startTime));
+	}
 	if (bytesRead < 0) {
 		aChunk->used = 0;
 	} else {
@@ -75,37 +113,54 @@ ssize_t chunkReadAt(struct chunk *aChunk, int aFd, uint64_t aOffset, uint32_t aS
 	return bytesRead;
 }
 
-ssize_t chunkWriteAt(const struct chunk *aChunk, int aFd, uint64_t aOffset) {
-	ssize_t bytesWritten;
-	if (!checkedSeek(aFd, aOffset, "chunkWriteAt")) {
-		return -1;
+ssize_t chunkWriteTo(const struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset) {
+	PROBE2(chunk__write__start, aOffset, aChunk->used);
+	uint64_t startTime = PROBE_TIMER_START(chunk__write__done);
+	ssize_t bytesWritten = aBackend->writeAt(aBackend, aChunk->data, aChunk->used, aOffset);
+	if (PROBE_ENABLED(chunk__write__done)) {
+		PROBE4(chunk__write__done, aOffset, aChunk->used, bytesWritten, PROBE_TIMER_ELAPSED(startTime));
 	}
-	bytesWritten = write(aFd, aChunk->data, aChunk->used);
 	if (bytesWritten != aChunk->used) {
 		logmsg(LLVL_WARN, "Requested write of %d bytes unsuccessful (wrote %ld).\n", aChunk->used, bytesWritten);
 	}
 	return bytesWritten;
 }
 
+bool backendFlush(struct ioBackend *aBackend) {
+	return aBackend->flush ? aBackend->flush(aBackend) : true;
+}
+
+ssize_t chunkReadAt(struct chunk *aChunk, int aFd, uint64_t aOffset, uint32_t aSize) {
+	struct ioBackend backend;
+	initFdBackend(&backend, aFd);
+	return chunkReadFrom(aChunk, &backend, aOffset, aSize);
+}
+
+ssize_t chunkWriteAt(const struct chunk *aChunk, int aFd, uint64_t aOffset) {
+	struct ioBackend backend;
+	initFdBackend(&backend, aFd);
+	return chunkWriteTo(aChunk, &backend, aOffset);
+}
+
 #ifdef DEVELOPMENT
 /* Don't even compile these variants in if we're not in a development build so
  * there's no possibility they get used accidently */
 
-ssize_t unreliableChunkReadAt(struct chunk *aChunk, int aFd, uint64_t aOffset, uint32_t aSize) {
+ssize_t unreliableChunkReadFrom(struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset, uint32_t aSize) {
 	if (randomEvent(100)) {
 		logmsg(LLVL_WARN, "Fault injection: Failing unreliable read at offset 0x%lx.\n", aOffset);
 		return -1;
 	} else {
-		return chunkReadAt(aChunk, aFd, aOffset, aSize);
+		return chunkReadFrom(aChunk, aBackend, aOffset, aSize);
 	}
 }
 
-ssize_t unreliableChunkWriteAt(struct chunk *aChunk, int aFd, uint64_t aOffset) {
+ssize_t unreliableChunkWriteTo(struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset) {
 	if (randomEvent(100)) {
 		logmsg(LLVL_WARN, "Fault injection: Failing unreliable write at offset 0x%lx.\n", aOffset);
 		return -1;
 	} else {
-		return chunkWriteAt(aChunk, aFd, aOffset);
+		return chunkWriteTo(aChunk, aBackend, aOffset);
 	}
 }
 #endif
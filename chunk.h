@@ -26,6 +26,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 struct chunk {
 	uint32_t size;			/* Total chunk size */
@@ -33,13 +34,30 @@ struct chunk {
 	uint8_t *data;			/* Data */
 };
 
+/* Something chunks can be read from and written to. Usually this is a block
+ * device accessed through a file descriptor, but it can also be a simulated
+ * device (see simdev.h). */
+struct ioBackend {
+	const char *name;
+	ssize_t (*readAt)(struct ioBackend *aBackend, uint8_t *aData, uint32_t aLength, uint64_t aOffset);
+	ssize_t (*writeAt)(struct ioBackend *aBackend, const uint8_t *aData, uint32_t aLength, uint64_t aOffset);
+	bool (*flush)(struct ioBackend *aBackend);
+	int fd;					/* File descriptor (fd backend) */
+	uint64_t offset;		/* Added to every offset */
+	void *context;			/* Backend specific state */
+};
+
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool allocChunk(struct chunk *aChunk, uint32_t aSize);
 void freeChunk(struct chunk *aChunk);
+void initFdBackend(struct ioBackend *aBackend, int aFd);
+ssize_t chunkReadFrom(struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset, uint32_t aSize);
+ssize_t chunkWriteTo(const struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset);
+bool backendFlush(struct ioBackend *aBackend);
 ssize_t chunkReadAt(struct chunk *aChunk, int aFd, uint64_t aOffset, uint32_t aSize);
 ssize_t chunkWriteAt(const struct chunk *aChunk, int aFd, uint64_t aOffset);
-ssize_t unreliableChunkReadAt(struct chunk *aChunk, int aFd, uint64_t aOffset, uint32_t aSize);
-ssize_t unreliableChunkWriteAt(struct chunk *aChunk, int aFd, uint64_t aOffset);
+ssize_t unreliableChunkReadFrom(struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset, uint32_t aSize);
+ssize_t unreliableChunkWriteTo(struct chunk *aChunk, struct ioBackend *aBackend, uint64_t aOffset);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
@@ -0,0 +1,279 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+
+#include "cipherbench.h"
+#include "globals.h"
+#include "logging.h"
+#include "utils.h"
+
+#ifndef SOL_ALG
+#define SOL_ALG			279
+#endif
+
+/* Ciphers which are reasonable for a new LUKS volume. Adiantum is meant for
+ * CPUs without AES instructions. */
+static const struct cipherCandidate candidates[] = {
+	{ "aes-xts-plain64", "xts(aes)", 256, 16 },
+	{ "aes-xts-plain64", "xts(aes)", 512, 16 },
+	{ "serpent-xts-plain64", "xts(serpent)", 256, 16 },
+	{ "serpent-xts-plain64", "xts(serpent)", 512, 16 },
+	{ "twofish-xts-plain64", "xts(twofish)", 256, 16 },
+	{ "twofish-xts-plain64", "xts(twofish)", 512, 16 },
+	{ "camellia-xts-plain64", "xts(camellia)", 256, 16 },
+	{ "camellia-xts-plain64", "xts(camellia)", 512, 16 },
+	{ "xchacha12,aes-adiantum-plain64", "adiantum(xchacha12,aes)", 256, 32 },
+	{ "xchacha20,aes-adiantum-plain64", "adiantum(xchacha20,aes)", 256, 32 },
+};
+
+static const int sectorSizes[] = { DEFAULT_CRYPT_SECTOR_SIZE, 4096 };
+
+struct benchThread {
+	int tfmFd;
+	const struct cipherCandidate *candidate;
+	int sectorSize;
+	bool encrypt;
+	uint32_t length;
+	double deadline;
+	uint64_t bytesProcessed;
+	bool success;
+};
+
+/* Opens a transformation of the kernel crypto API with a fixed key. Returns
+ * -1 if the algorithm is not available. */
+static int openTransformation(const struct cipherCandidate *aCandidate) {
+	int fd = socket(AF_ALG, SOCK_SEQPACKET, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	struct sockaddr_alg address = {
+		.salg_family = AF_ALG,
+		.salg_type = "skcipher",
+	};
+	strncpy((char*)address.salg_name, aCandidate->kernelName, sizeof(address.salg_name) - 1);
+	uint8_t key[64];
+	for (unsigned int i = 0; i < sizeof(key); i++) {
+		/* XTS rejects keys with identical halves */
+		key[i] = (i * 37) + 1;
+	}
+	if ((bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) || (setsockopt(fd, SOL_ALG, ALG_SET_KEY, key, aCandidate->keySize / 8) == -1)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Processes one sector per request, with the IV of its sector number (plain64),
+ * just like dm-crypt does */
+static bool processSector(int aOpFd, const struct benchThread *aThread, uint8_t *aData, uint64_t aSector) {
+	uint8_t control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + 32)];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = {
+		.iov_base = aData,
+		.iov_len = aThread->sectorSize,
+	};
+	struct msghdr message = {
+		.msg_control = control,
+		.msg_controllen = CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + aThread->candidate->ivSize),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_ALG;
+	header->cmsg_type = ALG_SET_OP;
+	header->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+	uint32_t operation = aThread->encrypt ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+	memcpy(CMSG_DATA(header), &operation, sizeof(operation));
+
+	header = CMSG_NXTHDR(&message, header);
+	header->cmsg_level = SOL_ALG;
+	header->cmsg_type = ALG_SET_IV;
+	header->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + aThread->candidate->ivSize);
+	struct af_alg_iv *iv = (struct af_alg_iv*)CMSG_DATA(header);
+	iv->ivlen = aThread->candidate->ivSize;
+	memcpy(iv->iv, &aSector, sizeof(aSector));
+
+	if (sendmsg(aOpFd, &message, 0) != aThread->sectorSize) {
+		return false;
+	}
+	return read(aOpFd, aData, aThread->sectorSize) == aThread->sectorSize;
+}
+
+static void *benchThreadMain(void *aArgument) {
+	struct benchThread *thread = (struct benchThread*)aArgument;
+	thread->success = false;
+	int opFd = accept(thread->tfmFd, NULL, 0);
+	uint8_t *data = malloc(thread->length);
+	if ((opFd == -1) || !data) {
+		if (opFd != -1) {
+			close(opFd);
+		}
+		free(data);
+		return NULL;
+	}
+	memset(data, 0x5a, thread->length);
+
+	thread->success = true;
+	uint32_t sectorCount = thread->length / thread->sectorSize;
+	while (thread->success && (getTime() < thread->deadline)) {
+		for (uint32_t i = 0; i < sectorCount; i++) {
+			if (!processSector(opFd, thread, data + (i * thread->sectorSize), i)) {
+				thread->success = false;
+				break;
+			}
+			thread->bytesProcessed += thread->sectorSize;
+			if (((i % 64) == 63) && (getTime() >= thread->deadline)) {
+				break;
+			}
+		}
+	}
+	close(opFd);
+	free(data);
+	return NULL;
+}
+
+/* Encrypts or decrypts one chunk, split evenly among the threads, for
+ * CIPHERBENCH_SECONDS. Returns the rate in bytes per second, or a negative
+ * value on error. */
+static double measureRate(int aTfmFd, const struct cipherCandidate *aCandidate, int aSectorSize, bool aEncrypt, int aThreadCount, uint32_t aChunkSize) {
+	struct benchThread threads[CIPHERBENCH_MAX_THREADS];
+	pthread_t threadIds[CIPHERBENCH_MAX_THREADS];
+	uint32_t length = (aChunkSize / aThreadCount) / aSectorSize * aSectorSize;
+	length = (length < (uint32_t)aSectorSize) ? (uint32_t)aSectorSize : length;
+
+	double startTime = getTime();
+	int started = 0;
+	for (int i = 0; i < aThreadCount; i++) {
+		threads[i] = (struct benchThread) {
+			.tfmFd = aTfmFd,
+			.candidate = aCandidate,
+			.sectorSize = aSectorSize,
+			.encrypt = aEncrypt,
+			.length = length,
+			.deadline = startTime + CIPHERBENCH_SECONDS,
+		};
+		if (pthread_create(&threadIds[i], NULL, benchThreadMain, &threads[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	uint64_t bytesProcessed = 0;
+	bool success = (started > 0);
+	for (int i = 0; i < started; i++) {
+		pthread_join(threadIds[i], NULL);
+		bytesProcessed += threads[i].bytesProcessed;
+		success = success && threads[i].success;
+	}
+	double elapsed = getTime() - startTime;
+	return (success && (elapsed > 0)) ? (bytesProcessed / elapsed) : -1;
+}
+
+/* Measures all candidate ciphers with the kernel crypto API, i.e. with the
+ * implementations dm-crypt will use, at the chunk size and number of threads
+ * of the conversion. Returns the number of results or -1 if the kernel crypto
+ * API is not available. */
+int cipherBenchmarkRun(const struct conversionParameters *aParameters, struct cipherBenchResult *aResults, int aMaxResults) {
+	int probeFd = socket(AF_ALG, SOCK_SEQPACKET, 0);
+	if (probeFd == -1) {
+		logmsg(LLVL_ERROR, "Kernel crypto API is not available (CONFIG_CRYPTO_USER_API_SKCIPHER): %s\n", strerror(errno));
+		return -1;
+	}
+	close(probeFd);
+
+	int threadCount = aParameters->cryptoThreads;
+	if (threadCount < 1) {
+		long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+		threadCount = (cpuCount > 0) ? cpuCount : 1;
+	}
+	threadCount = (threadCount > CIPHERBENCH_MAX_THREADS) ? CIPHERBENCH_MAX_THREADS : threadCount;
+	logmsg(LLVL_INFO, "Benchmarking ciphers with %d thread%s and %d MiB chunks.\n", threadCount, (threadCount == 1) ? "" : "s", aParameters->blocksize / 1024 / 1024);
+
+	int resultCount = 0;
+	for (unsigned int i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+		int tfmFd = openTransformation(&candidates[i]);
+		if (tfmFd == -1) {
+			logmsg(LLVL_DEBUG, "%s with %d bit key not available: %s\n", candidates[i].kernelName, candidates[i].keySize, strerror(errno));
+			continue;
+		}
+		for (unsigned int j = 0; (j < sizeof(sectorSizes) / sizeof(sectorSizes[0])) && (resultCount < aMaxResults); j++) {
+			struct cipherBenchResult result = {
+				.candidate = &candidates[i],
+				.sectorSize = sectorSizes[j],
+				.encryptRate = measureRate(tfmFd, &candidates[i], sectorSizes[j], true, threadCount, aParameters->blocksize),
+				.decryptRate = measureRate(tfmFd, &candidates[i], sectorSizes[j], false, threadCount, aParameters->blocksize),
+			};
+			if ((result.encryptRate > 0) && (result.decryptRate > 0)) {
+				aResults[resultCount++] = result;
+			}
+		}
+		close(tfmFd);
+	}
+	return resultCount;
+}
+
+/* Rate when encrypting and decrypting the same amount of data */
+static double combinedRate(const struct cipherBenchResult *aResult) {
+	return 2 / ((1 / aResult->encryptRate) + (1 / aResult->decryptRate));
+}
+
+static int compareResults(const void *aResult1, const void *aResult2) {
+	double rate1 = combinedRate((const struct cipherBenchResult*)aResult1);
+	double rate2 = combinedRate((const struct cipherBenchResult*)aResult2);
+	return (rate1 < rate2) ? 1 : ((rate1 > rate2) ? -1 : 0);
+}
+
+/* Prints the results ranked by their combined rate */
+void cipherBenchmarkReport(const struct cipherBenchResult *aResults, int aResultCount, const struct cipherBenchResult *aRecommended) {
+	struct cipherBenchResult ranked[CIPHERBENCH_MAX_RESULTS];
+	int rankedCount = (aResultCount > CIPHERBENCH_MAX_RESULTS) ? CIPHERBENCH_MAX_RESULTS : aResultCount;
+	memcpy(ranked, aResults, rankedCount * sizeof(struct cipherBenchResult));
+	qsort(ranked, rankedCount, sizeof(struct cipherBenchResult), compareResults);
+
+	logmsg(LLVL_INFO, "    %-30s %4s %6s %13s %13s\n", "Cipher", "Key", "Sector", "Encryption", "Decryption");
+	for (int i = 0; i < rankedCount; i++) {
+		bool recommended = aRecommended && (aRecommended->candidate == ranked[i].candidate) && (aRecommended->sectorSize == ranked[i].sectorSize);
+		logmsg(LLVL_INFO, "%2d%s %-30s %4d %6d %8.1f MiB/s %8.1f MiB/s\n", i + 1, recommended ? "*" : " ", ranked[i].candidate->cipher, ranked[i].candidate->keySize, ranked[i].sectorSize, ranked[i].encryptRate / 1024 / 1024, ranked[i].decryptRate / 1024 / 1024);
+	}
+}
+
+/* Returns the fastest cipher and key size at the given sector size */
+const struct cipherBenchResult *cipherBenchmarkBest(const struct cipherBenchResult *aResults, int aResultCount, int aSectorSize) {
+	const struct cipherBenchResult *best = NULL;
+	for (int i = 0; i < aResultCount; i++) {
+		if ((aResults[i].sectorSize == aSectorSize) && (!best || (combinedRate(&aResults[i]) > combinedRate(best)))) {
+			best = &aResults[i];
+		}
+	}
+	return best;
+}
@@ -0,0 +1,56 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __CIPHERBENCH_H__
+#define __CIPHERBENCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "parameters.h"
+
+/* Measuring time per cipher, key size, sector size and direction */
+#define CIPHERBENCH_SECONDS				0.25
+#define CIPHERBENCH_MAX_THREADS			64
+#define CIPHERBENCH_MAX_RESULTS			32
+
+struct cipherCandidate {
+	const char *cipher;				/* As passed to cryptsetup luksFormat --cipher */
+	const char *kernelName;			/* Algorithm of the kernel crypto API that dm-crypt uses */
+	int keySize;					/* Bits */
+	int ivSize;						/* Bytes */
+};
+
+struct cipherBenchResult {
+	const struct cipherCandidate *candidate;
+	int sectorSize;
+	double encryptRate, decryptRate;	/* Bytes per second */
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+int cipherBenchmarkRun(const struct conversionParameters *aParameters, struct cipherBenchResult *aResults, int aMaxResults);
+void cipherBenchmarkReport(const struct cipherBenchResult *aResults, int aResultCount, const struct cipherBenchResult *aRecommended);
+const struct cipherBenchResult *cipherBenchmarkBest(const struct cipherBenchResult *aResults, int aResultCount, int aSectorSize);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,71 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "crashpoint.h"
+#include "logging.h"
+
+static bool crashPointsInitialized;
+static bool crashPointsEnabled;
+static unsigned long crashPointTarget;
+static unsigned long crashPointCounter;
+
+/* Parsed by TestEngine.count_crashpoints() for tests/crashtests to determine
+ * how many crash points a conversion passes */
+static void reportCrashPoints(void) {
+	fprintf(stderr, "luksipc crash points passed: %lu\n", crashPointCounter);
+}
+
+static void initCrashPoints(void) {
+	crashPointsInitialized = true;
+	const char *target = getenv("LUKSIPC_CRASHPOINT");
+	if (!target) {
+		return;
+	}
+	crashPointsEnabled = true;
+	crashPointTarget = strtoul(target, NULL, 10);
+	atexit(reportCrashPoints);
+	logmsg(LLVL_WARN, "Crash point injection enabled, %s.\n", crashPointTarget ? "will crash" : "counting only");
+}
+
+void crashPoint(const char *aName) {
+	if (!crashPointsInitialized) {
+		initCrashPoints();
+	}
+	if (!crashPointsEnabled) {
+		return;
+	}
+
+	crashPointCounter++;
+	logmsg(LLVL_DEBUG, "Crash point %lu: %s\n", crashPointCounter, aName);
+	if (crashPointCounter == crashPointTarget) {
+		logmsg(LLVL_CRITICAL, "Crash point %lu (%s) reached, killing process.\n", crashPointCounter, aName);
+		stopAsyncLogging();
+		kill(getpid(), SIGKILL);
+	}
+}
@@ -0,0 +1,43 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __CRASHPOINT_H__
+#define __CRASHPOINT_H__
+
+/* Crash points mark places where an abrupt termination of the process (power
+ * loss, kill -9) is interesting for testing resume correctness. They are only
+ * compiled into DEVELOPMENT builds and are numbered in the order in which they
+ * are passed. When the environment variable LUKSIPC_CRASHPOINT is set to N,
+ * the process kills itself with SIGKILL at the Nth crash point. With N = 0,
+ * only the number of passed crash points is reported at exit. */
+#ifdef DEVELOPMENT
+#define CRASHPOINT(name)		crashPoint(name)
+#else
+#define CRASHPOINT(name)
+#endif
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void crashPoint(const char *aName);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,623 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+/* posix_fadvise() is not part of XPG5 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "cryptengine.h"
+#include "logging.h"
+#include "utils.h"
+#include "crashpoint.h"
+
+#ifdef USERSPACE_CRYPTO
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#define MAX_CRYPTO_THREADS			256
+
+struct cryptJob {
+	struct cryptEngine *engine;
+	EVP_CIPHER_CTX *context;
+	const uint8_t *input;
+	uint8_t *output;
+	uint64_t offset;					/* Offset of the first sector in the dm-crypt device */
+	uint32_t length;
+	bool success;
+};
+
+struct cryptEngine {
+	struct dmCryptTable table;
+	bool plain64;						/* plain64 IVs (otherwise 32 bit plain IVs) */
+	int threadCount;
+	EVP_CIPHER_CTX *contexts[MAX_CRYPTO_THREADS];
+	EVP_CIPHER_CTX *decryptContexts[MAX_CRYPTO_THREADS];	/* Only for LUKS images, which are also read through the engine */
+	int rawFd;							/* Raw device alias that the ciphertext is written to */
+	int mapperFd;						/* dm-crypt device, used for verification and fallback, -1 for LUKS images */
+	uint64_t mapperSize;
+	bool verifyAll;						/* Verify every chunk, not only the first one */
+	bool verifiedOnce;
+	bool disabled;						/* Verification failed, all further writes go through dm-crypt */
+	uint8_t *cipherText;
+	uint8_t *verifyBuffer;
+	uint32_t bufferSize;
+
+	/* Worker threads, started once in cryptEngineSetup(). Worker i does
+	 * jobs[i] of every generation; jobs[0] and the jobs of workers that
+	 * could not be started are done by the calling thread. */
+	struct cryptJob jobs[MAX_CRYPTO_THREADS];
+	pthread_t workers[MAX_CRYPTO_THREADS];
+	int workerCount;
+	bool poolInitialized;
+	pthread_mutex_t poolLock;
+	pthread_cond_t workAvailable;
+	pthread_cond_t workDone;
+	uint64_t generation;
+	int pendingWorkers;
+	bool stopWorkers;
+};
+
+static void *cryptSectors(void *aJob) {
+	struct cryptJob *job = (struct cryptJob*)aJob;
+	const struct dmCryptTable *table = &job->engine->table;
+	uint8_t iv[16];
+
+	job->success = true;
+	memset(iv, 0, sizeof(iv));
+	for (uint32_t position = 0; position < job->length; position += table->sectorSize) {
+		uint64_t offset = job->offset + position;
+		uint64_t ivSector = table->ivOffset + (table->ivLargeSectors ? (offset / table->sectorSize) : (offset / 512));
+		int ivLength = job->engine->plain64 ? 8 : 4;
+		for (int i = 0; i < ivLength; i++) {
+			iv[i] = (ivSector >> (8 * i)) & 0xff;
+		}
+
+		int outLength;
+		if ((EVP_CipherInit_ex(job->context, NULL, NULL, NULL, iv, -1) != 1) || (EVP_CipherUpdate(job->context, job->output + position, &outLength, job->input + position, table->sectorSize) != 1) || (outLength != table->sectorSize)) {
+			job->success = false;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Waits for each new generation of jobs and does its own one */
+static void *cryptWorker(void *aJob) {
+	struct cryptJob *job = (struct cryptJob*)aJob;
+	struct cryptEngine *engine = job->engine;
+	uint64_t doneGeneration = 0;
+
+	pthread_mutex_lock(&engine->poolLock);
+	while (true) {
+		while (!engine->stopWorkers && (engine->generation == doneGeneration)) {
+			pthread_cond_wait(&engine->workAvailable, &engine->poolLock);
+		}
+		if (engine->stopWorkers) {
+			break;
+		}
+		doneGeneration = engine->generation;
+		pthread_mutex_unlock(&engine->poolLock);
+
+		if (job->length > 0) {
+			cryptSectors(job);
+		}
+
+		pthread_mutex_lock(&engine->poolLock);
+		if (--engine->pendingWorkers == 0) {
+			pthread_cond_signal(&engine->workDone);
+		}
+	}
+	pthread_mutex_unlock(&engine->poolLock);
+	return NULL;
+}
+
+static void startCryptWorkers(struct cryptEngine *aEngine) {
+	if ((pthread_mutex_init(&aEngine->poolLock, NULL) != 0) || (pthread_cond_init(&aEngine->workAvailable, NULL) != 0) || (pthread_cond_init(&aEngine->workDone, NULL) != 0)) {
+		logmsg(LLVL_WARN, "Cannot set up crypto worker threads, encrypting in a single thread.\n");
+		return;
+	}
+	aEngine->poolInitialized = true;
+	for (int i = 1; i < aEngine->threadCount; i++) {
+		aEngine->jobs[i].engine = aEngine;
+		int error = pthread_create(&aEngine->workers[i], NULL, cryptWorker, &aEngine->jobs[i]);
+		if (error) {
+			/* The calling thread does the remaining jobs then */
+			logmsg(LLVL_DEBUG, "Cannot start crypto thread %d: %s\n", i, strerror(error));
+			break;
+		}
+		aEngine->workerCount = i;
+	}
+}
+
+static void stopCryptWorkers(struct cryptEngine *aEngine) {
+	if (!aEngine->poolInitialized) {
+		return;
+	}
+	pthread_mutex_lock(&aEngine->poolLock);
+	aEngine->stopWorkers = true;
+	pthread_cond_broadcast(&aEngine->workAvailable);
+	pthread_mutex_unlock(&aEngine->poolLock);
+	for (int i = 1; i <= aEngine->workerCount; i++) {
+		pthread_join(aEngine->workers[i], NULL);
+	}
+	pthread_cond_destroy(&aEngine->workDone);
+	pthread_cond_destroy(&aEngine->workAvailable);
+	pthread_mutex_destroy(&aEngine->poolLock);
+	aEngine->poolInitialized = false;
+	aEngine->workerCount = 0;
+}
+
+/* En- or decrypts (depending on the contexts) aLength bytes, a multiple of
+ * the sector size, at offset aOffset of the dm-crypt device. Sectors are
+ * distributed evenly across all threads, the calling thread does the first
+ * share while the workers do theirs. */
+static bool cryptData(struct cryptEngine *aEngine, EVP_CIPHER_CTX **aContexts, const uint8_t *aInput, uint8_t *aOutput, uint64_t aOffset, uint32_t aLength) {
+	struct cryptJob *jobs = aEngine->jobs;
+	uint32_t sectorCount = aLength / aEngine->table.sectorSize;
+	uint32_t sectorsPerThread = (sectorCount + aEngine->threadCount - 1) / aEngine->threadCount;
+
+	for (int i = 0; i < aEngine->threadCount; i++) {
+		uint32_t firstSector = i * sectorsPerThread;
+		uint32_t threadSectors = (firstSector >= sectorCount) ? 0 : (sectorCount - firstSector);
+		if (threadSectors > sectorsPerThread) {
+			threadSectors = sectorsPerThread;
+		}
+
+		uint32_t position = firstSector * aEngine->table.sectorSize;
+		jobs[i] = (struct cryptJob) {
+			.engine = aEngine,
+			.context = aContexts[i],
+			.input = aInput + position,
+			.output = aOutput + position,
+			.offset = aOffset + position,
+			.length = threadSectors * aEngine->table.sectorSize,
+			.success = true,
+		};
+	}
+
+	if (aEngine->workerCount > 0) {
+		pthread_mutex_lock(&aEngine->poolLock);
+		aEngine->generation++;
+		aEngine->pendingWorkers = aEngine->workerCount;
+		pthread_cond_broadcast(&aEngine->workAvailable);
+		pthread_mutex_unlock(&aEngine->poolLock);
+	}
+	cryptSectors(&jobs[0]);
+	for (int i = aEngine->workerCount + 1; i < aEngine->threadCount; i++) {
+		if (jobs[i].length > 0) {
+			cryptSectors(&jobs[i]);
+		}
+	}
+	if (aEngine->workerCount > 0) {
+		pthread_mutex_lock(&aEngine->poolLock);
+		while (aEngine->pendingWorkers > 0) {
+			pthread_cond_wait(&aEngine->workDone, &aEngine->poolLock);
+		}
+		pthread_mutex_unlock(&aEngine->poolLock);
+	}
+
+	bool success = true;
+	for (int i = 0; i < aEngine->threadCount; i++) {
+		success = success && jobs[i].success;
+	}
+	return success;
+}
+
+static bool fullPwrite(int aFd, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	while (aLength > 0) {
+		ssize_t written = pwrite(aFd, aData, aLength, aOffset);
+		if (written <= 0) {
+			if ((written == -1) && (errno == EINTR)) {
+				continue;
+			}
+			logmsg(LLVL_WARN, "Writing %u bytes of ciphertext at raw offset 0x%" PRIx64 " failed: %s\n", aLength, aOffset, strerror(errno));
+			return false;
+		}
+		aData += written;
+		aLength -= written;
+		aOffset += written;
+	}
+	return true;
+}
+
+static bool fullPread(int aFd, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	while (aLength > 0) {
+		ssize_t bytesRead = pread(aFd, aData, aLength, aOffset);
+		if (bytesRead <= 0) {
+			if ((bytesRead == -1) && (errno == EINTR)) {
+				continue;
+			}
+			logmsg(LLVL_WARN, "Reading %u bytes at offset 0x%" PRIx64 " failed: %s\n", aLength, aOffset, (bytesRead == 0) ? "end of device" : strerror(errno));
+			return false;
+		}
+		aData += bytesRead;
+		aLength -= bytesRead;
+		aOffset += bytesRead;
+	}
+	return true;
+}
+
+/* Reads back what was just written through the dm-crypt device and compares
+ * it to the plaintext. The page cache of that range is dropped first so that
+ * the kernel really decrypts what is on disk. */
+static bool verifyData(struct cryptEngine *aEngine, const uint8_t *aPlainText, uint64_t aOffset, uint32_t aLength) {
+	if (fdatasync(aEngine->rawFd) == -1) {
+		logmsg(LLVL_WARN, "Cannot flush raw device before verification: %s\n", strerror(errno));
+		return false;
+	}
+	posix_fadvise(aEngine->mapperFd, aOffset, aLength, POSIX_FADV_DONTNEED);
+	if (!fullPread(aEngine->mapperFd, aEngine->verifyBuffer, aLength, aOffset)) {
+		return false;
+	}
+	if (memcmp(aEngine->verifyBuffer, aPlainText, aLength)) {
+		for (uint32_t i = 0; i < aLength; i++) {
+			if (aEngine->verifyBuffer[i] != aPlainText[i]) {
+				logmsg(LLVL_ERROR, "Userspace encryption differs from dm-crypt at offset 0x%" PRIx64 ".\n", aOffset + i);
+				break;
+			}
+		}
+		return false;
+	}
+	return true;
+}
+
+/* Picks the cipher for the dm-crypt table of the engine and sets up the
+ * cipher contexts of all threads and the buffers */
+static bool cryptEngineSetup(struct cryptEngine *aEngine, const char *aDevice, uint32_t aChunkSize, int aThreadCount) {
+	const EVP_CIPHER *cipher = NULL;
+	if (!strcmp(aEngine->table.cipher, "aes-xts-plain64") || !strcmp(aEngine->table.cipher, "aes-xts-plain")) {
+		aEngine->plain64 = !strcmp(aEngine->table.cipher, "aes-xts-plain64");
+		if (aEngine->table.keyLength == 32) {
+			cipher = EVP_aes_128_xts();
+		} else if (aEngine->table.keyLength == 64) {
+			cipher = EVP_aes_256_xts();
+		}
+	}
+	if (!cipher) {
+		logmsg(LLVL_ERROR, "Userspace encryption supports only aes-xts-plain64 and aes-xts-plain with 256 or 512 bit keys, but %s uses %s with a %d bit key.\n", aDevice, aEngine->table.cipher, aEngine->table.keyLength * 8);
+		return false;
+	}
+	if ((aEngine->table.sectorSize < 512) || (aEngine->table.sectorSize % 512) || (aChunkSize % aEngine->table.sectorSize)) {
+		logmsg(LLVL_ERROR, "Unsupported encryption sector size of %d bytes.\n", aEngine->table.sectorSize);
+		return false;
+	}
+
+	if (aThreadCount < 1) {
+		long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+		aThreadCount = (cpuCount > 0) ? cpuCount : 1;
+	}
+	aEngine->threadCount = (aThreadCount > MAX_CRYPTO_THREADS) ? MAX_CRYPTO_THREADS : aThreadCount;
+	for (int i = 0; i < aEngine->threadCount; i++) {
+		aEngine->contexts[i] = EVP_CIPHER_CTX_new();
+		if ((!aEngine->contexts[i]) || (EVP_EncryptInit_ex(aEngine->contexts[i], cipher, NULL, aEngine->table.key, NULL) != 1)) {
+			logmsg(LLVL_ERROR, "Cannot initialize %s cipher context.\n", aEngine->table.cipher);
+			return false;
+		}
+		if (aEngine->mapperFd == -1) {
+			aEngine->decryptContexts[i] = EVP_CIPHER_CTX_new();
+			if ((!aEngine->decryptContexts[i]) || (EVP_DecryptInit_ex(aEngine->decryptContexts[i], cipher, NULL, aEngine->table.key, NULL) != 1)) {
+				logmsg(LLVL_ERROR, "Cannot initialize %s cipher context.\n", aEngine->table.cipher);
+				return false;
+			}
+		}
+	}
+
+	aEngine->bufferSize = aChunkSize;
+	aEngine->cipherText = malloc(aChunkSize);
+	aEngine->verifyBuffer = malloc(aChunkSize);
+	if ((!aEngine->cipherText) || (!aEngine->verifyBuffer)) {
+		logmsg(LLVL_ERROR, "Cannot allocate crypto engine buffers: %s\n", strerror(errno));
+		return false;
+	}
+	startCryptWorkers(aEngine);
+	return true;
+}
+
+struct cryptEngine *cryptEngineInit(const char *aMapperHandle, const char *aRawDevice, int aMapperFd, uint64_t aMapperSize, uint32_t aChunkSize, int aThreadCount, bool aVerifyAll) {
+	struct cryptEngine *engine = calloc(1, sizeof(struct cryptEngine));
+	if (!engine) {
+		logmsg(LLVL_ERROR, "Cannot allocate crypto engine: %s\n", strerror(errno));
+		return NULL;
+	}
+	engine->rawFd = -1;
+	engine->mapperFd = aMapperFd;
+	engine->mapperSize = aMapperSize;
+	engine->verifyAll = aVerifyAll;
+
+	if (!dmGetCryptTable(aMapperHandle, &engine->table) || !cryptEngineSetup(engine, aMapperHandle, aChunkSize, aThreadCount)) {
+		cryptEngineFree(engine);
+		return NULL;
+	}
+
+	engine->rawFd = open(aRawDevice, O_RDWR);
+	if (engine->rawFd == -1) {
+		logmsg(LLVL_ERROR, "Cannot open %s for writing ciphertext: %s\n", aRawDevice, strerror(errno));
+		cryptEngineFree(engine);
+		return NULL;
+	}
+	uint64_t rawSize = getDiskSizeOfFd(engine->rawFd);
+	if (engine->table.dataOffset + aMapperSize > rawSize) {
+		logmsg(LLVL_ERROR, "dm-crypt data area (offset %" PRIu64 ", %" PRIu64 " bytes) exceeds size of %s (%" PRIu64 " bytes).\n", engine->table.dataOffset, aMapperSize, aRawDevice, rawSize);
+		cryptEngineFree(engine);
+		return NULL;
+	}
+
+	logmsg(LLVL_INFO, "Using userspace %s encryption with %d thread%s, writing to %s at offset %" PRIu64 ".\n", engine->table.cipher, engine->threadCount, (engine->threadCount == 1) ? "" : "s", aRawDevice, engine->table.dataOffset);
+	return engine;
+}
+
+/* Engine for a LUKS image that is not opened with dm-crypt at all: the
+ * table comes from the LUKS2 header (see luks2.h) and everything, including
+ * reads, goes through the engine (see initCryptEngineBackend()). There is no
+ * dm-crypt device to verify against or to fall back to. */
+struct cryptEngine *cryptEngineInitImage(const struct dmCryptTable *aTable, int aRawFd, uint64_t aMapperSize, uint32_t aChunkSize, int aThreadCount) {
+	struct cryptEngine *engine = calloc(1, sizeof(struct cryptEngine));
+	if (!engine) {
+		logmsg(LLVL_ERROR, "Cannot allocate crypto engine: %s\n", strerror(errno));
+		return NULL;
+	}
+	engine->table = *aTable;
+	engine->mapperFd = -1;
+	engine->mapperSize = aMapperSize;
+	engine->verifiedOnce = true;
+	engine->rawFd = dup(aRawFd);
+	if ((engine->rawFd == -1) || !cryptEngineSetup(engine, "LUKS image", aChunkSize, aThreadCount)) {
+		cryptEngineFree(engine);
+		return NULL;
+	}
+	logmsg(LLVL_INFO, "Using userspace %s encryption with %d thread%s at offset %" PRIu64 " of the LUKS image.\n", engine->table.cipher, engine->threadCount, (engine->threadCount == 1) ? "" : "s", engine->table.dataOffset);
+	return engine;
+}
+
+ssize_t cryptEngineWriteAt(struct cryptEngine *aEngine, const struct chunk *aChunk, uint64_t aOffset) {
+	if (aEngine->disabled || (aChunk->used % aEngine->table.sectorSize) || (aOffset % aEngine->table.sectorSize)) {
+		/* Unaligned remainder (or engine unusable), dm-crypt does this one */
+		return chunkWriteAt(aChunk, aEngine->mapperFd, aOffset);
+	}
+
+	if (!cryptData(aEngine, aEngine->contexts, aChunk->data, aEngine->cipherText, aOffset, aChunk->used)) {
+		logmsg(LLVL_ERROR, "Userspace encryption failed at offset 0x%" PRIx64 ".\n", aOffset);
+		return -1;
+	}
+	CRASHPOINT("ciphertext write");
+	if (!fullPwrite(aEngine->rawFd, aEngine->cipherText, aChunk->used, aEngine->table.dataOffset + aOffset)) {
+		return -1;
+	}
+	CRASHPOINT("ciphertext written");
+
+	if (aEngine->verifyAll || !aEngine->verifiedOnce) {
+		if (!verifyData(aEngine, aChunk->data, aOffset, aChunk->used)) {
+			/* The plaintext is still in memory, so nothing is lost: write it
+			 * (again) through dm-crypt and do not trust the engine anymore */
+			logmsg(LLVL_ERROR, "Verification of userspace encryption failed, falling back to dm-crypt for the remainder of the conversion.\n");
+			aEngine->disabled = true;
+			return chunkWriteAt(aChunk, aEngine->mapperFd, aOffset);
+		}
+		if (!aEngine->verifiedOnce) {
+			logmsg(LLVL_DEBUG, "Userspace encryption of first chunk matches dm-crypt.\n");
+		}
+		aEngine->verifiedOnce = true;
+	}
+	return aChunk->used;
+}
+
+/* Makes the ciphertext written so far durable, including what was written
+ * through dm-crypt */
+bool cryptEngineFlush(struct cryptEngine *aEngine) {
+	bool success = (fdatasync(aEngine->rawFd) == 0);
+	if (aEngine->mapperFd != -1) {
+		success = (fdatasync(aEngine->mapperFd) == 0) && success;
+	}
+	return success;
+}
+
+/* Decrypts the sector at aSectorOffset of a LUKS image into the verify
+ * buffer, for accesses that do not cover a whole sector */
+static bool readImageSector(struct cryptEngine *aEngine, uint64_t aSectorOffset) {
+	uint32_t sectorSize = aEngine->table.sectorSize;
+	return fullPread(aEngine->rawFd, aEngine->cipherText, sectorSize, aEngine->table.dataOffset + aSectorOffset) && cryptData(aEngine, aEngine->decryptContexts, aEngine->cipherText, aEngine->verifyBuffer, aSectorOffset, sectorSize);
+}
+
+static ssize_t imageReadAt(struct ioBackend *aBackend, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct cryptEngine *engine = (struct cryptEngine*)aBackend->context;
+	uint32_t sectorSize = engine->table.sectorSize;
+	aOffset += aBackend->offset;
+	if (aOffset >= engine->mapperSize) {
+		return 0;
+	}
+	if (aLength > engine->mapperSize - aOffset) {
+		aLength = engine->mapperSize - aOffset;
+	}
+
+	uint32_t done = 0;
+	while (done < aLength) {
+		uint64_t offset = aOffset + done;
+		uint32_t remaining = aLength - done;
+		uint32_t inSector = offset % sectorSize;
+		if ((inSector == 0) && (remaining >= sectorSize)) {
+			uint32_t length = remaining - (remaining % sectorSize);
+			if (length > engine->bufferSize) {
+				length = engine->bufferSize;
+			}
+			if (!fullPread(engine->rawFd, engine->cipherText, length, engine->table.dataOffset + offset) || !cryptData(engine, engine->decryptContexts, engine->cipherText, aData + done, offset, length)) {
+				return -1;
+			}
+			done += length;
+		} else {
+			uint32_t length = ((sectorSize - inSector) < remaining) ? (sectorSize - inSector) : remaining;
+			if (!readImageSector(engine, offset - inSector)) {
+				return -1;
+			}
+			memcpy(aData + done, engine->verifyBuffer + inSector, length);
+			done += length;
+		}
+	}
+	return aLength;
+}
+
+static ssize_t imageWriteAt(struct ioBackend *aBackend, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct cryptEngine *engine = (struct cryptEngine*)aBackend->context;
+	uint32_t sectorSize = engine->table.sectorSize;
+	aOffset += aBackend->offset;
+	if (aOffset >= engine->mapperSize) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (aLength > engine->mapperSize - aOffset) {
+		aLength = engine->mapperSize - aOffset;
+	}
+
+	uint32_t done = 0;
+	while (done < aLength) {
+		uint64_t offset = aOffset + done;
+		uint32_t remaining = aLength - done;
+		uint32_t inSector = offset % sectorSize;
+		uint32_t length;
+		if ((inSector == 0) && (remaining >= sectorSize)) {
+			length = remaining - (remaining % sectorSize);
+			if (length > engine->bufferSize) {
+				length = engine->bufferSize;
+			}
+			if (!cryptData(engine, engine->contexts, aData + done, engine->cipherText, offset, length)) {
+				return -1;
+			}
+		} else {
+			/* Read, modify and write back the partially covered sector */
+			length = ((sectorSize - inSector) < remaining) ? (sectorSize - inSector) : remaining;
+			if (!readImageSector(engine, offset - inSector)) {
+				return -1;
+			}
+			memcpy(engine->verifyBuffer + inSector, aData + done, length);
+			if (!cryptData(engine, engine->contexts, engine->verifyBuffer, engine->cipherText, offset - inSector, sectorSize)) {
+				return -1;
+			}
+		}
+
+		uint64_t sectorOffset = offset - inSector;
+		uint32_t writeLength = (inSector || (length < sectorSize)) ? sectorSize : length;
+		CRASHPOINT("ciphertext write");
+		if (!fullPwrite(engine->rawFd, engine->cipherText, writeLength, engine->table.dataOffset + sectorOffset)) {
+			return -1;
+		}
+		CRASHPOINT("ciphertext written");
+		done += length;
+	}
+	return aLength;
+}
+
+static bool imageFlush(struct ioBackend *aBackend) {
+	struct cryptEngine *engine = (struct cryptEngine*)aBackend->context;
+	return fdatasync(engine->rawFd) == 0;
+}
+
+/* Backend for the LUKS device inside a LUKS image, see
+ * cryptEngineInitImage() */
+void initCryptEngineBackend(struct ioBackend *aBackend, struct cryptEngine *aEngine) {
+	memset(aBackend, 0, sizeof(struct ioBackend));
+	aBackend->name = "luks image";
+	aBackend->readAt = imageReadAt;
+	aBackend->writeAt = imageWriteAt;
+	aBackend->flush = imageFlush;
+	aBackend->fd = -1;
+	aBackend->context = aEngine;
+}
+
+void cryptEngineFree(struct cryptEngine *aEngine) {
+	if (!aEngine) {
+		return;
+	}
+	stopCryptWorkers(aEngine);
+	for (int i = 0; i < aEngine->threadCount; i++) {
+		if (aEngine->contexts[i]) {
+			EVP_CIPHER_CTX_free(aEngine->contexts[i]);
+		}
+		if (aEngine->decryptContexts[i]) {
+			EVP_CIPHER_CTX_free(aEngine->decryptContexts[i]);
+		}
+	}
+	if (aEngine->rawFd != -1) {
+		fdatasync(aEngine->rawFd);
+		close(aEngine->rawFd);
+	}
+	free(aEngine->cipherText);
+	free(aEngine->verifyBuffer);
+	memset(aEngine, 0, sizeof(struct cryptEngine));
+	free(aEngine);
+}
+
+#else
+
+struct cryptEngine *cryptEngineInit(const char *aMapperHandle, const char *aRawDevice, int aMapperFd, uint64_t aMapperSize, uint32_t aChunkSize, int aThreadCount, bool aVerifyAll) {
+	(void)aMapperHandle;
+	(void)aRawDevice;
+	(void)aMapperFd;
+	(void)aMapperSize;
+	(void)aChunkSize;
+	(void)aThreadCount;
+	(void)aVerifyAll;
+	logmsg(LLVL_ERROR, "luksipc was built without userspace encryption support (build with 'make USERSPACE_CRYPTO=1').\n");
+	return NULL;
+}
+
+struct cryptEngine *cryptEngineInitImage(const struct dmCryptTable *aTable, int aRawFd, uint64_t aMapperSize, uint32_t aChunkSize, int aThreadCount) {
+	(void)aTable;
+	(void)aRawFd;
+	(void)aMapperSize;
+	(void)aChunkSize;
+	(void)aThreadCount;
+	logmsg(LLVL_ERROR, "luksipc was built without userspace encryption support (build with 'make USERSPACE_CRYPTO=1').\n");
+	return NULL;
+}
+
+ssize_t cryptEngineWriteAt(struct cryptEngine *aEngine, const struct chunk *aChunk, uint64_t aOffset) {
+	(void)aEngine;
+	(void)aChunk;
+	(void)aOffset;
+	return -1;
+}
+
+bool cryptEngineFlush(struct cryptEngine *aEngine) {
+	(void)aEngine;
+	return false;
+}
+
+void initCryptEngineBackend(struct ioBackend *aBackend, struct cryptEngine *aEngine) {
+	(void)aEngine;
+	memset(aBackend, 0, sizeof(struct ioBackend));
+	aBackend->fd = -1;
+}
+
+void cryptEngineFree(struct cryptEngine *aEngine) {
+	(void)aEngine;
+}
+
+#endif
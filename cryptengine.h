@@ -0,0 +1,47 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __CRYPTENGINE_H__
+#define __CRYPTENGINE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chunk.h"
+#include "luks.h"
+
+/* The userspace encryption engine is only available when luksipc is built
+ * with USERSPACE_CRYPTO=1 (which links against OpenSSL) */
+struct cryptEngine;
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct cryptEngine *cryptEngineInit(const char *aMapperHandle, const char *aRawDevice, int aMapperFd, uint64_t aMapperSize, uint32_t aChunkSize, int aThreadCount, bool aVerifyAll);
+struct cryptEngine *cryptEngineInitImage(const struct dmCryptTable *aTable, int aRawFd, uint64_t aMapperSize, uint32_t aChunkSize, int aThreadCount);
+ssize_t cryptEngineWriteAt(struct cryptEngine *aEngine, const struct chunk *aChunk, uint64_t aOffset);
+bool cryptEngineFlush(struct cryptEngine *aEngine);
+void initCryptEngineBackend(struct ioBackend *aBackend, struct cryptEngine *aEngine);
+void cryptEngineFree(struct cryptEngine *aEngine);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
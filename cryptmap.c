@@ -0,0 +1,150 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cryptmap.h"
+#include "globals.h"
+#include "sysfs.h"
+#include "logging.h"
+#include "utils.h"
+
+/* Encrypting in 4096 byte sectors instead of 512 byte sectors needs an eighth
+ * of the cipher invocations and IV computations, and dm-crypt's read and
+ * write workqueues only add latency on devices that are not seek bound. Both
+ * can be chosen from the topology of the disk. The encryption sector size
+ * becomes the logical block size of the LUKS device, though: a filesystem
+ * converted in place must keep working on it, so it never exceeds the logical
+ * block size of the disk. */
+
+static const char *deviceKind(const char *aDevice, bool aRotational) {
+	char path[PATH_MAX];
+	if (getWholeDiskSysfsPath(aDevice, path, sizeof(path))) {
+		const char *name = strrchr(path, '/');
+		if (name && !strncmp(name + 1, "nvme", 4)) {
+			return "NVMe drive";
+		}
+	}
+	return aRotational ? "rotational disk" : "SSD";
+}
+
+static bool luksFormatParamsContain(const struct conversionParameters *aParameters, const char *aNeedle) {
+	return aParameters->luksFormatParams && strstr(aParameters->luksFormatParams, aNeedle);
+}
+
+/* Determines the encryption sector size and the dm-crypt workqueue flags,
+ * unless they were given by the user. Returns false if a sector size given by
+ * the user does not fit the device. */
+bool cryptMappingChoose(const struct conversionParameters *aParameters, uint64_t aReadDevSize, struct cryptMapping *aMapping) {
+	memset(aMapping, 0, sizeof(struct cryptMapping));
+
+	int logical = 512;
+	int physical = 512;
+	int fd = open(aParameters->rawDevice, O_RDONLY);
+	if ((fd == -1) || (!getBlockSizesOfFd(fd, &logical, &physical))) {
+		logmsg(LLVL_WARN, "Cannot determine the block size of %s (%s), assuming 512 bytes.\n", aParameters->rawDevice, strerror(errno));
+		logical = 512;
+		physical = 512;
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	bool rotational = isRotationalDevice(aParameters->rawDevice);
+	logmsg(LLVL_INFO, "%s is on a%s %s with %d bytes logical and %d bytes physical block size.\n", aParameters->rawDevice, rotational ? "" : "n", deviceKind(aParameters->rawDevice, rotational), logical, physical);
+
+	if (aParameters->cryptSectorSize) {
+		if (aReadDevSize % aParameters->cryptSectorSize) {
+			logmsg(LLVL_ERROR, "Size of %s (%" PRIu64 " bytes) is not a multiple of the encryption sector size of %d bytes.\n", aParameters->readDevice, aReadDevSize, aParameters->cryptSectorSize);
+			return false;
+		}
+		if (aParameters->cryptSectorSize > logical) {
+			logmsg(LLVL_WARN, "Encryption sectors of %d bytes are larger than the logical blocks of %s, the filesystem on it must use blocks of at least %d bytes.\n", aParameters->cryptSectorSize, aParameters->rawDevice, aParameters->cryptSectorSize);
+		}
+		aMapping->sectorSize = aParameters->cryptSectorSize;
+	} else if (luksFormatParamsContain(aParameters, "--sector-size") || luksFormatParamsContain(aParameters, "luks1")) {
+		logmsg(LLVL_DEBUG, "Encryption sector size is left to the LUKS format parameters.\n");
+	} else {
+		/* Given explicitly even if it is 512 bytes, so that cryptsetup does
+		 * not pick the physical block size of 512e disks on its own */
+		int sectorSize = (logical < CRYPTMAP_MAX_SECTOR_SIZE) ? logical : CRYPTMAP_MAX_SECTOR_SIZE;
+		if (aReadDevSize % sectorSize) {
+			sectorSize = DEFAULT_CRYPT_SECTOR_SIZE;
+		}
+		aMapping->sectorSize = sectorSize;
+		aMapping->autoSectorSize = true;
+	}
+
+	switch (aParameters->workqueues) {
+		case WORKQUEUES_ON:
+			aMapping->bypassWorkqueues = false;
+			break;
+
+		case WORKQUEUES_OFF:
+			aMapping->bypassWorkqueues = true;
+			break;
+
+		case WORKQUEUES_AUTO:
+			aMapping->bypassWorkqueues = !rotational;
+			aMapping->autoWorkqueues = true;
+			break;
+	}
+
+	if (aMapping->sectorSize) {
+		logmsg(LLVL_INFO, "Encrypting in %d byte sectors, %s dm-crypt's workqueues.\n", aMapping->sectorSize, aMapping->bypassWorkqueues ? "bypassing" : "using");
+	} else {
+		logmsg(LLVL_INFO, "%s dm-crypt's workqueues.\n", aMapping->bypassWorkqueues ? "Bypassing" : "Using");
+	}
+	return true;
+}
+
+/* Assembles the comma-separated luksOpen parameters. Returns NULL if there
+ * are none. */
+const char *cryptMappingOpenParams(const struct cryptMapping *aMapping, bool aDisableKeyring, char *aBuffer, int aBufferSize) {
+	snprintf(aBuffer, aBufferSize, "%s%s%s", aDisableKeyring ? "--disable-keyring" : "", (aDisableKeyring && aMapping->bypassWorkqueues) ? "," : "", aMapping->bypassWorkqueues ? "--perf-no_read_workqueue,--perf-no_write_workqueue" : "");
+	return aBuffer[0] ? aBuffer : NULL;
+}
+
+/* Chunks are written to the LUKS device at arbitrary multiples of the chunk
+ * size, which only works if all offsets are aligned to its sector size. A
+ * resumed conversion might have been started with different parameters. */
+bool cryptSectorSizeCompatible(const struct conversionParameters *aParameters, const struct conversionProcess *aConvProcess) {
+	int logical, physical;
+	if (aConvProcess->luksTarget.sectorSize) {
+		logical = aConvProcess->luksTarget.sectorSize;
+	} else if (!getBlockSizesOfFd(aConvProcess->writeDevFd, &logical, &physical)) {
+		logmsg(LLVL_WARN, "Cannot determine the sector size of %s: %s\n", aConvProcess->writeDevicePath, strerror(errno));
+		return true;
+	}
+	logmsg(LLVL_DEBUG, "%s has %d byte sectors.\n", aConvProcess->writeDevicePath, logical);
+	if ((aParameters->blocksize % logical) || (aConvProcess->outOffset % logical) || (aConvProcess->endOutOffset % logical)) {
+		logmsg(LLVL_ERROR, "%s has %d byte sectors, but the chunk size (%d bytes), the conversion offset (%" PRIu64 ") or the end of the conversion (%" PRIu64 ") is not a multiple of that.\n", aConvProcess->writeDevicePath, logical, aParameters->blocksize, aConvProcess->outOffset, aConvProcess->endOutOffset);
+		return false;
+	}
+	return true;
+}
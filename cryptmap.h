@@ -0,0 +1,50 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __CRYPTMAP_H__
+#define __CRYPTMAP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parameters.h"
+#include "engine.h"
+
+/* Largest encryption sector size dm-crypt supports */
+#define CRYPTMAP_MAX_SECTOR_SIZE		4096
+
+/* How the dm-crypt device is formatted and opened */
+struct cryptMapping {
+	int sectorSize;					/* Passed to luksFormat, 0 = cryptsetup's choice */
+	bool autoSectorSize;			/* Sector size was chosen automatically */
+	bool bypassWorkqueues;			/* Open with --perf-no_read_workqueue and --perf-no_write_workqueue */
+	bool autoWorkqueues;			/* Workqueue flags were chosen automatically */
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool cryptMappingChoose(const struct conversionParameters *aParameters, uint64_t aReadDevSize, struct cryptMapping *aMapping);
+const char *cryptMappingOpenParams(const struct cryptMapping *aMapping, bool aDisableKeyring, char *aBuffer, int aBufferSize);
+bool cryptSectorSizeCompatible(const struct conversionParameters *aParameters, const struct conversionProcess *aConvProcess);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
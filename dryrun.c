@@ -0,0 +1,175 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+/* mkdtemp() is not part of XPG5 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/statvfs.h>
+
+#include "dryrun.h"
+#include "logging.h"
+#include "luks.h"
+#include "loop.h"
+#include "random.h"
+#include "utils.h"
+
+/* A dry run converts a non-persistent dm-snapshot of the raw device instead
+ * of the device itself. All writes (LUKS header and converted data) end up in
+ * a sparse copy-on-write file and the key, resume and backup files are kept
+ * in a temporary directory, all of which is removed at exit. */
+static char dryRunDirectory[256];
+static char keyFilename[320], resumeFilename[320], backupFilename[320], cowFilename[320];
+static char snapshotPath[64];
+static const char *snapshotHandle;
+
+static void dryRunCleanup(void) {
+	if (snapshotHandle) {
+		if (!dmRemove(snapshotHandle)) {
+			logmsg(LLVL_WARN, "Cannot remove dry run overlay %s, please remove it with 'dmsetup remove %s'.\n", snapshotPath, snapshotHandle);
+		}
+		snapshotHandle = NULL;
+	}
+	unlink(keyFilename);
+	unlink(resumeFilename);
+	unlink(backupFilename);
+	unlink(cowFilename);
+	if (rmdir(dryRunDirectory) == -1) {
+		logmsg(LLVL_WARN, "Cannot remove dry run directory %s: %s\n", dryRunDirectory, strerror(errno));
+	}
+}
+
+/* Lets the key, resume and header backup files of the dry run point to a
+ * fresh temporary directory in $TMPDIR (or /var/tmp) */
+bool dryRunRedirectFiles(struct conversionParameters *aParameters) {
+	const char *tempDirectory = getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+	snprintf(dryRunDirectory, sizeof(dryRunDirectory), "%s/luksipc_dryrun_XXXXXX", tempDirectory);
+	if (!mkdtemp(dryRunDirectory)) {
+		logmsg(LLVL_ERROR, "Cannot create dry run directory in %s: %s\n", tempDirectory, strerror(errno));
+		return false;
+	}
+	atexit(dryRunCleanup);
+
+	snprintf(keyFilename, sizeof(keyFilename), "%s/keyfile.bin", dryRunDirectory);
+	snprintf(resumeFilename, sizeof(resumeFilename), "%s/resume.bin", dryRunDirectory);
+	snprintf(backupFilename, sizeof(backupFilename), "%s/header_backup.img", dryRunDirectory);
+	snprintf(cowFilename, sizeof(cowFilename), "%s/overlay.img", dryRunDirectory);
+	aParameters->keyFile = keyFilename;
+	aParameters->resumeFilename = resumeFilename;
+	aParameters->backupFile = backupFilename;
+	return true;
+}
+
+/* Stacks the copy-on-write overlay on top of the raw device and lets the
+ * conversion use it instead */
+bool dryRunCreateOverlay(struct conversionParameters *aParameters) {
+	const char *origin = aParameters->rawDevice;
+	if (isRegularFile(origin)) {
+		origin = loopAttach(origin);
+		if (!origin) {
+			return false;
+		}
+	}
+	uint64_t deviceSize = getDiskSizeOfPath(origin);
+
+	struct statvfs fsStats;
+	if (statvfs(dryRunDirectory, &fsStats) == -1) {
+		logmsg(LLVL_ERROR, "Cannot determine free space in %s: %s\n", dryRunDirectory, strerror(errno));
+		return false;
+	}
+	uint64_t freeSpace = (uint64_t)fsStats.f_bavail * fsStats.f_frsize;
+	if (freeSpace < DRYRUN_OVERLAY_RESERVE + (uint64_t)aParameters->blocksize) {
+		logmsg(LLVL_ERROR, "Only %" PRIu64 " MiB free in %s, not enough for the dry run overlay.\n", freeSpace / 1024 / 1024, dryRunDirectory);
+		return false;
+	}
+	aParameters->dryRunOverlaySpace = freeSpace - DRYRUN_OVERLAY_RESERVE;
+
+	/* Sparse, only what is written during the dry run is allocated */
+	int fd = open(cowFilename, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1) {
+		logmsg(LLVL_ERROR, "Cannot create dry run overlay file %s: %s\n", cowFilename, strerror(errno));
+		return false;
+	}
+	bool success = (ftruncate(fd, deviceSize + (1024 * 1024)) == 0);
+	close(fd);
+	if (!success) {
+		logmsg(LLVL_ERROR, "Cannot resize dry run overlay file %s: %s\n", cowFilename, strerror(errno));
+		return false;
+	}
+	const char *cowDevice = loopAttach(cowFilename);
+	if (!cowDevice) {
+		return false;
+	}
+
+	strcpy(snapshotPath, "/dev/mapper/luksipc_dryrun_");
+	if (!randomHexStrCat(snapshotPath, 4)) {
+		logmsg(LLVL_ERROR, "Cannot generate randomized dry run overlay handle.\n");
+		return false;
+	}
+	if (!dmCreateSnapshot(origin, cowDevice, snapshotPath + 12)) {
+		return false;
+	}
+	snapshotHandle = snapshotPath + 12;
+
+	logmsg(LLVL_INFO, "Dry run: converting overlay %s instead of %s, %" PRIu64 " MiB are available for changes in %s. The data on %s is not modified.\n", snapshotPath, aParameters->rawDevice, aParameters->dryRunOverlaySpace / 1024 / 1024, dryRunDirectory, aParameters->rawDevice);
+	if (!aParameters->reluksification) {
+		aParameters->readDevice = snapshotPath;
+	}
+	aParameters->rawDevice = snapshotPath;
+	return true;
+}
+
+/* Restricts the copy to the configured time or fraction of the device and
+ * to what fits into the overlay */
+void dryRunLimitCopy(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	uint64_t totalBytes = aConvProcess->endOutOffset - aConvProcess->outOffset;
+	uint64_t byteLimit = aParameters->dryRunOverlaySpace;
+	if ((aParameters->dryRunFraction > 0) && (aParameters->dryRunFraction * totalBytes < byteLimit)) {
+		byteLimit = aParameters->dryRunFraction * totalBytes;
+	}
+	if (byteLimit < totalBytes) {
+		aConvProcess->endOutOffset = aConvProcess->outOffset + byteLimit;
+	}
+	if (aParameters->dryRunSeconds > 0) {
+		aConvProcess->dryRunDeadline = getTime() + aParameters->dryRunSeconds;
+	}
+	logmsg(LLVL_INFO, "Dry run copies at most %" PRIu64 " MiB of %" PRIu64 " MiB%s.\n", (aConvProcess->endOutOffset - aConvProcess->outOffset) / 1024 / 1024, totalBytes / 1024 / 1024, (aParameters->dryRunSeconds > 0) ? " or until the time limit is reached" : "");
+}
+
+void dryRunReport(double aSetupTime, double aCopyTime, uint64_t aCopiedBytes, uint64_t aTotalBytes) {
+	if ((aCopiedBytes == 0) || (aCopyTime <= 0)) {
+		logmsg(LLVL_WARN, "Dry run did not copy any data, cannot project the conversion time.\n");
+		return;
+	}
+	double bytesPerSecond = aCopiedBytes / aCopyTime;
+	int projectedSeconds = aSetupTime + (aTotalBytes / bytesPerSecond);
+	logmsg(LLVL_INFO, "Dry run copied %" PRIu64 " MiB in %.1f seconds (%.1f MiB/s including the final sync), setup took %.1f seconds.\n", aCopiedBytes / 1024 / 1024, aCopyTime, bytesPerSecond / 1024 / 1024, aSetupTime);
+	logmsg(LLVL_INFO, "Projected duration of the conversion of %" PRIu64 " MiB: %d:%02d h:m\n", aTotalBytes / 1024 / 1024, projectedSeconds / 3600, projectedSeconds % 3600 / 60);
+	logmsg(LLVL_INFO, "The data on the device has not been modified, all changes are discarded.\n");
+}
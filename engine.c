@@ -0,0 +1,1249 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#include "engine.h"
+#include "logging.h"
+#include "shutdown.h"
+#include "utils.h"
+#include "globals.h"
+#include "scheduler.h"
+#include "cryptengine.h"
+#include "crashpoint.h"
+#include "probes.h"
+#include "trace.h"
+#include "throughput.h"
+#include "iostats.h"
+#include "spill.h"
+#include "rollback.h"
+#include "splicecopy.h"
+
+#define REMAINING_BYTES(aconvptr)		(((aconvptr)->endOutOffset) - ((aconvptr)->outOffset))
+
+/* Header of version 2 resume files, which lacks the checkpoint fields */
+#define RESUME_FILE_V2_HEADER_SIZE		offsetof(struct resumeFileHeader, spanEnd)
+
+/* Pieces of a checkpointed span start at multiples of this (the largest
+ * encryption sector size), see copyCheckpointed */
+#define CHECKPOINT_PIECE_ALIGNMENT		4096
+
+_Static_assert(sizeof(struct resumeFileHeader) == 64, "resume file header must not contain padding");
+
+/* The data at the write pointer that the resume file holds: the pending
+ * window while one is held, the active buffer otherwise */
+struct chunk *resumeWindow(struct conversionProcess *aConvProcess) {
+	if (aConvProcess->pendingWindow.used > 0) {
+		return &aConvProcess->pendingWindow;
+	}
+	return &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex];
+}
+
+/* Fills the space reserved for the window behind its data with zeros, so that
+ * the space is allocated when the resume file is created and a full disk is
+ * noticed then, not in the middle of the conversion */
+static bool writeResumeFilePadding(int aFd, uint32_t aLength) {
+	static uint8_t zeros[64 * 1024];
+	while (aLength > 0) {
+		uint32_t length = (aLength < sizeof(zeros)) ? aLength : sizeof(zeros);
+		if (!checkedWrite(aFd, zeros, length)) {
+			return false;
+		}
+		aLength -= length;
+	}
+	return true;
+}
+
+bool writeResumeFile(struct conversionProcess *aConvProcess) {
+	if (aConvProcess->rollback) {
+		return writeRollbackState(aConvProcess);
+	}
+
+	bool success = true;
+	struct chunk *window = resumeWindow(aConvProcess);
+	struct chunk *tail = &aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex];
+	uint32_t tailLength = aConvProcess->checkpoint.spanEnd ? tail->used : 0;
+	uint32_t windowSpace = window->used + tailLength;
+	struct resumeFileHeader fileHeader = {
+		.outOffset = aConvProcess->outOffset,
+		.readDevSize = aConvProcess->readDevSize,
+		.writeDevSize = aConvProcess->writeDevSize,
+		.windowLength = window->used,
+		.windowCapacity = (windowSpace > aConvProcess->dataBuffer[0].size) ? windowSpace : aConvProcess->dataBuffer[0].size,
+		.chunkSize = aConvProcess->dataBuffer[0].size,
+		.reluksification = aConvProcess->reluksification,
+		.spanEnd = aConvProcess->checkpoint.spanEnd,
+		.movedOffset = aConvProcess->checkpoint.movedOffset,
+		.tailLength = tailLength,
+	};
+	char header[RESUME_FILE_HEADER_MAGIC_LEN];
+	memcpy(header, RESUME_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN);
+	uint64_t startTime = PROBE_TIMER_START(resume__write);
+	CRASHPOINT("resume file write");
+	success = (lseek(aConvProcess->resumeFd, 0, SEEK_SET) != -1) && success;
+	success = checkedWrite(aConvProcess->resumeFd, header, sizeof(header)) && success;
+	success = checkedWrite(aConvProcess->resumeFd, &fileHeader, sizeof(fileHeader)) && success;
+	CRASHPOINT("resume file data write");
+	success = checkedWrite(aConvProcess->resumeFd, window->data, window->used) && success;
+	success = checkedWrite(aConvProcess->resumeFd, tail->data, tailLength) && success;
+	success = writeResumeFilePadding(aConvProcess->resumeFd, fileHeader.windowCapacity - windowSpace) && success;
+	success = checkedWrite(aConvProcess->resumeFd, &aConvProcess->throughput.history, sizeof(aConvProcess->throughput.history)) && success;
+	CRASHPOINT("resume file fsync");
+	success = (fsync(aConvProcess->resumeFd) == 0) && success;
+	CRASHPOINT("resume file synced");
+	aConvProcess->resumeWindowCapacity = fileHeader.windowCapacity;
+	aConvProcess->resumeHeaderLength = sizeof(fileHeader);
+	if (PROBE_ENABLED(resume__write)) {
+		PROBE4(resume__write, aConvProcess->outOffset, window->used, success, PROBE_TIMER_ELAPSED(startTime));
+	}
+	logmsg(LLVL_DEBUG, "Wrote resume file: read pointer offset %" PRIu64 " write pointer offset %" PRIu64 ", %u bytes of data in active buffer.\n", aConvProcess->inOffset, aConvProcess->outOffset, window->used);
+	return success;
+}
+
+/* Makes everything written to the LUKS device so far durable */
+static bool flushLuksDevice(struct conversionProcess *aConvProcess) {
+	if (aConvProcess->cryptEngine) {
+		return cryptEngineFlush(aConvProcess->cryptEngine);
+	}
+	return backendFlush(&aConvProcess->writeBackend);
+}
+
+/* Makes the rename of a file durable */
+static bool syncParentDirectory(const char *aFilename) {
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s", aFilename) >= (int)sizeof(path)) {
+		return false;
+	}
+	int fd = open(dirname(path), O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	bool success = (fsync(fd) == 0);
+	close(fd);
+	return success;
+}
+
+/* Replaces the resume file by one with the current state. It is written to a
+ * temporary file that is then renamed over the resume file, so that a crash
+ * leaves either the previous or the new state behind. The LUKS device is
+ * flushed first, since the state describes what has been written to it. */
+bool writeCheckpoint(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	if (!flushLuksDevice(aConvProcess)) {
+		logmsg(LLVL_ERROR, "Cannot flush the LUKS device before writing a checkpoint: %s\n", strerror(errno));
+		return false;
+	}
+
+	char tmpFilename[PATH_MAX];
+	if (snprintf(tmpFilename, sizeof(tmpFilename), "%s.tmp", aParameters->resumeFilename) >= (int)sizeof(tmpFilename)) {
+		logmsg(LLVL_ERROR, "Resume file name %s is too long.\n", aParameters->resumeFilename);
+		return false;
+	}
+	int tmpFd = open(tmpFilename, O_TRUNC | O_WRONLY | O_CREAT, 0600);
+	if (tmpFd == -1) {
+		logmsg(LLVL_ERROR, "Cannot create %s to write a checkpoint: %s\n", tmpFilename, strerror(errno));
+		return false;
+	}
+
+	int resumeFd = aConvProcess->resumeFd;
+	aConvProcess->resumeFd = tmpFd;
+	bool success = writeResumeFile(aConvProcess);
+	CRASHPOINT("checkpoint rename");
+	if (!success || (rename(tmpFilename, aParameters->resumeFilename) == -1)) {
+		logmsg(LLVL_ERROR, "Cannot replace the resume file %s by %s: %s\n", aParameters->resumeFilename, tmpFilename, strerror(errno));
+		aConvProcess->resumeFd = resumeFd;
+		close(tmpFd);
+		unlink(tmpFilename);
+		return false;
+	}
+	close(resumeFd);
+	CRASHPOINT("checkpoint renamed");
+	if (!syncParentDirectory(aParameters->resumeFilename)) {
+		logmsg(LLVL_ERROR, "Cannot sync the directory of the resume file %s: %s\n", aParameters->resumeFilename, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Reads a window of aLength bytes at the current position of the resume file.
+ * A window larger than a chunk (the file was written with a larger chunk size)
+ * is held as pending window until startDataCopy() has written it. */
+bool loadResumeWindow(struct conversionProcess *aConvProcess, uint32_t aLength) {
+	struct chunk *window = &aConvProcess->dataBuffer[0];
+	aConvProcess->usedBufferIndex = 0;
+	window->used = 0;
+	freeChunk(&aConvProcess->pendingWindow);
+	if (aLength > window->size) {
+		if (!allocChunk(&aConvProcess->pendingWindow, aLength)) {
+			logmsg(LLVL_ERROR, "Failed to allocate %u bytes for the pending window of the resume file: %s\n", aLength, strerror(errno));
+			return false;
+		}
+		logmsg(LLVL_INFO, "Resume file holds %u bytes at the write pointer, more than a chunk of %u bytes. They are written before copying continues.\n", aLength, window->size);
+		window = &aConvProcess->pendingWindow;
+	}
+	if (!checkedRead(aConvProcess->resumeFd, window->data, aLength)) {
+		logmsg(LLVL_ERROR, "Read error while trying to read the data of the resume file.\n");
+		freeChunk(&aConvProcess->pendingWindow);
+		return false;
+	}
+	window->used = aLength;
+	return true;
+}
+
+/* Resume files of version 1 record the active buffer, whose size is not
+ * stored, and end with the throughput history if they have one */
+static bool readResumeFileHeaderV1(int aFd, struct resumeFileHeader *aFileHeader) {
+	bool success = true;
+	bool reluksification = false;
+	memset(aFileHeader, 0, sizeof(struct resumeFileHeader));
+	success = checkedRead(aFd, &aFileHeader->outOffset, sizeof(uint64_t)) && success;
+	success = checkedRead(aFd, &aFileHeader->readDevSize, sizeof(uint64_t)) && success;
+	success = checkedRead(aFd, &aFileHeader->writeDevSize, sizeof(uint64_t)) && success;
+	success = checkedRead(aFd, &reluksification, sizeof(bool)) && success;
+	success = checkedRead(aFd, &aFileHeader->windowLength, sizeof(uint32_t)) && success;
+	aFileHeader->reluksification = reluksification;
+	return success;
+}
+
+bool readResumeFile(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	bool success = true;
+	char header[RESUME_FILE_HEADER_MAGIC_LEN];
+	success = (lseek(aConvProcess->resumeFd, 0, SEEK_SET) != -1) && success;
+	if (!success) {
+		logmsg(LLVL_ERROR, "Seek error while trying to read resume file: %s\n", strerror(errno));
+		return false;
+	}
+
+	success = checkedRead(aConvProcess->resumeFd, header, sizeof(header)) && success;
+	if (!success) {
+		logmsg(LLVL_ERROR, "Read error while trying to read resume file header.\n");
+		return false;
+	}
+
+	bool version1 = !memcmp(header, RESUME_FILE_V1_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN);
+	bool version2 = !memcmp(header, RESUME_FILE_V2_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN) || !memcmp(header, ROLLBACK_FILE_V2_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN);
+	if (!memcmp(header, ROLLBACK_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN) || !memcmp(header, ROLLBACK_FILE_V2_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN)) {
+		if (!aParameters->rollback) {
+			logmsg(LLVL_ERROR, "Resume file belongs to an interrupted rollback, continue it with --rollback.\n");
+			return false;
+		}
+	} else if (!version1 && !version2 && (memcmp(header, RESUME_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN) != 0)) {
+		logmsg(LLVL_ERROR, "Header magic mismatch in resume file.\n");
+		return false;
+	}
+
+	struct resumeFileHeader fileHeader;
+	memset(&fileHeader, 0, sizeof(fileHeader));
+	if (version1) {
+		success = readResumeFileHeaderV1(aConvProcess->resumeFd, &fileHeader) && success;
+		aConvProcess->resumeHeaderLength = 0;
+	} else {
+		aConvProcess->resumeHeaderLength = version2 ? RESUME_FILE_V2_HEADER_SIZE : sizeof(fileHeader);
+		success = checkedRead(aConvProcess->resumeFd, &fileHeader, aConvProcess->resumeHeaderLength) && success;
+	}
+
+	if (!success) {
+		logmsg(LLVL_ERROR, "Read error while trying to read resume file offset metadata.\n");
+		return false;
+	}
+
+	/* The window sizes decide how much memory is allocated and where the
+	 * throughput history is, so a corrupt file must not get that far */
+	if (version1) {
+		fileHeader.windowCapacity = fileHeader.windowLength;
+	}
+	if ((fileHeader.windowLength > fileHeader.windowCapacity) || (fileHeader.tailLength > fileHeader.windowCapacity - fileHeader.windowLength) || (fileHeader.windowCapacity > aConvProcess->readDevSize)) {
+		logmsg(LLVL_ERROR, "Resume file holds %u bytes of data with %u bytes reserved for them, which does not fit a device of %" PRIu64 " bytes. The resume file is corrupt.\n", fileHeader.windowLength + fileHeader.tailLength, fileHeader.windowCapacity, aConvProcess->readDevSize);
+		return false;
+	}
+
+	/* A span that is being moved is continued with the buffers of the
+	 * current chunk size, see copyCheckpointed */
+	if (fileHeader.spanEnd) {
+		bool spanValid = (fileHeader.outOffset + fileHeader.windowLength <= fileHeader.movedOffset) && (fileHeader.movedOffset <= fileHeader.spanEnd) && (fileHeader.spanEnd <= aConvProcess->readDevSize);
+		if (!spanValid || (fileHeader.windowLength > aConvProcess->dataBuffer[0].size) || (fileHeader.tailLength > aConvProcess->dataBuffer[1].size)) {
+			logmsg(LLVL_ERROR, "Resume file describes a checkpointed span from %" PRIu64 " to %" PRIu64 " (moved from %" PRIu64 " on) with %u and %u bytes of data, which cannot be continued with chunks of %u bytes. The resume file is corrupt.\n", fileHeader.outOffset, fileHeader.spanEnd, fileHeader.movedOffset, fileHeader.windowLength, fileHeader.tailLength, aConvProcess->dataBuffer[0].size);
+			return false;
+		}
+	}
+
+	if (fileHeader.readDevSize != aConvProcess->readDevSize) {
+		if (aParameters->safetyChecks) {
+			logmsg(LLVL_ERROR, "Resume file used read device of size %" PRIu64 " bytes, but currently read device size is %" PRIu64 " bytes. Refusing to continue in spite of mismatch.\n", fileHeader.readDevSize, aConvProcess->readDevSize);
+			return false;
+		} else {
+			logmsg(LLVL_WARN, "Resume file used read device of size %" PRIu64 " bytes, but currently read device size is %" PRIu64 " bytes. Continuing only because safety checks are disabled.\n", fileHeader.readDevSize, aConvProcess->readDevSize);
+		}
+	}
+	/* A checkpoint written before luksFormat does not know the size yet */
+	if (fileHeader.writeDevSize && (fileHeader.writeDevSize != aConvProcess->writeDevSize)) {
+		if (aParameters->safetyChecks) {
+			logmsg(LLVL_ERROR, "Resume file used write device of size %" PRIu64 " bytes, but currently write device size is %" PRIu64 " bytes. Refusing to continue in spite of mismatch.\n", fileHeader.writeDevSize, aConvProcess->writeDevSize);
+			return false;
+		} else {
+			logmsg(LLVL_WARN, "Resume file used write device of size %" PRIu64 " bytes, but currently write device size is %" PRIu64 " bytes. Continuing only because safety checks are disabled.\n", fileHeader.writeDevSize, aConvProcess->writeDevSize);
+		}
+	}
+	if ((bool)fileHeader.reluksification != aConvProcess->reluksification) {
+		if (aParameters->safetyChecks) {
+			logmsg(LLVL_ERROR, "Resume file was performing reLUKSification, command line specification indicates you do not want reLUKSification. Refusing to continue in spite of mismatch.\n");
+			return false;
+		} else {
+			logmsg(LLVL_WARN, "Resume file was performing reLUKSification, command line specification indicates you do not want reLUKSification. Continuing only because safety checks are disabled.\n");
+		}
+	}
+
+	aConvProcess->outOffset = fileHeader.outOffset;
+	logmsg(LLVL_DEBUG, "Read write pointer offset %" PRIu64 " from resume file.\n", aConvProcess->outOffset);
+	if (fileHeader.chunkSize && (fileHeader.chunkSize != aConvProcess->dataBuffer[0].size)) {
+		logmsg(LLVL_INFO, "Resume file was written with chunks of %u bytes, continuing with chunks of %u bytes.\n", fileHeader.chunkSize, aConvProcess->dataBuffer[0].size);
+	}
+
+	if (!loadResumeWindow(aConvProcess, fileHeader.windowLength)) {
+		return false;
+	}
+	aConvProcess->resumeWindowCapacity = fileHeader.windowCapacity;
+	aConvProcess->checkpoint.spanEnd = fileHeader.spanEnd;
+	aConvProcess->checkpoint.movedOffset = fileHeader.movedOffset;
+	aConvProcess->dataBuffer[1].used = 0;
+	if (fileHeader.spanEnd) {
+		if (!checkedRead(aConvProcess->resumeFd, aConvProcess->dataBuffer[1].data, fileHeader.tailLength)) {
+			logmsg(LLVL_ERROR, "Read error while trying to read the data of the resume file.\n");
+			return false;
+		}
+		aConvProcess->dataBuffer[1].used = fileHeader.tailLength;
+		logmsg(LLVL_INFO, "Resume file describes a checkpointed span up to offset %" PRIu64 ", which has been moved from offset %" PRIu64 " on.\n", fileHeader.spanEnd, fileHeader.movedOffset);
+	}
+
+	/* Resume files written by older versions may not carry the history, it
+	 * then simply starts out empty */
+	if (version1) {
+		success = (lseek(aConvProcess->resumeFd, -(off_t)sizeof(struct throughputHistory), SEEK_END) != -1);
+	} else {
+		success = (lseek(aConvProcess->resumeFd, RESUME_FILE_HEADER_MAGIC_LEN + aConvProcess->resumeHeaderLength + fileHeader.windowCapacity, SEEK_SET) != -1);
+	}
+	if (success) {
+		throughputLoadHistory(aConvProcess->resumeFd, &aConvProcess->throughput.history);
+	} else {
+		memset(&aConvProcess->throughput.history, 0, sizeof(struct throughputHistory));
+	}
+
+	return true;
+}
+
+/* Reads only the write offset of a resume file */
+bool peekResumeFileOffset(const char *aFilename, uint64_t *aOutOffset) {
+	int fd = open(aFilename, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	char header[RESUME_FILE_HEADER_MAGIC_LEN];
+	bool success = checkedRead(fd, header, sizeof(header));
+	success = success && (!memcmp(header, RESUME_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN) || !memcmp(header, RESUME_FILE_V2_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN) || !memcmp(header, RESUME_FILE_V1_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN));
+	success = success && checkedRead(fd, aOutOffset, sizeof(uint64_t));
+	close(fd);
+	return success;
+}
+
+static void showProgress(struct conversionProcess *aConvProcess) {
+	double curTime = getTime();
+	if (aConvProcess->stats.startTime < 1) {
+		aConvProcess->stats.startTime = curTime;
+		aConvProcess->stats.lastOutOffset = aConvProcess->outOffset;
+		aConvProcess->stats.lastShowTime = curTime;
+	} else {
+		uint64_t progressBytes = aConvProcess->outOffset - aConvProcess->stats.lastOutOffset;
+		double progressTime = curTime - aConvProcess->stats.lastShowTime;
+
+		bool showStats = ((progressBytes >= 100 * 1024 * 1024) && (progressTime >= 5));
+		showStats = showStats || (progressTime >= 60);
+
+		if (showStats) {
+			double runtimeSeconds = curTime - aConvProcess->stats.startTime;
+			int runtimeSecondsInteger = (int)runtimeSeconds;
+
+			/* The shown rate is the recent one, while the remaining time is
+			 * projected from the rates measured for the individual zones of
+			 * the disk */
+			double copySpeedBytesPerSecond = aConvProcess->throughput.currentRate;
+			uint64_t remainingBytes = aConvProcess->endOutOffset - aConvProcess->outOffset;
+			double remainingSecs = throughputRemainingSeconds(&aConvProcess->throughput, aConvProcess->outOffset, aConvProcess->endOutOffset);
+			int remainingSecsInteger = 0;
+			if ((remainingSecs > 0) && (remainingSecs < (100 * 3600))) {
+				remainingSecsInteger = (int)remainingSecs;
+			}
+
+			/* When running as one of several jobs, the scheduler shows the
+			 * aggregated progress instead */
+			logmsg(isRunningAsJob() ? LLVL_DEBUG : LLVL_INFO, "%2d:%02d: "
+							"%5.1f%%   "
+							"%7" PRIu64 " MiB / %" PRIu64 " MiB   "
+							"%5.1f MiB/s   "
+							"Left: "
+							"%7" PRIu64 " MiB "
+							"%2d:%02d h:m"
+							"\n",
+								runtimeSecondsInteger / 3600, runtimeSecondsInteger % 3600 / 60,
+								100.0 * (double)aConvProcess->outOffset / (double)aConvProcess->endOutOffset,
+								aConvProcess->outOffset / 1024 / 1024,
+								aConvProcess->endOutOffset / 1024 / 1024,
+								copySpeedBytesPerSecond / 1024. / 1024.,
+								remainingBytes / 1024 / 1024,
+								remainingSecsInteger / 3600, remainingSecsInteger % 3600 / 60
+			);
+			if (aConvProcess->ioStats && (aConvProcess->ioStats->deviceCount > 0)) {
+				char deviceStats[256];
+				ioStatsSample(aConvProcess->ioStats, deviceStats, sizeof(deviceStats));
+				logmsg(isRunningAsJob() ? LLVL_DEBUG : LLVL_INFO, "       %s\n", deviceStats);
+			}
+			aConvProcess->stats.lastOutOffset = aConvProcess->outOffset;
+			aConvProcess->stats.lastShowTime = curTime;
+		}
+	}
+}
+
+/* Keeps the copy rate below the I/O rate budget by sleeping. When running as
+ * a job, the budget share is assigned (and changed) by the scheduler. */
+static void throttleCopy(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess, uint64_t aBytesCopied) {
+	uint64_t rateLimit = isRunningAsJob() ? getJobIoRateLimit() : aParameters->ioRateBudget;
+	if (rateLimit == 0) {
+		aConvProcess->throttle.rateLimit = 0;
+		return;
+	}
+
+	double curTime = getTime();
+	if (rateLimit != aConvProcess->throttle.rateLimit) {
+		/* Rate changed, start a new measurement window */
+		aConvProcess->throttle.rateLimit = rateLimit;
+		aConvProcess->throttle.windowStartTime = curTime;
+		aConvProcess->throttle.windowBytes = 0;
+		return;
+	}
+
+	aConvProcess->throttle.windowBytes += aBytesCopied;
+	double targetTime = aConvProcess->throttle.windowStartTime + ((double)aConvProcess->throttle.windowBytes / (double)rateLimit);
+	if (targetTime > curTime) {
+		usleep((useconds_t)((targetTime - curTime) * 1e6));
+	}
+}
+
+static enum copyResult_t issueGracefulShutdown(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	logmsg(LLVL_INFO, "Gracefully shutting down.\n");
+	/* With checkpoints, the resume file is never overwritten in place */
+	bool checkpointing = !aConvProcess->rollback && (aParameters->checkpointInterval || aConvProcess->checkpoint.spanEnd);
+	if (!(checkpointing ? writeCheckpoint(aParameters, aConvProcess) : writeResumeFile(aConvProcess))) {
+		logmsg(LLVL_WARN, "There were errors writing the resume file %s.\n", aParameters->resumeFilename);
+		return COPYRESULT_ERROR_WRITING_RESUME_FILE;
+	} else {
+		logmsg(LLVL_INFO, "Successfully written resume file %s.\n", aParameters->resumeFilename);
+		return COPYRESULT_SUCCESS_RESUMABLE;
+	}
+}
+
+/* Copies the first HEADER_BACKUP_SIZE_BYTES of the device (or the whole
+ * device if it is smaller) into the backup file */
+bool backupDeviceHeader(const char *aDevice, uint64_t aDeviceSize, const char *aBackupFile) {
+	/* Open raw disk for reading */
+	int readFd = open(aDevice, O_RDONLY);
+	if (readFd == -1) {
+		logmsg(LLVL_ERROR, "Opening raw disk device %s for reading failed: %s\n", aDevice, strerror(errno));
+		return false;
+	}
+
+	/* Open backup file */
+	int writeFd = open(aBackupFile, O_TRUNC | O_WRONLY | O_CREAT, 0600);
+	if (writeFd == -1) {
+		logmsg(LLVL_ERROR, "Opening backup file %s for writing failed: %s\n", aBackupFile, strerror(errno));
+		close(readFd);
+		return false;
+	}
+
+	/* Determine the amount of blocks that need to be copied */
+	int copyBlockCount = (HEADER_BACKUP_SIZE_BYTES < aDeviceSize) ? HEADER_BACKUP_BLOCKCNT : (aDeviceSize / HEADER_BACKUP_BLOCKSIZE);
+	logmsg(LLVL_DEBUG, "Backup file %s will consist of %d blocks of %d bytes each (%d bytes total, %d kiB)\n", aBackupFile, copyBlockCount, HEADER_BACKUP_BLOCKSIZE, copyBlockCount * HEADER_BACKUP_BLOCKSIZE, copyBlockCount * HEADER_BACKUP_BLOCKSIZE / 1024);
+
+	/* Start copying */
+	uint8_t copyBuffer[HEADER_BACKUP_BLOCKSIZE];
+	for (int i = 0; i < copyBlockCount; i++) {
+		if (!checkedRead(readFd, copyBuffer, HEADER_BACKUP_BLOCKSIZE)) {
+			logmsg(LLVL_ERROR, "Read failed when trying to copy to backup file: %s\n", strerror(errno));
+			close(writeFd);
+			close(readFd);
+			return false;
+		}
+		if (!checkedWrite(writeFd, copyBuffer, HEADER_BACKUP_BLOCKSIZE)) {
+			logmsg(LLVL_ERROR, "Write failed when trying to copy to backup file: %s\n", strerror(errno));
+			close(writeFd);
+			close(readFd);
+			return false;
+		}
+	}
+
+	CRASHPOINT("header backup fsync");
+	fsync(writeFd);
+	close(writeFd);
+	close(readFd);
+	return true;
+}
+
+/* A failed write may already have overwritten part of the plain data that was
+ * read ahead into the next buffer, since the LUKS device is shifted by the
+ * header size relative to the plain device. The resume file only holds the
+ * buffer that failed to write, so the read-ahead data is written back to
+ * where it was read from before shutting down. */
+static bool restoreReadAhead(struct conversionProcess *aConvProcess, const struct chunk *aReadAhead, uint64_t aOffset) {
+	if (aReadAhead->used == 0) {
+		return true;
+	}
+	if (aConvProcess->rollback) {
+		/* Rolling back writes behind the read pointer, see rollback.c */
+		return true;
+	}
+
+	for (int try = 0; try < 10; try++) {
+		if (chunkWriteTo(aReadAhead, &aConvProcess->readBackend, aOffset) == aReadAhead->used) {
+			logmsg(LLVL_INFO, "Restored %u bytes of read-ahead data at offset 0x%" PRIx64 ".\n", aReadAhead->used, aOffset);
+			return true;
+		}
+	}
+	logmsg(LLVL_CRITICAL, "Unable to restore read-ahead data at offset 0x%" PRIx64 " to 0x%" PRIx64 " of the plain device, up to %" PRIu64 " bytes at the start of that range may be lost.\n", aOffset, aOffset + aReadAhead->used, aConvProcess->readDevSize - aConvProcess->writeDevSize);
+	return false;
+}
+
+/* Writes a chunk to the LUKS device, either through dm-crypt or by the
+ * userspace encryption engine */
+static ssize_t writeChunkAt(struct conversionProcess *aConvProcess, const struct chunk *aChunk, uint64_t aOffset) {
+	if (aConvProcess->cryptEngine) {
+		/* The engine bypasses the write backend, so it is traced here */
+		if (aConvProcess->trace) {
+			uint64_t issueTime = traceTimestamp();
+			ssize_t result = cryptEngineWriteAt(aConvProcess->cryptEngine, aChunk, aOffset);
+			traceRecordOp(aConvProcess->trace, TRACEDEV_WRITE, TRACEOP_WRITE, aOffset, aChunk->used, result, issueTime);
+			return result;
+		}
+		return cryptEngineWriteAt(aConvProcess->cryptEngine, aChunk, aOffset);
+	}
+	return chunkWriteTo(aChunk, &aConvProcess->writeBackend, aOffset);
+}
+
+/* Alternately reads one chunk ahead and writes the previous one */
+static enum copyResult_t copyAlternating(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	while (true) {
+		ssize_t bytesTransferred;
+		int unUsedBufferIndex = (1 - aConvProcess->usedBufferIndex);
+		int bytesToRead;
+
+#ifdef DEVELOPMENT
+		if (aParameters->dev.slowDown) {
+			usleep(500 * 1000);
+		}
+#endif
+
+		if (REMAINING_BYTES(aConvProcess) - (aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used) < aConvProcess->dataBuffer[unUsedBufferIndex].size) {
+			/* Remaining is not a full chunk */
+			bytesToRead = REMAINING_BYTES(aConvProcess) - (aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used);
+			if (bytesToRead > 0) {
+				logmsg(LLVL_DEBUG, "Preparing to write last (partial) chunk of %d bytes.\n", bytesToRead);
+			}
+		} else {
+			bytesToRead = aConvProcess->dataBuffer[unUsedBufferIndex].size;
+		}
+		if (bytesToRead > 0) {
+#ifdef DEVELOPMENT
+			if (aParameters->dev.ioErrors) {
+				bytesTransferred = unreliableChunkReadFrom(&aConvProcess->dataBuffer[unUsedBufferIndex], &aConvProcess->readBackend, aConvProcess->inOffset, bytesToRead);
+			} else {
+				bytesTransferred = chunkReadFrom(&aConvProcess->dataBuffer[unUsedBufferIndex], &aConvProcess->readBackend, aConvProcess->inOffset, bytesToRead);
+			}
+#else
+			bytesTransferred = chunkReadFrom(&aConvProcess->dataBuffer[unUsedBufferIndex], &aConvProcess->readBackend, aConvProcess->inOffset, bytesToRead);
+#endif
+			if (bytesTransferred == -1) {
+				/* Error reading from device, handle this! */
+				logmsg(LLVL_ERROR, "Error reading from device at offset 0x%lx, will shutdown.\n", aConvProcess->inOffset);
+				issueSigQuit();
+			} else if (bytesTransferred > 0) {
+				aConvProcess->inOffset += aConvProcess->dataBuffer[unUsedBufferIndex].used;
+			} else {
+				logmsg(LLVL_WARN, "Read of %d transferred %d hit EOF at inOffset = %ld remaining = %ld\n", bytesToRead, bytesTransferred, aConvProcess->inOffset, REMAINING_BYTES(aConvProcess));
+			}
+		} else {
+			if (bytesToRead == 0) {
+				logmsg(LLVL_DEBUG, "No more bytes to read, will finish writing last partial chunk of %d bytes.\n", REMAINING_BYTES(aConvProcess));
+			} else {
+				logmsg(LLVL_WARN, "Odd: %d bytes to read at inOffset = %ld remaining = %ld\n", bytesToRead, aConvProcess->inOffset, REMAINING_BYTES(aConvProcess));
+			}
+		}
+
+		if (receivedSigQuit()) {
+			return issueGracefulShutdown(aParameters, aConvProcess);
+		}
+
+		if (REMAINING_BYTES(aConvProcess) < aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used) {
+			/* Remaining is not a full chunk */
+			aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used = REMAINING_BYTES(aConvProcess);
+		}
+
+#ifdef DEVELOPMENT
+		if (aParameters->dev.ioErrors) {
+			bytesTransferred = unreliableChunkWriteTo(&aConvProcess->dataBuffer[aConvProcess->usedBufferIndex], &aConvProcess->writeBackend, aConvProcess->outOffset);
+		} else {
+			bytesTransferred = writeChunkAt(aConvProcess, &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex], aConvProcess->outOffset);
+		}
+#else
+		bytesTransferred = writeChunkAt(aConvProcess, &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex], aConvProcess->outOffset);
+#endif
+		if (bytesTransferred == -1) {
+			logmsg(LLVL_ERROR, "Error writing to device at offset 0x%lx, shutting down.\n", aConvProcess->outOffset);
+			restoreReadAhead(aConvProcess, &aConvProcess->dataBuffer[unUsedBufferIndex], aConvProcess->inOffset - aConvProcess->dataBuffer[unUsedBufferIndex].used);
+			return issueGracefulShutdown(aParameters, aConvProcess);
+		} else if (bytesTransferred > 0) {
+			throughputUpdate(&aConvProcess->throughput, aConvProcess->outOffset, bytesTransferred, getTime());
+			aConvProcess->outOffset += bytesTransferred;
+			aConvProcess->stats.copied += bytesTransferred;
+			reportJobProgress(aConvProcess->outOffset, aConvProcess->endOutOffset);
+			showProgress(aConvProcess);
+			if (aConvProcess->outOffset == aConvProcess->endOutOffset) {
+				logmsg(LLVL_INFO, "Disk copy completed successfully.\n");
+				return COPYRESULT_SUCCESS_FINISHED;
+			}
+
+			aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used = 0;
+			aConvProcess->usedBufferIndex = unUsedBufferIndex;
+			throttleCopy(aParameters, aConvProcess, bytesTransferred);
+
+			if ((aConvProcess->dryRunDeadline > 0) && (getTime() >= aConvProcess->dryRunDeadline)) {
+				logmsg(LLVL_INFO, "Dry run time limit reached.\n");
+				return COPYRESULT_DRY_RUN_LIMIT_REACHED;
+			}
+		}
+	}
+}
+
+/* Accounts for a chunk that was written at the write pointer. Returns true
+ * if copying ends here, the result is then stored in aResult. */
+static bool chunkWritten(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess, ssize_t aBytesWritten, enum copyResult_t *aResult) {
+	throughputUpdate(&aConvProcess->throughput, aConvProcess->outOffset, aBytesWritten, getTime());
+	aConvProcess->outOffset += aBytesWritten;
+	aConvProcess->stats.copied += aBytesWritten;
+	reportJobProgress(aConvProcess->outOffset, aConvProcess->endOutOffset);
+	showProgress(aConvProcess);
+	if (aConvProcess->outOffset == aConvProcess->endOutOffset) {
+		logmsg(LLVL_INFO, "Disk copy completed successfully.\n");
+		*aResult = COPYRESULT_SUCCESS_FINISHED;
+		return true;
+	}
+
+	throttleCopy(aParameters, aConvProcess, aBytesWritten);
+	if ((aConvProcess->dryRunDeadline > 0) && (getTime() >= aConvProcess->dryRunDeadline)) {
+		logmsg(LLVL_INFO, "Dry run time limit reached.\n");
+		*aResult = COPYRESULT_DRY_RUN_LIMIT_REACHED;
+		return true;
+	}
+	return false;
+}
+
+/* Makes the chunk at the write pointer the active buffer again, which is the
+ * one the resume file is written from */
+static void keepBatchHead(struct conversionProcess *aConvProcess, const struct chunk *aHead) {
+	int index = (aConvProcess->dataBuffer[1].data == aHead->data) ? 1 : 0;
+	if (aConvProcess->dataBuffer[index].data != aHead->data) {
+		memcpy(aConvProcess->dataBuffer[index].data, aHead->data, aHead->used);
+	}
+	aConvProcess->dataBuffer[index].used = aHead->used;
+	aConvProcess->dataBuffer[1 - index].used = 0;
+	aConvProcess->usedBufferIndex = index;
+}
+
+/* Reads a window of several chunks, then writes all of them but the last one
+ * (which is needed as read-ahead, see restoreReadAhead) and flushes the writes
+ * before reading again. This saves seeks when reading and writing the same
+ * rotational disk. */
+static enum copyResult_t copyBatched(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess, struct chunk *aRing, int aChunkCount) {
+	int head = 0, filled = 1;
+	while (true) {
+		while ((filled < aChunkCount) && (aConvProcess->inOffset < aConvProcess->endOutOffset) && !receivedSigQuit()) {
+			struct chunk *readChunk = &aRing[(head + filled) % aChunkCount];
+			uint64_t remaining = aConvProcess->endOutOffset - aConvProcess->inOffset;
+			uint32_t bytesToRead = (remaining < readChunk->size) ? remaining : readChunk->size;
+			if (chunkReadFrom(readChunk, &aConvProcess->readBackend, aConvProcess->inOffset, bytesToRead) != bytesToRead) {
+				logmsg(LLVL_ERROR, "Error reading from device at offset 0x%" PRIx64 ", will shutdown.\n", aConvProcess->inOffset);
+				readChunk->used = 0;
+				issueSigQuit();
+				break;
+			}
+			aConvProcess->inOffset += readChunk->used;
+			filled++;
+		}
+
+		/* A chunk may only be written when the following one has been read,
+		 * since writing it overwrites the start of that */
+		int writable = (aConvProcess->inOffset >= aConvProcess->endOutOffset) ? filled : (filled - 1);
+		for (int i = 0; (i < writable) && !receivedSigQuit(); i++) {
+			struct chunk *writeChunk = &aRing[head];
+			if (REMAINING_BYTES(aConvProcess) < writeChunk->used) {
+				writeChunk->used = REMAINING_BYTES(aConvProcess);
+			}
+			ssize_t bytesTransferred = writeChunkAt(aConvProcess, writeChunk, aConvProcess->outOffset);
+			if (bytesTransferred == -1) {
+				logmsg(LLVL_ERROR, "Error writing to device at offset 0x%" PRIx64 ", shutting down.\n", aConvProcess->outOffset);
+				if (filled > 1) {
+					restoreReadAhead(aConvProcess, &aRing[(head + 1) % aChunkCount], aConvProcess->outOffset + writeChunk->used);
+				}
+				keepBatchHead(aConvProcess, writeChunk);
+				return issueGracefulShutdown(aParameters, aConvProcess);
+			}
+
+			writeChunk->used = 0;
+			head = (head + 1) % aChunkCount;
+			filled--;
+			enum copyResult_t result;
+			if (chunkWritten(aParameters, aConvProcess, bytesTransferred, &result)) {
+				keepBatchHead(aConvProcess, &aRing[head]);
+				return result;
+			}
+		}
+
+		if (receivedSigQuit()) {
+			keepBatchHead(aConvProcess, &aRing[head]);
+			return issueGracefulShutdown(aParameters, aConvProcess);
+		}
+
+		/* Otherwise the kernel writes back while the next batch is read */
+		if (!aConvProcess->cryptEngine) {
+			backendFlush(&aConvProcess->writeBackend);
+		}
+	}
+}
+
+/* Discards everything that was read ahead of the chunk at the write pointer,
+ * which has not been written yet and therefore is still intact on the device,
+ * and continues with alternating reads and writes */
+static enum copyResult_t abandonSpill(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	logmsg(LLVL_WARN, "Spill file unusable, continuing without read-ahead.\n");
+	aConvProcess->inOffset = aConvProcess->outOffset + aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used;
+	aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex].used = 0;
+	return copyAlternating(aParameters, aConvProcess);
+}
+
+/* Like copyBatched, but the batch is kept in the spill file instead of
+ * memory. Only the chunk at the write pointer and the one after it are held
+ * in the two regular buffers. */
+static enum copyResult_t copySpilled(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	struct spillFile *spill = aConvProcess->spill;
+	int head = 0, filled = 1;
+	if (!spillStore(spill, head, &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex], aConvProcess->outOffset)) {
+		return abandonSpill(aParameters, aConvProcess);
+	}
+	while (true) {
+		struct chunk *readChunk = &aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex];
+		while ((filled < spill->slotCount) && (aConvProcess->inOffset < aConvProcess->endOutOffset) && !receivedSigQuit()) {
+			uint64_t remaining = aConvProcess->endOutOffset - aConvProcess->inOffset;
+			uint32_t bytesToRead = (remaining < readChunk->size) ? remaining : readChunk->size;
+			if (chunkReadFrom(readChunk, &aConvProcess->readBackend, aConvProcess->inOffset, bytesToRead) != bytesToRead) {
+				logmsg(LLVL_ERROR, "Error reading from device at offset 0x%" PRIx64 ", will shutdown.\n", aConvProcess->inOffset);
+				issueSigQuit();
+				break;
+			}
+			if (!spillStore(spill, (head + filled) % spill->slotCount, readChunk, aConvProcess->inOffset)) {
+				return abandonSpill(aParameters, aConvProcess);
+			}
+			aConvProcess->inOffset += readChunk->used;
+			filled++;
+		}
+		readChunk->used = 0;
+		if (receivedSigQuit()) {
+			return issueGracefulShutdown(aParameters, aConvProcess);
+		}
+		if (!spillSync(spill)) {
+			return abandonSpill(aParameters, aConvProcess);
+		}
+
+		int writable = (aConvProcess->inOffset >= aConvProcess->endOutOffset) ? filled : (filled - 1);
+		for (int i = 0; (i < writable) && !receivedSigQuit(); i++) {
+			struct chunk *writeChunk = &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex];
+			struct chunk *nextChunk = &aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex];
+			if ((filled > 1) && !spillLoad(spill, (head + 1) % spill->slotCount, nextChunk, aConvProcess->outOffset + writeChunk->used)) {
+				return abandonSpill(aParameters, aConvProcess);
+			}
+			if (REMAINING_BYTES(aConvProcess) < writeChunk->used) {
+				writeChunk->used = REMAINING_BYTES(aConvProcess);
+			}
+			ssize_t bytesTransferred = writeChunkAt(aConvProcess, writeChunk, aConvProcess->outOffset);
+			if (bytesTransferred == -1) {
+				logmsg(LLVL_ERROR, "Error writing to device at offset 0x%" PRIx64 ", shutting down.\n", aConvProcess->outOffset);
+				if (filled > 1) {
+					restoreReadAhead(aConvProcess, nextChunk, aConvProcess->outOffset + writeChunk->used);
+				}
+				return issueGracefulShutdown(aParameters, aConvProcess);
+			}
+
+			writeChunk->used = 0;
+			aConvProcess->usedBufferIndex = 1 - aConvProcess->usedBufferIndex;
+			head = (head + 1) % spill->slotCount;
+			filled--;
+			enum copyResult_t result;
+			if (chunkWritten(aParameters, aConvProcess, bytesTransferred, &result)) {
+				return result;
+			}
+		}
+
+		if (receivedSigQuit()) {
+			return issueGracefulShutdown(aParameters, aConvProcess);
+		}
+		if (!aConvProcess->cryptEngine) {
+			backendFlush(&aConvProcess->writeBackend);
+		}
+	}
+}
+
+/* Splices one piece of the chunk at the write pointer from the plain device
+ * to the LUKS device */
+static ssize_t splicePiece(struct conversionProcess *aConvProcess, struct splicePipe *aPipe, uint64_t aOffset, uint32_t aLength) {
+	uint64_t issueTime = aConvProcess->trace ? traceTimestamp() : 0;
+	ssize_t result = spliceRange(aPipe, aConvProcess->readBackend.fd, aConvProcess->readBackend.offset + aOffset, aConvProcess->writeBackend.fd, aConvProcess->writeBackend.offset + aOffset, aLength);
+	if (aConvProcess->trace) {
+		/* Splicing bypasses both backends, so it is traced here */
+		int savedErrno = errno;
+		traceRecordOp(aConvProcess->trace, TRACEDEV_READ, TRACEOP_READ, aOffset, aLength, result, issueTime);
+		traceRecordOp(aConvProcess->trace, TRACEDEV_WRITE, TRACEOP_WRITE, aOffset, aLength, result, issueTime);
+		errno = savedErrno;
+	}
+	return result;
+}
+
+/* Completes a chunk that could not be spliced in the conventional way. The
+ * chunk is assembled from the window in aHead, the plain data that has not
+ * been spliced yet and what has already been spliced to the LUKS device,
+ * and then written as a whole. Afterwards aHead holds the whole chunk, so
+ * that the resume file can be written from it if writing fails. */
+static ssize_t writeAssembledChunk(struct conversionProcess *aConvProcess, struct chunk *aHead, uint64_t aSplicedOffset, uint32_t aLength) {
+	uint64_t chunkDataEnd = aConvProcess->outOffset + aHead->used;
+	uint32_t unspliced = aSplicedOffset - chunkDataEnd;
+	uint32_t spliced = aLength - (unspliced + aHead->used);
+	struct chunk unsplicedPart = { .size = unspliced, .data = aHead->data + aHead->used };
+	struct chunk splicedPart = { .size = spliced, .data = unsplicedPart.data + unspliced };
+
+	bool assembled = false;
+	for (int try = 0; (try < 10) && !assembled; try++) {
+		assembled = ((unspliced == 0) || (chunkReadFrom(&unsplicedPart, &aConvProcess->readBackend, chunkDataEnd, unspliced) == unspliced))
+			&& ((spliced == 0) || (chunkReadFrom(&splicedPart, &aConvProcess->writeBackend, aSplicedOffset, spliced) == spliced));
+	}
+	if (!assembled) {
+		if (spliced > 0) {
+			logmsg(LLVL_CRITICAL, "Unable to assemble the chunk at offset 0x%" PRIx64 ", the plain data from 0x%" PRIx64 " to 0x%" PRIx64 " is only contained on the LUKS device.\n", aConvProcess->outOffset, aSplicedOffset, aConvProcess->outOffset + aLength);
+		} else {
+			logmsg(LLVL_ERROR, "Error reading from device at offset 0x%" PRIx64 ".\n", chunkDataEnd);
+		}
+		return -1;
+	}
+	aHead->used = aLength;
+	return writeChunkAt(aConvProcess, aHead, aConvProcess->outOffset);
+}
+
+/* Moves the data with splice(2) so that it does not have to be copied to user
+ * space and back. Writing a chunk overwrites the first header size bytes of
+ * the plain data following it, only this window is read into the buffer at
+ * the write pointer. The rest of a chunk is spliced from its end towards its
+ * start in pieces of at most the header size, so that every piece only ever
+ * overwrites data that has already been moved. If a piece cannot be spliced,
+ * that chunk is completed with writeAssembledChunk. */
+static enum copyResult_t copySpliced(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	if (aConvProcess->readDevSize <= aConvProcess->writeDevSize) {
+		logmsg(LLVL_WARN, "Splicing requires the LUKS device to be smaller than the plain device, alternating reads and writes instead.\n");
+		return copyAlternating(aParameters, aConvProcess);
+	}
+	uint32_t windowSize = aConvProcess->readDevSize - aConvProcess->writeDevSize;
+
+	struct splicePipe pipe = { .readFd = -1, .writeFd = -1 };
+	bool splicing = (aConvProcess->readBackend.fd != -1) && (aConvProcess->writeBackend.fd != -1) && splicePipeCreate(&pipe, SPLICE_PIPE_SIZE);
+	uint32_t pieceSize = 0;
+	if (splicing) {
+		pieceSize = (pipe.capacity < windowSize) ? pipe.capacity : windowSize;
+		logmsg(LLVL_DEBUG, "Splicing in pieces of %u bytes, header window of %u bytes.\n", pieceSize, windowSize);
+	} else {
+		logmsg(LLVL_WARN, "Cannot splice between the devices, copying through user space.\n");
+	}
+
+	enum copyResult_t result;
+	while (true) {
+		struct chunk *head = &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex];
+		struct chunk *next = &aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex];
+		uint32_t length = (REMAINING_BYTES(aConvProcess) < head->size) ? REMAINING_BYTES(aConvProcess) : head->size;
+		if (head->used > length) {
+			head->used = length;
+		}
+
+		/* The window behind the chunk must be read before anything of the
+		 * chunk is written */
+		uint64_t nextOffset = aConvProcess->outOffset + length;
+		uint64_t afterChunk = aConvProcess->endOutOffset - nextOffset;
+		uint32_t windowLength = (afterChunk < windowSize) ? afterChunk : windowSize;
+		next->used = 0;
+		if ((windowLength > 0) && (chunkReadFrom(next, &aConvProcess->readBackend, nextOffset, windowLength) != windowLength)) {
+			logmsg(LLVL_ERROR, "Error reading from device at offset 0x%" PRIx64 ", will shutdown.\n", nextOffset);
+			next->used = 0;
+			issueSigQuit();
+		}
+		aConvProcess->inOffset = nextOffset + next->used;
+		if (receivedSigQuit()) {
+			next->used = 0;
+			aConvProcess->inOffset = aConvProcess->outOffset + head->used;
+			result = issueGracefulShutdown(aParameters, aConvProcess);
+			break;
+		}
+
+		uint64_t splicedOffset = nextOffset;
+		uint64_t chunkDataEnd = aConvProcess->outOffset + head->used;
+		while (splicing && (splicedOffset > chunkDataEnd)) {
+			uint32_t pieceLength = ((splicedOffset - chunkDataEnd) < pieceSize) ? (splicedOffset - chunkDataEnd) : pieceSize;
+			if (splicePiece(aConvProcess, &pipe, splicedOffset - pieceLength, pieceLength) != pieceLength) {
+				if (errno == EINVAL) {
+					logmsg(LLVL_WARN, "Devices do not support splicing, copying through user space.\n");
+					splicing = false;
+				} else {
+					logmsg(LLVL_WARN, "Error splicing at offset 0x%" PRIx64 ", copying chunk through user space.\n", splicedOffset - pieceLength);
+				}
+				break;
+			}
+			splicedOffset -= pieceLength;
+		}
+
+		ssize_t bytesTransferred = -1;
+		if (splicedOffset == chunkDataEnd) {
+			if ((head->used == 0) || (writeChunkAt(aConvProcess, head, aConvProcess->outOffset) == head->used)) {
+				bytesTransferred = length;
+			}
+		}
+		if (bytesTransferred == -1) {
+			bytesTransferred = writeAssembledChunk(aConvProcess, head, splicedOffset, length);
+		}
+		if (bytesTransferred != length) {
+			logmsg(LLVL_ERROR, "Error writing to device at offset 0x%" PRIx64 ", shutting down.\n", aConvProcess->outOffset);
+			restoreReadAhead(aConvProcess, next, nextOffset);
+			next->used = 0;
+			aConvProcess->inOffset = aConvProcess->outOffset + head->used;
+			result = issueGracefulShutdown(aParameters, aConvProcess);
+			break;
+		}
+
+		head->used = 0;
+		aConvProcess->usedBufferIndex = 1 - aConvProcess->usedBufferIndex;
+		if (chunkWritten(aParameters, aConvProcess, bytesTransferred, &result)) {
+			break;
+		}
+	}
+
+	if (pipe.readFd != -1) {
+		splicePipeClose(&pipe);
+	}
+	return result;
+}
+
+/* Writes the pending window of a resume file that was written with larger
+ * chunks, in pieces of the current chunk size. The chunk behind it is read
+ * ahead into the first buffer first, which then is the active buffer and
+ * copying continues from there. Returns true if copying ends here, the result
+ * is then stored in aResult. */
+static bool writePendingWindow(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess, enum copyResult_t *aResult) {
+	struct chunk *window = &aConvProcess->pendingWindow;
+	struct chunk *readAhead = &aConvProcess->dataBuffer[0];
+	if (window->used > REMAINING_BYTES(aConvProcess)) {
+		window->used = REMAINING_BYTES(aConvProcess);
+	}
+	uint64_t windowEnd = aConvProcess->outOffset + window->used;
+	uint64_t remaining = aConvProcess->endOutOffset - windowEnd;
+	uint32_t bytesToRead = (remaining < readAhead->size) ? remaining : readAhead->size;
+	aConvProcess->usedBufferIndex = 0;
+	readAhead->used = 0;
+	if ((bytesToRead > 0) && (chunkReadFrom(readAhead, &aConvProcess->readBackend, windowEnd, bytesToRead) != bytesToRead)) {
+		logmsg(LLVL_ERROR, "Error reading from device at offset 0x%" PRIx64 ", will shutdown.\n", windowEnd);
+		readAhead->used = 0;
+		*aResult = issueGracefulShutdown(aParameters, aConvProcess);
+		return true;
+	}
+	aConvProcess->inOffset = windowEnd + readAhead->used;
+
+	logmsg(LLVL_DEBUG, "Writing pending window of %u bytes at offset 0x%" PRIx64 ".\n", window->used, aConvProcess->outOffset);
+	uint32_t written = 0;
+	while (written < window->used) {
+		uint32_t pieceLength = window->used - written;
+		pieceLength = (pieceLength < readAhead->size) ? pieceLength : readAhead->size;
+		struct chunk piece = {
+			.size = pieceLength,
+			.used = pieceLength,
+			.data = window->data + written,
+		};
+		if (writeChunkAt(aConvProcess, &piece, aConvProcess->outOffset + written) != (ssize_t)pieceLength) {
+			logmsg(LLVL_ERROR, "Error writing to device at offset 0x%" PRIx64 ", shutting down.\n", aConvProcess->outOffset + written);
+			restoreReadAhead(aConvProcess, readAhead, windowEnd);
+			readAhead->used = 0;
+			*aResult = issueGracefulShutdown(aParameters, aConvProcess);
+			return true;
+		}
+		written += pieceLength;
+	}
+	freeChunk(window);
+	return chunkWritten(aParameters, aConvProcess, written, aResult);
+}
+
+/* Records in the resume file how far the current span has been moved. Only
+ * this field changes while a span is moved, so it is updated in place. */
+static bool recordMovedOffset(struct conversionProcess *aConvProcess) {
+	uint64_t movedOffset = aConvProcess->checkpoint.movedOffset;
+	off_t position = RESUME_FILE_HEADER_MAGIC_LEN + offsetof(struct resumeFileHeader, movedOffset);
+	CRASHPOINT("checkpoint progress write");
+	bool success = (pwrite(aConvProcess->resumeFd, &movedOffset, sizeof(movedOffset), position) == sizeof(movedOffset));
+	CRASHPOINT("checkpoint progress sync");
+	return success && (fdatasync(aConvProcess->resumeFd) == 0);
+}
+
+/* Starts the next checkpointed span at the write pointer. The window at the
+ * write pointer is cut to the header size, the plain data behind it is still
+ * intact. The plain data at the end of the span, which moving the span
+ * overwrites, is read and the resume file is replaced by one holding both. */
+static bool beginCheckpointSpan(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess, uint32_t aWindowSize) {
+	if (aConvProcess->pendingWindow.used > 0) {
+		uint32_t length = (aConvProcess->pendingWindow.used < aWindowSize) ? aConvProcess->pendingWindow.used : aWindowSize;
+		memcpy(aConvProcess->dataBuffer[0].data, aConvProcess->pendingWindow.data, length);
+		aConvProcess->dataBuffer[0].used = length;
+		aConvProcess->usedBufferIndex = 0;
+		freeChunk(&aConvProcess->pendingWindow);
+	}
+	struct chunk *head = &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex];
+	struct chunk *tail = &aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex];
+	if (head->used > aWindowSize) {
+		head->used = aWindowSize;
+	}
+	if (head->used > REMAINING_BYTES(aConvProcess)) {
+		head->used = REMAINING_BYTES(aConvProcess);
+	}
+
+	uint64_t spanEnd = aConvProcess->outOffset + aParameters->checkpointInterval;
+	spanEnd -= spanEnd % CHECKPOINT_PIECE_ALIGNMENT;
+	if (spanEnd < aConvProcess->outOffset + head->used) {
+		spanEnd = aConvProcess->outOffset + head->used;
+	}
+	if (spanEnd > aConvProcess->endOutOffset) {
+		spanEnd = aConvProcess->endOutOffset;
+	}
+	uint64_t afterSpan = aConvProcess->endOutOffset - spanEnd;
+	uint32_t tailLength = (afterSpan < aWindowSize) ? afterSpan : aWindowSize;
+	tail->used = 0;
+	if ((tailLength > 0) && (chunkReadFrom(tail, &aConvProcess->readBackend, spanEnd, tailLength) != tailLength)) {
+		logmsg(LLVL_ERROR, "Error reading from device at offset 0x%" PRIx64 ", will shutdown.\n", spanEnd);
+		tail->used = 0;
+		return false;
+	}
+
+	aConvProcess->inOffset = spanEnd + tail->used;
+	aConvProcess->checkpoint.spanEnd = spanEnd;
+	aConvProcess->checkpoint.movedOffset = spanEnd;
+	if (!writeCheckpoint(aParameters, aConvProcess)) {
+		aConvProcess->checkpoint.spanEnd = 0;
+		aConvProcess->checkpoint.movedOffset = 0;
+		tail->used = 0;
+		aConvProcess->inOffset = aConvProcess->outOffset + head->used;
+		return false;
+	}
+	logmsg(LLVL_DEBUG, "Checkpoint written, moving span from 0x%" PRIx64 " to 0x%" PRIx64 ".\n", aConvProcess->outOffset, spanEnd);
+	return true;
+}
+
+/* Moves the data in spans of the checkpoint interval, so that the resume file
+ * is valid at all times and a conversion that was killed or lost power can be
+ * continued with --resume. Writing the LUKS device overwrites the plain data
+ * one header size behind, so every span is moved from its end towards its
+ * start in pieces of less than the header size. Each piece is read right
+ * before it is written and only overwrites plain data that has already been
+ * moved or that is held in the resume file. After each piece, the LUKS device
+ * is flushed and the start of the moved part is recorded in the resume file,
+ * from where --resume continues. The window at the start of the span is
+ * written last. */
+static enum copyResult_t copyCheckpointed(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	if (aConvProcess->readDevSize < aConvProcess->writeDevSize + (2 * CHECKPOINT_PIECE_ALIGNMENT)) {
+		if (aConvProcess->checkpoint.spanEnd) {
+			logmsg(LLVL_ERROR, "Resume file describes a checkpointed span, but the LUKS device is not smaller than the plain device. Refusing to continue.\n");
+			return COPYRESULT_SUCCESS_RESUMABLE;
+		}
+		logmsg(LLVL_WARN, "Checkpoints require the LUKS device to be smaller than the plain device, the resume file is only written when aborting.\n");
+		return copyAlternating(aParameters, aConvProcess);
+	}
+	uint32_t windowSize = aConvProcess->readDevSize - aConvProcess->writeDevSize;
+
+	/* Partially covered sectors are written as a whole, so a piece must end
+	 * one sector short of the header size in front of its own data */
+	uint32_t pieceSize = windowSize - CHECKPOINT_PIECE_ALIGNMENT;
+	pieceSize -= pieceSize % CHECKPOINT_PIECE_ALIGNMENT;
+	struct chunk piece;
+	if (!allocChunk(&piece, pieceSize)) {
+		logmsg(LLVL_ERROR, "Failed to allocate %u bytes for checkpointed copying: %s\n", pieceSize, strerror(errno));
+		return issueGracefulShutdown(aParameters, aConvProcess);
+	}
+	logmsg(LLVL_DEBUG, "Checkpointing every %" PRIu64 " bytes, moving spans in pieces of %u bytes.\n", aParameters->checkpointInterval, pieceSize);
+
+	enum copyResult_t result;
+	while (true) {
+		if (!aConvProcess->checkpoint.spanEnd) {
+			if (!aParameters->checkpointInterval) {
+				/* The span of the resume file is complete, continue without
+				 * checkpoints */
+				aConvProcess->inOffset = aConvProcess->outOffset + aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used;
+				result = copyAlternating(aParameters, aConvProcess);
+				break;
+			}
+			if (receivedSigQuit() || !beginCheckpointSpan(aParameters, aConvProcess, windowSize)) {
+				result = issueGracefulShutdown(aParameters, aConvProcess);
+				break;
+			}
+		}
+
+		struct chunk *head = &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex];
+		uint64_t headEnd = aConvProcess->outOffset + head->used;
+		while ((aConvProcess->checkpoint.movedOffset > headEnd) && !receivedSigQuit()) {
+			uint64_t pieceStart = headEnd;
+			if (aConvProcess->checkpoint.movedOffset - headEnd > pieceSize) {
+				pieceStart = aConvProcess->checkpoint.movedOffset - pieceSize;
+				pieceStart += (CHECKPOINT_PIECE_ALIGNMENT - (pieceStart % CHECKPOINT_PIECE_ALIGNMENT)) % CHECKPOINT_PIECE_ALIGNMENT;
+			}
+			uint32_t pieceLength = aConvProcess->checkpoint.movedOffset - pieceStart;
+			if (chunkReadFrom(&piece, &aConvProcess->readBackend, pieceStart, pieceLength) != pieceLength) {
+				logmsg(LLVL_ERROR, "Error reading from device at offset 0x%" PRIx64 ", will shutdown.\n", pieceStart);
+				issueSigQuit();
+				break;
+			}
+			if ((writeChunkAt(aConvProcess, &piece, pieceStart) != pieceLength) || !flushLuksDevice(aConvProcess)) {
+				logmsg(LLVL_ERROR, "Error writing to device at offset 0x%" PRIx64 ", shutting down.\n", pieceStart);
+				issueSigQuit();
+				break;
+			}
+			aConvProcess->checkpoint.movedOffset = pieceStart;
+			if (!recordMovedOffset(aConvProcess)) {
+				logmsg(LLVL_ERROR, "Cannot record the checkpoint progress in the resume file %s: %s\n", aParameters->resumeFilename, strerror(errno));
+				issueSigQuit();
+				break;
+			}
+		}
+		if (receivedSigQuit()) {
+			result = issueGracefulShutdown(aParameters, aConvProcess);
+			break;
+		}
+
+		if ((head->used > 0) && (writeChunkAt(aConvProcess, head, aConvProcess->outOffset) != head->used)) {
+			logmsg(LLVL_ERROR, "Error writing to device at offset 0x%" PRIx64 ", shutting down.\n", aConvProcess->outOffset);
+			result = issueGracefulShutdown(aParameters, aConvProcess);
+			break;
+		}
+
+		/* The plain data at the end of the span is the next window */
+		uint64_t spanLength = aConvProcess->checkpoint.spanEnd - aConvProcess->outOffset;
+		head->used = 0;
+		aConvProcess->usedBufferIndex = 1 - aConvProcess->usedBufferIndex;
+		aConvProcess->checkpoint.spanEnd = 0;
+		aConvProcess->checkpoint.movedOffset = 0;
+		if (chunkWritten(aParameters, aConvProcess, spanLength, &result)) {
+			break;
+		}
+	}
+
+	freeChunk(&piece);
+	return result;
+}
+
+enum copyResult_t startDataCopy(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	logmsg(LLVL_INFO, "Starting copying of data, read offset %" PRIu64 ", write offset %" PRIu64 "\n", aConvProcess->inOffset, aConvProcess->outOffset);
+	if (aConvProcess->throughput.deviceSize == 0) {
+		throughputInit(&aConvProcess->throughput, aConvProcess->endOutOffset);
+	}
+	throughputStartTiming(&aConvProcess->throughput, getTime());
+	if (REMAINING_BYTES(aConvProcess) == 0) {
+		/* Recovered a conversion that had copied everything already */
+		logmsg(LLVL_INFO, "No data left to copy.\n");
+		return COPYRESULT_SUCCESS_FINISHED;
+	}
+
+	/* A pending window is not written in one go when checkpointing */
+	if ((aParameters->checkpointInterval || aConvProcess->checkpoint.spanEnd) && !aConvProcess->rollback) {
+		return copyCheckpointed(aParameters, aConvProcess);
+	}
+
+	enum copyResult_t result;
+	if ((aConvProcess->pendingWindow.used > 0) && writePendingWindow(aParameters, aConvProcess, &result)) {
+		return result;
+	}
+
+	if ((aParameters->engine == ENGINE_SPLICE) && !aConvProcess->rollback) {
+		return copySpliced(aParameters, aConvProcess);
+	}
+
+	bool batched = true;
+#ifdef DEVELOPMENT
+	/* Simulated I/O errors are only injected when alternating */
+	if (aParameters->dev.ioErrors) {
+		batched = false;
+	}
+#endif
+	if (batched && aConvProcess->spill) {
+		return copySpilled(aParameters, aConvProcess);
+	}
+	int chunkCount = batched ? aConvProcess->batchChunks : 0;
+	if (chunkCount < 3) {
+		return copyAlternating(aParameters, aConvProcess);
+	}
+
+	/* The ring starts with the two regular buffers, the one at the write
+	 * pointer first */
+	struct chunk *ring = calloc(chunkCount, sizeof(struct chunk));
+	int allocated = 0;
+	if (ring) {
+		allocated = 2;
+		ring[0] = aConvProcess->dataBuffer[aConvProcess->usedBufferIndex];
+		ring[1] = aConvProcess->dataBuffer[1 - aConvProcess->usedBufferIndex];
+		ring[1].used = 0;
+		while ((allocated < chunkCount) && allocChunk(&ring[allocated], aConvProcess->dataBuffer[0].size)) {
+			allocated++;
+		}
+	}
+	if (allocated < 3) {
+		logmsg(LLVL_WARN, "Cannot allocate memory for batched I/O, alternating reads and writes.\n");
+		result = copyAlternating(aParameters, aConvProcess);
+	} else {
+		logmsg(LLVL_DEBUG, "Batching reads and writes of %d chunks.\n", allocated - 1);
+		result = copyBatched(aParameters, aConvProcess, ring, allocated);
+	}
+	for (int i = 0; i < allocated; i++) {
+		if ((ring[i].data != aConvProcess->dataBuffer[0].data) && (ring[i].data != aConvProcess->dataBuffer[1].data)) {
+			freeChunk(&ring[i]);
+		}
+	}
+	free(ring);
+	return result;
+}
@@ -0,0 +1,130 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chunk.h"
+#include "parameters.h"
+#include "throughput.h"
+#include "lukstarget.h"
+
+struct cryptEngine;
+struct ioTrace;
+struct ioStats;
+struct spillFile;
+
+/* Span length of --checkpoint if none is given */
+#define CHECKPOINT_DEFAULT_INTERVAL		(1024 * 1024 * 1024ULL)
+
+/* Follows the magic in a resume file. Then come the pending window (the plain
+ * data for the LUKS device from outOffset on, the plain device is intact
+ * behind it), padded to windowCapacity bytes, and the throughput history. The
+ * window is a byte range, so a conversion can be resumed with a different
+ * chunk size. While a checkpointed span is moved (see copyCheckpointed), the
+ * window is followed by the plain data at spanEnd within windowCapacity. */
+struct resumeFileHeader {
+	uint64_t outOffset;
+	uint64_t readDevSize;
+	uint64_t writeDevSize;		/* 0 if written before the LUKS device was opened */
+	uint32_t windowLength;
+	uint32_t windowCapacity;
+	uint32_t chunkSize;			/* Of the run that wrote the file, informational */
+	uint8_t reluksification;
+	uint8_t reserved[3];
+	uint64_t spanEnd;			/* End of the checkpointed span being moved, 0 = none */
+	uint64_t movedOffset;		/* The span has been written to the LUKS device from here on */
+	uint32_t tailLength;		/* Plain data at spanEnd that follows the window */
+	uint32_t reserved2;
+};
+
+/* State of one conversion. The copy engine only accesses the devices through
+ * the two I/O backends, the file descriptors are used for setting up. */
+struct conversionProcess {
+	int readDevFd, writeDevFd;
+	struct ioBackend readBackend, writeBackend;
+	uint64_t readDevSize, writeDevSize;
+	struct chunk dataBuffer[2];
+	int usedBufferIndex;
+	int resumeFd;
+	char *rawDeviceAlias;
+	bool reluksification;
+	uint64_t inOffset, outOffset;
+	uint64_t endOutOffset;
+	char *writeDeviceHandle;
+	char writeDevicePath[48];
+	struct luksTarget luksTarget;		/* Creates and opens the LUKS device */
+	struct cryptEngine *cryptEngine;	/* Userspace encryption, NULL when writing through dm-crypt */
+	struct ioTrace *trace;				/* Records all I/O of the copy engine, NULL if disabled */
+	struct ioStats *ioStats;			/* Device utilisation shown with the progress, NULL if disabled */
+	double dryRunDeadline;				/* Stop copying at this time (dry run only), 0 = no limit */
+	int batchChunks;					/* Chunks held when batching reads and writes, 0 = alternate them */
+	struct spillFile *spill;			/* Batches are staged in this file instead of memory, NULL if disabled */
+	struct throughputModel throughput;	/* Per zone copy rates for the ETA, persisted in the resume file */
+	bool rollback;						/* Copying the LUKS device back to the plain device */
+	struct chunk rollbackTail;			/* Plain data at the end of the rolled back range, from the conversion's resume file */
+	struct chunk pendingWindow;			/* Resumed window larger than a chunk, written before copying continues */
+	uint32_t resumeWindowCapacity;		/* Space reserved for the window in the resume file */
+	uint32_t resumeHeaderLength;		/* Of the resume file as read or written, older versions have a shorter header */
+
+	struct {
+		uint64_t spanEnd;				/* Checkpointed span being moved, see struct resumeFileHeader */
+		uint64_t movedOffset;
+	} checkpoint;
+
+	struct {
+		double startTime;
+		double lastShowTime;
+		uint64_t lastOutOffset;
+		uint64_t copied;
+	} stats;
+
+	struct {
+		double windowStartTime;
+		uint64_t windowBytes;
+		uint64_t rateLimit;
+	} throttle;
+};
+
+enum copyResult_t {
+	COPYRESULT_SUCCESS_FINISHED,
+	COPYRESULT_SUCCESS_RESUMABLE,
+	COPYRESULT_ERROR_WRITING_RESUME_FILE,
+	COPYRESULT_DRY_RUN_LIMIT_REACHED,
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct chunk *resumeWindow(struct conversionProcess *aConvProcess);
+bool writeResumeFile(struct conversionProcess *aConvProcess);
+bool writeCheckpoint(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess);
+bool loadResumeWindow(struct conversionProcess *aConvProcess, uint32_t aLength);
+bool readResumeFile(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess);
+bool peekResumeFileOffset(const char *aFilename, uint64_t *aOutOffset);
+bool backupDeviceHeader(const char *aDevice, uint64_t aDeviceSize, const char *aBackupFile);
+enum copyResult_t startDataCopy(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
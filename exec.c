@@ -146,15 +146,29 @@ static void convertCommandLine(char *aBuffer, int aBufSize, const char **aArgume
 	}
 }
 
-struct execResult_t execGetReturnCode(const char **aArguments) {
+/* Executes the given command and waits for it to finish. If aOutput is
+ * given, the standard output of the child is captured into that buffer
+ * (truncated to aOutputSize - 1 bytes, always zero-terminated). */
+static struct execResult_t execute(const char **aArguments, char *aOutput, int aOutputSize) {
 	struct execResult_t execResult;
 	char **argcopy = argCopy(aArguments);
 	pid_t pid;
 	int status;
+	int outputPipe[2] = { -1, -1 };
 
 	memset(&execResult, 0, sizeof(execResult));
 	execResult.success = true;
 
+	if (aOutput) {
+		aOutput[0] = 0;
+		if (pipe(outputPipe) == -1) {
+			perror("pipe");
+			freeArgCopy(argcopy);
+			execResult.success = false;
+			return execResult;
+		}
+	}
+
 	pid = fork();
 	if (pid == -1) {
 		perror("fork");
@@ -168,9 +182,16 @@ struct execResult_t execGetReturnCode(const char **aArguments) {
 	}
 	if (pid == 0) {
 		/* Child */
+		if (aOutput) {
+			close(outputPipe[0]);
+			dup2(outputPipe[1], 1);
+			close(outputPipe[1]);
+		}
 		if (getLogLevel() < LLVL_DEBUG) {
 			/* Shut up the child if user did not request debug output */
-			close(1);
+			if (!aOutput) {
+				close(1);
+			}
 			close(2);
 		}
 		execvp(aArguments[0], argcopy);
@@ -178,8 +199,36 @@ struct execResult_t execGetReturnCode(const char **aArguments) {
 		logmsg(LLVL_ERROR, "Execution of %s in forked child process failed at execvp: %s\n", aArguments[0], strerror(errno));
 
 		/* Exec failed, terminate chExec failed, terminate child process
-		 * (parent will catch this as the return code) */
-		exit(EXIT_FAILURE);
+		 * (parent will catch this as the return code). Do not run the
+		 * parent's atexit handlers in here. */
+		_exit(EXIT_FAILURE);
+	}
+
+	if (aOutput) {
+		/* Read everything, even if it does not fit, so the child never
+		 * blocks on a full pipe */
+		close(outputPipe[1]);
+		int position = 0;
+		while (true) {
+			char discard[256];
+			char *target = (position < aOutputSize - 1) ? (aOutput + position) : discard;
+			int space = (position < aOutputSize - 1) ? (aOutputSize - 1 - position) : (int)sizeof(discard);
+			ssize_t bytesRead = read(outputPipe[0], target, space);
+			if (bytesRead < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			if (bytesRead == 0) {
+				break;
+			}
+			if (target != discard) {
+				position += bytesRead;
+			}
+		}
+		aOutput[position] = 0;
+		close(outputPipe[0]);
 	}
 
 	if (waitpid(pid, &status, 0) == (pid_t)-1) {
@@ -194,4 +243,10 @@ struct execResult_t execGetReturnCode(const char **aArguments) {
 	return execResult;
 }
 
+struct execResult_t execGetReturnCode(const char **aArguments) {
+	return execute(aArguments, NULL, 0);
+}
 
+struct execResult_t execGetOutput(const char **aArguments, char *aOutput, int aOutputSize) {
+	return execute(aArguments, aOutput, aOutputSize);
+}
@@ -26,7 +26,7 @@
 #include "logging.h"
 #include "exit.h"
 
-#define MAX_VALID_ERROR_CODE		28
+#define MAX_VALID_ERROR_CODE		39
 static const char *exitCodeAbbr[] = {
 	[EC_SUCCESS] = "EC_SUCCESS",
 	[EC_UNSPECIFIED_ERROR] = "EC_UNSPECIFIED_ERROR",
@@ -57,6 +57,17 @@ static const char *exitCodeAbbr[] = {
 	[EC_CMDLINE_ARGUMENT_ERROR] = "EC_CMDLINE_ARGUMENT_ERROR",
 	[EC_CANNOT_GENERATE_WRITE_HANDLE] = "EC_CANNOT_GENERATE_WRITE_HANDLE",
 	[EC_PRNG_INITIALIZATION_FAILED] = "EC_PRNG_INITIALIZATION_FAILED",
+	[EC_CONVERSION_JOB_FAILED] = "EC_CONVERSION_JOB_FAILED",
+	[EC_CANNOT_READ_JOB_FILE] = "EC_CANNOT_READ_JOB_FILE",
+	[EC_CANNOT_ATTACH_LOOP_DEVICE] = "EC_CANNOT_ATTACH_LOOP_DEVICE",
+	[EC_CANNOT_OPEN_LOG_FILE] = "EC_CANNOT_OPEN_LOG_FILE",
+	[EC_CANNOT_CREATE_TRACE_FILE] = "EC_CANNOT_CREATE_TRACE_FILE",
+	[EC_CANNOT_PREPARE_DRY_RUN] = "EC_CANNOT_PREPARE_DRY_RUN",
+	[EC_CANNOT_RECOVER_CONVERSION_STATE] = "EC_CANNOT_RECOVER_CONVERSION_STATE",
+	[EC_CIPHER_BENCHMARK_FAILED] = "EC_CIPHER_BENCHMARK_FAILED",
+	[EC_CRYPT_SECTOR_SIZE_MISMATCH] = "EC_CRYPT_SECTOR_SIZE_MISMATCH",
+	[EC_CANNOT_ROLL_BACK] = "EC_CANNOT_ROLL_BACK",
+	[EC_RANDOM_FILL_INCOMPLETE] = "EC_RANDOM_FILL_INCOMPLETE",
 };
 static const char *exitCodeDesc[] = {
 	[EC_SUCCESS] = "Success",
@@ -88,6 +99,17 @@ static const char *exitCodeDesc[] = {
 	[EC_CMDLINE_ARGUMENT_ERROR] = "Error with a parameter which was given on the command line",
 	[EC_CANNOT_GENERATE_WRITE_HANDLE] = "Error generating device mapper write handle",
 	[EC_PRNG_INITIALIZATION_FAILED] = "Initialization of PRNG failed",
+	[EC_CONVERSION_JOB_FAILED] = "One or more conversion jobs failed",
+	[EC_CANNOT_READ_JOB_FILE] = "Cannot read job file",
+	[EC_CANNOT_ATTACH_LOOP_DEVICE] = "Cannot attach image file to a loop device",
+	[EC_CANNOT_OPEN_LOG_FILE] = "Cannot open the log file",
+	[EC_CANNOT_CREATE_TRACE_FILE] = "Cannot create I/O trace file",
+	[EC_CANNOT_PREPARE_DRY_RUN] = "Cannot set up the overlay for the dry run",
+	[EC_CANNOT_RECOVER_CONVERSION_STATE] = "Cannot locate the conversion boundary on the device",
+	[EC_CIPHER_BENCHMARK_FAILED] = "Cipher benchmark could not be run",
+	[EC_CRYPT_SECTOR_SIZE_MISMATCH] = "Encryption sector size incompatible with the conversion",
+	[EC_CANNOT_ROLL_BACK] = "Cannot roll back the conversion",
+	[EC_RANDOM_FILL_INCOMPLETE] = "Conversion completed, but filling space with random data failed",
 };
 
 void terminate(enum terminationCode_t aTermCode) {
@@ -59,6 +59,17 @@
 :26	EC_CMDLINE_ARGUMENT_ERROR								Error with a parameter which was given on the command line
 :27	EC_CANNOT_GENERATE_WRITE_HANDLE							Error generating device mapper write handle
 :28	EC_PRNG_INITIALIZATION_FAILED							Initialization of PRNG failed
+:29	EC_CONVERSION_JOB_FAILED								One or more conversion jobs failed
+:30	EC_CANNOT_READ_JOB_FILE									Cannot read job file
+:31	EC_CANNOT_ATTACH_LOOP_DEVICE							Cannot attach image file to a loop device
+:32	EC_CANNOT_OPEN_LOG_FILE									Cannot open the log file
+:33	EC_CANNOT_CREATE_TRACE_FILE								Cannot create I/O trace file
+:34	EC_CANNOT_PREPARE_DRY_RUN								Cannot set up the overlay for the dry run
+:35	EC_CANNOT_RECOVER_CONVERSION_STATE						Cannot locate the conversion boundary on the device
+:36	EC_CIPHER_BENCHMARK_FAILED								Cipher benchmark could not be run
+:37	EC_CRYPT_SECTOR_SIZE_MISMATCH							Encryption sector size incompatible with the conversion
+:38	EC_CANNOT_ROLL_BACK										Cannot roll back the conversion
+:39	EC_RANDOM_FILL_INCOMPLETE								Conversion completed, but filling space with random data failed
 */
 
 enum terminationCode_t {
@@ -90,7 +101,18 @@ enum terminationCode_t {
 	EC_CMDLINE_PARSING_ERROR = 25,
 	EC_CMDLINE_ARGUMENT_ERROR = 26,
 	EC_CANNOT_GENERATE_WRITE_HANDLE = 27,
-	EC_PRNG_INITIALIZATION_FAILED = 28
+	EC_PRNG_INITIALIZATION_FAILED = 28,
+	EC_CONVERSION_JOB_FAILED = 29,
+	EC_CANNOT_READ_JOB_FILE = 30,
+	EC_CANNOT_ATTACH_LOOP_DEVICE = 31,
+	EC_CANNOT_OPEN_LOG_FILE = 32,
+	EC_CANNOT_CREATE_TRACE_FILE = 33,
+	EC_CANNOT_PREPARE_DRY_RUN = 34,
+	EC_CANNOT_RECOVER_CONVERSION_STATE = 35,
+	EC_CIPHER_BENCHMARK_FAILED = 36,
+	EC_CRYPT_SECTOR_SIZE_MISMATCH = 37,
+	EC_CANNOT_ROLL_BACK = 38,
+	EC_RANDOM_FILL_INCOMPLETE = 39
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
@@ -0,0 +1,181 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "fillrandom.h"
+#include "logging.h"
+#include "shutdown.h"
+#include "utils.h"
+
+/* Space is filled with ChaCha20 keystream instead of data from the kernel,
+ * which is far too slow for whole disks. The keystream position is the offset
+ * on the device, so every thread generates its slice of a chunk on its own.
+ * The threads generate the next chunk while the current one is written. */
+
+struct generatorJob {
+	const struct csprng *prng;
+	uint8_t *data;
+	uint64_t position;
+	uint32_t length;
+};
+
+struct generator {
+	struct generatorJob jobs[FILLRANDOM_MAX_THREADS];
+	pthread_t threads[FILLRANDOM_MAX_THREADS];
+	bool threadStarted[FILLRANDOM_MAX_THREADS];
+	int threadCount;
+};
+
+static void *generateSlice(void *aJob) {
+	struct generatorJob *job = (struct generatorJob*)aJob;
+	csprngGenerate(job->prng, job->position, job->data, job->length);
+	return NULL;
+}
+
+/* Starts generating the keystream for aLength bytes at device offset
+ * aPosition into aData, in slices of whole ChaCha20 blocks */
+static void generatorStart(struct generator *aGenerator, const struct csprng *aPrng, uint8_t *aData, uint64_t aPosition, uint32_t aLength) {
+	uint32_t sliceLength = (((aLength + aGenerator->threadCount - 1) / aGenerator->threadCount) + 63) & ~63;
+	for (int i = 0; i < aGenerator->threadCount; i++) {
+		uint32_t start = i * sliceLength;
+		uint32_t length = (start >= aLength) ? 0 : (aLength - start);
+		length = (length < sliceLength) ? length : sliceLength;
+		aGenerator->jobs[i] = (struct generatorJob) {
+			.prng = aPrng,
+			.data = aData + start,
+			.position = aPosition + start,
+			.length = length,
+		};
+		aGenerator->threadStarted[i] = false;
+		if (length > 0) {
+			int error = pthread_create(&aGenerator->threads[i], NULL, generateSlice, &aGenerator->jobs[i]);
+			if (error) {
+				/* Do it ourselves then */
+				logmsg(LLVL_DEBUG, "Cannot start random generator thread %d: %s\n", i, strerror(error));
+				generateSlice(&aGenerator->jobs[i]);
+			} else {
+				aGenerator->threadStarted[i] = true;
+			}
+		}
+	}
+}
+
+static void generatorFinish(struct generator *aGenerator) {
+	for (int i = 0; i < aGenerator->threadCount; i++) {
+		if (aGenerator->threadStarted[i]) {
+			pthread_join(aGenerator->threads[i], NULL);
+			aGenerator->threadStarted[i] = false;
+		}
+	}
+}
+
+/* Overwrites aLength bytes at aOffset of the target with the keystream of
+ * aPrng for these offsets, using the two buffers alternately. */
+bool fillRandomRange(struct ioBackend *aTarget, const struct csprng *aPrng, uint64_t aOffset, uint64_t aLength, struct chunk aBuffers[2], int aThreadCount) {
+	struct generator generator;
+	memset(&generator, 0, sizeof(generator));
+	if (aThreadCount <= 0) {
+		long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+		aThreadCount = (cpuCount > 0) ? cpuCount : 1;
+	}
+	generator.threadCount = (aThreadCount < FILLRANDOM_MAX_THREADS) ? aThreadCount : FILLRANDOM_MAX_THREADS;
+
+	uint64_t end = aOffset + aLength;
+	uint64_t position = aOffset;
+	int current = 0;
+	aBuffers[0].used = ((end - position) < aBuffers[0].size) ? (end - position) : aBuffers[0].size;
+	generatorStart(&generator, aPrng, aBuffers[0].data, position, aBuffers[0].used);
+	generatorFinish(&generator);
+	while (position < end) {
+		struct chunk *next = &aBuffers[1 - current];
+		uint64_t nextPosition = position + aBuffers[current].used;
+		next->used = ((end - nextPosition) < next->size) ? (end - nextPosition) : next->size;
+		if (next->used > 0) {
+			generatorStart(&generator, aPrng, next->data, nextPosition, next->used);
+		}
+		ssize_t bytesWritten = chunkWriteTo(&aBuffers[current], aTarget, position);
+		generatorFinish(&generator);
+		if (bytesWritten != (ssize_t)aBuffers[current].used) {
+			logmsg(LLVL_ERROR, "Error writing random data at offset 0x%" PRIx64 ": %s\n", position, strerror(errno));
+			return false;
+		}
+		position = nextPosition;
+		current = 1 - current;
+
+		if ((position < end) && receivedSigQuit()) {
+			logmsg(LLVL_WARN, "Random fill interrupted, offsets 0x%" PRIx64 " to 0x%" PRIx64 " were not filled.\n", position, end);
+			return false;
+		}
+	}
+	return backendFlush(aTarget);
+}
+
+/* Fills the part of the LUKS device behind the converted data (which is
+ * there when the new LUKS header is smaller than the old one) and the ranges
+ * given on the command line. Writes go through the LUKS device, so what ends
+ * up on the disk is ciphertext of random data. */
+bool fillRandomSpace(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	struct csprng prng;
+	if (!csprngInit(&prng)) {
+		return false;
+	}
+	struct ioBackend target;
+	aConvProcess->luksTarget.initBackend(aConvProcess, &target);
+
+	bool success = true;
+	uint64_t filled = 0;
+	double startTime = getTime();
+	if (aConvProcess->writeDevSize > aConvProcess->endOutOffset) {
+		uint64_t length = aConvProcess->writeDevSize - aConvProcess->endOutOffset;
+		logmsg(LLVL_INFO, "Filling %" PRIu64 " bytes freed at the end of the LUKS device with random data.\n", length);
+		success = fillRandomRange(&target, &prng, aConvProcess->endOutOffset, length, aConvProcess->dataBuffer, aParameters->cryptoThreads);
+		filled += success ? length : 0;
+	} else if (aParameters->fillRangeCount == 0) {
+		logmsg(LLVL_INFO, "No space was freed at the end of the LUKS device, nothing to fill with random data.\n");
+	}
+
+	for (int i = 0; success && (i < aParameters->fillRangeCount); i++) {
+		const struct fillRange *range = &aParameters->fillRanges[i];
+		if ((range->offset > aConvProcess->writeDevSize) || (range->length > aConvProcess->writeDevSize - range->offset)) {
+			logmsg(LLVL_ERROR, "Range of %" PRIu64 " bytes at offset %" PRIu64 " exceeds the LUKS device of %" PRIu64 " bytes, not filling it.\n", range->length, range->offset, aConvProcess->writeDevSize);
+			success = false;
+			break;
+		}
+		logmsg(LLVL_INFO, "Filling %" PRIu64 " bytes at offset %" PRIu64 " of the LUKS device with random data.\n", range->length, range->offset);
+		success = fillRandomRange(&target, &prng, range->offset, range->length, aConvProcess->dataBuffer, aParameters->cryptoThreads);
+		filled += success ? range->length : 0;
+	}
+	memset(&prng, 0, sizeof(prng));
+
+	double duration = getTime() - startTime;
+	if (filled && (duration > 0)) {
+		logmsg(LLVL_INFO, "Filled %" PRIu64 " MiB with random data at %.1f MiB/s.\n", filled / 1024 / 1024, filled / duration / 1024 / 1024);
+	}
+	return success;
+}
@@ -0,0 +1,42 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __FILLRANDOM_H__
+#define __FILLRANDOM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chunk.h"
+#include "random.h"
+#include "parameters.h"
+#include "engine.h"
+
+#define FILLRANDOM_MAX_THREADS			64
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool fillRandomRange(struct ioBackend *aTarget, const struct csprng *aPrng, uint64_t aOffset, uint64_t aLength, struct chunk aBuffers[2], int aThreadCount);
+bool fillRandomSpace(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -31,13 +31,24 @@
 
 #define EXEC_MAX_ARGCNT					64
 
-#define RESUME_FILE_HEADER_MAGIC		"luksipc RESUME v1\0\xde\xad\xbe\xef & \xc0\xff\xee\0\0\0\0"
+#define RESUME_FILE_HEADER_MAGIC		"luksipc RESUME v3\0\xde\xad\xbe\xef & \xc0\xff\xee\0\0\0\0"
 #define RESUME_FILE_HEADER_MAGIC_LEN	32
 
+/* Resume files of older versions, which are still read */
+#define RESUME_FILE_V2_HEADER_MAGIC		"luksipc RESUME v2\0\xde\xad\xbe\xef & \xc0\xff\xee\0\0\0\0"
+#define RESUME_FILE_V1_HEADER_MAGIC		"luksipc RESUME v1\0\xde\xad\xbe\xef & \xc0\xff\xee\0\0\0\0"
+
+/* Replaces the resume file magic once a rollback has started */
+#define ROLLBACK_FILE_HEADER_MAGIC		"luksipc ROLLBACK v3\0\xde\xad\xbe\xef\xc0\xff\xee\0\0\0\0"
+#define ROLLBACK_FILE_V2_HEADER_MAGIC	"luksipc ROLLBACK v2\0\xde\xad\xbe\xef\xc0\xff\xee\0\0\0\0"
+
 #define HEADER_BACKUP_BLOCKSIZE			(128 * 1024)
 #define HEADER_BACKUP_BLOCKCNT			4096
 #define HEADER_BACKUP_SIZE_BYTES		(HEADER_BACKUP_BLOCKSIZE * HEADER_BACKUP_BLOCKCNT)
 
 #define DEFAULT_RESUME_FILENAME			"resume.bin"
 
+/* Encryption sector size of dm-crypt unless another one is chosen */
+#define DEFAULT_CRYPT_SECTOR_SIZE		512
+
 #endif
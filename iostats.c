@@ -0,0 +1,187 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "iostats.h"
+#include "sysfs.h"
+#include "logging.h"
+#include "utils.h"
+
+static bool readBlockDeviceStat(const char *aStatPath, struct blockDeviceStat *aStat) {
+	char buffer[256];
+	if (!readSysfsString(aStatPath, buffer, sizeof(buffer))) {
+		return false;
+	}
+	uint64_t readMerges, writeMerges, inFlight;
+	int fields = sscanf(buffer, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+			&aStat->readIos, &readMerges, &aStat->readSectors, &aStat->readTicks,
+			&aStat->writeIos, &writeMerges, &aStat->writeSectors, &aStat->writeTicks,
+			&inFlight, &aStat->ioTicks, &aStat->timeInQueue);
+	return (fields == 11);
+}
+
+static void readProcessIoStat(struct processIoStat *aStat) {
+	memset(aStat, 0, sizeof(struct processIoStat));
+	FILE *f = fopen("/proc/self/io", "r");
+	if (!f) {
+		return;
+	}
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "rchar: %" SCNu64, &aStat->readChars);
+		sscanf(line, "wchar: %" SCNu64, &aStat->writeChars);
+		sscanf(line, "read_bytes: %" SCNu64, &aStat->readBytes);
+		sscanf(line, "write_bytes: %" SCNu64, &aStat->writeBytes);
+	}
+	fclose(f);
+}
+
+static double timevalSeconds(const struct timeval *aTime) {
+	return aTime->tv_sec + (aTime->tv_usec / 1e6);
+}
+
+void ioStatsInit(struct ioStats *aStats) {
+	memset(aStats, 0, sizeof(struct ioStats));
+	aStats->startTime = getTime();
+	aStats->phaseStartTime = aStats->startTime;
+	getrusage(RUSAGE_SELF, &aStats->startUsage);
+	readProcessIoStat(&aStats->startProcessIo);
+}
+
+/* Starts accounting the I/O of a block device. Devices without statistics in
+ * sysfs are silently ignored. */
+bool ioStatsAddDevice(struct ioStats *aStats, const char *aLabel, const char *aDevice) {
+	if (aStats->deviceCount >= IOSTATS_MAX_DEVICES) {
+		return false;
+	}
+	struct ioStatsDevice *device = &aStats->devices[aStats->deviceCount];
+	char sysfsPath[PATH_MAX - 8];
+	if (!getBlockDeviceSysfsPath(aDevice, sysfsPath, sizeof(sysfsPath))) {
+		return false;
+	}
+	snprintf(device->statPath, sizeof(device->statPath), "%s/stat", sysfsPath);
+	if (!readBlockDeviceStat(device->statPath, &device->first)) {
+		logmsg(LLVL_DEBUG, "No I/O statistics available for %s in %s.\n", aDevice, device->statPath);
+		return false;
+	}
+	const char *lastSlash = strrchr(sysfsPath, '/');
+	safestrcpy(device->name, lastSlash ? (lastSlash + 1) : sysfsPath, sizeof(device->name));
+	safestrcpy(device->label, aLabel, sizeof(device->label));
+	device->last = device->first;
+	device->lastTime = getTime();
+	aStats->deviceCount++;
+	logmsg(LLVL_DEBUG, "Accounting I/O of %s device %s (%s).\n", aLabel, aDevice, device->name);
+	return true;
+}
+
+static void endPhase(struct ioStats *aStats, double aNow) {
+	if (aStats->phaseCount > 0) {
+		aStats->phases[aStats->phaseCount - 1].seconds = aNow - aStats->phaseStartTime;
+	}
+}
+
+/* Ends the current phase and starts the next one */
+void ioStatsPhase(struct ioStats *aStats, const char *aPhase) {
+	double now = getTime();
+	endPhase(aStats, now);
+	if (aStats->phaseCount < IOSTATS_MAX_PHASES) {
+		aStats->phases[aStats->phaseCount].name = aPhase;
+		aStats->phaseCount++;
+	}
+	aStats->phaseStartTime = now;
+}
+
+/* Formats utilisation, average queue depth and await of every device since
+ * the previous sample */
+void ioStatsSample(struct ioStats *aStats, char *aBuffer, int aBufferSize) {
+	int length = 0;
+	aBuffer[0] = 0;
+	for (int i = 0; (i < aStats->deviceCount) && (length < aBufferSize); i++) {
+		struct ioStatsDevice *device = &aStats->devices[i];
+		struct blockDeviceStat current;
+		double now = getTime();
+		if (!readBlockDeviceStat(device->statPath, &current)) {
+			continue;
+		}
+		double intervalMillis = (now - device->lastTime) * 1000;
+		uint64_t ios = (current.readIos - device->last.readIos) + (current.writeIos - device->last.writeIos);
+		uint64_t ticks = (current.readTicks - device->last.readTicks) + (current.writeTicks - device->last.writeTicks);
+		double utilisation = (intervalMillis > 0) ? (100. * (current.ioTicks - device->last.ioTicks) / intervalMillis) : 0;
+		double queueDepth = (intervalMillis > 0) ? ((current.timeInQueue - device->last.timeInQueue) / intervalMillis) : 0;
+		double await = ios ? ((double)ticks / ios) : 0;
+		length += snprintf(aBuffer + length, aBufferSize - length, "%s%s %3.0f%% busy qd %4.1f await %5.1f ms", (i > 0) ? "   " : "", device->name, (utilisation > 100) ? 100 : utilisation, queueDepth, await);
+		device->last = current;
+		device->lastTime = now;
+	}
+}
+
+/* Logs the summary of the whole conversion */
+void ioStatsReport(struct ioStats *aStats) {
+	double now = getTime();
+	endPhase(aStats, now);
+
+	double runtime = now - aStats->startTime;
+	logmsg(LLVL_INFO, "I/O summary after %.1f seconds:\n", runtime);
+	for (int i = 0; i < aStats->deviceCount; i++) {
+		struct ioStatsDevice *device = &aStats->devices[i];
+		struct blockDeviceStat current;
+		if (!readBlockDeviceStat(device->statPath, &current)) {
+			current = device->last;
+		}
+		uint64_t ios = (current.readIos - device->first.readIos) + (current.writeIos - device->first.writeIos);
+		uint64_t ticks = (current.readTicks - device->first.readTicks) + (current.writeTicks - device->first.writeTicks);
+		logmsg(LLVL_INFO, "    %-6s %-10s read %8" PRIu64 " MiB   written %8" PRIu64 " MiB   %3.0f%% busy   await %5.1f ms\n",
+				device->label, device->name,
+				(current.readSectors - device->first.readSectors) * 512 / 1024 / 1024,
+				(current.writeSectors - device->first.writeSectors) * 512 / 1024 / 1024,
+				(runtime > 0) ? (100. * (current.ioTicks - device->first.ioTicks) / (runtime * 1000)) : 0,
+				ios ? ((double)ticks / ios) : 0);
+	}
+
+	struct processIoStat processIo;
+	readProcessIoStat(&processIo);
+	logmsg(LLVL_INFO, "    luksipc read %" PRIu64 " MiB, wrote %" PRIu64 " MiB (%" PRIu64 " MiB / %" PRIu64 " MiB reached the block layer)\n",
+			(processIo.readChars - aStats->startProcessIo.readChars) / 1024 / 1024,
+			(processIo.writeChars - aStats->startProcessIo.writeChars) / 1024 / 1024,
+			(processIo.readBytes - aStats->startProcessIo.readBytes) / 1024 / 1024,
+			(processIo.writeBytes - aStats->startProcessIo.writeBytes) / 1024 / 1024);
+
+	/* dm-crypt encrypts in kernel workers, that time is not accounted to the
+	 * process */
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	double userSeconds = timevalSeconds(&usage.ru_utime) - timevalSeconds(&aStats->startUsage.ru_utime);
+	double systemSeconds = timevalSeconds(&usage.ru_stime) - timevalSeconds(&aStats->startUsage.ru_stime);
+	logmsg(LLVL_INFO, "    CPU time %.1f s user, %.1f s system (%.0f%% of runtime), %ld voluntary and %ld involuntary context switches\n",
+			userSeconds, systemSeconds, (runtime > 0) ? (100. * (userSeconds + systemSeconds) / runtime) : 0,
+			usage.ru_nvcsw - aStats->startUsage.ru_nvcsw, usage.ru_nivcsw - aStats->startUsage.ru_nivcsw);
+
+	for (int i = 0; i < aStats->phaseCount; i++) {
+		logmsg(LLVL_INFO, "    Phase %-14s %8.1f s\n", aStats->phases[i].name, aStats->phases[i].seconds);
+	}
+}
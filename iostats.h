@@ -0,0 +1,82 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __IOSTATS_H__
+#define __IOSTATS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/resource.h>
+
+#define IOSTATS_MAX_DEVICES			3
+#define IOSTATS_MAX_PHASES			10
+
+/* Fields of /sys/block/<dev>/stat, times in milliseconds */
+struct blockDeviceStat {
+	uint64_t readIos, readSectors, readTicks;
+	uint64_t writeIos, writeSectors, writeTicks;
+	uint64_t ioTicks, timeInQueue;
+};
+
+/* Fields of /proc/self/io */
+struct processIoStat {
+	uint64_t readChars, writeChars;
+	uint64_t readBytes, writeBytes;
+};
+
+struct ioStatsDevice {
+	char label[16];
+	char name[32];
+	char statPath[PATH_MAX];
+	struct blockDeviceStat first, last;
+	double lastTime;
+};
+
+/* Accounting of the I/O of all layers involved in a conversion (raw device
+ * and device mapper devices), of the process itself and of the time spent in
+ * every phase. Used to find out whether the disk, dm-crypt or luksipc is the
+ * bottleneck. */
+struct ioStats {
+	struct ioStatsDevice devices[IOSTATS_MAX_DEVICES];
+	int deviceCount;
+	double startTime;
+	struct rusage startUsage;
+	struct processIoStat startProcessIo;
+	struct {
+		const char *name;
+		double seconds;
+	} phases[IOSTATS_MAX_PHASES];
+	int phaseCount;
+	double phaseStartTime;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void ioStatsInit(struct ioStats *aStats);
+bool ioStatsAddDevice(struct ioStats *aStats, const char *aLabel, const char *aDevice);
+void ioStatsPhase(struct ioStats *aStats, const char *aPhase);
+void ioStatsSample(struct ioStats *aStats, char *aBuffer, int aBufferSize);
+void ioStatsReport(struct ioStats *aStats);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
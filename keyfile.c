@@ -73,3 +73,23 @@ bool genKeyfile(const char *aFilename, bool aForce) {
 	close(fd);
 	return true;
 }
+
+/* Reads the complete key file, all of which cryptsetup uses as passphrase */
+bool readKeyfile(const char *aFilename, uint8_t *aData, uint32_t aMaxLength, uint32_t *aLength) {
+	int fd = open(aFilename, O_RDONLY);
+	if (fd == -1) {
+		logmsg(LLVL_ERROR, "Cannot open keyfile %s: %s\n", aFilename, strerror(errno));
+		return false;
+	}
+
+	ssize_t length = read(fd, aData, aMaxLength);
+	uint8_t excess;
+	bool tooLarge = (length == (ssize_t)aMaxLength) && (read(fd, &excess, 1) == 1);
+	close(fd);
+	if ((length <= 0) || tooLarge) {
+		logmsg(LLVL_ERROR, "Keyfile %s is empty, unreadable or larger than %u bytes.\n", aFilename, aMaxLength);
+		return false;
+	}
+	*aLength = length;
+	return true;
+}
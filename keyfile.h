@@ -25,9 +25,14 @@
 #define __KEYFILE_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+
+/* Key files are used as passphrase, luksipc generates 4096 bytes */
+#define MAX_KEYFILE_SIZE			8192
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool genKeyfile(const char *aFilename, bool aForce);
+bool readKeyfile(const char *aFilename, uint8_t *aData, uint32_t aMaxLength, uint32_t *aLength);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
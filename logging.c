@@ -21,12 +21,69 @@
 	Johannes Bauer <JohannesBauer@gmx.de>
 */
 
+/* syscall() and sem_timedwait() are not part of XPG5 */
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
 
 #include "logging.h"
 
+/* Messages are formatted by the caller into a slot of a bounded lock-free
+ * ring buffer (multiple producers, one consumer) and written by a background
+ * thread, so logging does not block on a slow terminal or log file. When the
+ * ring is full, informational and debug messages are dropped and counted. The
+ * last LOG_RESERVED_SLOTS slots are kept for warnings and errors, and if even
+ * those are taken, a warning or error is written synchronously by the caller;
+ * neither ever waits for the logging thread. Until initAsyncLogging() is
+ * called (and in forked children), messages are written synchronously and
+ * without repeat suppression. */
+#define LOG_RING_SLOTS				1024
+#define LOG_RESERVED_SLOTS			64
+#define LOG_MESSAGE_MAXLEN			512
+#define LOG_REPEAT_INTERVAL_SECS	5
+
+struct logEntry {
+	atomic_size_t sequence;
+	int logLevel;
+	struct timespec timestamp;
+	pid_t threadId;
+	char text[LOG_MESSAGE_MAXLEN];
+};
+
 static int currentLogLevel;
+static int logFileFd = -1;
+static struct timespec logEpoch;
+static bool logEpochSet;
+
+static struct logEntry logRing[LOG_RING_SLOTS];
+static atomic_size_t enqueuePosition;
+static atomic_size_t writtenPosition;
+static atomic_ulong droppedMessages;
+static atomic_bool asyncActive;
+static atomic_bool stopRequested;
+static sem_t logSemaphore;
+static pthread_t logThread;
+static bool cleanupRegistered;
+
+/* Repeat suppression state, only accessed by the writing thread */
+static struct {
+	int logLevel;
+	char text[LOG_MESSAGE_MAXLEN];
+	struct timespec firstTimestamp, lastTimestamp;
+	unsigned int count;
+} repeat;
 
 int getLogLevel(void) {
 	return currentLogLevel;
@@ -47,13 +104,297 @@ static const char* logLevelToStr(int aLogLvl) {
 	return "?";
 }
 
+static double secondsSinceEpoch(const struct timespec *aTimestamp) {
+	return (double)(aTimestamp->tv_sec - logEpoch.tv_sec) + (1e-9 * (aTimestamp->tv_nsec - logEpoch.tv_nsec));
+}
+
+/* Only uses async-signal-safe functions */
+static void fillEntryHeader(struct logEntry *aEntry, int aLogLvl) {
+	aEntry->logLevel = aLogLvl;
+	clock_gettime(CLOCK_MONOTONIC, &aEntry->timestamp);
+	aEntry->threadId = syscall(SYS_gettid);
+}
+
+static void writeAll(int aFd, const char *aData, size_t aLength) {
+	while (aLength > 0) {
+		ssize_t written = write(aFd, aData, aLength);
+		if (written <= 0) {
+			if ((written == -1) && (errno == EINTR)) {
+				continue;
+			}
+			return;
+		}
+		aData += written;
+		aLength -= written;
+	}
+}
+
+static void writeLine(int aLogLvl, const struct timespec *aTimestamp, pid_t aThreadId, const char *aText) {
+	char line[LOG_MESSAGE_MAXLEN + 64];
+	int length = snprintf(line, sizeof(line), "[%s %.6f %d]: %s", logLevelToStr(aLogLvl), secondsSinceEpoch(aTimestamp), (int)aThreadId, aText);
+	if (length < 0) {
+		return;
+	}
+	if (length >= (int)sizeof(line)) {
+		length = sizeof(line) - 1;
+		line[length - 1] = '\n';
+	}
+	writeAll(STDERR_FILENO, line, length);
+	if (logFileFd != -1) {
+		writeAll(logFileFd, line, length);
+	}
+}
+
+static void flushRepeats(void) {
+	if (repeat.count > 0) {
+		char text[128];
+		snprintf(text, sizeof(text), "Last message repeated %u times.\n", repeat.count);
+		writeLine(repeat.logLevel, &repeat.lastTimestamp, syscall(SYS_gettid), text);
+		repeat.count = 0;
+	}
+}
+
+/* Used by the logging thread only. Identical consecutive messages are only
+ * written once per LOG_REPEAT_INTERVAL_SECS seconds, the number of suppressed
+ * repetitions is written when a different message arrives or the interval has
+ * passed. */
+static void emitEntry(const struct logEntry *aEntry) {
+	bool isRepeat = (aEntry->logLevel == repeat.logLevel) && (!strcmp(aEntry->text, repeat.text));
+	if (isRepeat && (aEntry->timestamp.tv_sec - repeat.firstTimestamp.tv_sec < LOG_REPEAT_INTERVAL_SECS)) {
+		repeat.count++;
+		repeat.lastTimestamp = aEntry->timestamp;
+		return;
+	}
+
+	flushRepeats();
+	writeLine(aEntry->logLevel, &aEntry->timestamp, aEntry->threadId, aEntry->text);
+	repeat.logLevel = aEntry->logLevel;
+	strcpy(repeat.text, aEntry->text);
+	repeat.firstTimestamp = aEntry->timestamp;
+}
+
+/* Claims a ring slot without blocking, returns NULL if the ring is full.
+ * Messages below LLVL_WARN may not use the reserved slots. */
+static struct logEntry *tryClaimEntry(int aLogLvl, size_t *aPosition) {
+	size_t limit = (aLogLvl <= LLVL_WARN) ? LOG_RING_SLOTS : (LOG_RING_SLOTS - LOG_RESERVED_SLOTS);
+	size_t position = atomic_load_explicit(&enqueuePosition, memory_order_relaxed);
+	while (true) {
+		size_t written = atomic_load_explicit(&writtenPosition, memory_order_acquire);
+		if ((position >= written) && (position - written >= limit)) {
+			return NULL;
+		}
+		struct logEntry *entry = &logRing[position % LOG_RING_SLOTS];
+		size_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+		if (sequence == position) {
+			if (atomic_compare_exchange_weak_explicit(&enqueuePosition, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+				*aPosition = position;
+				return entry;
+			}
+		} else if (sequence < position) {
+			return NULL;
+		} else {
+			position = atomic_load_explicit(&enqueuePosition, memory_order_relaxed);
+		}
+	}
+}
+
+/* Claims a ring slot for a message of the given level. Returns NULL if the
+ * ring is full or the logging thread is shutting down; a message below
+ * LLVL_WARN is then dropped (and counted), a more important one needs to be
+ * written synchronously by the caller. */
+static struct logEntry *claimEntry(int aLogLvl, size_t *aPosition) {
+	struct logEntry *entry = NULL;
+	if (!atomic_load(&stopRequested)) {
+		entry = tryClaimEntry(aLogLvl, aPosition);
+	}
+	if (!entry && (aLogLvl > LLVL_WARN)) {
+		atomic_fetch_add(&droppedMessages, 1);
+	}
+	return entry;
+}
+
+static void publishEntry(struct logEntry *aEntry, size_t aPosition) {
+	atomic_store_explicit(&aEntry->sequence, aPosition + 1, memory_order_release);
+	sem_post(&logSemaphore);
+}
+
+/* Writes all published entries, returns false if there were none */
+static bool drainRing(void) {
+	bool drained = false;
+	while (true) {
+		size_t position = atomic_load_explicit(&writtenPosition, memory_order_relaxed);
+		struct logEntry *entry = &logRing[position % LOG_RING_SLOTS];
+		if (atomic_load_explicit(&entry->sequence, memory_order_acquire) != position + 1) {
+			break;
+		}
+		emitEntry(entry);
+		atomic_store_explicit(&entry->sequence, position + LOG_RING_SLOTS, memory_order_release);
+		atomic_store_explicit(&writtenPosition, position + 1, memory_order_release);
+		drained = true;
+	}
+
+	unsigned long dropped = atomic_exchange(&droppedMessages, 0);
+	if (dropped) {
+		struct logEntry entry;
+		fillEntryHeader(&entry, LLVL_WARN);
+		snprintf(entry.text, sizeof(entry.text), "Log buffer overflow, %lu message(s) dropped.\n", dropped);
+		emitEntry(&entry);
+	}
+	return drained;
+}
+
+static void *logThreadMain(void *aArgument) {
+	(void)aArgument;
+	while (true) {
+		struct timespec timeout;
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += 1;
+		sem_timedwait(&logSemaphore, &timeout);
+
+		if (!drainRing()) {
+			/* Idle, make sure suppressed repeats do not stay unreported */
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((repeat.count > 0) && (now.tv_sec - repeat.firstTimestamp.tv_sec >= LOG_REPEAT_INTERVAL_SECS)) {
+				flushRepeats();
+			}
+		}
+		if (atomic_load(&stopRequested)) {
+			drainRing();
+			flushRepeats();
+			return NULL;
+		}
+	}
+}
+
+static void initLogEpoch(void) {
+	if (!logEpochSet) {
+		clock_gettime(CLOCK_MONOTONIC, &logEpoch);
+		logEpochSet = true;
+	}
+}
+
 void logmsg(int aLogLvl, const char *aFmtString, ...) {
-	if (aLogLvl <= currentLogLevel) {
-		va_list ap;
-		fprintf(stderr, "[%s]: ", logLevelToStr(aLogLvl));
+	if (aLogLvl > currentLogLevel) {
+		return;
+	}
+	initLogEpoch();
+
+	va_list ap;
+	va_start(ap, aFmtString);
+	if (atomic_load(&asyncActive)) {
+		size_t position;
+		struct logEntry *entry = claimEntry(aLogLvl, &position);
+		if (entry) {
+			fillEntryHeader(entry, aLogLvl);
+			vsnprintf(entry->text, sizeof(entry->text), aFmtString, ap);
+			publishEntry(entry, position);
+		} else if (aLogLvl <= LLVL_WARN) {
+			struct logEntry syncEntry;
+			fillEntryHeader(&syncEntry, aLogLvl);
+			vsnprintf(syncEntry.text, sizeof(syncEntry.text), aFmtString, ap);
+			writeLine(syncEntry.logLevel, &syncEntry.timestamp, syncEntry.threadId, syncEntry.text);
+		}
+	} else {
+		struct logEntry entry;
+		fillEntryHeader(&entry, aLogLvl);
+		vsnprintf(entry.text, sizeof(entry.text), aFmtString, ap);
+		writeLine(entry.logLevel, &entry.timestamp, entry.threadId, entry.text);
+	}
+	va_end(ap);
+}
+
+/* Logs a constant message from a signal handler. Unlike logmsg(), this only
+ * uses async-signal-safe functions (no formatting, no stdio); if the ring is
+ * full, a warning or error is written directly. */
+void logmsgSignalSafe(int aLogLvl, const char *aMessage) {
+	if (aLogLvl > currentLogLevel) {
+		return;
+	}
+	size_t position;
+	struct logEntry *entry = NULL;
+	if (atomic_load(&asyncActive)) {
+		entry = claimEntry(aLogLvl, &position);
+		if (!entry && (aLogLvl > LLVL_WARN)) {
+			return;
+		}
+	}
+	if (!entry) {
+		const char *logLevelStr = logLevelToStr(aLogLvl);
+		writeAll(STDERR_FILENO, "[", 1);
+		writeAll(STDERR_FILENO, logLevelStr, strlen(logLevelStr));
+		writeAll(STDERR_FILENO, "]: ", 3);
+		writeAll(STDERR_FILENO, aMessage, strlen(aMessage));
+		return;
+	}
+
+	fillEntryHeader(entry, aLogLvl);
+	size_t length = strlen(aMessage);
+	if (length >= sizeof(entry->text)) {
+		length = sizeof(entry->text) - 1;
+	}
+	memcpy(entry->text, aMessage, length);
+	entry->text[length] = 0;
+	publishEntry(entry, position);
+}
 
-		va_start(ap, aFmtString);
-		vfprintf(stderr, aFmtString, ap);
-		va_end(ap);
+void stopAsyncLogging(void) {
+	if (!atomic_load(&asyncActive)) {
+		return;
+	}
+	atomic_store(&stopRequested, true);
+	sem_post(&logSemaphore);
+	pthread_join(logThread, NULL);
+	atomic_store(&asyncActive, false);
+	/* Entries published while the logging thread was exiting */
+	drainRing();
+	flushRepeats();
+}
+
+/* The logging thread does not exist in a forked child, which therefore logs
+ * synchronously until it calls initAsyncLogging() itself. Messages still
+ * pending in the parent's ring are written by the parent. */
+static void logAtForkChild(void) {
+	atomic_store(&asyncActive, false);
+}
+
+/* Starts the background logging thread. If a log file name is given, all
+ * messages are additionally appended to that file; a log file that was
+ * opened before stays open. */
+bool initAsyncLogging(const char *aLogFilename) {
+	initLogEpoch();
+	if (aLogFilename && (logFileFd == -1)) {
+		logFileFd = open(aLogFilename, O_WRONLY | O_APPEND | O_CREAT, 0600);
+		if (logFileFd == -1) {
+			logmsg(LLVL_ERROR, "Cannot open log file %s: %s\n", aLogFilename, strerror(errno));
+			return false;
+		}
+	}
+	if (atomic_load(&asyncActive)) {
+		return true;
+	}
+
+	for (int i = 0; i < LOG_RING_SLOTS; i++) {
+		atomic_store(&logRing[i].sequence, i);
+	}
+	atomic_store(&enqueuePosition, 0);
+	atomic_store(&writtenPosition, 0);
+	atomic_store(&stopRequested, false);
+	if (sem_init(&logSemaphore, 0, 0) == -1) {
+		logmsg(LLVL_ERROR, "Cannot initialize log semaphore: %s\n", strerror(errno));
+		return false;
+	}
+
+	int error = pthread_create(&logThread, NULL, logThreadMain, NULL);
+	if (error) {
+		logmsg(LLVL_WARN, "Cannot start logging thread, logging synchronously: %s\n", strerror(error));
+		return true;
+	}
+	atomic_store(&asyncActive, true);
+	if (!cleanupRegistered) {
+		pthread_atfork(NULL, NULL, logAtForkChild);
+		atexit(stopAsyncLogging);
+		cleanupRegistered = true;
 	}
+	return true;
 }
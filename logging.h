@@ -24,6 +24,8 @@
 #ifndef __LOGGING_H__
 #define __LOGGING_H__
 
+#include <stdbool.h>
+
 #define LLVL_DEBUG			4
 #define LLVL_INFO			3
 #define LLVL_WARN			2
@@ -34,6 +36,9 @@
 int getLogLevel(void);
 void setLogLevel(int aLogLevel);
 void logmsg(int aLogLvl, const char *aFmtString, ...);
+void logmsgSignalSafe(int aLogLvl, const char *aMessage);
+void stopAsyncLogging(void);
+bool initAsyncLogging(const char *aLogFilename);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
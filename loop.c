@@ -0,0 +1,141 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "loop.h"
+#include "exec.h"
+#include "logging.h"
+
+#define MAX_ATTACHED_LOOP_DEVICES		4
+
+static char attachedLoopDevices[MAX_ATTACHED_LOOP_DEVICES][64];
+static bool detachRegistered;
+
+bool isRegularFile(const char *aPath) {
+	struct stat statBuf;
+	return (stat(aPath, &statBuf) == 0) && S_ISREG(statBuf.st_mode);
+}
+
+/* Returns true if the given image file is already attached to a loop device
+ * (and therefore might be in use, e.g. mounted through that loop device) */
+bool isFileLoopAttached(const char *aFilename) {
+	const char *arguments[] = {
+		"losetup",
+		"-j",
+		aFilename,
+		NULL
+	};
+	char output[256];
+	struct execResult_t execResult = execGetOutput(arguments, output, sizeof(output));
+	if ((!execResult.success) || (execResult.returnCode != 0)) {
+		logmsg(LLVL_ERROR, "Unable to query loop devices of %s, assuming it is attached for safety.\n", aFilename);
+		return true;
+	}
+	if (strlen(output) > 0) {
+		logmsg(LLVL_DEBUG, "%s is already attached: %s", aFilename, output);
+		return true;
+	}
+	return false;
+}
+
+/* Detaches the loop devices at process exit (the last attached one first),
+ * no matter if the conversion succeeded or not. If a loop device is still
+ * held open (e.g. by the device mapper alias after an abort), the kernel
+ * detaches it automatically as soon as it is closed. */
+static void detachLoopDevices(void) {
+	for (int i = MAX_ATTACHED_LOOP_DEVICES - 1; i >= 0; i--) {
+		if (!attachedLoopDevices[i][0]) {
+			continue;
+		}
+		const char *arguments[] = {
+			"losetup",
+			"-d",
+			attachedLoopDevices[i],
+			NULL
+		};
+		struct execResult_t execResult = execGetReturnCode(arguments);
+		if ((!execResult.success) || (execResult.returnCode != 0)) {
+			logmsg(LLVL_WARN, "Detaching loop device %s failed (execution %s, return code %d).\n", attachedLoopDevices[i], execResult.success ? "successful" : "failed", execResult.returnCode);
+		} else {
+			logmsg(LLVL_DEBUG, "Detached loop device %s.\n", attachedLoopDevices[i]);
+		}
+		attachedLoopDevices[i][0] = 0;
+	}
+}
+
+/* Attaches the given image file to the next free loop device. The loop device
+ * is detached again when the process exits. Returns the path of the loop
+ * device or NULL on error. */
+const char *loopAttach(const char *aFilename) {
+	struct stat statBuf;
+	if (stat(aFilename, &statBuf) != 0) {
+		logmsg(LLVL_ERROR, "Cannot stat image file %s: %s\n", aFilename, strerror(errno));
+		return NULL;
+	}
+	int slot = 0;
+	while ((slot < MAX_ATTACHED_LOOP_DEVICES) && attachedLoopDevices[slot][0]) {
+		slot++;
+	}
+	if (slot == MAX_ATTACHED_LOOP_DEVICES) {
+		logmsg(LLVL_ERROR, "Cannot attach %s, already %d loop devices attached.\n", aFilename, MAX_ATTACHED_LOOP_DEVICES);
+		return NULL;
+	}
+	if (statBuf.st_size % 512) {
+		logmsg(LLVL_ERROR, "Size of image file %s (%ld bytes) is not a multiple of 512 bytes.\n", aFilename, (long)statBuf.st_size);
+		return NULL;
+	}
+
+	const char *arguments[] = {
+		"losetup",
+		"-f",
+		"--show",
+		aFilename,
+		NULL
+	};
+	char output[sizeof(attachedLoopDevices[0])];
+	struct execResult_t execResult = execGetOutput(arguments, output, sizeof(output));
+	if ((!execResult.success) || (execResult.returnCode != 0)) {
+		logmsg(LLVL_ERROR, "Attaching %s to a loop device failed (execution %s, return code %d).\n", aFilename, execResult.success ? "successful" : "failed", execResult.returnCode);
+		return NULL;
+	}
+	output[strcspn(output, "\n")] = 0;
+	if (strncmp(output, "/dev/", 5)) {
+		logmsg(LLVL_ERROR, "losetup returned unexpected loop device name '%s'.\n", output);
+		return NULL;
+	}
+
+	if (!detachRegistered) {
+		atexit(detachLoopDevices);
+		detachRegistered = true;
+	}
+	strcpy(attachedLoopDevices[slot], output);
+	logmsg(LLVL_INFO, "Attached image file %s to loop device %s\n", aFilename, attachedLoopDevices[slot]);
+	return attachedLoopDevices[slot];
+}
@@ -21,11 +21,15 @@
 	Johannes Bauer <JohannesBauer@gmx.de>
 */
 
-#ifndef __MOUNT_H__
-#define __MOUNT_H__
+#ifndef __LOOP_H__
+#define __LOOP_H__
+
+#include <stdbool.h>
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
-bool isBlockDeviceMounted(const char *aBlkDevice);
+bool isRegularFile(const char *aPath);
+bool isFileLoopAttached(const char *aFilename);
+const char *loopAttach(const char *aFilename);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
@@ -35,6 +35,7 @@
 #include "globals.h"
 #include "utils.h"
 #include "random.h"
+#include "probes.h"
 
 /* Checks is the given block device has already been formatted with LUKS. */
 bool isLuks(const char *aBlockDevice) {
@@ -67,10 +68,13 @@ bool isLuksMapperAvailable(const char *aMapperName) {
 }
 
 /* Formats a block device with LUKS using the given key file for slot 0 and
- * passes some optional parameters (comma-separated) to cryptsetup */
-bool luksFormat(const char *aBlkDevice, const char *aKeyFile, const char *aOptionalParams) {
+ * passes some optional parameters (comma-separated) to cryptsetup. Cipher and
+ * sector size are left to cryptsetup if NULL or 0. */
+bool luksFormat(const char *aBlkDevice, const char *aKeyFile, const char *aCipher, int aKeySize, int aSectorSize, const char *aOptionalParams) {
 	int argcnt = -1;
 	char userSuppliedArguments[MAX_ARGLENGTH];
+	char keySize[16];
+	char sectorSize[16];
 	const char *arguments[MAX_ARG_CNT] = {
 		"cryptsetup",
 		"luksFormat",
@@ -79,6 +83,22 @@ bool luksFormat(const char *aBlkDevice, const char *aKeyFile, const char *aOptio
 		aKeyFile,
 		NULL
 	};
+	if (aCipher) {
+		/* Passed separately since cipher specifications may contain commas;
+		 * given first so that a cipher in the user's parameters wins */
+		snprintf(keySize, sizeof(keySize), "%d", aKeySize);
+		if (!argAppend(arguments, "--cipher", &argcnt, MAX_ARG_CNT) || !argAppend(arguments, aCipher, &argcnt, MAX_ARG_CNT) || !argAppend(arguments, "--key-size", &argcnt, MAX_ARG_CNT) || !argAppend(arguments, keySize, &argcnt, MAX_ARG_CNT)) {
+			logmsg(LLVL_ERROR, "Unable to append cipher arguments, %d count max.\n", MAX_ARG_CNT);
+			return false;
+		}
+	}
+	if (aSectorSize) {
+		snprintf(sectorSize, sizeof(sectorSize), "%d", aSectorSize);
+		if (!argAppend(arguments, "--sector-size", &argcnt, MAX_ARG_CNT) || !argAppend(arguments, sectorSize, &argcnt, MAX_ARG_CNT)) {
+			logmsg(LLVL_ERROR, "Unable to append sector size arguments, %d count max.\n", MAX_ARG_CNT);
+			return false;
+		}
+	}
 	if (aOptionalParams) {
 		if (!safestrcpy(userSuppliedArguments, aOptionalParams, MAX_ARGLENGTH)) {
 			logmsg(LLVL_ERROR, "Unable to copy user supplied argument, %d bytes max.\n", MAX_ARGLENGTH);
@@ -97,7 +117,11 @@ bool luksFormat(const char *aBlkDevice, const char *aKeyFile, const char *aOptio
 	}
 
 	logmsg(LLVL_DEBUG, "Performing luksFormat of block device %s using key file %s\n", aBlkDevice, aKeyFile);
+	uint64_t startTime = PROBE_TIMER_START(luks__format);
 	struct execResult_t execResult = execGetReturnCode(arguments);
+	if (PROBE_ENABLED(luks__format)) {
+		PROBE3(luks__format, aBlkDevice, execResult.success ? execResult.returnCode : -1, PROBE_TIMER_ELAPSED(startTime));
+	}
 	if ((!execResult.success) || (execResult.returnCode != 0)) {
 		logmsg(LLVL_ERROR, "luksFormat failed (execution %s, return code %d), aborting.\n", execResult.success ? "successful" : "failed", execResult.returnCode);
 		return false;
@@ -106,18 +130,48 @@ bool luksFormat(const char *aBlkDevice, const char *aKeyFile, const char *aOptio
 	return true;
 }
 
-bool luksOpen(const char *aBlkDevice, const char *aKeyFile, const char *aHandle) {
-	const char *arguments[] = {
+/* Opens a LUKS block device under the given device mapper handle and passes
+ * some optional parameters (comma-separated) to cryptsetup. If a header file
+ * is given, the LUKS header is read from there instead of the device. */
+bool luksOpen(const char *aBlkDevice, const char *aKeyFile, const char *aHandle, const char *aHeaderFile, const char *aOptionalParams) {
+	int argcnt = -1;
+	char userSuppliedArguments[MAX_ARGLENGTH];
+	const char *arguments[MAX_ARG_CNT] = {
 		"cryptsetup",
 		"luksOpen",
 		"--key-file",
 		aKeyFile,
-		aBlkDevice,
-		aHandle,
 		NULL
 	};
+	if (aHeaderFile) {
+		if (!argAppend(arguments, "--header", &argcnt, MAX_ARG_CNT) || !argAppend(arguments, aHeaderFile, &argcnt, MAX_ARG_CNT)) {
+			logmsg(LLVL_ERROR, "Unable to append header file to luksOpen arguments, %d count max.\n", MAX_ARG_CNT);
+			return false;
+		}
+	}
+	if (aOptionalParams) {
+		if (!safestrcpy(userSuppliedArguments, aOptionalParams, MAX_ARGLENGTH)) {
+			logmsg(LLVL_ERROR, "Unable to copy optional luksOpen argument, %d bytes max.\n", MAX_ARGLENGTH);
+			return false;
+		}
+
+		if (!argAppendParse(arguments, userSuppliedArguments, &argcnt, MAX_ARG_CNT)) {
+			logmsg(LLVL_ERROR, "Unable to copy optional luksOpen argument, %d count max.\n", MAX_ARG_CNT);
+			return false;
+		}
+	}
+
+	if (!argAppend(arguments, aBlkDevice, &argcnt, MAX_ARG_CNT) || !argAppend(arguments, aHandle, &argcnt, MAX_ARG_CNT)) {
+		logmsg(LLVL_ERROR, "Unable to append device and handle to luksOpen arguments, %d count max.\n", MAX_ARG_CNT);
+		return false;
+	}
+
 	logmsg(LLVL_DEBUG, "Performing luksOpen of block device %s using key file %s and device mapper handle %s\n", aBlkDevice, aKeyFile, aHandle);
+	uint64_t startTime = PROBE_TIMER_START(luks__open);
 	struct execResult_t execResult = execGetReturnCode(arguments);
+	if (PROBE_ENABLED(luks__open)) {
+		PROBE3(luks__open, aBlkDevice, execResult.success ? execResult.returnCode : -1, PROBE_TIMER_ELAPSED(startTime));
+	}
 	if ((!execResult.success) || (execResult.returnCode != 0)) {
 		logmsg(LLVL_ERROR, "luksOpen failed (execution %s, return code %d).\n", execResult.success ? "successful" : "failed", execResult.returnCode);
 		return false;
@@ -126,6 +180,124 @@ bool luksOpen(const char *aBlkDevice, const char *aKeyFile, const char *aHandle)
 	return true;
 }
 
+/* Saves the LUKS header of a block device to a file, which can be used to
+ * open the device after its header has been overwritten */
+bool luksHeaderBackup(const char *aBlkDevice, const char *aBackupFile) {
+	const char *arguments[] = {
+		"cryptsetup",
+		"luksHeaderBackup",
+		"--header-backup-file",
+		aBackupFile,
+		aBlkDevice,
+		NULL
+	};
+
+	logmsg(LLVL_DEBUG, "Saving LUKS header of %s to %s\n", aBlkDevice, aBackupFile);
+	struct execResult_t execResult = execGetReturnCode(arguments);
+	if ((!execResult.success) || (execResult.returnCode != 0)) {
+		logmsg(LLVL_ERROR, "luksHeaderBackup failed (execution %s, return code %d).\n", execResult.success ? "successful" : "failed", execResult.returnCode);
+		return false;
+	}
+	return true;
+}
+
+static int hexNibble(char aChar) {
+	if ((aChar >= '0') && (aChar <= '9')) {
+		return aChar - '0';
+	} else if ((aChar >= 'a') && (aChar <= 'f')) {
+		return aChar - 'a' + 10;
+	} else if ((aChar >= 'A') && (aChar <= 'F')) {
+		return aChar - 'A' + 10;
+	}
+	return -1;
+}
+
+/* Reads the dm-crypt table of an opened LUKS device (including the volume
+ * key) so that data can be encrypted in user space exactly like the kernel
+ * would do it. The key is only available if the device was opened without
+ * the kernel keyring (cryptsetup --disable-keyring). */
+bool dmGetCryptTable(const char *aMapperHandle, struct dmCryptTable *aTable) {
+	const char *arguments[] = {
+		"dmsetup",
+		"table",
+		"--showkeys",
+		aMapperHandle,
+		NULL
+	};
+
+	char output[1024];
+	struct execResult_t execResult = execGetOutput(arguments, output, sizeof(output));
+	if ((!execResult.success) || (execResult.returnCode != 0)) {
+		logmsg(LLVL_ERROR, "Reading dm-crypt table of %s failed (execution %s, return code %d).\n", aMapperHandle, execResult.success ? "successful" : "failed", execResult.returnCode);
+		return false;
+	}
+
+	/* Format is "start length crypt cipher key ivoffset device offset
+	 * [#opt_params opt_params...]" */
+	memset(aTable, 0, sizeof(struct dmCryptTable));
+	aTable->sectorSize = 512;
+	char *savePtr = NULL;
+	char *fields[8];
+	int fieldCount = 0;
+	for (char *token = strtok_r(output, " \n", &savePtr); token && (fieldCount < 8); token = strtok_r(NULL, " \n", &savePtr)) {
+		fields[fieldCount++] = token;
+	}
+	if ((fieldCount < 8) || strcmp(fields[2], "crypt")) {
+		logmsg(LLVL_ERROR, "Device mapper table of %s is not a single dm-crypt target.\n", aMapperHandle);
+		return false;
+	}
+
+	if (!safestrcpy(aTable->cipher, fields[3], sizeof(aTable->cipher))) {
+		logmsg(LLVL_ERROR, "Cipher specification '%s' of %s is too long.\n", fields[3], aMapperHandle);
+		return false;
+	}
+
+	const char *hexKey = fields[4];
+	if (hexKey[0] == ':') {
+		logmsg(LLVL_ERROR, "Volume key of %s is stored in the kernel keyring and cannot be read.\n", aMapperHandle);
+		return false;
+	}
+	int hexKeyLength = strlen(hexKey);
+	if ((hexKeyLength % 2) || ((hexKeyLength / 2) > (int)sizeof(aTable->key))) {
+		logmsg(LLVL_ERROR, "Volume key of %s has an unsupported length of %d hex characters.\n", aMapperHandle, hexKeyLength);
+		return false;
+	}
+	for (int i = 0; i < hexKeyLength / 2; i++) {
+		int high = hexNibble(hexKey[2 * i]);
+		int low = hexNibble(hexKey[2 * i + 1]);
+		if ((high < 0) || (low < 0)) {
+			logmsg(LLVL_ERROR, "Volume key of %s is not a hex string.\n", aMapperHandle);
+			memset(aTable->key, 0, sizeof(aTable->key));
+			return false;
+		}
+		aTable->key[i] = (high << 4) | low;
+	}
+	aTable->keyLength = hexKeyLength / 2;
+
+	char *endPtr;
+	aTable->ivOffset = strtoull(fields[5], &endPtr, 10);
+	aTable->dataOffset = strtoull(fields[7], &endPtr, 10) * 512;
+
+	/* Optional parameters that change the on-disk layout */
+	char *token = strtok_r(NULL, " \n", &savePtr);
+	int optionalCount = token ? atoi(token) : 0;
+	for (int i = 0; i < optionalCount; i++) {
+		token = strtok_r(NULL, " \n", &savePtr);
+		if (!token) {
+			break;
+		}
+		if (!strncmp(token, "sector_size:", 12)) {
+			aTable->sectorSize = atoi(token + 12);
+		} else if (!strcmp(token, "iv_large_sectors")) {
+			aTable->ivLargeSectors = true;
+		}
+	}
+	memset(output, 0, sizeof(output));
+
+	logmsg(LLVL_DEBUG, "dm-crypt table of %s: cipher %s, %d bit key, IV offset %" PRIu64 ", data offset %" PRIu64 " bytes, sector size %d%s\n", aMapperHandle, aTable->cipher, aTable->keyLength * 8, aTable->ivOffset, aTable->dataOffset, aTable->sectorSize, aTable->ivLargeSectors ? " (large sector IVs)" : "");
+	return true;
+}
+
 bool dmCreateAlias(const char *aSrcDevice, const char *aMapperHandle) {
 	uint64_t devSize = getDiskSizeOfPath(aSrcDevice);
 	if (devSize % 512) {
@@ -164,6 +336,37 @@ bool dmCreateAlias(const char *aSrcDevice, const char *aMapperHandle) {
 	return true;
 }
 
+/* Creates a non-persistent snapshot of the origin device, all writes to which
+ * end up in the copy-on-write device and leave the origin untouched */
+bool dmCreateSnapshot(const char *aOriginDevice, const char *aCowDevice, const char *aMapperHandle) {
+	uint64_t devSize = getDiskSizeOfPath(aOriginDevice);
+	if (devSize % 512) {
+		logmsg(LLVL_ERROR, "Device size of %s (%" PRIu64 " bytes) is not divisible by even 512 bytes sector size.\n", aOriginDevice, devSize);
+		return false;
+	}
+
+	/* Chunks of 4 kiB, conversion writes always cover them completely */
+	char mapperTable[256];
+	snprintf(mapperTable, sizeof(mapperTable), "0 %" PRIu64 " snapshot %s %s N 8", devSize / 512, aOriginDevice, aCowDevice);
+
+	const char *arguments[] = {
+		"dmsetup",
+		"create",
+		aMapperHandle,
+		"--table",
+		mapperTable,
+		NULL
+	};
+
+	struct execResult_t execResult = execGetReturnCode(arguments);
+	if ((!execResult.success) || (execResult.returnCode != 0)) {
+		logmsg(LLVL_ERROR, "dmsetup snapshot creation failed (execution %s, returncode %d).\n", execResult.success ? "successful" : "failed", execResult.returnCode);
+		return false;
+	}
+	logmsg(LLVL_DEBUG, "Created device mapper snapshot %s of %s, copy-on-write store %s\n", aMapperHandle, aOriginDevice, aCowDevice);
+	return true;
+}
+
 char *dmCreateDynamicAlias(const char *aSrcDevice, const char *aAliasPrefix) {
 	char alias[64];
 	if (aAliasPrefix && (strlen(aAliasPrefix) < 32)) {
@@ -25,13 +25,27 @@
 #define __LUKS_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+
+struct dmCryptTable {
+	char cipher[64];				/* Kernel cipher specification, e.g. aes-xts-plain64 */
+	uint8_t key[128];				/* Volume key */
+	int keyLength;					/* Volume key length in bytes */
+	uint64_t ivOffset;				/* Added to the sector number for IV generation */
+	uint64_t dataOffset;			/* Offset of encrypted data on the raw device in bytes */
+	int sectorSize;					/* Encryption sector size in bytes */
+	bool ivLargeSectors;			/* IVs count in sectorSize instead of 512 byte units */
+};
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool isLuks(const char *aBlockDevice);
 bool isLuksMapperAvailable(const char *aMapperName);
-bool luksFormat(const char *aBlkDevice, const char *aKeyFile, const char *aOptionalParams);
-bool luksOpen(const char *aBlkDevice, const char *aKeyFile, const char *aHandle);
+bool luksFormat(const char *aBlkDevice, const char *aKeyFile, const char *aCipher, int aKeySize, int aSectorSize, const char *aOptionalParams);
+bool luksOpen(const char *aBlkDevice, const char *aKeyFile, const char *aHandle, const char *aHeaderFile, const char *aOptionalParams);
+bool luksHeaderBackup(const char *aBlkDevice, const char *aBackupFile);
+bool dmGetCryptTable(const char *aMapperHandle, struct dmCryptTable *aTable);
 bool dmCreateAlias(const char *aSrcDevice, const char *aMapperHandle);
+bool dmCreateSnapshot(const char *aOriginDevice, const char *aCowDevice, const char *aMapperHandle);
 char *dmCreateDynamicAlias(const char *aSrcDevice, const char *aAliasPrefix);
 bool dmRemove(const char *aMapperHandle);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
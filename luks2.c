@@ -0,0 +1,663 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "luks2.h"
+#include "globals.h"
+#include "logging.h"
+#include "utils.h"
+#include "random.h"
+
+/* A LUKS2 header written without cryptsetup, so that a conversion can run
+ * without root and device mapper. The layout is the one cryptsetup creates
+ * by default: two copies of a 16 kiB header (binary header and JSON area),
+ * followed by the keyslot area up to the data at 16 MiB. Keyslots use PBKDF2
+ * instead of Argon2, which keeps the implementation to what OpenSSL offers;
+ * cryptsetup opens such headers all the same. */
+
+_Static_assert(sizeof(struct luks2BinaryHeader) == 4096, "LUKS2 binary header must not contain padding");
+
+#define LUKS2_MAGIC					"LUKS\xba\xbe"
+#define LUKS2_SECONDARY_MAGIC		"SKUL\xba\xbe"
+#define LUKS2_MAGIC_LEN				6
+
+/* Checks if the given device or image file starts with a LUKS header (of
+ * either version) without calling cryptsetup */
+bool hasLuksMagic(const char *aPath) {
+	int fd = open(aPath, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	char magic[LUKS2_MAGIC_LEN];
+	bool isLuks = (pread(fd, magic, sizeof(magic), 0) == sizeof(magic)) && !memcmp(magic, LUKS2_MAGIC, LUKS2_MAGIC_LEN);
+	close(fd);
+	return isLuks;
+}
+
+#ifdef USERSPACE_CRYPTO
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+#define LUKS2_KEYSLOTS_OFFSET		(2 * LUKS2_HEADER_SIZE)
+#define LUKS2_KEYSLOTS_SIZE			(LUKS2_DATA_OFFSET - LUKS2_KEYSLOTS_OFFSET)
+#define LUKS2_MAX_HEADER_SIZE		(4 * 1024 * 1024)
+#define LUKS2_CIPHER				"aes-xts-plain64"
+#define LUKS2_KEY_SIZE				512
+#define LUKS2_HASH					"sha256"
+#define LUKS2_AF_STRIPES			4000
+#define LUKS2_SALT_SIZE				32
+#define LUKS2_KEYSLOT_MIN_ITERATIONS	100000
+#define LUKS2_KEYSLOT_PROBE_ITERATIONS	10000
+#define LUKS2_KEYSLOT_TARGET_SECONDS	2.0
+#define LUKS2_DIGEST_ITERATIONS		1000
+#define LUKS2_MAX_KEY_SIZE			64
+#define LUKS2_AREA_SECTOR_SIZE		512
+#define LUKS2_JSON_VALUE_SIZE		128
+
+/* Part of the JSON area, see jsonObject() */
+struct jsonSpan {
+	const char *start;
+	int length;
+};
+
+static void putBigEndian(uint8_t *aData, int aLength, uint64_t aValue) {
+	for (int i = aLength - 1; i >= 0; i--) {
+		aData[i] = aValue & 0xff;
+		aValue >>= 8;
+	}
+}
+
+static uint64_t getBigEndian(const uint8_t *aData, int aLength) {
+	uint64_t value = 0;
+	for (int i = 0; i < aLength; i++) {
+		value = (value << 8) | aData[i];
+	}
+	return value;
+}
+
+static bool fullPwrite(int aFd, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	while (aLength > 0) {
+		ssize_t written = pwrite(aFd, aData, aLength, aOffset);
+		if (written <= 0) {
+			if ((written == -1) && (errno == EINTR)) {
+				continue;
+			}
+			logmsg(LLVL_ERROR, "Writing %u bytes of LUKS2 metadata at offset 0x%" PRIx64 " failed: %s\n", aLength, aOffset, strerror(errno));
+			return false;
+		}
+		aData += written;
+		aLength -= written;
+		aOffset += written;
+	}
+	return true;
+}
+
+static bool fullPread(int aFd, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	while (aLength > 0) {
+		ssize_t bytesRead = pread(aFd, aData, aLength, aOffset);
+		if (bytesRead <= 0) {
+			if ((bytesRead == -1) && (errno == EINTR)) {
+				continue;
+			}
+			logmsg(LLVL_DEBUG, "Reading %u bytes of LUKS2 metadata at offset 0x%" PRIx64 " failed: %s\n", aLength, aOffset, (bytesRead == 0) ? "end of device" : strerror(errno));
+			return false;
+		}
+		aData += bytesRead;
+		aLength -= bytesRead;
+		aOffset += bytesRead;
+	}
+	return true;
+}
+
+static void base64Encode(const uint8_t *aData, int aLength, char *aString) {
+	EVP_EncodeBlock((unsigned char*)aString, aData, aLength);
+}
+
+/* Returns the number of decoded bytes or -1 if the string is not valid
+ * base64 or does not fit */
+static int base64Decode(const char *aString, uint8_t *aData, int aMaxLength) {
+	int length = strlen(aString);
+	if ((length % 4) || ((length / 4 * 3) > aMaxLength)) {
+		return -1;
+	}
+	int decoded = EVP_DecodeBlock(aData, (const unsigned char*)aString, length);
+	if (decoded < 0) {
+		return -1;
+	}
+	/* EVP_DecodeBlock() counts the padding as well */
+	for (int i = length - 1; (i >= 0) && (aString[i] == '='); i--) {
+		decoded--;
+	}
+	return decoded;
+}
+
+/* Checksum of a header, computed with the checksum field zeroed */
+static bool headerChecksum(uint8_t *aHeader, uint32_t aHeaderSize, const EVP_MD *aHash, uint8_t aChecksum[EVP_MAX_MD_SIZE]) {
+	struct luks2BinaryHeader *header = (struct luks2BinaryHeader*)aHeader;
+	uint8_t stored[sizeof(header->checksum)];
+	memcpy(stored, header->checksum, sizeof(stored));
+	memset(header->checksum, 0, sizeof(header->checksum));
+	bool success = (EVP_Digest(aHeader, aHeaderSize, aChecksum, NULL, aHash, NULL) == 1);
+	memcpy(header->checksum, stored, sizeof(stored));
+	return success;
+}
+
+/* En- or decrypts the keyslot area with aes-xts-plain64 in 512 byte sectors,
+ * which are numbered from the start of the area */
+static bool cryptKeyslotArea(const uint8_t *aKey, int aKeyLength, bool aEncrypt, const uint8_t *aInput, uint8_t *aOutput, uint32_t aLength) {
+	EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+	bool success = context && (EVP_CipherInit_ex(context, (aKeyLength == 64) ? EVP_aes_256_xts() : EVP_aes_128_xts(), NULL, aKey, NULL, aEncrypt ? 1 : 0) == 1);
+
+	uint8_t iv[16];
+	memset(iv, 0, sizeof(iv));
+	for (uint32_t position = 0; success && (position < aLength); position += LUKS2_AREA_SECTOR_SIZE) {
+		uint32_t sector = position / LUKS2_AREA_SECTOR_SIZE;
+		for (int i = 0; i < 4; i++) {
+			iv[i] = (sector >> (8 * i)) & 0xff;
+		}
+		int outLength;
+		success = (EVP_CipherInit_ex(context, NULL, NULL, NULL, iv, -1) == 1) && (EVP_CipherUpdate(context, aOutput + position, &outLength, aInput + position, LUKS2_AREA_SECTOR_SIZE) == 1) && (outLength == LUKS2_AREA_SECTOR_SIZE);
+	}
+	EVP_CIPHER_CTX_free(context);
+	return success;
+}
+
+/* Diffusion function of the anti-forensic splitter: every digest sized piece
+ * of the block is replaced by the hash of its index and itself */
+static bool afDiffuse(const EVP_MD *aHash, uint8_t *aBlock, uint32_t aLength) {
+	EVP_MD_CTX *context = EVP_MD_CTX_new();
+	uint32_t digestSize = EVP_MD_size(aHash);
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	bool success = (context != NULL);
+	for (uint32_t i = 0; success && (i * digestSize < aLength); i++) {
+		uint32_t position = i * digestSize;
+		uint32_t length = ((aLength - position) < digestSize) ? (aLength - position) : digestSize;
+		uint8_t index[4] = { (i >> 24) & 0xff, (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff };
+		success = (EVP_DigestInit_ex(context, aHash, NULL) == 1) && (EVP_DigestUpdate(context, index, sizeof(index)) == 1) && (EVP_DigestUpdate(context, aBlock + position, length) == 1) && (EVP_DigestFinal_ex(context, digest, NULL) == 1);
+		memcpy(aBlock + position, digest, length);
+	}
+	EVP_MD_CTX_free(context);
+	return success;
+}
+
+static void xorBlock(uint8_t *aBlock, const uint8_t *aData, uint32_t aLength) {
+	for (uint32_t i = 0; i < aLength; i++) {
+		aBlock[i] ^= aData[i];
+	}
+}
+
+/* Spreads the key over aStripes blocks of keyslot material, all of which are
+ * needed to recover it (LUKS anti-forensic splitter) */
+static bool afSplit(const EVP_MD *aHash, const uint8_t *aKey, uint32_t aKeyLength, uint32_t aStripes, uint8_t *aMaterial) {
+	if (!readRandomData(aMaterial, aKeyLength * (aStripes - 1))) {
+		return false;
+	}
+	uint8_t block[LUKS2_MAX_KEY_SIZE];
+	memset(block, 0, sizeof(block));
+	bool success = true;
+	for (uint32_t i = 0; success && (i < aStripes - 1); i++) {
+		xorBlock(block, aMaterial + (i * aKeyLength), aKeyLength);
+		success = afDiffuse(aHash, block, aKeyLength);
+	}
+	uint8_t *lastStripe = aMaterial + ((aStripes - 1) * aKeyLength);
+	memcpy(lastStripe, aKey, aKeyLength);
+	xorBlock(lastStripe, block, aKeyLength);
+	memset(block, 0, sizeof(block));
+	return success;
+}
+
+static bool afMerge(const EVP_MD *aHash, const uint8_t *aMaterial, uint32_t aKeyLength, uint32_t aStripes, uint8_t *aKey) {
+	uint8_t block[LUKS2_MAX_KEY_SIZE];
+	memset(block, 0, sizeof(block));
+	bool success = true;
+	for (uint32_t i = 0; success && (i < aStripes - 1); i++) {
+		xorBlock(block, aMaterial + (i * aKeyLength), aKeyLength);
+		success = afDiffuse(aHash, block, aKeyLength);
+	}
+	memcpy(aKey, aMaterial + ((aStripes - 1) * aKeyLength), aKeyLength);
+	xorBlock(aKey, block, aKeyLength);
+	memset(block, 0, sizeof(block));
+	return success;
+}
+
+static bool pbkdf2(const uint8_t *aPassphrase, uint32_t aPassphraseLength, const uint8_t *aSalt, int aSaltLength, uint64_t aIterations, const EVP_MD *aHash, uint8_t *aKey, int aKeyLength) {
+	if ((aIterations < 1) || (aIterations > INT32_MAX)) {
+		return false;
+	}
+	return PKCS5_PBKDF2_HMAC((const char*)aPassphrase, aPassphraseLength, aSalt, aSaltLength, aIterations, aHash, aKeyLength, aKey) == 1;
+}
+
+/* Like cryptsetup's --iter-time, the keyslot iteration count is chosen so
+ * that unlocking takes about LUKS2_KEYSLOT_TARGET_SECONDS on this machine,
+ * but never less than LUKS2_KEYSLOT_MIN_ITERATIONS. Scaled from a timed
+ * probe with the same hash and key length. */
+static uint64_t keyslotIterations(const EVP_MD *aHash, int aKeyLength) {
+	uint8_t probeSalt[LUKS2_SALT_SIZE] = { 0 };
+	uint8_t probeKey[LUKS2_MAX_KEY_SIZE];
+	double tStart = getTime();
+	bool success = pbkdf2((const uint8_t*)"luksipc", 7, probeSalt, sizeof(probeSalt), LUKS2_KEYSLOT_PROBE_ITERATIONS, aHash, probeKey, aKeyLength);
+	double probeTime = getTime() - tStart;
+	if (!success || (probeTime <= 0)) {
+		logmsg(LLVL_WARN, "Cannot time PBKDF2, using %d iterations for the keyslot.\n", LUKS2_KEYSLOT_MIN_ITERATIONS);
+		return LUKS2_KEYSLOT_MIN_ITERATIONS;
+	}
+	double iterations = LUKS2_KEYSLOT_PROBE_ITERATIONS * LUKS2_KEYSLOT_TARGET_SECONDS / probeTime;
+	if (iterations > INT32_MAX) {
+		iterations = INT32_MAX;
+	} else if (iterations < LUKS2_KEYSLOT_MIN_ITERATIONS) {
+		iterations = LUKS2_KEYSLOT_MIN_ITERATIONS;
+	}
+	logmsg(LLVL_INFO, "Using %" PRIu64 " PBKDF2 iterations for the keyslot (%.0f per second).\n", (uint64_t)iterations, LUKS2_KEYSLOT_PROBE_ITERATIONS / probeTime);
+	return (uint64_t)iterations;
+}
+
+/* Formats the device behind aFd with a LUKS2 header that has the passphrase
+ * (i.e. the contents of the key file) in keyslot 0. The resulting dm-crypt
+ * parameters, including the volume key, are stored in aTable. Cipher and
+ * sector size default to aes-xts-plain64 and 512 bytes if NULL or 0; the
+ * volume key always has 512 bits. */
+bool luks2Format(int aFd, const uint8_t *aPassphrase, uint32_t aPassphraseLength, const char *aCipher, int aKeySize, int aSectorSize, struct dmCryptTable *aTable) {
+	const char *cipher = aCipher ? aCipher : LUKS2_CIPHER;
+	int keySize = aCipher ? aKeySize : LUKS2_KEY_SIZE;
+	if (strcmp(cipher, LUKS2_CIPHER) || (keySize != LUKS2_KEY_SIZE)) {
+		logmsg(LLVL_ERROR, "The userspace LUKS target supports only %s with a %d bit key, not %s with a %d bit key.\n", LUKS2_CIPHER, LUKS2_KEY_SIZE, cipher, keySize);
+		return false;
+	}
+	int sectorSize = aSectorSize ? aSectorSize : DEFAULT_CRYPT_SECTOR_SIZE;
+	if ((sectorSize < 512) || (sectorSize > 4096) || (sectorSize & (sectorSize - 1))) {
+		logmsg(LLVL_ERROR, "Unsupported encryption sector size of %d bytes.\n", sectorSize);
+		return false;
+	}
+	uint64_t deviceSize = getDiskSizeOfFd(aFd);
+	if (deviceSize < (uint64_t)LUKS2_DATA_OFFSET + sectorSize) {
+		logmsg(LLVL_ERROR, "Device of %" PRIu64 " bytes is too small for a LUKS2 header of %d bytes.\n", deviceSize, LUKS2_DATA_OFFSET);
+		return false;
+	}
+
+	const EVP_MD *hash = EVP_sha256();
+	uint32_t keyLength = keySize / 8;
+	uint32_t materialLength = keyLength * LUKS2_AF_STRIPES;
+	uint32_t areaSize = (materialLength + 4095) / 4096 * 4096;
+	uint64_t slotIterations = keyslotIterations(hash, keyLength);
+
+	/* All metadata up to the data segment, so that nothing of the plain
+	 * device stays behind in the keyslot area */
+	uint8_t *metadata = calloc(1, LUKS2_DATA_OFFSET);
+	if (!metadata) {
+		logmsg(LLVL_ERROR, "Cannot allocate LUKS2 metadata: %s\n", strerror(errno));
+		return false;
+	}
+
+	uint8_t volumeKey[LUKS2_MAX_KEY_SIZE];
+	uint8_t slotKey[LUKS2_MAX_KEY_SIZE];
+	uint8_t kdfSalt[LUKS2_SALT_SIZE];
+	uint8_t digestSalt[LUKS2_SALT_SIZE];
+	uint8_t digest[32];
+	uint8_t uuidBytes[16];
+	bool success = readRandomData(volumeKey, keyLength) && readRandomData(kdfSalt, sizeof(kdfSalt)) && readRandomData(digestSalt, sizeof(digestSalt)) && readRandomData(uuidBytes, sizeof(uuidBytes));
+
+	/* Keyslot 0: split volume key, encrypted with the key derived from the
+	 * passphrase */
+	uint8_t *material = metadata + LUKS2_KEYSLOTS_OFFSET;
+	success = success && afSplit(hash, volumeKey, keyLength, LUKS2_AF_STRIPES, material);
+	success = success && pbkdf2(aPassphrase, aPassphraseLength, kdfSalt, sizeof(kdfSalt), slotIterations, hash, slotKey, keyLength);
+	success = success && cryptKeyslotArea(slotKey, keyLength, true, material, material, materialLength);
+	success = success && pbkdf2(volumeKey, keyLength, digestSalt, sizeof(digestSalt), LUKS2_DIGEST_ITERATIONS, hash, digest, sizeof(digest));
+	if (!success) {
+		logmsg(LLVL_ERROR, "Cannot create LUKS2 keyslot.\n");
+	}
+
+	char uuid[40];
+	uuidBytes[6] = (uuidBytes[6] & 0x0f) | 0x40;
+	uuidBytes[8] = (uuidBytes[8] & 0x3f) | 0x80;
+	snprintf(uuid, sizeof(uuid), "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", uuidBytes[0], uuidBytes[1], uuidBytes[2], uuidBytes[3], uuidBytes[4], uuidBytes[5], uuidBytes[6], uuidBytes[7], uuidBytes[8], uuidBytes[9], uuidBytes[10], uuidBytes[11], uuidBytes[12], uuidBytes[13], uuidBytes[14], uuidBytes[15]);
+
+	char kdfSaltString[64], digestSaltString[64], digestString[64];
+	base64Encode(kdfSalt, sizeof(kdfSalt), kdfSaltString);
+	base64Encode(digestSalt, sizeof(digestSalt), digestSaltString);
+	base64Encode(digest, sizeof(digest), digestString);
+
+	char *json = (char*)metadata + sizeof(struct luks2BinaryHeader);
+	int jsonSize = LUKS2_HEADER_SIZE - sizeof(struct luks2BinaryHeader);
+	int jsonLength = snprintf(json, jsonSize,
+		"{\"keyslots\":{\"0\":{\"type\":\"luks2\",\"key_size\":%u,\"af\":{\"type\":\"luks1\",\"stripes\":%d,\"hash\":\"%s\"},"
+			"\"area\":{\"type\":\"raw\",\"offset\":\"%d\",\"size\":\"%u\",\"encryption\":\"%s\",\"key_size\":%u},"
+			"\"kdf\":{\"type\":\"pbkdf2\",\"hash\":\"%s\",\"iterations\":%" PRIu64 ",\"salt\":\"%s\"}}},"
+		"\"tokens\":{},"
+		"\"segments\":{\"0\":{\"type\":\"crypt\",\"offset\":\"%d\",\"size\":\"dynamic\",\"iv_tweak\":\"0\",\"encryption\":\"%s\",\"sector_size\":%d}},"
+		"\"digests\":{\"0\":{\"type\":\"pbkdf2\",\"keyslots\":[\"0\"],\"segments\":[\"0\"],\"hash\":\"%s\",\"iterations\":%d,\"salt\":\"%s\",\"digest\":\"%s\"}},"
+		"\"config\":{\"json_size\":\"%d\",\"keyslots_size\":\"%d\"}}",
+		keyLength, LUKS2_AF_STRIPES, LUKS2_HASH,
+		LUKS2_KEYSLOTS_OFFSET, areaSize, LUKS2_CIPHER, keyLength,
+		LUKS2_HASH, slotIterations, kdfSaltString,
+		LUKS2_DATA_OFFSET, LUKS2_CIPHER, sectorSize,
+		LUKS2_HASH, LUKS2_DIGEST_ITERATIONS, digestSaltString, digestString,
+		jsonSize, LUKS2_KEYSLOTS_SIZE);
+	if (jsonLength >= jsonSize) {
+		logmsg(LLVL_ERROR, "LUKS2 JSON metadata does not fit into %d bytes.\n", jsonSize);
+		success = false;
+	}
+
+	/* Primary and secondary header, identical apart from magic, offset and
+	 * salt */
+	for (int i = 0; success && (i < 2); i++) {
+		uint8_t *headerData = metadata + (i * LUKS2_HEADER_SIZE);
+		struct luks2BinaryHeader *header = (struct luks2BinaryHeader*)headerData;
+		if (i > 0) {
+			memcpy(headerData + sizeof(struct luks2BinaryHeader), json, jsonSize);
+		}
+		memcpy(header->magic, (i == 0) ? LUKS2_MAGIC : LUKS2_SECONDARY_MAGIC, LUKS2_MAGIC_LEN);
+		putBigEndian(header->version, sizeof(header->version), 2);
+		putBigEndian(header->headerSize, sizeof(header->headerSize), LUKS2_HEADER_SIZE);
+		putBigEndian(header->sequenceId, sizeof(header->sequenceId), 1);
+		strcpy(header->checksumAlgorithm, LUKS2_HASH);
+		strcpy(header->uuid, uuid);
+		putBigEndian(header->headerOffset, sizeof(header->headerOffset), i * LUKS2_HEADER_SIZE);
+
+		uint8_t checksum[EVP_MAX_MD_SIZE];
+		success = readRandomData(header->salt, sizeof(header->salt)) && headerChecksum(headerData, LUKS2_HEADER_SIZE, hash, checksum);
+		memcpy(header->checksum, checksum, EVP_MD_size(hash));
+	}
+
+	success = success && fullPwrite(aFd, metadata, LUKS2_DATA_OFFSET, 0) && (fdatasync(aFd) == 0);
+	if (success) {
+		memset(aTable, 0, sizeof(struct dmCryptTable));
+		strcpy(aTable->cipher, LUKS2_CIPHER);
+		memcpy(aTable->key, volumeKey, keyLength);
+		aTable->keyLength = keyLength;
+		aTable->dataOffset = LUKS2_DATA_OFFSET;
+		aTable->sectorSize = sectorSize;
+		logmsg(LLVL_INFO, "Wrote LUKS2 header with UUID %s (%s, %d bit key, %d byte sectors).\n", uuid, LUKS2_CIPHER, keySize, sectorSize);
+	}
+
+	memset(volumeKey, 0, sizeof(volumeKey));
+	memset(slotKey, 0, sizeof(slotKey));
+	free(metadata);
+	return success;
+}
+
+/* Finds the object that is the value of aKey within aParent. This is not a
+ * general JSON parser, but enough for the compact metadata that cryptsetup
+ * and luks2Format() write. */
+static bool jsonObject(const struct jsonSpan *aParent, const char *aKey, struct jsonSpan *aObject) {
+	char needle[64];
+	int needleLength = snprintf(needle, sizeof(needle), "\"%s\":", aKey);
+	const char *end = aParent->start + aParent->length;
+	for (const char *position = aParent->start; position + needleLength < end; position++) {
+		if (memcmp(position, needle, needleLength)) {
+			continue;
+		}
+		const char *value = position + needleLength;
+		while ((value < end) && (*value == ' ')) {
+			value++;
+		}
+		if ((value == end) || (*value != '{')) {
+			/* Same key with an array or string value, e.g. the segments a
+			 * digest refers to */
+			continue;
+		}
+
+		int depth = 0;
+		bool inString = false;
+		for (const char *scan = value; scan < end; scan++) {
+			if (inString) {
+				if (*scan == '\\') {
+					scan++;
+				} else if (*scan == '"') {
+					inString = false;
+				}
+			} else if (*scan == '"') {
+				inString = true;
+			} else if (*scan == '{') {
+				depth++;
+			} else if ((*scan == '}') && (--depth == 0)) {
+				aObject->start = value;
+				aObject->length = scan - value + 1;
+				return true;
+			}
+		}
+		return false;
+	}
+	return false;
+}
+
+/* Copies the string or number that is the value of aKey within aObject */
+static bool jsonValue(const struct jsonSpan *aObject, const char *aKey, char *aValue, int aValueSize) {
+	char needle[64];
+	int needleLength = snprintf(needle, sizeof(needle), "\"%s\":", aKey);
+	const char *end = aObject->start + aObject->length;
+	for (const char *position = aObject->start; position + needleLength < end; position++) {
+		if (memcmp(position, needle, needleLength)) {
+			continue;
+		}
+		const char *value = position + needleLength;
+		while ((value < end) && (*value == ' ')) {
+			value++;
+		}
+		bool quoted = (value < end) && (*value == '"');
+		if (quoted) {
+			value++;
+		}
+		int length = 0;
+		while ((value + length < end) && (quoted ? (value[length] != '"') : !strchr(",}] ", value[length]))) {
+			length++;
+		}
+		if ((length == 0) || (length >= aValueSize) || (value + length == end)) {
+			return false;
+		}
+		memcpy(aValue, value, length);
+		aValue[length] = 0;
+		return true;
+	}
+	return false;
+}
+
+static bool jsonNumber(const struct jsonSpan *aObject, const char *aKey, uint64_t *aNumber) {
+	char value[LUKS2_JSON_VALUE_SIZE];
+	if (!jsonValue(aObject, aKey, value, sizeof(value))) {
+		return false;
+	}
+	char *endPtr;
+	errno = 0;
+	*aNumber = strtoull(value, &endPtr, 10);
+	return (errno == 0) && (*endPtr == 0);
+}
+
+/* Reads the header at aOffset and checks magic, size and checksum. The JSON
+ * area is returned NUL terminated. */
+static uint8_t *readHeader(int aFd, uint64_t aOffset) {
+	struct luks2BinaryHeader binaryHeader;
+	if (!fullPread(aFd, (uint8_t*)&binaryHeader, sizeof(binaryHeader), aOffset)) {
+		return NULL;
+	}
+	uint64_t headerSize = getBigEndian(binaryHeader.headerSize, sizeof(binaryHeader.headerSize));
+	if (memcmp(binaryHeader.magic, (aOffset == 0) ? LUKS2_MAGIC : LUKS2_SECONDARY_MAGIC, LUKS2_MAGIC_LEN) || (getBigEndian(binaryHeader.version, sizeof(binaryHeader.version)) != 2)) {
+		logmsg(LLVL_DEBUG, "No LUKS2 header at offset %" PRIu64 ".\n", aOffset);
+		return NULL;
+	}
+	if ((headerSize < LUKS2_HEADER_SIZE) || (headerSize > LUKS2_MAX_HEADER_SIZE) || (getBigEndian(binaryHeader.headerOffset, sizeof(binaryHeader.headerOffset)) != aOffset)) {
+		logmsg(LLVL_WARN, "LUKS2 header at offset %" PRIu64 " is invalid (size %" PRIu64 " bytes).\n", aOffset, headerSize);
+		return NULL;
+	}
+
+	binaryHeader.checksumAlgorithm[sizeof(binaryHeader.checksumAlgorithm) - 1] = 0;
+	const EVP_MD *hash = EVP_get_digestbyname(binaryHeader.checksumAlgorithm);
+	uint8_t *header = malloc(headerSize);
+	if ((!hash) || (!header)) {
+		logmsg(LLVL_WARN, "Cannot verify LUKS2 header at offset %" PRIu64 " (checksum %s).\n", aOffset, binaryHeader.checksumAlgorithm);
+		free(header);
+		return NULL;
+	}
+
+	uint8_t checksum[EVP_MAX_MD_SIZE];
+	if (!fullPread(aFd, header, headerSize, aOffset) || !headerChecksum(header, headerSize, hash, checksum) || memcmp(checksum, ((struct luks2BinaryHeader*)header)->checksum, EVP_MD_size(hash))) {
+		logmsg(LLVL_WARN, "Checksum of LUKS2 header at offset %" PRIu64 " does not match.\n", aOffset);
+		free(header);
+		return NULL;
+	}
+	header[headerSize - 1] = 0;
+	return header;
+}
+
+/* Reads the LUKS2 header from aFd (the secondary one if the primary is
+ * damaged) and opens keyslot 0 with the passphrase. The dm-crypt parameters
+ * of the data segment and the volume key are stored in aTable. Only PBKDF2
+ * keyslots can be opened, like the ones luks2Format() creates. */
+bool luks2Unlock(int aFd, const uint8_t *aPassphrase, uint32_t aPassphraseLength, struct dmCryptTable *aTable) {
+	uint8_t *header = readHeader(aFd, 0);
+	if (!header) {
+		header = readHeader(aFd, LUKS2_HEADER_SIZE);
+		if (!header) {
+			logmsg(LLVL_ERROR, "No valid LUKS2 header found.\n");
+			return false;
+		}
+		logmsg(LLVL_WARN, "Primary LUKS2 header is damaged, using the secondary one.\n");
+	}
+
+	const char *json = (const char*)header + sizeof(struct luks2BinaryHeader);
+	struct jsonSpan root = { .start = json, .length = strlen(json) };
+	struct jsonSpan keyslots, keyslot, area, kdf, af, segments, segment, digests, digestObject;
+	if (!jsonObject(&root, "keyslots", &keyslots) || !jsonObject(&keyslots, "0", &keyslot) || !jsonObject(&keyslot, "area", &area) || !jsonObject(&keyslot, "kdf", &kdf) || !jsonObject(&keyslot, "af", &af)
+			|| !jsonObject(&root, "segments", &segments) || !jsonObject(&segments, "0", &segment) || !jsonObject(&root, "digests", &digests) || !jsonObject(&digests, "0", &digestObject)) {
+		logmsg(LLVL_ERROR, "LUKS2 header has no keyslot 0, segment 0 or digest 0.\n");
+		free(header);
+		return false;
+	}
+
+	char kdfType[LUKS2_JSON_VALUE_SIZE], kdfHash[LUKS2_JSON_VALUE_SIZE], kdfSaltString[LUKS2_JSON_VALUE_SIZE];
+	char afType[LUKS2_JSON_VALUE_SIZE], afHash[LUKS2_JSON_VALUE_SIZE], areaEncryption[LUKS2_JSON_VALUE_SIZE], segmentEncryption[LUKS2_JSON_VALUE_SIZE];
+	char digestType[LUKS2_JSON_VALUE_SIZE], digestHash[LUKS2_JSON_VALUE_SIZE], digestSaltString[LUKS2_JSON_VALUE_SIZE], digestString[LUKS2_JSON_VALUE_SIZE];
+	uint64_t keySize, areaKeySize, areaOffset, areaSize, stripes, kdfIterations, segmentOffset, ivTweak, sectorSize, digestIterations;
+	bool parsed = jsonValue(&kdf, "type", kdfType, sizeof(kdfType)) && jsonValue(&af, "type", afType, sizeof(afType)) && jsonValue(&digestObject, "type", digestType, sizeof(digestType));
+	if (parsed && (strcmp(kdfType, "pbkdf2") || strcmp(afType, "luks1") || strcmp(digestType, "pbkdf2"))) {
+		logmsg(LLVL_ERROR, "Keyslot 0 uses %s (anti-forensic splitter %s, digest %s), but only pbkdf2 keyslots can be opened without cryptsetup.\n", kdfType, afType, digestType);
+		free(header);
+		return false;
+	}
+	parsed = parsed && jsonValue(&kdf, "hash", kdfHash, sizeof(kdfHash)) && jsonValue(&kdf, "salt", kdfSaltString, sizeof(kdfSaltString)) && jsonNumber(&kdf, "iterations", &kdfIterations);
+	parsed = parsed && jsonValue(&af, "hash", afHash, sizeof(afHash)) && jsonNumber(&af, "stripes", &stripes) && jsonNumber(&keyslot, "key_size", &keySize);
+	parsed = parsed && jsonValue(&area, "encryption", areaEncryption, sizeof(areaEncryption)) && jsonNumber(&area, "key_size", &areaKeySize) && jsonNumber(&area, "offset", &areaOffset) && jsonNumber(&area, "size", &areaSize);
+	parsed = parsed && jsonValue(&segment, "encryption", segmentEncryption, sizeof(segmentEncryption)) && jsonNumber(&segment, "offset", &segmentOffset) && jsonNumber(&segment, "iv_tweak", &ivTweak) && jsonNumber(&segment, "sector_size", &sectorSize);
+	parsed = parsed && jsonValue(&digestObject, "hash", digestHash, sizeof(digestHash)) && jsonValue(&digestObject, "salt", digestSaltString, sizeof(digestSaltString)) && jsonValue(&digestObject, "digest", digestString, sizeof(digestString)) && jsonNumber(&digestObject, "iterations", &digestIterations);
+	free(header);
+	if (!parsed) {
+		logmsg(LLVL_ERROR, "LUKS2 header lacks keyslot, segment or digest parameters.\n");
+		return false;
+	}
+
+	const EVP_MD *kdfMd = EVP_get_digestbyname(kdfHash);
+	const EVP_MD *afMd = EVP_get_digestbyname(afHash);
+	const EVP_MD *digestMd = EVP_get_digestbyname(digestHash);
+	uint8_t kdfSalt[LUKS2_JSON_VALUE_SIZE], digestSalt[LUKS2_JSON_VALUE_SIZE], storedDigest[LUKS2_JSON_VALUE_SIZE];
+	int kdfSaltLength = base64Decode(kdfSaltString, kdfSalt, sizeof(kdfSalt));
+	int digestSaltLength = base64Decode(digestSaltString, digestSalt, sizeof(digestSalt));
+	int digestLength = base64Decode(digestString, storedDigest, sizeof(storedDigest));
+	if ((!kdfMd) || (!afMd) || (!digestMd) || (kdfSaltLength <= 0) || (digestSaltLength <= 0) || (digestLength <= 0) || (digestLength > EVP_MAX_MD_SIZE)) {
+		logmsg(LLVL_ERROR, "Unsupported hash (%s, %s, %s) or invalid salt in LUKS2 header.\n", kdfHash, afHash, digestHash);
+		return false;
+	}
+	if (strcmp(areaEncryption, LUKS2_CIPHER) || ((areaKeySize != 32) && (areaKeySize != 64)) || (keySize > LUKS2_MAX_KEY_SIZE) || (stripes < 1) || (keySize * stripes > areaSize) || (areaSize > LUKS2_KEYSLOTS_SIZE)) {
+		logmsg(LLVL_ERROR, "Unsupported keyslot: %s area with %" PRIu64 " bit key, %" PRIu64 " bit volume key in %" PRIu64 " stripes.\n", areaEncryption, areaKeySize * 8, keySize * 8, stripes);
+		return false;
+	}
+	if ((sectorSize < 512) || (sectorSize > 4096) || (sectorSize & (sectorSize - 1))) {
+		logmsg(LLVL_ERROR, "Unsupported encryption sector size of %" PRIu64 " bytes.\n", sectorSize);
+		return false;
+	}
+
+	uint32_t materialLength = (keySize * stripes + LUKS2_AREA_SECTOR_SIZE - 1) / LUKS2_AREA_SECTOR_SIZE * LUKS2_AREA_SECTOR_SIZE;
+	uint8_t *material = malloc(materialLength);
+	if (!material) {
+		logmsg(LLVL_ERROR, "Cannot allocate keyslot material: %s\n", strerror(errno));
+		return false;
+	}
+	uint8_t slotKey[LUKS2_MAX_KEY_SIZE];
+	uint8_t volumeKey[LUKS2_MAX_KEY_SIZE];
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	bool success = fullPread(aFd, material, materialLength, areaOffset);
+	success = success && pbkdf2(aPassphrase, aPassphraseLength, kdfSalt, kdfSaltLength, kdfIterations, kdfMd, slotKey, areaKeySize);
+	success = success && cryptKeyslotArea(slotKey, areaKeySize, false, material, material, materialLength);
+	success = success && afMerge(afMd, material, keySize, stripes, volumeKey);
+	success = success && pbkdf2(volumeKey, keySize, digestSalt, digestSaltLength, digestIterations, digestMd, digest, digestLength);
+	memset(material, 0, materialLength);
+	free(material);
+	memset(slotKey, 0, sizeof(slotKey));
+	if (!success) {
+		logmsg(LLVL_ERROR, "Cannot read or decrypt LUKS2 keyslot 0.\n");
+		memset(volumeKey, 0, sizeof(volumeKey));
+		return false;
+	}
+	if (CRYPTO_memcmp(digest, storedDigest, digestLength)) {
+		logmsg(LLVL_ERROR, "Key file does not unlock keyslot 0 of the LUKS2 header.\n");
+		memset(volumeKey, 0, sizeof(volumeKey));
+		return false;
+	}
+
+	memset(aTable, 0, sizeof(struct dmCryptTable));
+	if (!safestrcpy(aTable->cipher, segmentEncryption, sizeof(aTable->cipher))) {
+		memset(volumeKey, 0, sizeof(volumeKey));
+		return false;
+	}
+	memcpy(aTable->key, volumeKey, keySize);
+	memset(volumeKey, 0, sizeof(volumeKey));
+	aTable->keyLength = keySize;
+	aTable->ivOffset = ivTweak;
+	aTable->dataOffset = segmentOffset;
+	aTable->sectorSize = sectorSize;
+	logmsg(LLVL_DEBUG, "Unlocked LUKS2 keyslot 0: %s, %d bit key, data offset %" PRIu64 ", %d byte sectors\n", aTable->cipher, aTable->keyLength * 8, aTable->dataOffset, aTable->sectorSize);
+	return true;
+}
+
+#else
+
+bool luks2Format(int aFd, const uint8_t *aPassphrase, uint32_t aPassphraseLength, const char *aCipher, int aKeySize, int aSectorSize, struct dmCryptTable *aTable) {
+	(void)aFd;
+	(void)aPassphrase;
+	(void)aPassphraseLength;
+	(void)aCipher;
+	(void)aKeySize;
+	(void)aSectorSize;
+	(void)aTable;
+	logmsg(LLVL_ERROR, "luksipc was built without userspace encryption support (build with 'make USERSPACE_CRYPTO=1').\n");
+	return false;
+}
+
+bool luks2Unlock(int aFd, const uint8_t *aPassphrase, uint32_t aPassphraseLength, struct dmCryptTable *aTable) {
+	(void)aFd;
+	(void)aPassphrase;
+	(void)aPassphraseLength;
+	(void)aTable;
+	logmsg(LLVL_ERROR, "luksipc was built without userspace encryption support (build with 'make USERSPACE_CRYPTO=1').\n");
+	return false;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __LUKS2_H__
+#define __LUKS2_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "luks.h"
+
+#define LUKS2_HEADER_SIZE			(16 * 1024)				/* Binary header and JSON area, stored twice */
+#define LUKS2_DATA_OFFSET			(16 * 1024 * 1024)		/* Same as cryptsetup's default */
+
+/* Binary part of a LUKS2 header as found on disk, followed by the JSON area.
+ * All integers are big endian. The checksum covers the binary header (with
+ * the checksum zeroed) and the JSON area. */
+struct luks2BinaryHeader {
+	char magic[6];
+	uint8_t version[2];
+	uint8_t headerSize[8];
+	uint8_t sequenceId[8];
+	char label[48];
+	char checksumAlgorithm[32];
+	uint8_t salt[64];
+	char uuid[40];
+	char subsystem[48];
+	uint8_t headerOffset[8];
+	uint8_t padding[184];
+	uint8_t checksum[64];
+	uint8_t padding4096[7 * 512];
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool hasLuksMagic(const char *aPath);
+bool luks2Format(int aFd, const uint8_t *aPassphrase, uint32_t aPassphraseLength, const char *aCipher, int aKeySize, int aSectorSize, struct dmCryptTable *aTable);
+bool luks2Unlock(int aFd, const uint8_t *aPassphrase, uint32_t aPassphraseLength, struct dmCryptTable *aTable);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
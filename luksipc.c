@@ -44,202 +44,39 @@
 #include "keyfile.h"
 #include "utils.h"
 #include "globals.h"
-#include "mount.h"
+#include "preflight.h"
 #include "exit.h"
 #include "random.h"
+#include "scheduler.h"
+#include "affinity.h"
+#include "cryptengine.h"
+#include "loop.h"
+#include "engine.h"
+#include "crashpoint.h"
+#include "probes.h"
+#include "trace.h"
+#include "dryrun.h"
+#include "throughput.h"
+#include "iostats.h"
+#include "recover.h"
+#include "batchio.h"
+#include "spill.h"
+#include "cipherbench.h"
+#include "cryptmap.h"
+#include "rollback.h"
+#include "fillrandom.h"
+#include "lukstarget.h"
+#include "luks2.h"
 
 #define staticassert(cond)				_Static_assert(cond, #cond)
 
 /* Assert that lseek(2) has 64-bit file offsets */
 staticassert(sizeof(off_t) == 8);
 
-
-#define REMAINING_BYTES(aconvptr)		(((aconvptr)->endOutOffset) - ((aconvptr)->outOffset))
-
-struct conversionProcess {
-	int readDevFd, writeDevFd;
-	uint64_t readDevSize, writeDevSize;
-	struct chunk dataBuffer[2];
-	int usedBufferIndex;
-	int resumeFd;
-	char *rawDeviceAlias;
-	bool reluksification;
-	uint64_t inOffset, outOffset;
-	uint64_t endOutOffset;
-	char *writeDeviceHandle;
-	char writeDevicePath[48];
-
-	struct {
-		double startTime;
-		double lastShowTime;
-		uint64_t lastOutOffset;
-		uint64_t copied;
-	} stats;
-};
-
-enum copyResult_t {
-	COPYRESULT_SUCCESS_FINISHED,
-	COPYRESULT_SUCCESS_RESUMABLE,
-	COPYRESULT_ERROR_WRITING_RESUME_FILE,
-};
-
-static bool checkedWrite(int aFd, void *aData, int aLength) {
-	ssize_t result = write(aFd, aData, aLength);
-	if (result != aLength) {
-		logmsg(LLVL_ERROR, "Error while trying to write %d bytes to file with FD #%d: only %ld bytes written: %s\n", aLength, aFd, result, strerror(errno));
-		return false;
-	}
-	return true;
-}
-
-static bool checkedRead(int aFd, void *aData, int aLength) {
-	ssize_t result = read(aFd, aData, aLength);
-	if (result != aLength) {
-		logmsg(LLVL_ERROR, "Error while trying to read %d bytes from file with FD #%d: only %ld bytes read: %s\n", aLength, aFd, result, strerror(errno));
-		return false;
-	}
-	return true;
-}
-
-static bool writeResumeFile(struct conversionProcess *aConvProcess) {
-	bool success = true;
-	char header[RESUME_FILE_HEADER_MAGIC_LEN];
-	memcpy(header, RESUME_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN);
-	success = (lseek(aConvProcess->resumeFd, 0, SEEK_SET) != -1) && success;
-	success = checkedWrite(aConvProcess->resumeFd, header, sizeof(header)) && success;
-	success = checkedWrite(aConvProcess->resumeFd, &aConvProcess->outOffset, sizeof(uint64_t)) && success;
-	success = checkedWrite(aConvProcess->resumeFd, &aConvProcess->readDevSize, sizeof(uint64_t)) && success;
-	success = checkedWrite(aConvProcess->resumeFd, &aConvProcess->writeDevSize, sizeof(uint64_t)) && success;
-	success = checkedWrite(aConvProcess->resumeFd, &aConvProcess->reluksification, sizeof(bool)) && success;
-	success = checkedWrite(aConvProcess->resumeFd, &aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used, sizeof(uint32_t)) && success;
-	success = checkedWrite(aConvProcess->resumeFd, aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].data, aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].size) && success;
-	fsync(aConvProcess->resumeFd);
-	logmsg(LLVL_DEBUG, "Wrote resume file: read pointer offset %" PRIu64 " write pointer offset %" PRIu64 ", %" PRIu64 " bytes of data in active buffer.\n", aConvProcess->inOffset, aConvProcess->outOffset, aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used);
-	return success;
-}
-
-static bool readResumeFile(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
-	bool success = true;
-	char header[RESUME_FILE_HEADER_MAGIC_LEN];
-	success = (lseek(aConvProcess->resumeFd, 0, SEEK_SET) != -1) && success;
-	if (!success) {
-		logmsg(LLVL_ERROR, "Seek error while trying to read resume file: %s\n", strerror(errno));
-		return false;
-	}
-
-	success = checkedRead(aConvProcess->resumeFd, header, sizeof(header)) && success;
-	if (!success) {
-		logmsg(LLVL_ERROR, "Read error while trying to read resume file header.\n");
-		return false;
-	}
-
-	if (memcmp(header, RESUME_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN) != 0) {
-		logmsg(LLVL_ERROR, "Header magic mismatch in resume file.\n");
-		return false;
-	}
-
-	uint64_t origReadDevSize, origWriteDevSize;
-	bool origReluksification;
-	success = checkedRead(aConvProcess->resumeFd, &aConvProcess->outOffset, sizeof(uint64_t)) && success;
-	success = checkedRead(aConvProcess->resumeFd, &origReadDevSize, sizeof(uint64_t)) && success;
-	success = checkedRead(aConvProcess->resumeFd, &origWriteDevSize, sizeof(uint64_t)) && success;
-	success = checkedRead(aConvProcess->resumeFd, &origReluksification, sizeof(bool)) && success;
-
-	if (!success) {
-		logmsg(LLVL_ERROR, "Read error while trying to read resume file offset metadata.\n");
-		return false;
-	}
-
-	if (origReadDevSize != aConvProcess->readDevSize) {
-		if (aParameters->safetyChecks) {
-			logmsg(LLVL_ERROR, "Resume file used read device of size %" PRIu64 " bytes, but currently read device size is %" PRIu64 " bytes. Refusing to continue in spite of mismatch.\n", origReadDevSize, aConvProcess->readDevSize);
-			return false;
-		} else {
-			logmsg(LLVL_WARN, "Resume file used read device of size %" PRIu64 " bytes, but currently read device size is %" PRIu64 " bytes. Continuing only because safety checks are disabled.\n", origReadDevSize, aConvProcess->readDevSize);
-		}
-	}
-	if (origWriteDevSize != aConvProcess->writeDevSize) {
-		if (aParameters->safetyChecks) {
-			logmsg(LLVL_ERROR, "Resume file used write device of size %" PRIu64 " bytes, but currently write device size is %" PRIu64 " bytes. Refusing to continue in spite of mismatch.\n", origWriteDevSize, aConvProcess->writeDevSize);
-			return false;
-		} else {
-			logmsg(LLVL_WARN, "Resume file used write device of size %" PRIu64 " bytes, but currently write device size is %" PRIu64 " bytes. Continuing only because safety checks are disabled.\n", origWriteDevSize, aConvProcess->writeDevSize);
-		}
-	}
-	if (origReluksification != aConvProcess->reluksification) {
-		if (aParameters->safetyChecks) {
-			logmsg(LLVL_ERROR, "Resume file was performing reLUKSification, command line specification indicates you do not want reLUKSification. Refusing to continue in spite of mismatch.\n");
-			return false;
-		} else {
-			logmsg(LLVL_WARN, "Resume file was performing reLUKSification, command line specification indicates you do not want reLUKSification. Continuing only because safety checks are disabled.\n");
-		}
-	}
-
-	logmsg(LLVL_DEBUG, "Read write pointer offset %" PRIu64 " from resume file.\n", aConvProcess->outOffset);
-
-	aConvProcess->usedBufferIndex = 0;
-	success = checkedRead(aConvProcess->resumeFd, &aConvProcess->dataBuffer[0].used, sizeof(uint32_t)) && success;
-	success = checkedRead(aConvProcess->resumeFd, aConvProcess->dataBuffer[0].data, aConvProcess->dataBuffer[0].used) && success;
-
-	return success;
-}
-
-static void showProgress(struct conversionProcess *aConvProcess) {
-	double curTime = getTime();
-	if (aConvProcess->stats.startTime < 1) {
-		aConvProcess->stats.startTime = curTime;
-		aConvProcess->stats.lastOutOffset = aConvProcess->outOffset;
-		aConvProcess->stats.lastShowTime = curTime;
-	} else {
-		uint64_t progressBytes = aConvProcess->outOffset - aConvProcess->stats.lastOutOffset;
-		double progressTime = curTime - aConvProcess->stats.lastShowTime;
-
-		bool showStats = ((progressBytes >= 100 * 1024 * 1024) && (progressTime >= 5));
-		showStats = showStats || (progressTime >= 60);
-
-		if (showStats) {
-			double runtimeSeconds = curTime - aConvProcess->stats.startTime;
-			int runtimeSecondsInteger = (int)runtimeSeconds;
-
-			double copySpeedBytesPerSecond = 0;
-			if (runtimeSeconds > 1) {
-				copySpeedBytesPerSecond = (double)aConvProcess->stats.copied / runtimeSeconds;
-			}
-
-			uint64_t remainingBytes = aConvProcess->endOutOffset - aConvProcess->outOffset;
-
-			double remainingSecs = 0;
-			if (copySpeedBytesPerSecond > 10) {
-				remainingSecs = (double)remainingBytes / copySpeedBytesPerSecond;
-			}
-			int remainingSecsInteger = 0;
-			if ((remainingSecs > 0) && (remainingSecs < (100 * 3600))) {
-				remainingSecsInteger = (int)remainingSecs;
-			}
-
-			logmsg(LLVL_INFO, "%2d:%02d: "
-							"%5.1f%%   "
-							"%7" PRIu64 " MiB / %" PRIu64 " MiB   "
-							"%5.1f MiB/s   "
-							"Left: "
-							"%7" PRIu64 " MiB "
-							"%2d:%02d h:m"
-							"\n",
-								runtimeSecondsInteger / 3600, runtimeSecondsInteger % 3600 / 60,
-								100.0 * (double)aConvProcess->outOffset / (double)aConvProcess->endOutOffset,
-								aConvProcess->outOffset / 1024 / 1024,
-								aConvProcess->endOutOffset / 1024 / 1024,
-								copySpeedBytesPerSecond / 1024. / 1024.,
-								remainingBytes / 1024 / 1024,
-								remainingSecsInteger / 3600, remainingSecsInteger % 3600 / 60
-			);
-			aConvProcess->stats.lastOutOffset = aConvProcess->outOffset;
-			aConvProcess->stats.lastShowTime = curTime;
-		}
-	}
-}
-
 static void closeFileDescriptorsAndSync(struct conversionProcess *aConvProcess) {
+	cryptEngineFree(aConvProcess->cryptEngine);
+	aConvProcess->cryptEngine = NULL;
+
 	logmsg(LLVL_DEBUG, "Closing read/write file descriptors %d and %d.\n", aConvProcess->readDevFd, aConvProcess->writeDevFd);
 	close(aConvProcess->readDevFd);
 	close(aConvProcess->writeDevFd);
@@ -247,108 +84,16 @@ static void closeFileDescriptorsAndSync(struct conversionProcess *aConvProcess)
 	aConvProcess->writeDevFd = -1;
 
 	logmsg(LLVL_INFO, "Synchronizing disk...\n");
+	CRASHPOINT("sync");
 	sync();
+	CRASHPOINT("synced");
 	logmsg(LLVL_INFO, "Synchronizing of disk finished.\n");
 }
 
-static enum copyResult_t issueGracefulShutdown(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
-	logmsg(LLVL_INFO, "Gracefully shutting down.\n");
-	if (!writeResumeFile(aConvProcess)) {
-		logmsg(LLVL_WARN, "There were errors writing the resume file %s.\n", aParameters->resumeFilename);
-		return COPYRESULT_ERROR_WRITING_RESUME_FILE;
-	} else {
-		logmsg(LLVL_INFO, "Successfully written resume file %s.\n", aParameters->resumeFilename);
-		return COPYRESULT_SUCCESS_RESUMABLE;
-	}
-}
-
-static enum copyResult_t startDataCopy(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
-	logmsg(LLVL_INFO, "Starting copying of data, read offset %" PRIu64 ", write offset %" PRIu64 "\n", aConvProcess->inOffset, aConvProcess->outOffset);
-	while (true) {
-		ssize_t bytesTransferred;
-		int unUsedBufferIndex = (1 - aConvProcess->usedBufferIndex);
-		int bytesToRead;
-
-#ifdef DEVELOPMENT
-		if (aParameters->dev.slowDown) {
-			usleep(500 * 1000);
-		}
-#endif
-
-		if (REMAINING_BYTES(aConvProcess) - (aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used) < aConvProcess->dataBuffer[unUsedBufferIndex].size) {
-			/* Remaining is not a full chunk */
-			bytesToRead = REMAINING_BYTES(aConvProcess) - (aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used);
-			if (bytesToRead > 0) {
-				logmsg(LLVL_DEBUG, "Preparing to write last (partial) chunk of %d bytes.\n", bytesToRead);
-			}
-		} else {
-			bytesToRead = aConvProcess->dataBuffer[unUsedBufferIndex].size;
-		}
-		if (bytesToRead > 0) {
-#ifdef DEVELOPMENT
-			if (aParameters->dev.ioErrors) {
-				bytesTransferred = unreliableChunkReadAt(&aConvProcess->dataBuffer[unUsedBufferIndex], aConvProcess->readDevFd, aConvProcess->inOffset, bytesToRead);
-			} else {
-				bytesTransferred = chunkReadAt(&aConvProcess->dataBuffer[unUsedBufferIndex], aConvProcess->readDevFd, aConvProcess->inOffset, bytesToRead);
-			}
-#else
-			bytesTransferred = chunkReadAt(&aConvProcess->dataBuffer[unUsedBufferIndex], aConvProcess->readDevFd, aConvProcess->inOffset, bytesToRead);
-#endif
-			if (bytesTransferred == -1) {
-				/* Error reading from device, handle this! */
-				logmsg(LLVL_ERROR, "Error reading from device at offset 0x%lx, will shutdown.\n", aConvProcess->inOffset);
-				issueSigQuit();
-			} else if (bytesTransferred > 0) {
-				aConvProcess->inOffset += aConvProcess->dataBuffer[unUsedBufferIndex].used;
-			} else {
-				logmsg(LLVL_WARN, "Read of %d transferred %d hit EOF at inOffset = %ld remaining = %ld\n", bytesToRead, bytesTransferred, aConvProcess->inOffset, REMAINING_BYTES(aConvProcess));
-			}
-		} else {
-			if (bytesToRead == 0) {
-				logmsg(LLVL_DEBUG, "No more bytes to read, will finish writing last partial chunk of %d bytes.\n", REMAINING_BYTES(aConvProcess));
-			} else {
-				logmsg(LLVL_WARN, "Odd: %d bytes to read at inOffset = %ld remaining = %ld\n", bytesToRead, aConvProcess->inOffset, REMAINING_BYTES(aConvProcess));
-			}
-		}
-
-		if (receivedSigQuit()) {
-			return issueGracefulShutdown(aParameters, aConvProcess);
-		}
-
-		if (REMAINING_BYTES(aConvProcess) < aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used) {
-			/* Remaining is not a full chunk */
-			aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used = REMAINING_BYTES(aConvProcess);
-		}
-
-#ifdef DEVELOPMENT
-		if (aParameters->dev.ioErrors) {
-			bytesTransferred = unreliableChunkWriteAt(&aConvProcess->dataBuffer[aConvProcess->usedBufferIndex], aConvProcess->writeDevFd, aConvProcess->outOffset);
-		} else {
-			bytesTransferred = chunkWriteAt(&aConvProcess->dataBuffer[aConvProcess->usedBufferIndex], aConvProcess->writeDevFd, aConvProcess->outOffset);
-		}
-#else
-		bytesTransferred = chunkWriteAt(&aConvProcess->dataBuffer[aConvProcess->usedBufferIndex], aConvProcess->writeDevFd, aConvProcess->outOffset);
-#endif
-		if (bytesTransferred == -1) {
-			logmsg(LLVL_ERROR, "Error writing to device at offset 0x%lx, shutting down.\n", aConvProcess->outOffset);
-			return issueGracefulShutdown(aParameters, aConvProcess);
-		} else if (bytesTransferred > 0) {
-			aConvProcess->outOffset += bytesTransferred;
-			aConvProcess->stats.copied += bytesTransferred;
-			showProgress(aConvProcess);
-			if (aConvProcess->outOffset == aConvProcess->endOutOffset) {
-				logmsg(LLVL_INFO, "Disk copy completed successfully.\n");
-				return COPYRESULT_SUCCESS_FINISHED;
-			}
-
-			aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used = 0;
-			aConvProcess->usedBufferIndex = unUsedBufferIndex;
-		}
-	}
-}
-
 static bool openResumeFile(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
-	bool createResumeFile = (!aParameters->resuming);
+	/* When recovering, the resume file is rewritten from what is found on the
+	 * device */
+	bool createResumeFile = (!aParameters->resuming) || aParameters->recover;
 	int openFlags = createResumeFile ? (O_TRUNC | O_WRONLY | O_CREAT) : O_RDWR;
 
 	/* Open resume file */
@@ -433,16 +178,6 @@ static bool plausibilizeReadWriteDeviceSizes(struct conversionParameters const *
 	return true;
 }
 
-static bool initializeDeviceAlias(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
-	aConvProcess->rawDeviceAlias = dmCreateDynamicAlias(aParameters->rawDevice, "luksipc_raw");
-	if (!aConvProcess->rawDeviceAlias) {
-		logmsg(LLVL_ERROR, "Unable to initialize raw device alias.\n");
-		return false;
-	}
-	logmsg(LLVL_INFO, "Created raw device alias: %s -> %s\n", aParameters->rawDevice, aConvProcess->rawDeviceAlias);
-	return true;
-}
-
 static bool backupPhysicalDisk(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
 	logmsg(LLVL_INFO, "Backing up physical disk %s header to backup file %s\n", aParameters->rawDevice, aParameters->backupFile);
 
@@ -455,42 +190,9 @@ static bool backupPhysicalDisk(struct conversionParameters const *aParameters, s
 		}
 	}
 
-	/* Open raw disk for reading (cannot use aConvProcess->readDevFd here since
-	 * we might be doing reLUKSification) */
-	int readFd = open(aParameters->rawDevice, O_RDONLY);
-	if (readFd == -1) {
-		logmsg(LLVL_ERROR, "Opening raw disk device %s for reading failed: %s\n", aParameters->rawDevice, strerror(errno));
-		return false;
-	}
-
-	/* Open backup file */
-	int writeFd = open(aParameters->backupFile, O_TRUNC | O_WRONLY | O_CREAT, 0600);
-	if (writeFd == -1) {
-		logmsg(LLVL_ERROR, "Opening backup file %s for writing failed: %s\n", aParameters->backupFile, strerror(errno));
-		return false;
-	}
-
-	/* Determine the amount of blocks that need to be copied */
-	int copyBlockCount = (HEADER_BACKUP_SIZE_BYTES < aConvProcess->readDevSize) ? HEADER_BACKUP_BLOCKCNT : (aConvProcess->readDevSize / HEADER_BACKUP_BLOCKSIZE);
-	logmsg(LLVL_DEBUG, "Backup file %s will consist of %d blocks of %d bytes each (%d bytes total, %d kiB)\n", aParameters->backupFile, copyBlockCount, HEADER_BACKUP_BLOCKSIZE, copyBlockCount * HEADER_BACKUP_BLOCKSIZE, copyBlockCount * HEADER_BACKUP_BLOCKSIZE / 1024);
-
-	/* Start copying */
-	uint8_t copyBuffer[HEADER_BACKUP_BLOCKSIZE];
-	for (int i = 0; i < copyBlockCount; i++) {
-		if (!checkedRead(readFd, copyBuffer, HEADER_BACKUP_BLOCKSIZE)) {
-			logmsg(LLVL_ERROR, "Read failed when trying to copy to backup file: %s\n", strerror(errno));
-			return false;
-		}
-		if (!checkedWrite(writeFd, copyBuffer, HEADER_BACKUP_BLOCKSIZE)) {
-			logmsg(LLVL_ERROR, "Write failed when trying to copy to backup file: %s\n", strerror(errno));
-			return false;
-		}
-	}
-
-	fsync(writeFd);
-	close(writeFd);
-	close(readFd);
-	return true;
+	/* Cannot use aConvProcess->readDevFd here since we might be doing
+	 * reLUKSification */
+	return backupDeviceHeader(aParameters->rawDevice, aConvProcess->readDevSize, aParameters->backupFile);
 }
 
 static bool generateRandomizedWriteHandle(struct conversionProcess *aConvProcess) {
@@ -503,13 +205,52 @@ static bool generateRandomizedWriteHandle(struct conversionProcess *aConvProcess
 	return true;
 }
 
+/* Marks the transition into the next phase of convert() for tracing; the
+ * probe carries the duration of the phase that just ended */
+static void enterPhase(struct conversionParameters const *aParameters, struct ioStats *aIoStats, const char *aPhase, uint64_t *aPhaseStartTime) {
+	ioStatsPhase(aIoStats, aPhase);
+	if (PROBE_ENABLED(phase)) {
+		uint64_t now = probeTimestamp();
+		PROBE3(phase, aParameters->rawDevice, aPhase, (*aPhaseStartTime) ? (now - *aPhaseStartTime) : 0);
+		*aPhaseStartTime = now;
+	}
+}
+
 static void convert(struct conversionParameters const *parameters) {
 	/* Initialize conversion process status */
 	struct conversionProcess convProcess;
 	memset(&convProcess, 0, sizeof(struct conversionProcess));
+	uint64_t phaseStartTime = 0;
+	struct ioStats ioStats;
+	ioStatsInit(&ioStats);
+	convProcess.ioStats = &ioStats;
+	enterPhase(parameters, &ioStats, "prepare", &phaseStartTime);
+	double convertStartTime = getTime();
+
+	/* Image files are converted through a loop device that is attached for
+	 * the duration of the conversion, unless the userspace LUKS target
+	 * accesses them directly */
+	initLuksTarget(&convProcess.luksTarget, parameters->luksTarget);
+	struct conversionParameters loopParameters;
+	if ((parameters->luksTarget == LUKSTARGET_DMCRYPT) && isRegularFile(parameters->rawDevice)) {
+		const char *loopDevice = loopAttach(parameters->rawDevice);
+		if (!loopDevice) {
+			terminate(EC_CANNOT_ATTACH_LOOP_DEVICE);
+		}
+		loopParameters = *parameters;
+		loopParameters.rawDevice = loopDevice;
+		if (!parameters->reluksification) {
+			loopParameters.readDevice = loopDevice;
+		}
+		parameters = &loopParameters;
+	}
+	ioStatsAddDevice(&ioStats, "raw", parameters->rawDevice);
+	if (parameters->reluksification) {
+		ioStatsAddDevice(&ioStats, "read", parameters->readDevice);
+	}
 
 	/* Generate a randomized conversion handle */
-	if (!generateRandomizedWriteHandle(&convProcess)) {
+	if ((parameters->luksTarget == LUKSTARGET_DMCRYPT) && !generateRandomizedWriteHandle(&convProcess)) {
 		terminate(EC_CANNOT_GENERATE_WRITE_HANDLE);
 	}
 
@@ -517,10 +258,14 @@ static void convert(struct conversionParameters const *parameters) {
 	 * reLUKSification, but basically are a noop if not using reLUKSification.
 	 * To keep the code as simple as possible, we only want to have one case
 	 * here */
-	if (!initializeDeviceAlias(parameters, &convProcess)) {
+	if (!convProcess.luksTarget.prepare(parameters, &convProcess)) {
 		terminate(EC_CANNOT_INITIALIZE_DEVICE_ALIAS);
 	}
 
+	/* Move close to the device's controller before the chunks are allocated
+	 * (and thereby touched for the first time) */
+	placeOnDeviceNumaNode(parameters->rawDevice, parameters->numaNode);
+
 	/* Allocate two block chunks */
 	for (int i = 0; i < 2; i++) {
 		if (!allocChunk(&convProcess.dataBuffer[i], parameters->blocksize)) {
@@ -539,11 +284,13 @@ static void convert(struct conversionParameters const *parameters) {
 	if (!openDevice(parameters->readDevice, &convProcess.readDevFd, O_RDWR, &convProcess.readDevSize)) {
 		terminate(EC_CANNOT_OPEN_READ_DEVICE);
 	}
+	initFdBackend(&convProcess.readBackend, convProcess.readDevFd);
 	logmsg(LLVL_INFO, "Size of reading device %s is %" PRIu64 " bytes (%" PRIu64 " MiB + %" PRIu64 " bytes)\n", parameters->readDevice, convProcess.readDevSize, convProcess.readDevSize / (1024 * 1024), convProcess.readDevSize % (1024 * 1024));
 
 	/* Do a backup of the physical disk first if we're just starting out our
 	 * conversion */
 	if (!parameters->resuming) {
+		enterPhase(parameters, &ioStats, "header backup", &phaseStartTime);
 		if (!backupPhysicalDisk(parameters, &convProcess)) {
 			terminate(EC_FAILED_TO_BACKUP_HEADER);
 		}
@@ -557,9 +304,16 @@ static void convert(struct conversionParameters const *parameters) {
 		terminate(EC_UNSUPPORTED_SMALL_DISK_CORNER_CASE);
 	}
 
+	/* Sector size and workqueue flags of the dm-crypt mapping */
+	struct cryptMapping cryptMapping;
+	if (!cryptMappingChoose(parameters, convProcess.readDevSize, &cryptMapping)) {
+		terminate(EC_CRYPT_SECTOR_SIZE_MISMATCH);
+	}
+
 	if (!parameters->resuming) {
 		/* Read the first chunk of data from the unencrypted device (because it
 		 * will be overwritten with the LUKS header after the luksFormat action) */
+		enterPhase(parameters, &ioStats, "luksFormat", &phaseStartTime);
 		logmsg(LLVL_DEBUG, "%s: Reading first chunk.\n", parameters->readDevice);
 		if (chunkReadAt(&convProcess.dataBuffer[0], convProcess.readDevFd, 0, convProcess.dataBuffer[0].size) != parameters->blocksize) {
 			logmsg(LLVL_ERROR, "%s: Unable to read chunk data.\n", parameters->readDevice);
@@ -567,22 +321,73 @@ static void convert(struct conversionParameters const *parameters) {
 		}
 		logmsg(LLVL_DEBUG, "%s: Read %d bytes from first chunk.\n", parameters->readDevice, convProcess.dataBuffer[0].used);
 
+		/* With checkpoints, the resume file must hold the first chunk before
+		 * luksFormat overwrites its start */
+		if (parameters->checkpointInterval && !writeResumeFile(&convProcess)) {
+			logmsg(LLVL_ERROR, "Error writing the first chunk to the resume file: %s\n", strerror(errno));
+			terminate(EC_CANNOT_OPEN_RESUME_FILE);
+		}
+
 		/* Check availability of device mapper handle before performing format */
-		if (!isLuksMapperAvailable(convProcess.writeDeviceHandle)) {
+		if (convProcess.writeDeviceHandle && !isLuksMapperAvailable(convProcess.writeDeviceHandle)) {
 			logmsg(LLVL_ERROR, "Error: luksipc conversion handle '%s' not available.\n", convProcess.writeDeviceHandle);
 			terminate(EC_LUKSIPC_WRITE_DEVICE_HANDLE_UNAVAILABLE);
 		}
 
 		/* Format the device while keeping unencrypted disk header in memory (Chunk 0) */
 		logmsg(LLVL_INFO, "Performing luksFormat of %s\n", parameters->rawDevice);
-		if (!luksFormat(convProcess.rawDeviceAlias, parameters->keyFile, parameters->luksFormatParams)) {
+		CRASHPOINT("luksFormat");
+		bool formatted = convProcess.luksTarget.format(&convProcess, parameters->keyFile, parameters->luksCipher, parameters->luksKeySize, cryptMapping.sectorSize, parameters->luksFormatParams);
+		if ((!formatted) && cryptMapping.autoSectorSize) {
+			/* cryptsetup before 2.0 does not know about sector sizes */
+			logmsg(LLVL_WARN, "luksFormat with %d byte sectors failed, retrying with cryptsetup's default sector size.\n", cryptMapping.sectorSize);
+			cryptMapping.sectorSize = 0;
+			formatted = convProcess.luksTarget.format(&convProcess, parameters->keyFile, parameters->luksCipher, parameters->luksKeySize, 0, parameters->luksFormatParams);
+		}
+		if (!formatted) {
 			terminate(EC_FAILED_TO_PERFORM_LUKSFORMAT);
 		}
+		CRASHPOINT("luksFormat done");
 	}
 
 	/* luksOpen the writing block device using the generated keyfile */
-	logmsg(LLVL_INFO, "Performing luksOpen of %s (opening as mapper name %s)\n", parameters->rawDevice, convProcess.writeDeviceHandle);
-	if (!luksOpen(convProcess.rawDeviceAlias, parameters->keyFile, convProcess.writeDeviceHandle)) {
+	enterPhase(parameters, &ioStats, "luksOpen", &phaseStartTime);
+	if (convProcess.writeDeviceHandle) {
+		logmsg(LLVL_INFO, "Performing luksOpen of %s (opening as mapper name %s)\n", parameters->rawDevice, convProcess.writeDeviceHandle);
+	} else {
+		logmsg(LLVL_INFO, "Unlocking LUKS header of %s in userspace\n", parameters->rawDevice);
+	}
+	/* The userspace engine needs to read the volume key from the dm-crypt
+	 * table, which is impossible if it is stored in the kernel keyring */
+	char luksOpenParamBuffer[128];
+	const char *luksOpenParams = cryptMappingOpenParams(&cryptMapping, parameters->engine == ENGINE_USERSPACE, luksOpenParamBuffer, sizeof(luksOpenParamBuffer));
+	/* A rollback overwrites the LUKS header of the device, so it is saved
+	 * first and the device is opened with the saved header from then on */
+	char headerFile[256];
+	const char *detachedHeader = NULL;
+	if (parameters->rollback) {
+		if (!rollbackHeaderFile(parameters, headerFile, sizeof(headerFile))) {
+			logmsg(LLVL_ERROR, "Resume file name %s is too long.\n", parameters->resumeFilename);
+			terminate(EC_CANNOT_ROLL_BACK);
+		}
+		if (!doesFileExist(headerFile)) {
+			if (!convProcess.luksTarget.headerBackup(&convProcess, headerFile)) {
+				logmsg(LLVL_ERROR, "Cannot save the LUKS header to %s, which is needed to continue an interrupted rollback.\n", headerFile);
+				terminate(EC_CANNOT_ROLL_BACK);
+			}
+			logmsg(LLVL_INFO, "Saved LUKS header to %s.\n", headerFile);
+		}
+		detachedHeader = headerFile;
+	}
+	bool opened = convProcess.luksTarget.open(&convProcess, parameters->keyFile, detachedHeader, luksOpenParams);
+	if ((!opened) && cryptMapping.bypassWorkqueues && cryptMapping.autoWorkqueues) {
+		/* The --perf-* flags need cryptsetup 2.3.4 and Linux 5.9 */
+		logmsg(LLVL_WARN, "luksOpen bypassing the dm-crypt workqueues failed, retrying with workqueues.\n");
+		cryptMapping.bypassWorkqueues = false;
+		luksOpenParams = cryptMappingOpenParams(&cryptMapping, parameters->engine == ENGINE_USERSPACE, luksOpenParamBuffer, sizeof(luksOpenParamBuffer));
+		opened = convProcess.luksTarget.open(&convProcess, parameters->keyFile, detachedHeader, luksOpenParams);
+	}
+	if (!opened) {
 		if (!parameters->resuming) {
 			/* Open failed, but we already formatted the disk. Try to unpulp,
 			 * but only if we already messed with the disk! */
@@ -592,8 +397,8 @@ static void convert(struct conversionParameters const *parameters) {
 	}
 
 	/* Open LUKS device for reading/writing */
-	if (!openDevice(convProcess.writeDevicePath, &convProcess.writeDevFd, O_RDWR, &convProcess.writeDevSize)) {
-		logmsg(LLVL_ERROR, "Opening LUKS device %s failed: %s\n", convProcess.writeDevicePath, strerror(errno));
+	if (!convProcess.luksTarget.attach(&convProcess)) {
+		logmsg(LLVL_ERROR, "Opening LUKS device %s failed.\n", convProcess.writeDevicePath);
 		if (!parameters->resuming) {
 			/* Open failed, but we already formatted the disk. Try to unpulp,
 			 * but only if we already messed with the disk! */
@@ -601,6 +406,10 @@ static void convert(struct conversionParameters const *parameters) {
 		}
 		terminate(EC_FAILED_TO_OPEN_UNLOCKED_CRYPTO_DEVICE);
 	}
+	convProcess.luksTarget.initBackend(&convProcess, &convProcess.writeBackend);
+	if (convProcess.writeDeviceHandle) {
+		ioStatsAddDevice(&ioStats, "write", convProcess.writeDevicePath);
+	}
 	logmsg(LLVL_INFO, "Size of luksOpened writing device is %" PRIu64 " bytes (%" PRIu64 " MiB + %" PRIu64 " bytes)\n", convProcess.writeDevSize, convProcess.writeDevSize / (1024 * 1024), convProcess.writeDevSize % (1024 * 1024));
 
 	/* Check that the sizes of reading and writing device are in a sane
@@ -622,35 +431,138 @@ static void convert(struct conversionParameters const *parameters) {
 		convProcess.outOffset = 0;
 	} else {
 		/* Now it's time to read in the resume file. */
-		if (!readResumeFile(parameters, &convProcess)) {
+		if (parameters->recover) {
+			enterPhase(parameters, &ioStats, "recover", &phaseStartTime);
+			if (!recoverConversionState(parameters, &convProcess)) {
+				logmsg(LLVL_ERROR, "Failed to recover conversion state from the device, aborting. Nothing has been written to it; do not mount the volume, restore it from your backup.\n");
+				terminate(EC_CANNOT_RECOVER_CONVERSION_STATE);
+			}
+		} else if (parameters->rollback) {
+			enterPhase(parameters, &ioStats, "rollback", &phaseStartTime);
+			if (!rollbackPrepare(parameters, &convProcess)) {
+				logmsg(LLVL_ERROR, "Cannot roll back the conversion, aborting.\n");
+				terminate(EC_CANNOT_ROLL_BACK);
+			}
+		} else if (!readResumeFile(parameters, &convProcess)) {
 			logmsg(LLVL_ERROR, "Failed to read resume file, aborting.\n");
 			terminate(EC_FAILED_TO_READ_RESUME_FILE);
 		}
 	}
 
-	/* These values are identical for resume and non resume cases */
+	/* These values are identical for resume and non resume cases; a rollback
+	 * ends where the conversion stopped */
 	convProcess.usedBufferIndex = 0;
-	convProcess.endOutOffset = (convProcess.readDevSize < convProcess.writeDevSize) ? convProcess.readDevSize : convProcess.writeDevSize;
-	convProcess.inOffset = convProcess.dataBuffer[0].used + convProcess.outOffset;
+	if (!convProcess.rollback) {
+		convProcess.endOutOffset = (convProcess.readDevSize < convProcess.writeDevSize) ? convProcess.readDevSize : convProcess.writeDevSize;
+	}
+	convProcess.inOffset = resumeWindow(&convProcess)->used + convProcess.outOffset;
+	throughputInit(&convProcess.throughput, convProcess.endOutOffset);
+
+	if (!cryptSectorSizeCompatible(parameters, &convProcess)) {
+		if (!parameters->resuming) {
+			/* Formatted with sectors that do not fit, restore the header */
+			chunkWriteAt(&convProcess.dataBuffer[0], convProcess.readDevFd, 0);
+		}
+		terminate(EC_CRYPT_SECTOR_SIZE_MISMATCH);
+	}
+
+	if (convProcess.rollback) {
+		/* Rolling back reads from the LUKS device and writes to the plain
+		 * device, alternating between the two */
+		if (!rollbackStart(&convProcess)) {
+			terminate(EC_CANNOT_ROLL_BACK);
+		}
+	} else {
+		if ((parameters->engine == ENGINE_USERSPACE) && (parameters->luksTarget == LUKSTARGET_DMCRYPT)) {
+			/* The disk might already be formatted at this point, so failing to
+			 * set up the engine must not abort the conversion */
+			convProcess.cryptEngine = cryptEngineInit(convProcess.writeDeviceHandle, convProcess.rawDeviceAlias, convProcess.writeDevFd, convProcess.writeDevSize, parameters->blocksize, parameters->cryptoThreads, parameters->verifyEngine);
+			if (!convProcess.cryptEngine) {
+				logmsg(LLVL_WARN, "Userspace encryption engine unavailable, writing through dm-crypt instead.\n");
+			}
+		}
+
+		/* Checkpointed spans are moved piece by piece, and the measurement
+		 * would overwrite the tail of a resumed span in the idle buffer */
+		if (batchIoWanted(parameters) && !parameters->checkpointInterval && !convProcess.checkpoint.spanEnd) {
+			convProcess.batchChunks = batchIoPlan(parameters, &convProcess);
+		}
+		if (parameters->spillFile) {
+			/* Like the userspace engine, the spill file is optional once the
+			 * disk has been formatted */
+			convProcess.spill = spillCreate(parameters->spillFile, parameters->blocksize, parameters->spillSize, convProcess.readDevSize);
+			if (!convProcess.spill) {
+				logmsg(LLVL_WARN, "Spill file unavailable, reading ahead in memory only.\n");
+			}
+		}
+	}
+
+	if (parameters->traceFile) {
+		struct traceFileHeader traceHeader = {
+			.readDevSize = convProcess.readDevSize,
+			.writeDevSize = convProcess.writeDevSize,
+			.blocksize = parameters->blocksize,
+			.engine = convProcess.cryptEngine ? ENGINE_USERSPACE : parameters->engine,
+		};
+		convProcess.trace = traceCreate(parameters->traceFile, &traceHeader);
+		if (!convProcess.trace) {
+			terminate(EC_CANNOT_CREATE_TRACE_FILE);
+		}
+		traceAttach(convProcess.trace, &convProcess.readBackend, TRACEDEV_READ);
+		traceAttach(convProcess.trace, &convProcess.writeBackend, TRACEDEV_WRITE);
+	}
+
+	uint64_t totalBytes = convProcess.endOutOffset - convProcess.outOffset;
+	if (parameters->dryRun) {
+		dryRunLimitCopy(parameters, &convProcess);
+	}
 
 	/* Then start the copying process */
+	enterPhase(parameters, &ioStats, "copy", &phaseStartTime);
+	double copyStartTime = getTime();
 	enum copyResult_t copyResult = startDataCopy(parameters, &convProcess);
+	if (convProcess.rollback && (copyResult == COPYRESULT_SUCCESS_FINISHED)) {
+		copyResult = rollbackFinish(parameters, &convProcess);
+	}
+	if (convProcess.trace && !traceClose(convProcess.trace)) {
+		logmsg(LLVL_WARN, "I/O trace file %s is incomplete.\n", parameters->traceFile);
+	}
+	convProcess.trace = NULL;
+	if (convProcess.spill) {
+		/* Without a resume file, the spill file may be needed by --recover */
+		spillClose(convProcess.spill, copyResult != COPYRESULT_ERROR_WRITING_RESUME_FILE);
+		convProcess.spill = NULL;
+	}
 	if (copyResult == COPYRESULT_ERROR_WRITING_RESUME_FILE) {
 		terminate(EC_COPY_ABORTED_FAILED_TO_WRITE_WRITE_RESUME_FILE);
 	}
 
+	bool fillComplete = true;
+	if (parameters->fillRandom && (copyResult == COPYRESULT_SUCCESS_FINISHED)) {
+		enterPhase(parameters, &ioStats, "random fill", &phaseStartTime);
+		fillComplete = fillRandomSpace(parameters, &convProcess);
+		if (!fillComplete) {
+			logmsg(LLVL_WARN, "Not all space could be filled with random data, the conversion itself has completed.\n");
+		}
+	}
+
 	/* Sync the disk and close open file descriptors to partition */
+	enterPhase(parameters, &ioStats, "sync", &phaseStartTime);
 	closeFileDescriptorsAndSync(&convProcess);
+	if (parameters->dryRun) {
+		dryRunReport(copyStartTime - convertStartTime, getTime() - copyStartTime, convProcess.stats.copied, totalBytes);
+	}
 
 	/* Then close the LUKS device */
-	if (!dmRemove(convProcess.writeDeviceHandle)) {
-		logmsg(LLVL_ERROR, "Failed to close LUKS device %s.\n", convProcess.writeDeviceHandle);
+	enterPhase(parameters, &ioStats, "close", &phaseStartTime);
+	if (!convProcess.luksTarget.close(&convProcess)) {
+		logmsg(LLVL_ERROR, "Failed to close LUKS device %s.\n", convProcess.writeDevicePath);
 		terminate(EC_FAILED_TO_CLOSE_LUKS_DEVICE);
 	}
 
 	/* Finally remove the device mapper alias */
-	if (!dmRemove(convProcess.rawDeviceAlias)) {
-		logmsg(LLVL_ERROR, "Removing device mapper alias %s failed.\n", convProcess.rawDeviceAlias);
+	if (!convProcess.luksTarget.release(&convProcess)) {
+		logmsg(LLVL_ERROR, "Removing device mapper alias %s failed.\n", convProcess.rawDeviceAlias ? convProcess.rawDeviceAlias : parameters->rawDevice);
 		terminate(EC_FAILED_TO_REMOVE_DEVICE_MAPPER_ALIAS);
 	}
 
@@ -658,11 +570,26 @@ static void convert(struct conversionParameters const *parameters) {
 	for (int i = 0; i < 2; i++) {
 		freeChunk(&convProcess.dataBuffer[i]);
 	}
+	freeChunk(&convProcess.rollbackTail);
+	freeChunk(&convProcess.pendingWindow);
+	if (convProcess.rollback && (copyResult == COPYRESULT_SUCCESS_FINISHED)) {
+		rollbackCleanup(parameters);
+	}
+
+	ioStatsReport(&ioStats);
+	enterPhase(parameters, &ioStats, "finished", &phaseStartTime);
+
+	if (parameters->dryRun) {
+		terminate((copyResult == COPYRESULT_SUCCESS_RESUMABLE) ? EC_USER_ABORTED_PROCESS : EC_SUCCESS);
+	}
 
 	/* Return with a code that depends on whether the copying was finished
 	 * completely or if it was aborted gracefully (i.e. resuming is possible)
 	 **/
-	terminate((copyResult == COPYRESULT_SUCCESS_FINISHED) ? EC_SUCCESS : EC_COPY_ABORTED_RESUME_FILE_WRITTEN);
+	if (copyResult != COPYRESULT_SUCCESS_FINISHED) {
+		terminate(EC_COPY_ABORTED_RESUME_FILE_WRITTEN);
+	}
+	terminate(fillComplete ? EC_SUCCESS : EC_RANDOM_FILL_INCOMPLETE);
 }
 
 static void printCheckListItem(int *aNumber, const char *aMsg, ...) {
@@ -675,13 +602,15 @@ static void printCheckListItem(int *aNumber, const char *aMsg, ...) {
 	va_end(argList);
 }
 
-static void checkPreconditions(struct conversionParameters const *aParameters) {
+static void checkPreconditions(struct conversionParameters const *aParameters, const struct deviceTopology *aTopology) {
 	bool abortProcess = false;
 	bool reluksification = strcmp(aParameters->rawDevice, aParameters->readDevice) != 0;
+	char usage[256];
 
 	if ((!aParameters->resuming) && (!reluksification)) {
 		logmsg(LLVL_DEBUG, "Checking if device %s is already a LUKS device...\n", aParameters->rawDevice);
-		if (isLuks(aParameters->rawDevice)) {
+		bool alreadyLuks = (aParameters->luksTarget == LUKSTARGET_USERSPACE) ? hasLuksMagic(aParameters->rawDevice) : isLuks(aParameters->rawDevice);
+		if (alreadyLuks) {
 			if (aParameters->safetyChecks) {
 				logmsg(LLVL_ERROR, "%s: Already LUKS, refuse to do anything.\n", aParameters->rawDevice);
 				abortProcess = true;
@@ -704,12 +633,12 @@ static void checkPreconditions(struct conversionParameters const *aParameters) {
 			}
 		}
 
-		if (doesFileExist(DEFAULT_RESUME_FILENAME)) {
+		if (doesFileExist(aParameters->resumeFilename)) {
 			if (aParameters->safetyChecks) {
-				logmsg(LLVL_ERROR, "Resume file %s already exists, refusing to overwrite.\n", DEFAULT_RESUME_FILENAME);
+				logmsg(LLVL_ERROR, "Resume file %s already exists, refusing to overwrite.\n", aParameters->resumeFilename);
 				abortProcess = true;
 			} else {
-				logmsg(LLVL_WARN, "Resume file %s already exists. Will be overwritten when process continues because safety checks have been disabled.\n", DEFAULT_RESUME_FILENAME);
+				logmsg(LLVL_WARN, "Resume file %s already exists. Will be overwritten when process continues because safety checks have been disabled.\n", aParameters->resumeFilename);
 			}
 		}
 
@@ -723,21 +652,61 @@ static void checkPreconditions(struct conversionParameters const *aParameters) {
 		}
 	}
 
-	if (isBlockDeviceMounted(aParameters->rawDevice)) {
+	if (aParameters->recover) {
+		if (!doesFileExist(aParameters->keyFile)) {
+			logmsg(LLVL_ERROR, "Key file %s of the interrupted conversion does not exist, cannot recover.\n", aParameters->keyFile);
+			abortProcess = true;
+		}
+		/* The resume file written before copying starts is outdated, but one
+		 * written when aborting gracefully should be used instead */
+		uint64_t resumeOffset;
+		if (peekResumeFileOffset(aParameters->resumeFilename, &resumeOffset) && (resumeOffset > 0)) {
+			if (aParameters->safetyChecks) {
+				logmsg(LLVL_ERROR, "Resume file %s is valid (stopped at offset %" PRIu64 "), use --resume instead of --recover.\n", aParameters->resumeFilename, resumeOffset);
+				abortProcess = true;
+			} else {
+				logmsg(LLVL_WARN, "Resume file %s is valid, but will be overwritten with the recovered state because safety checks have been disabled.\n", aParameters->resumeFilename);
+			}
+		}
+	}
+
+	if (aParameters->rollback) {
+		if (!doesFileExist(aParameters->keyFile)) {
+			logmsg(LLVL_ERROR, "Key file %s of the interrupted conversion does not exist, cannot roll back.\n", aParameters->keyFile);
+			abortProcess = true;
+		}
+		if (!doesFileExist(aParameters->resumeFilename)) {
+			logmsg(LLVL_ERROR, "Resume file %s of the interrupted conversion does not exist, cannot roll back.\n", aParameters->resumeFilename);
+			abortProcess = true;
+		}
+	}
+
+	if (isRegularFile(aParameters->rawDevice)) {
+		/* Image file, which is in use if it is attached to a loop device
+		 * already */
+		if (isFileLoopAttached(aParameters->rawDevice)) {
+			if (aParameters->safetyChecks) {
+				logmsg(LLVL_ERROR, "Image file %s is attached to a loop device, refusing to continue. Detach it or pass the loop device instead.\n", aParameters->rawDevice);
+				abortProcess = true;
+			} else {
+				logmsg(LLVL_WARN, "Image file %s is attached to a loop device, still continuing because safety checks have been disabled.\n", aParameters->rawDevice);
+			}
+		}
+	} else if (isBlockDeviceInUse(aTopology, aParameters->rawDevice, reluksification ? aParameters->readDevice : NULL, usage, sizeof(usage))) {
 		if (aParameters->safetyChecks) {
-			logmsg(LLVL_ERROR, "Raw block device %s appears to be mounted, refusing to continue.\n", aParameters->rawDevice);
+			logmsg(LLVL_ERROR, "Raw block device %s appears to be in use (%s), refusing to continue.\n", aParameters->rawDevice, usage);
 			abortProcess = true;
 		} else {
-			logmsg(LLVL_WARN, "Raw block device %s appears to be mounted, still continuing because safety checks have been disabled.\n", aParameters->rawDevice);
+			logmsg(LLVL_WARN, "Raw block device %s appears to be in use (%s), still continuing because safety checks have been disabled.\n", aParameters->rawDevice, usage);
 		}
 	}
 
-	if (reluksification && isBlockDeviceMounted(aParameters->readDevice)) {
+	if (reluksification && isBlockDeviceInUse(aTopology, aParameters->readDevice, NULL, usage, sizeof(usage))) {
 		if (aParameters->safetyChecks) {
-			logmsg(LLVL_ERROR, "Unlocked read block device %s appears to be mounted, refusing to continue.\n", aParameters->readDevice);
+			logmsg(LLVL_ERROR, "Unlocked read block device %s appears to be in use (%s), refusing to continue.\n", aParameters->readDevice, usage);
 			abortProcess = true;
 		} else {
-			logmsg(LLVL_WARN, "Unlocked read block device %s appears to be mounted, still continuing because safety checks have been disabled.\n", aParameters->readDevice);
+			logmsg(LLVL_WARN, "Unlocked read block device %s appears to be in use (%s), still continuing because safety checks have been disabled.\n", aParameters->readDevice, usage);
 		}
 	}
 
@@ -747,78 +716,204 @@ static void checkPreconditions(struct conversionParameters const *aParameters) {
 	}
 }
 
-static void askUserConfirmation(struct conversionParameters const *parameters) {
+static void showConversionSummary(struct conversionParameters const *parameters) {
 	bool reluksification = strcmp(parameters->rawDevice, parameters->readDevice) != 0;
 
-	if (!parameters->batchMode) {
-		uint64_t devSize = getDiskSizeOfPath(parameters->rawDevice);
-		if (devSize == 0) {
-			logmsg(LLVL_ERROR, "%s: Cannot determine disk size.\n", parameters->rawDevice);
-			terminate(EC_UNABLE_TO_GET_RAW_DISK_SIZE);
-		}
-		fprintf(stderr, "WARNING! luksipc will perform the following actions:\n");
-		if (!reluksification) {
-			if (!parameters->resuming) {
-				fprintf(stderr, "   => Normal LUKSification of plain device %s\n", parameters->rawDevice);
-				fprintf(stderr, "   -> luksFormat will be performed on %s\n", parameters->rawDevice);
+	uint64_t devSize = getDiskSizeOfPath(parameters->rawDevice);
+	if (devSize == 0) {
+		logmsg(LLVL_ERROR, "%s: Cannot determine disk size.\n", parameters->rawDevice);
+		terminate(EC_UNABLE_TO_GET_RAW_DISK_SIZE);
+	}
+	fprintf(stderr, "WARNING! luksipc will perform the following actions:\n");
+	if (!reluksification) {
+		if (!parameters->resuming) {
+			fprintf(stderr, "   => Normal LUKSification of plain device %s\n", parameters->rawDevice);
+			fprintf(stderr, "   -> luksFormat will be performed on %s\n", parameters->rawDevice);
+		} else if (parameters->rollback) {
+			fprintf(stderr, "   => Roll back the LUKSification of (partially encrypted) plain device %s\n", parameters->rawDevice);
+			fprintf(stderr, "   -> The converted part is decrypted back onto %s using resume file %s\n", parameters->rawDevice, parameters->resumeFilename);
+		} else {
+			fprintf(stderr, "   => Resume LUKSification of (partially encrypted) plain device %s\n", parameters->rawDevice);
+			if (parameters->recover) {
+				fprintf(stderr, "   -> Locating the point of interruption on the device, writing resume file %s\n", parameters->resumeFilename);
 			} else {
-				fprintf(stderr, "   => Resume LUKSification of (partially encrypted) plain device %s\n", parameters->rawDevice);
 				fprintf(stderr, "   -> Using the information in resume file %s\n", parameters->resumeFilename);
 			}
+		}
+	} else {
+		if (!parameters->resuming) {
+			fprintf(stderr, "   => reLUKSification of LUKS device %s\n", parameters->rawDevice);
+			fprintf(stderr, "   -> Which has been unlocked at %s\n", parameters->readDevice);
+			fprintf(stderr, "   -> luksFormat will be performed on %s\n", parameters->rawDevice);
+		} else if (parameters->rollback) {
+			fprintf(stderr, "   => Roll back the reLUKSification of (partially re-encrypted) LUKS device %s\n", parameters->rawDevice);
+			fprintf(stderr, "   -> The converted part is decrypted back onto %s (unlocked with the OLD key) using resume file %s\n", parameters->readDevice, parameters->resumeFilename);
 		} else {
-			if (!parameters->resuming) {
-				fprintf(stderr, "   => reLUKSification of LUKS device %s\n", parameters->rawDevice);
-				fprintf(stderr, "   -> Which has been unlocked at %s\n", parameters->readDevice);
-				fprintf(stderr, "   -> luksFormat will be performed on %s\n", parameters->rawDevice);
+			fprintf(stderr, "   => Resume reLUKSification of (partially re-encrypted) LUKS device %s\n", parameters->rawDevice);
+			fprintf(stderr, "   -> Which has been unlocked with the OLD key at %s\n", parameters->readDevice);
+			if (parameters->recover) {
+				fprintf(stderr, "   -> Locating the point of interruption on the device, writing resume file %s\n", parameters->resumeFilename);
 			} else {
-				fprintf(stderr, "   => Resume reLUKSification of (partially re-encrypted) LUKS device %s\n", parameters->rawDevice);
-				fprintf(stderr, "   -> Which has been unlocked with the OLD key at %s\n", parameters->readDevice);
 				fprintf(stderr, "   -> Using the information in resume file %s\n", parameters->resumeFilename);
 			}
 		}
-		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "\n");
 
-		fprintf(stderr, "Please confirm you have completed the checklist:\n");
-		int checkPoint = 0;
-		if  (!parameters->resuming) {
-			printCheckListItem(&checkPoint, "You have resized the contained filesystem(s) appropriately\n");
-			printCheckListItem(&checkPoint, "You have unmounted any contained filesystem(s)\n");
-			printCheckListItem(&checkPoint, "You will ensure secure storage of the keyfile that will be generated at %s\n", parameters->keyFile);
+	fprintf(stderr, "Please confirm you have completed the checklist:\n");
+	int checkPoint = 0;
+	if  (!parameters->resuming) {
+		printCheckListItem(&checkPoint, "You have resized the contained filesystem(s) appropriately\n");
+		printCheckListItem(&checkPoint, "You have unmounted any contained filesystem(s)\n");
+		printCheckListItem(&checkPoint, "You will ensure secure storage of the keyfile that will be generated at %s\n", parameters->keyFile);
+	} else {
+		if (parameters->recover) {
+			printCheckListItem(&checkPoint, "The key file %s belongs to the partially encrypted volume %s\n", parameters->keyFile, parameters->rawDevice);
 		} else {
 			printCheckListItem(&checkPoint, "The resume file %s belongs to the partially encrypted volume %s\n", parameters->resumeFilename, parameters->rawDevice);
 		}
-		printCheckListItem(&checkPoint, "Power conditions are satisfied (i.e. your laptop is not running off battery)\n");
-		if (!parameters->resuming) {
-			printCheckListItem(&checkPoint, "You have a backup of all important data on %s\n", parameters->rawDevice);
-		}
+	}
+	printCheckListItem(&checkPoint, "Power conditions are satisfied (i.e. your laptop is not running off battery)\n");
+	if (!parameters->resuming) {
+		printCheckListItem(&checkPoint, "You have a backup of all important data on %s\n", parameters->rawDevice);
+	}
 
-		fprintf(stderr, "\n");
-		fprintf(stderr, "    %s: %" PRIu64 " MiB = %.1f GiB\n", parameters->rawDevice, devSize / 1024 / 1024, (double)(devSize / 1024 / 1024) / 1024);
-		fprintf(stderr, "    Chunk size: %u bytes = %.1f MiB\n", parameters->blocksize, (double)parameters->blocksize / 1024 / 1024);
-		fprintf(stderr, "    Keyfile: %s\n", parameters->keyFile);
-		fprintf(stderr, "    LUKS format parameters: %s\n", parameters->luksFormatParams ? parameters->luksFormatParams : "None given");
-		fprintf(stderr, "    luksipc version: " BUILD_REVISION "\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    %s: %" PRIu64 " MiB = %.1f GiB\n", parameters->rawDevice, devSize / 1024 / 1024, (double)(devSize / 1024 / 1024) / 1024);
+	fprintf(stderr, "    Chunk size: %u bytes = %.1f MiB\n", parameters->blocksize, (double)parameters->blocksize / 1024 / 1024);
+	fprintf(stderr, "    Keyfile: %s\n", parameters->keyFile);
+	if (parameters->luksCipher) {
+		fprintf(stderr, "    LUKS cipher: %s with %d bit key (fastest in benchmark)\n", parameters->luksCipher, parameters->luksKeySize);
+	}
+	fprintf(stderr, "    LUKS format parameters: %s\n", parameters->luksFormatParams ? parameters->luksFormatParams : "None given");
+	if (parameters->luksTarget == LUKSTARGET_USERSPACE) {
+		fprintf(stderr, "    LUKS target: LUKS2 header written and data encrypted by luksipc (no dm-crypt)\n");
+	}
+	fprintf(stderr, "    luksipc version: " BUILD_REVISION "\n");
 #ifdef DEVELOPMENT
-		if (parameters->dev.ioErrors) {
-			fprintf(stderr, "    Simulating device I/O errors\n");
-		}
-		if (parameters->dev.slowDown) {
-			fprintf(stderr, "    Simulating slow I/O device\n");
-		}
+	if (parameters->dev.ioErrors) {
+		fprintf(stderr, "    Simulating device I/O errors\n");
+	}
+	if (parameters->dev.slowDown) {
+		fprintf(stderr, "    Simulating slow I/O device\n");
+	}
 #endif
-		fprintf(stderr, "\n");
-		fprintf(stderr, "Are all these conditions satisfied, then answer uppercase yes: ");
+	fprintf(stderr, "\n");
+}
+
+static void confirmOrAbort(void) {
+	fprintf(stderr, "Are all these conditions satisfied, then answer uppercase yes: ");
+
+	char yes[16];
+	if (!fgets(yes, sizeof(yes) - 1, stdin)) {
+		perror("fgets");
+		terminate(EC_UNABLE_TO_READ_FROM_STDIN);
+	}
+	if (strcmp(yes, "YES\n")) {
+		fprintf(stderr, "Wrong answer. Aborting.\n");
+		terminate(EC_USER_ABORTED_PROCESS);
+	}
+}
+
+static void askUserConfirmation(struct conversionParameters const *parameters) {
+	if (!parameters->batchMode) {
+		showConversionSummary(parameters);
+		confirmOrAbort();
+	}
+}
+
+static void generateKeyfile(struct conversionParameters const *parameters) {
+	if (!genKeyfile(parameters->keyFile, !parameters->safetyChecks)) {
+		logmsg(LLVL_ERROR, "Key generation failed, aborting.\n");
+		terminate(EC_CANNOT_GENERATE_KEY_FILE);
+	}
+}
+
+/* Runs in the forked process of a job, so that a key file is only generated
+ * for jobs that are actually started */
+static void convertJob(struct conversionParameters const *parameters) {
+	if (!parameters->resuming) {
+		generateKeyfile(parameters);
+	}
+	convert(parameters);
+}
+
+/* Converts all devices listed in the job file concurrently */
+static void convertJobs(struct conversionParameters const *parameters) {
+	static struct conversionJob jobs[MAX_CONVERSION_JOBS];
+	int jobCount = readJobFile(parameters, jobs, MAX_CONVERSION_JOBS);
+	if (jobCount < 0) {
+		terminate(EC_CANNOT_READ_JOB_FILE);
+	}
+
+	/* The devices of all jobs that are still to be run are checked against
+	 * one snapshot of the mounts and stacked devices */
+	struct deviceTopology *topology = topologyScan();
+	int pendingCount = 0;
+	for (int i = 0; i < jobCount; i++) {
+		if (jobs[i].state == JOBSTATE_PENDING) {
+			checkPreconditions(&jobs[i].parameters, topology);
+			pendingCount++;
+		}
+	}
+	topologyFree(topology);
 
-		char yes[16];
-		if (!fgets(yes, sizeof(yes) - 1, stdin)) {
-			perror("fgets");
-			terminate(EC_UNABLE_TO_READ_FROM_STDIN);
+	if (!parameters->batchMode && pendingCount) {
+		for (int i = 0; i < jobCount; i++) {
+			if (jobs[i].state == JOBSTATE_PENDING) {
+				fprintf(stderr, "Job %d of %d (group %s):\n", i + 1, jobCount, jobs[i].group);
+				showConversionSummary(&jobs[i].parameters);
+			}
 		}
-		if (strcmp(yes, "YES\n")) {
-			fprintf(stderr, "Wrong answer. Aborting.\n");
-			terminate(EC_USER_ABORTED_PROCESS);
+		confirmOrAbort();
+	}
+
+	if (!initAsyncLogging(parameters->logFile)) {
+		terminate(EC_CANNOT_OPEN_LOG_FILE);
+	}
+
+	if (!initSignalHandlers()) {
+		terminate(EC_CANNOT_INIT_SIGNAL_HANDLERS);
+	}
+
+	enum terminationCode_t result = runConversionJobs(parameters, jobs, jobCount, convertJob);
+	freeJobs(jobs, jobCount);
+	terminate(result);
+}
+
+/* Runs the cipher benchmark. Only prints the ranking (and exits) for
+ * --cipher-benchmark, otherwise chooses the cipher for luksFormat. Ciphers
+ * are ranked at the encryption sector size given with --sector-size, or at
+ * the default one if that was not measured. */
+static void benchmarkCiphers(struct conversionParameters *aParameters) {
+	struct cipherBenchResult results[CIPHERBENCH_MAX_RESULTS];
+	int resultCount = cipherBenchmarkRun(aParameters, results, CIPHERBENCH_MAX_RESULTS);
+	const struct cipherBenchResult *best = NULL;
+	if ((resultCount > 0) && aParameters->cryptSectorSize) {
+		best = cipherBenchmarkBest(results, resultCount, aParameters->cryptSectorSize);
+	}
+	if ((resultCount > 0) && !best) {
+		best = cipherBenchmarkBest(results, resultCount, DEFAULT_CRYPT_SECTOR_SIZE);
+	}
+	if (resultCount > 0) {
+		cipherBenchmarkReport(results, resultCount, best);
+	}
+	if (aParameters->cipherBenchmark) {
+		if (!best) {
+			logmsg(LLVL_ERROR, "No cipher could be measured.\n");
+			terminate(EC_CIPHER_BENCHMARK_FAILED);
 		}
+		logmsg(LLVL_INFO, "Recommended (marked with *): %s with a %d bit key, --auto-cipher formats with it.\n", best->candidate->cipher, best->candidate->keySize);
+		terminate(EC_SUCCESS);
+	}
+
+	if (!best) {
+		logmsg(LLVL_WARN, "Cipher benchmark failed, formatting with the default cipher of cryptsetup.\n");
+		return;
 	}
+	logmsg(LLVL_INFO, "Formatting with %s and a %d bit key.\n", best->candidate->cipher, best->candidate->keySize);
+	aParameters->luksCipher = best->candidate->cipher;
+	aParameters->luksKeySize = best->candidate->keySize;
 }
 
 int main(int argc, char **argv) {
@@ -833,18 +928,47 @@ int main(int argc, char **argv) {
 	/* Set loglevel to value given on command line */
 	setLogLevel(pgmParameters.logLevel);
 
+	/* Benchmark the ciphers before luksFormat (or instead of converting) */
+	if (pgmParameters.cipherBenchmark || (pgmParameters.autoCipher && !pgmParameters.resuming)) {
+		benchmarkCiphers(&pgmParameters);
+	}
+
+	/* Multiple devices are handled by the job scheduler */
+	if (pgmParameters.jobFile) {
+		convertJobs(&pgmParameters);
+	}
+
+	/* A dry run keeps its key, resume and backup files in a temporary
+	 * directory */
+	if (pgmParameters.dryRun && !dryRunRedirectFiles(&pgmParameters)) {
+		terminate(EC_CANNOT_PREPARE_DRY_RUN);
+	}
+
 	/* Check if all preconditions are satisfied */
-	checkPreconditions(&pgmParameters);
+	struct deviceTopology *topology = topologyScan();
+	checkPreconditions(&pgmParameters, topology);
+	topologyFree(topology);
+
+	/* Ask for user confirmation if necessary; a dry run does not modify the
+	 * device */
+	if (!pgmParameters.dryRun) {
+		askUserConfirmation(&pgmParameters);
+	}
 
-	/* Ask for user confirmation if necessary */
-	askUserConfirmation(&pgmParameters);
+	/* From now on, log from a background thread so that a slow console
+	 * cannot throttle the conversion */
+	if (!initAsyncLogging(pgmParameters.logFile)) {
+		terminate(EC_CANNOT_OPEN_LOG_FILE);
+	}
+
+	/* Stack the copy-on-write overlay on top of the device for a dry run */
+	if (pgmParameters.dryRun && !dryRunCreateOverlay(&pgmParameters)) {
+		terminate(EC_CANNOT_PREPARE_DRY_RUN);
+	}
 
 	/* Then generate the keyfile if we're converting (not in resume mode) */
 	if (!pgmParameters.resuming) {
-		if (!genKeyfile(pgmParameters.keyFile, !pgmParameters.safetyChecks)) {
-			logmsg(LLVL_ERROR, "Key generation failed, aborting.\n");
-			terminate(EC_CANNOT_GENERATE_KEY_FILE);
-		}
+		generateKeyfile(&pgmParameters);
 	}
 
 	/* Initialize signal handlers that will take care of abort */
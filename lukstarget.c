@@ -0,0 +1,220 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "lukstarget.h"
+#include "luks2.h"
+#include "engine.h"
+#include "cryptengine.h"
+#include "keyfile.h"
+#include "logging.h"
+#include "utils.h"
+
+/* dm-crypt target: the raw device is accessed through a device mapper alias
+ * (so that it can be told apart from the read device when reLUKSifying) and
+ * the LUKS device is a dm-crypt mapping under writeDeviceHandle */
+
+static bool dmPrepare(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	aConvProcess->rawDeviceAlias = dmCreateDynamicAlias(aParameters->rawDevice, "luksipc_raw");
+	if (!aConvProcess->rawDeviceAlias) {
+		logmsg(LLVL_ERROR, "Unable to initialize raw device alias.\n");
+		return false;
+	}
+	logmsg(LLVL_INFO, "Created raw device alias: %s -> %s\n", aParameters->rawDevice, aConvProcess->rawDeviceAlias);
+	return true;
+}
+
+static bool dmFormat(struct conversionProcess *aConvProcess, const char *aKeyFile, const char *aCipher, int aKeySize, int aSectorSize, const char *aOptionalParams) {
+	return luksFormat(aConvProcess->rawDeviceAlias, aKeyFile, aCipher, aKeySize, aSectorSize, aOptionalParams);
+}
+
+static bool dmHeaderBackup(struct conversionProcess *aConvProcess, const char *aBackupFile) {
+	return luksHeaderBackup(aConvProcess->rawDeviceAlias, aBackupFile);
+}
+
+static bool dmOpen(struct conversionProcess *aConvProcess, const char *aKeyFile, const char *aHeaderFile, const char *aOptionalParams) {
+	return luksOpen(aConvProcess->rawDeviceAlias, aKeyFile, aConvProcess->writeDeviceHandle, aHeaderFile, aOptionalParams);
+}
+
+static bool dmAttach(struct conversionProcess *aConvProcess) {
+	aConvProcess->writeDevFd = open(aConvProcess->writeDevicePath, O_RDWR);
+	if (aConvProcess->writeDevFd == -1) {
+		logmsg(LLVL_ERROR, "open %s failed: %s\n", aConvProcess->writeDevicePath, strerror(errno));
+		return false;
+	}
+	aConvProcess->writeDevSize = getDiskSizeOfFd(aConvProcess->writeDevFd);
+	if (aConvProcess->writeDevSize == 0) {
+		logmsg(LLVL_ERROR, "Determine disk size of %s failed: %s\n", aConvProcess->writeDevicePath, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void dmInitBackend(struct conversionProcess *aConvProcess, struct ioBackend *aBackend) {
+	initFdBackend(aBackend, aConvProcess->writeDevFd);
+}
+
+static bool dmClose(struct conversionProcess *aConvProcess) {
+	return dmRemove(aConvProcess->writeDeviceHandle);
+}
+
+static bool dmRelease(struct conversionProcess *aConvProcess) {
+	return dmRemove(aConvProcess->rawDeviceAlias);
+}
+
+/* Userspace target: the raw device (usually an image file) is opened
+ * directly and the LUKS device only exists as I/O backend, which en- and
+ * decrypts with the volume key from the LUKS2 header */
+
+static bool userspacePrepare(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	struct luksTarget *target = &aConvProcess->luksTarget;
+	target->rawDevice = aParameters->rawDevice;
+	target->chunkSize = aParameters->blocksize;
+	target->threadCount = aParameters->cryptoThreads;
+	target->rawFd = open(aParameters->rawDevice, O_RDWR);
+	if (target->rawFd == -1) {
+		logmsg(LLVL_ERROR, "open %s failed: %s\n", aParameters->rawDevice, strerror(errno));
+		return false;
+	}
+	snprintf(aConvProcess->writeDevicePath, sizeof(aConvProcess->writeDevicePath), "userspace LUKS device");
+	return true;
+}
+
+static bool userspaceFormat(struct conversionProcess *aConvProcess, const char *aKeyFile, const char *aCipher, int aKeySize, int aSectorSize, const char *aOptionalParams) {
+	struct luksTarget *target = &aConvProcess->luksTarget;
+	if (aOptionalParams) {
+		logmsg(LLVL_ERROR, "LUKS format parameters are passed to cryptsetup, which the userspace LUKS target does not use.\n");
+		return false;
+	}
+	/* Unlike cryptsetup, refuse to overwrite what is not held in memory */
+	if (aConvProcess->dataBuffer[0].used < LUKS2_DATA_OFFSET) {
+		logmsg(LLVL_ERROR, "The first chunk (%u bytes) does not hold all data that the LUKS2 header of %d bytes overwrites.\n", aConvProcess->dataBuffer[0].used, LUKS2_DATA_OFFSET);
+		return false;
+	}
+
+	uint8_t passphrase[MAX_KEYFILE_SIZE];
+	uint32_t passphraseLength;
+	bool success = readKeyfile(aKeyFile, passphrase, sizeof(passphrase), &passphraseLength) && luks2Format(target->rawFd, passphrase, passphraseLength, aCipher, aKeySize, aSectorSize, &target->table);
+	memset(passphrase, 0, sizeof(passphrase));
+	return success;
+}
+
+static bool userspaceHeaderBackup(struct conversionProcess *aConvProcess, const char *aBackupFile) {
+	return backupDeviceHeader(aConvProcess->luksTarget.rawDevice, LUKS2_DATA_OFFSET, aBackupFile);
+}
+
+static bool userspaceOpen(struct conversionProcess *aConvProcess, const char *aKeyFile, const char *aHeaderFile, const char *aOptionalParams) {
+	struct luksTarget *target = &aConvProcess->luksTarget;
+	(void)aOptionalParams;
+	int headerFd = target->rawFd;
+	if (aHeaderFile) {
+		headerFd = open(aHeaderFile, O_RDONLY);
+		if (headerFd == -1) {
+			logmsg(LLVL_ERROR, "Cannot open LUKS header file %s: %s\n", aHeaderFile, strerror(errno));
+			return false;
+		}
+	}
+
+	uint8_t passphrase[MAX_KEYFILE_SIZE];
+	uint32_t passphraseLength;
+	bool success = readKeyfile(aKeyFile, passphrase, sizeof(passphrase), &passphraseLength) && luks2Unlock(headerFd, passphrase, passphraseLength, &target->table);
+	memset(passphrase, 0, sizeof(passphrase));
+	if (aHeaderFile) {
+		close(headerFd);
+	}
+	return success;
+}
+
+static bool userspaceAttach(struct conversionProcess *aConvProcess) {
+	struct luksTarget *target = &aConvProcess->luksTarget;
+	uint64_t rawSize = getDiskSizeOfFd(target->rawFd);
+	if (rawSize < target->table.dataOffset + target->table.sectorSize) {
+		logmsg(LLVL_ERROR, "%s (%" PRIu64 " bytes) is too small for LUKS data at offset %" PRIu64 ".\n", target->rawDevice, rawSize, target->table.dataOffset);
+		return false;
+	}
+
+	/* Like dm-crypt, the device ends with the last complete sector */
+	aConvProcess->writeDevFd = -1;
+	aConvProcess->writeDevSize = (rawSize - target->table.dataOffset) / target->table.sectorSize * target->table.sectorSize;
+	target->engine = cryptEngineInitImage(&target->table, target->rawFd, aConvProcess->writeDevSize, target->chunkSize, target->threadCount);
+	target->sectorSize = target->table.sectorSize;
+	memset(target->table.key, 0, sizeof(target->table.key));
+	return target->engine != NULL;
+}
+
+static void userspaceInitBackend(struct conversionProcess *aConvProcess, struct ioBackend *aBackend) {
+	initCryptEngineBackend(aBackend, aConvProcess->luksTarget.engine);
+}
+
+static bool userspaceClose(struct conversionProcess *aConvProcess) {
+	struct luksTarget *target = &aConvProcess->luksTarget;
+	cryptEngineFree(target->engine);
+	target->engine = NULL;
+	return true;
+}
+
+static bool userspaceRelease(struct conversionProcess *aConvProcess) {
+	struct luksTarget *target = &aConvProcess->luksTarget;
+	bool success = (fsync(target->rawFd) == 0);
+	success = (close(target->rawFd) == 0) && success;
+	target->rawFd = -1;
+	if (!success) {
+		logmsg(LLVL_ERROR, "Closing %s failed: %s\n", target->rawDevice, strerror(errno));
+	}
+	return success;
+}
+
+void initLuksTarget(struct luksTarget *aTarget, enum luksTarget_t aType) {
+	memset(aTarget, 0, sizeof(struct luksTarget));
+	aTarget->rawFd = -1;
+	if (aType == LUKSTARGET_USERSPACE) {
+		aTarget->name = "userspace";
+		aTarget->prepare = userspacePrepare;
+		aTarget->format = userspaceFormat;
+		aTarget->headerBackup = userspaceHeaderBackup;
+		aTarget->open = userspaceOpen;
+		aTarget->attach = userspaceAttach;
+		aTarget->initBackend = userspaceInitBackend;
+		aTarget->close = userspaceClose;
+		aTarget->release = userspaceRelease;
+	} else {
+		aTarget->name = "dmcrypt";
+		aTarget->prepare = dmPrepare;
+		aTarget->format = dmFormat;
+		aTarget->headerBackup = dmHeaderBackup;
+		aTarget->open = dmOpen;
+		aTarget->attach = dmAttach;
+		aTarget->initBackend = dmInitBackend;
+		aTarget->close = dmClose;
+		aTarget->release = dmRelease;
+	}
+}
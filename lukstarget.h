@@ -0,0 +1,67 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __LUKSTARGET_H__
+#define __LUKSTARGET_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "luks.h"
+#include "parameters.h"
+
+struct conversionProcess;
+struct cryptEngine;
+
+/* Where the LUKS device comes from. The dm-crypt target formats and opens
+ * the raw device with cryptsetup and writes through a device mapper mapping,
+ * which needs root. The userspace target writes the LUKS2 header itself and
+ * encrypts in luksipc (see luks2.h), so that an image file can be converted,
+ * resumed and rolled back without any privileges. */
+struct luksTarget {
+	const char *name;
+	bool (*prepare)(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess);
+	bool (*format)(struct conversionProcess *aConvProcess, const char *aKeyFile, const char *aCipher, int aKeySize, int aSectorSize, const char *aOptionalParams);
+	bool (*headerBackup)(struct conversionProcess *aConvProcess, const char *aBackupFile);
+	bool (*open)(struct conversionProcess *aConvProcess, const char *aKeyFile, const char *aHeaderFile, const char *aOptionalParams);
+	bool (*attach)(struct conversionProcess *aConvProcess);		/* Opens the LUKS device, sets writeDevFd and writeDevSize */
+	void (*initBackend)(struct conversionProcess *aConvProcess, struct ioBackend *aBackend);
+	bool (*close)(struct conversionProcess *aConvProcess);
+	bool (*release)(struct conversionProcess *aConvProcess);	/* Undoes prepare() */
+	int sectorSize;						/* Encryption sector size if there is no block device to ask, else 0 */
+
+	/* Userspace target */
+	const char *rawDevice;
+	int rawFd;
+	uint32_t chunkSize;
+	int threadCount;
+	struct dmCryptTable table;
+	struct cryptEngine *engine;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void initLuksTarget(struct luksTarget *aTarget, enum luksTarget_t aType);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
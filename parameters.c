@@ -28,12 +28,19 @@
 #include <getopt.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 
 #include "utils.h"
 #include "logging.h"
 #include "parameters.h"
 #include "globals.h"
 #include "exit.h"
+#include "affinity.h"
+#include "dryrun.h"
+#include "batchio.h"
+#include "spill.h"
+#include "luks2.h"
+#include "engine.h"
 
 static void defaultParameters(struct conversionParameters *aParams) {
 	memset(aParams, 0, sizeof(struct conversionParameters));
@@ -44,6 +51,13 @@ static void defaultParameters(struct conversionParameters *aParams) {
 	aParams->logLevel = LLVL_INFO;
 	aParams->backupFile = "header_backup.img";
 	aParams->resumeFilename = "resume.bin";
+	aParams->maxJobs = 4;
+	aParams->numaNode = NUMA_NODE_AUTO;
+	aParams->dryRunSeconds = DRYRUN_DEFAULT_SECONDS;
+	aParams->batchIo = BATCHIO_AUTO;
+	aParams->batchWindow = BATCHIO_DEFAULT_WINDOW;
+	aParams->spillSize = SPILL_DEFAULT_SIZE;
+	aParams->workqueues = WORKQUEUES_AUTO;
 }
 
 static void syntax(char **argv, const char *aMessage, enum terminationCode_t aExitCode) {
@@ -56,11 +70,22 @@ static void syntax(char **argv, const char *aMessage, enum terminationCode_t aEx
 	fprintf(stderr, "%s (-d, --device=RAWDEV) (--readdev=DEV) (-b, --blocksize=BYTES)\n", argv[0]);
 	fprintf(stderr, "    (-c, --backupfile=FILE) (-k, --keyfile=FILE) (-p, --luksparam=PARAMS)\n");
 	fprintf(stderr, "    (-l, --loglevel=LVL) (--resume) (--resume-file=FILE) (--no-seatbelt)\n");
-	fprintf(stderr, "    (--i-know-what-im-doing) (-h, --help)\n");
+	fprintf(stderr, "    (--jobfile=FILE) (--max-jobs=N) (--memory-budget=BYTES)\n");
+	fprintf(stderr, "    (--io-rate-budget=BYTES) (--numa-node=NODE) (--engine=ENGINE)\n");
+	fprintf(stderr, "    (--crypto-threads=N) (--verify-engine) (--log-file=FILE)\n");
+	fprintf(stderr, "    (--record-trace=FILE) (--dry-run(=LIMIT)) (--recover) (--rollback)\n");
+	fprintf(stderr, "    (--recover-zero-fill) (--checkpoint(=BYTES))\n");
+	fprintf(stderr, "    (--batch-io=MODE) (--batch-window=BYTES) (--spill=FILE)\n");
+	fprintf(stderr, "    (--spill-size=BYTES) (--cipher-benchmark) (--auto-cipher)\n");
+	fprintf(stderr, "    (--sector-size=BYTES) (--dm-workqueues=MODE) (--fill-random(=RANGES))\n");
+	fprintf(stderr, "    (--luks-target=TARGET) (--i-know-what-im-doing)\n");
+	fprintf(stderr, "    (-h, --help)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  -d, --device=RAWDEV        Raw device that is about to be converted to LUKS. This is\n");
 	fprintf(stderr, "                             the device that luksFormat will be called on to create the\n");
-	fprintf(stderr, "                             new LUKS container. Mandatory argument.\n");
+	fprintf(stderr, "                             new LUKS container. May also be a disk image file, which is\n");
+	fprintf(stderr, "                             then attached to a loop device automatically. Mandatory\n");
+	fprintf(stderr, "                             argument.\n");
 	fprintf(stderr, "      --readdev=DEV          The device that the unencrypted data should be read from.\n");
 	fprintf(stderr, "                             This is only different from the raw device if the volume is\n");
 	fprintf(stderr, "                             already LUKS (or another container) and you want to\n");
@@ -97,9 +122,127 @@ static void syntax(char **argv, const char *aMessage, enum terminationCode_t aEx
 	fprintf(stderr, "                             read (when resuming a previously aborted conversion) and to\n");
 	fprintf(stderr, "                             which resume information is written (in the case of an\n");
 	fprintf(stderr, "                             abort). By default this will be resume.bin.\n");
+	fprintf(stderr, "      --recover              Resume an interrupted conversion for which no resume file\n");
+	fprintf(stderr, "                             was written (e.g. after the process was killed). The point\n");
+	fprintf(stderr, "                             at which the conversion stopped is located on the device\n");
+	fprintf(stderr, "                             and a new resume file is written. The data that was only\n");
+	fprintf(stderr, "                             held in memory at that time (one LUKS header size) is taken\n");
+	fprintf(stderr, "                             from the spill file or the header backup if possible. The\n");
+	fprintf(stderr, "                             header backup only covers the first 512 MiB of the device;\n");
+	fprintf(stderr, "                             if the conversion stopped further in and no spill file was\n");
+	fprintf(stderr, "                             used, luksipc refuses and prints the lost range.\n");
+	fprintf(stderr, "      --recover-zero-fill    With --recover, overwrite the data that cannot be restored\n");
+	fprintf(stderr, "                             with zeros instead of refusing. THIS DESTROYS ONE LUKS\n");
+	fprintf(stderr, "                             HEADER SIZE OF DATA (e.g. 16 MiB); the exact range is\n");
+	fprintf(stderr, "                             logged and must be restored from a backup afterwards.\n");
+	fprintf(stderr, "      --rollback             Undo an aborted conversion instead of resuming it: the part\n");
+	fprintf(stderr, "                             that was already converted is decrypted back onto the plain\n");
+	fprintf(stderr, "                             device, using the key file and the resume file. An\n");
+	fprintf(stderr, "                             interrupted rollback is continued with --rollback again.\n");
+	fprintf(stderr, "      --checkpoint(=BYTES)   Keep the resume file valid at all times, so that a\n");
+	fprintf(stderr, "                             conversion that was killed or lost power can be continued\n");
+	fprintf(stderr, "                             with --resume instead of --recover. The device is converted\n");
+	fprintf(stderr, "                             in spans of BYTES (suffixes k, M, G are accepted, by\n");
+	fprintf(stderr, "                             default %llu MiB), each one from its end towards its start\n", CHECKPOINT_DEFAULT_INTERVAL / 1024 / 1024);
+	fprintf(stderr, "                             in pieces of the LUKS header size. After every piece, the\n");
+	fprintf(stderr, "                             LUKS device and the resume file are flushed, which costs\n");
+	fprintf(stderr, "                             throughput. Cannot be combined with --engine=splice,\n");
+	fprintf(stderr, "                             --batch-io=on or a spill file.\n");
 	fprintf(stderr, "      --no-seatbelt          Disable several safetly checks which are in place to keep\n");
 	fprintf(stderr, "                             you from losing data. You really need to know what you're\n");
 	fprintf(stderr, "                             doing if you use this.\n");
+	fprintf(stderr, "      --jobfile=FILE         Convert several devices concurrently. Every line of FILE\n");
+	fprintf(stderr, "                             describes one conversion as 'DEVICE KEYFILE RESUMEFILE\n");
+	fprintf(stderr, "                             BACKUPFILE [GROUP]'. Devices of the same group (by default\n");
+	fprintf(stderr, "                             the whole disk a device resides on) are never converted at\n");
+	fprintf(stderr, "                             the same time. luksipc appends the state of every job to\n");
+	fprintf(stderr, "                             its line; running it again with the same job file skips\n");
+	fprintf(stderr, "                             finished jobs and resumes aborted ones. Cannot be combined\n");
+	fprintf(stderr, "                             with -d.\n");
+	fprintf(stderr, "      --max-jobs=N           Maximum number of conversions that run concurrently when\n");
+	fprintf(stderr, "                             using a job file. Defaults to 4.\n");
+	fprintf(stderr, "      --memory-budget=BYTES  Upper limit for the chunk memory of all concurrently\n");
+	fprintf(stderr, "                             running conversions. Suffixes k, M, G are accepted. By\n");
+	fprintf(stderr, "                             default, memory is not limited.\n");
+	fprintf(stderr, "      --io-rate-budget=BYTES Limit the copy rate to this many bytes per second. When\n");
+	fprintf(stderr, "                             using a job file, the budget is split evenly among all\n");
+	fprintf(stderr, "                             running conversions. By default, the rate is not limited.\n");
+	fprintf(stderr, "      --numa-node=NODE       Pin the copy process to the CPUs of this NUMA node and place\n");
+	fprintf(stderr, "                             the copy buffers in its memory. Can be a node number, 'auto'\n");
+	fprintf(stderr, "                             (the default, which uses the node the device's controller is\n");
+	fprintf(stderr, "                             attached to) or 'none' to disable placement.\n");
+	fprintf(stderr, "      --engine=ENGINE        Selects how data is written to the LUKS device. 'dmcrypt'\n");
+	fprintf(stderr, "                             (the default) writes through the kernel's dm-crypt device.\n");
+	fprintf(stderr, "                             'userspace' encrypts in user space on all CPUs and writes\n");
+	fprintf(stderr, "                             the ciphertext directly to the raw device. It only supports\n");
+	fprintf(stderr, "                             aes-xts-plain64 and requires a build with\n");
+	fprintf(stderr, "                             'make USERSPACE_CRYPTO=1'. 'splice' writes through dm-crypt\n");
+	fprintf(stderr, "                             like 'dmcrypt', but moves the data between the devices\n");
+	fprintf(stderr, "                             inside the kernel instead of copying it through user space.\n");
+	fprintf(stderr, "                             It cannot be combined with batched I/O or a spill file.\n");
+	fprintf(stderr, "      --crypto-threads=N     Number of encryption threads of the userspace engine and of\n");
+	fprintf(stderr, "                             generator threads of --fill-random. By default, one thread\n");
+	fprintf(stderr, "                             per online CPU is used.\n");
+	fprintf(stderr, "      --verify-engine        Read back every chunk written by the userspace engine\n");
+	fprintf(stderr, "                             through dm-crypt and compare it. By default, only the first\n");
+	fprintf(stderr, "                             chunk is verified.\n");
+	fprintf(stderr, "      --log-file=FILE        Additionally append all log messages (of the selected log\n");
+	fprintf(stderr, "                             level) to FILE.\n");
+	fprintf(stderr, "      --record-trace=FILE    Record every read, write and flush of the copy engine with\n");
+	fprintf(stderr, "                             offset, size and latency in a binary trace file, which can\n");
+	fprintf(stderr, "                             be replayed with tests/trace/trace_replay.\n");
+	fprintf(stderr, "      --dry-run(=LIMIT)      Measure how long the conversion will take without modifying\n");
+	fprintf(stderr, "                             the device. A copy-on-write overlay of the device is\n");
+	fprintf(stderr, "                             converted instead, changes are stored in a sparse file in\n");
+	fprintf(stderr, "                             $TMPDIR (or /var/tmp). LIMIT is either a time (e.g. 90s, 5m)\n");
+	fprintf(stderr, "                             or a fraction of the device (e.g. 10%%), by default the dry\n");
+	fprintf(stderr, "                             run stops after %d seconds.\n", DRYRUN_DEFAULT_SECONDS);
+	fprintf(stderr, "      --batch-io=MODE        Read several chunks in a row before writing them back, so\n");
+	fprintf(stderr, "                             that the disk head seeks less often between the read and\n");
+	fprintf(stderr, "                             write positions. MODE is 'auto' (the default, enabled when\n");
+	fprintf(stderr, "                             reading and writing the same rotational disk), 'on' or\n");
+	fprintf(stderr, "                             'off'. The batch size is derived from the measured seek\n");
+	fprintf(stderr, "                             time and transfer rate.\n");
+	fprintf(stderr, "      --batch-window=BYTES   Upper limit for the memory that holds one batch. Suffixes\n");
+	fprintf(stderr, "                             k, M, G are accepted. Defaults to %d MiB.\n", BATCHIO_DEFAULT_WINDOW / 1024 / 1024);
+	fprintf(stderr, "      --spill=FILE           Stage the batches in FILE instead of memory, which allows\n");
+	fprintf(stderr, "                             reading far ahead without much RAM. FILE should be on a\n");
+	fprintf(stderr, "                             different, fast device. Every chunk is stored with a\n");
+	fprintf(stderr, "                             checksum; --recover takes lost data from FILE if given.\n");
+	fprintf(stderr, "      --spill-size=BYTES     Size of the spill file. Suffixes k, M, G are accepted.\n");
+	fprintf(stderr, "                             Defaults to %llu MiB.\n", SPILL_DEFAULT_SIZE / 1024 / 1024);
+	fprintf(stderr, "      --cipher-benchmark     Measure the encryption and decryption rate of the kernel's\n");
+	fprintf(stderr, "                             implementations of the LUKS ciphers with the chunk size\n");
+	fprintf(stderr, "                             and number of threads (--crypto-threads) of a conversion,\n");
+	fprintf(stderr, "                             print a ranking and exit. No device is needed.\n");
+	fprintf(stderr, "      --auto-cipher          Run the cipher benchmark before converting and format the\n");
+	fprintf(stderr, "                             volume with the fastest cipher and key size. A cipher given\n");
+	fprintf(stderr, "                             with -p takes precedence.\n");
+	fprintf(stderr, "      --sector-size=BYTES    Encryption sector size of the new LUKS2 volume, either\n");
+	fprintf(stderr, "                             'auto' (the default) or 512, 1024, 2048 or 4096. The\n");
+	fprintf(stderr, "                             automatic choice is the logical block size of the disk, at\n");
+	fprintf(stderr, "                             most 4096 bytes, so that the filesystem keeps working.\n");
+	fprintf(stderr, "      --dm-workqueues=MODE   Whether dm-crypt queues reads and writes to its worker\n");
+	fprintf(stderr, "                             threads. MODE is 'auto' (the default, bypassed on SSDs and\n");
+	fprintf(stderr, "                             NVMe drives), 'on' or 'off'. Requires cryptsetup 2.3.4.\n");
+	fprintf(stderr, "      --fill-random(=RANGES) After the conversion, overwrite the space at the end of the\n");
+	fprintf(stderr, "                             LUKS device that held no plain data (when the new LUKS\n");
+	fprintf(stderr, "                             header is smaller than the old one) with random data from a\n");
+	fprintf(stderr, "                             ChaCha20 generator that runs on all CPUs (--crypto-threads).\n");
+	fprintf(stderr, "                             RANGES are comma separated OFFSET:LENGTH ranges of the LUKS\n");
+	fprintf(stderr, "                             device that are filled as well, whatever they contain, e.g.\n");
+	fprintf(stderr, "                             unused space of the file system. Suffixes k, M, G are\n");
+	fprintf(stderr, "                             accepted. At most %d ranges can be given.\n", MAX_FILL_RANGES);
+	fprintf(stderr, "      --luks-target=TARGET   What creates and opens the LUKS device. 'dmcrypt' (the\n");
+	fprintf(stderr, "                             default) uses cryptsetup and dm-crypt and needs root.\n");
+	fprintf(stderr, "                             'userspace' writes the LUKS2 header (with a PBKDF2\n");
+	fprintf(stderr, "                             keyslot) itself and encrypts in user space, so that an\n");
+	fprintf(stderr, "                             image file can be converted without root. It\n");
+	fprintf(stderr, "                             only supports aes-xts-plain64 with a 512 bit key and\n");
+	fprintf(stderr, "                             requires a build with 'make USERSPACE_CRYPTO=1'. The\n");
+	fprintf(stderr, "                             PBKDF2-SHA256 iterations are timed to take about 2s\n");
+	fprintf(stderr, "                             (at least 100000); this is weaker than cryptsetup's\n");
+	fprintf(stderr, "                             Argon2id, so replace the keyslot with luksAddKey.\n");
 	fprintf(stderr, "      --i-know-what-im-doing Enable batch mode (will not ask any questions or\n");
 	fprintf(stderr, "                             confirmations interactively). Please note that you will have\n");
 	fprintf(stderr, "                             to perform any and all sanity checks by yourself if you use\n");
@@ -126,6 +269,9 @@ static void syntax(char **argv, const char *aMessage, enum terminationCode_t aEx
 	fprintf(stderr, "       parameters of the LUKS container (different cipher) or to change the bulk\n");
 	fprintf(stderr, "       encryption key. In this example the old container is unlocked and accessible\n");
 	fprintf(stderr, "       under /dev/mapper/oldluks.\n");
+	fprintf(stderr, "    %s --jobfile /root/jobs.txt --memory-budget 1G --io-rate-budget 400M\n", argv[0]);
+	fprintf(stderr, "       Converts all devices listed in /root/jobs.txt, using at most 1 GiB of chunk\n");
+	fprintf(stderr, "       memory and copying at most 400 MiB per second in total.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "luksipc version: " BUILD_REVISION "\n");
 #ifdef DEVELOPMENT
@@ -142,9 +288,95 @@ static void syntax(char **argv, const char *aMessage, enum terminationCode_t aEx
 
 static void checkParameters(char **argv, const struct conversionParameters *aParams) {
 	char errorMessage[256];
-	if (!aParams->readDevice) {
+	if ((!aParams->readDevice) && (!aParams->jobFile) && (!aParams->cipherBenchmark)) {
 		syntax(argv, "No device to convert was given on the command line", EC_CMDLINE_ARGUMENT_ERROR);
 	}
+	if (aParams->readDevice && aParams->jobFile) {
+		syntax(argv, "A job file cannot be combined with a device given on the command line", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->maxJobs < 1) {
+		snprintf(errorMessage, sizeof(errorMessage), "At least one concurrent job must be allowed, user specified %d.", aParams->maxJobs);
+		syntax(argv, errorMessage, EC_CMDLINE_ARGUMENT_ERROR);
+	}
+#ifndef USERSPACE_CRYPTO
+	if (aParams->engine == ENGINE_USERSPACE) {
+		syntax(argv, "The userspace engine is not available in this build, rebuild with 'make USERSPACE_CRYPTO=1'.", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->luksTarget == LUKSTARGET_USERSPACE) {
+		syntax(argv, "The userspace LUKS target is not available in this build, rebuild with 'make USERSPACE_CRYPTO=1'.", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+#endif
+	if ((aParams->luksTarget == LUKSTARGET_USERSPACE) && (aParams->engine != ENGINE_DMCRYPT)) {
+		syntax(argv, "The userspace LUKS target encrypts by itself and cannot be combined with another engine", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if ((aParams->luksTarget == LUKSTARGET_USERSPACE) && aParams->dryRun) {
+		syntax(argv, "A dry run needs a device mapper snapshot and cannot use the userspace LUKS target", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if ((aParams->luksTarget == LUKSTARGET_USERSPACE) && aParams->luksFormatParams) {
+		syntax(argv, "LUKS format parameters are passed to cryptsetup and cannot be used with the userspace LUKS target", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if ((aParams->luksTarget == LUKSTARGET_USERSPACE) && aParams->autoCipher) {
+		syntax(argv, "The userspace LUKS target only supports aes-xts-plain64 and cannot pick a cipher by benchmark", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->cryptoThreads < 0) {
+		snprintf(errorMessage, sizeof(errorMessage), "Number of encryption threads cannot be negative, user specified %d.", aParams->cryptoThreads);
+		syntax(argv, errorMessage, EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->dryRun && aParams->jobFile) {
+		syntax(argv, "A dry run is only possible for a single device, not for a job file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->dryRun && aParams->resuming) {
+		syntax(argv, "A dry run cannot be resumed", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->recover && aParams->jobFile) {
+		syntax(argv, "Recovery is only possible for a single device, not for a job file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->rollback && aParams->jobFile) {
+		syntax(argv, "A rollback is only possible for a single device, not for a job file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->rollback && aParams->recover) {
+		syntax(argv, "A rollback needs the resume file and cannot be combined with --recover", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->recoverZeroFill && !aParams->recover) {
+		syntax(argv, "--recover-zero-fill only applies to --recover", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->rollback && aParams->traceFile) {
+		syntax(argv, "An I/O trace cannot be recorded for a rollback", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->checkpointInterval && aParams->rollback) {
+		syntax(argv, "A rollback cannot write checkpoints, it is continued with --rollback after a crash", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->checkpointInterval && (aParams->engine == ENGINE_SPLICE)) {
+		syntax(argv, "The splice engine moves whole chunks and cannot be combined with --checkpoint", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->checkpointInterval && ((aParams->batchIo == BATCHIO_ON) || aParams->spillFile)) {
+		syntax(argv, "Checkpointed copying does not read ahead and cannot be combined with --batch-io=on or a spill file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->checkpointInterval && (aParams->checkpointInterval < (uint64_t)aParams->blocksize)) {
+		snprintf(errorMessage, sizeof(errorMessage), "The checkpoint interval needs to be at least the blocksize of %d bytes, user specified %" PRIu64 " bytes.", aParams->blocksize, aParams->checkpointInterval);
+		syntax(argv, errorMessage, EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->spillFile && aParams->jobFile) {
+		syntax(argv, "A spill file can only be used for a single device, not for a job file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if ((aParams->engine == ENGINE_SPLICE) && aParams->spillFile) {
+		syntax(argv, "The splice engine does not read ahead and cannot be combined with a spill file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if ((aParams->engine == ENGINE_SPLICE) && (aParams->batchIo == BATCHIO_ON)) {
+		syntax(argv, "The splice engine moves every chunk right away and cannot be combined with --batch-io=on", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->fillRandom && aParams->rollback) {
+		syntax(argv, "A rollback restores the plain device and cannot fill space with random data", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->fillRandom && aParams->dryRun) {
+		syntax(argv, "A dry run cannot fill space with random data", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->fillRangeCount && aParams->jobFile) {
+		syntax(argv, "Ranges to fill with random data can only be given for a single device, not for a job file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
+	if (aParams->traceFile && aParams->jobFile) {
+		syntax(argv, "An I/O trace can only be recorded for a single device, not for a job file", EC_CMDLINE_ARGUMENT_ERROR);
+	}
 	if ((aParams->luksFormatParams) && ((strlen(aParams->luksFormatParams) + 1) > MAX_ARGLENGTH)) {
 		snprintf(errorMessage, sizeof(errorMessage), "Length of LUKS format parameters exceeds maximum of %d.", MAX_ARGLENGTH);
 		syntax(argv, errorMessage, EC_CMDLINE_ARGUMENT_ERROR);
@@ -153,18 +385,97 @@ static void checkParameters(char **argv, const struct conversionParameters *aPar
 		snprintf(errorMessage, sizeof(errorMessage), "Blocksize needs to be at the very least %d bytes (size of LUKS header), user specified %d bytes.", MINBLOCKSIZE, aParams->blocksize);
 		syntax(argv, errorMessage, EC_CMDLINE_ARGUMENT_ERROR);
 	}
+	if ((aParams->luksTarget == LUKSTARGET_USERSPACE) && (aParams->blocksize < LUKS2_DATA_OFFSET)) {
+		snprintf(errorMessage, sizeof(errorMessage), "The userspace LUKS target writes a %d bytes LUKS2 header, blocksize needs to be at least as large, user specified %d bytes.", LUKS2_DATA_OFFSET, aParams->blocksize);
+		syntax(argv, errorMessage, EC_CMDLINE_ARGUMENT_ERROR);
+	}
 	if ((aParams->logLevel < 0) || (aParams->logLevel > LLVL_DEBUG)) {
 		snprintf(errorMessage, sizeof(errorMessage), "Loglevel needs to be inbetween 0 and %d, user specified %d.", LLVL_DEBUG, aParams->logLevel);
 		syntax(argv, errorMessage, EC_CMDLINE_ARGUMENT_ERROR);
 	}
 }
 
+/* Parses a dry run limit, either a fraction of the device ("10%") or a time
+ * in seconds, minutes or hours ("90", "90s", "5m", "1h") */
+static bool parseDryRunLimit(const char *aString, struct conversionParameters *aParams) {
+	char *endPtr;
+	double value = strtod(aString, &endPtr);
+	if ((endPtr == aString) || (value <= 0)) {
+		return false;
+	}
+	aParams->dryRunSeconds = 0;
+	aParams->dryRunFraction = 0;
+	if (!strcmp(endPtr, "%")) {
+		if (value > 100) {
+			return false;
+		}
+		aParams->dryRunFraction = value / 100;
+	} else if (!strcmp(endPtr, "") || !strcmp(endPtr, "s")) {
+		aParams->dryRunSeconds = value;
+	} else if (!strcmp(endPtr, "m")) {
+		aParams->dryRunSeconds = value * 60;
+	} else if (!strcmp(endPtr, "h")) {
+		aParams->dryRunSeconds = value * 3600;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* Parses comma separated OFFSET:LENGTH ranges to fill with random data */
+static bool parseFillRanges(const char *aString, struct conversionParameters *aParams) {
+	char *string = strdup(aString);
+	if (!string) {
+		return false;
+	}
+	bool success = true;
+	char *savePtr = NULL;
+	for (char *token = strtok_r(string, ",", &savePtr); success && token; token = strtok_r(NULL, ",", &savePtr)) {
+		char *separator = strchr(token, ':');
+		if (!separator || (aParams->fillRangeCount >= MAX_FILL_RANGES)) {
+			success = false;
+			break;
+		}
+		*separator = 0;
+		struct fillRange *range = &aParams->fillRanges[aParams->fillRangeCount];
+		success = parseByteSize(token, &range->offset) && parseByteSize(separator + 1, &range->length) && (range->length > 0);
+		aParams->fillRangeCount++;
+	}
+	free(string);
+	return success && (aParams->fillRangeCount > 0);
+}
+
 enum longOnlyOptions_t {
 	OPT_IKNOWWHATIMDOING = 0x1000,
 	OPT_RESUME,
 	OPT_RESUME_FILE,
 	OPT_READDEVICE,
 	OPT_NOSEATBELT,
+	OPT_JOBFILE,
+	OPT_MAXJOBS,
+	OPT_MEMORYBUDGET,
+	OPT_IORATEBUDGET,
+	OPT_NUMANODE,
+	OPT_ENGINE,
+	OPT_CRYPTOTHREADS,
+	OPT_VERIFYENGINE,
+	OPT_LOGFILE,
+	OPT_RECORDTRACE,
+	OPT_DRYRUN,
+	OPT_RECOVER,
+	OPT_RECOVERZEROFILL,
+	OPT_ROLLBACK,
+	OPT_CHECKPOINT,
+	OPT_BATCHIO,
+	OPT_BATCHWINDOW,
+	OPT_SPILL,
+	OPT_SPILLSIZE,
+	OPT_CIPHERBENCHMARK,
+	OPT_AUTOCIPHER,
+	OPT_SECTORSIZE,
+	OPT_DMWORKQUEUES,
+	OPT_FILLRANDOM,
+	OPT_LUKSTARGET,
 #ifdef DEVELOPMENT
 	OPT_DEV_IOERRORS,
 	OPT_DEV_SLOWDOWN
@@ -182,7 +493,32 @@ void parseParameters(struct conversionParameters *aParams, int argc, char **argv
 		{ "loglevel", 1, NULL, 'l' },
 		{ "resume", 0, NULL, OPT_RESUME },
 		{ "resume-file", 1, NULL, OPT_RESUME_FILE },
+		{ "recover", 0, NULL, OPT_RECOVER },
+		{ "recover-zero-fill", 0, NULL, OPT_RECOVERZEROFILL },
+		{ "rollback", 0, NULL, OPT_ROLLBACK },
+		{ "checkpoint", 2, NULL, OPT_CHECKPOINT },
 		{ "no-seatbelt", 0, NULL, OPT_NOSEATBELT },
+		{ "jobfile", 1, NULL, OPT_JOBFILE },
+		{ "max-jobs", 1, NULL, OPT_MAXJOBS },
+		{ "memory-budget", 1, NULL, OPT_MEMORYBUDGET },
+		{ "io-rate-budget", 1, NULL, OPT_IORATEBUDGET },
+		{ "numa-node", 1, NULL, OPT_NUMANODE },
+		{ "engine", 1, NULL, OPT_ENGINE },
+		{ "crypto-threads", 1, NULL, OPT_CRYPTOTHREADS },
+		{ "verify-engine", 0, NULL, OPT_VERIFYENGINE },
+		{ "log-file", 1, NULL, OPT_LOGFILE },
+		{ "record-trace", 1, NULL, OPT_RECORDTRACE },
+		{ "dry-run", 2, NULL, OPT_DRYRUN },
+		{ "batch-io", 1, NULL, OPT_BATCHIO },
+		{ "batch-window", 1, NULL, OPT_BATCHWINDOW },
+		{ "spill", 1, NULL, OPT_SPILL },
+		{ "spill-size", 1, NULL, OPT_SPILLSIZE },
+		{ "cipher-benchmark", 0, NULL, OPT_CIPHERBENCHMARK },
+		{ "auto-cipher", 0, NULL, OPT_AUTOCIPHER },
+		{ "sector-size", 1, NULL, OPT_SECTORSIZE },
+		{ "dm-workqueues", 1, NULL, OPT_DMWORKQUEUES },
+		{ "fill-random", 2, NULL, OPT_FILLRANDOM },
+		{ "luks-target", 1, NULL, OPT_LUKSTARGET },
 		{ "i-know-what-im-doing", 0, NULL, OPT_IKNOWWHATIMDOING },
 		{ "i-know-what-im-doinx", 0, NULL, 'h' },							/* Do not allow abbreviation of --i-know-what-im-doing */
 #ifdef DEVELOPMENT
@@ -245,10 +581,189 @@ void parseParameters(struct conversionParameters *aParams, int argc, char **argv
 				aParams->resumeFilename = optarg;
 				break;
 
+			case OPT_RECOVER:
+				aParams->resuming = true;
+				aParams->recover = true;
+				break;
+
+			case OPT_RECOVERZEROFILL:
+				aParams->recoverZeroFill = true;
+				break;
+
+			case OPT_ROLLBACK:
+				aParams->resuming = true;
+				aParams->rollback = true;
+				break;
+
+			case OPT_CHECKPOINT:
+				aParams->checkpointInterval = CHECKPOINT_DEFAULT_INTERVAL;
+				if (optarg && (!parseByteSize(optarg, &aParams->checkpointInterval) || (aParams->checkpointInterval == 0))) {
+					fprintf(stderr, "Error: Cannot convert the value '%s' you passed as a checkpoint interval.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
 			case OPT_NOSEATBELT:
 				aParams->safetyChecks = false;
 				break;
 
+			case OPT_JOBFILE:
+				aParams->jobFile = optarg;
+				break;
+
+			case OPT_MAXJOBS:
+				aParams->maxJobs = atoi(optarg);
+				break;
+
+			case OPT_MEMORYBUDGET:
+				if (!parseByteSize(optarg, &aParams->memoryBudget)) {
+					fprintf(stderr, "Error: Cannot convert the value '%s' you passed as a memory budget.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_IORATEBUDGET:
+				if (!parseByteSize(optarg, &aParams->ioRateBudget)) {
+					fprintf(stderr, "Error: Cannot convert the value '%s' you passed as an I/O rate budget.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_NUMANODE:
+				if (!strcmp(optarg, "auto")) {
+					aParams->numaNode = NUMA_NODE_AUTO;
+				} else if (!strcmp(optarg, "none")) {
+					aParams->numaNode = NUMA_NODE_NONE;
+				} else {
+					char *endPtr = NULL;
+					aParams->numaNode = strtol(optarg, &endPtr, 10);
+					if ((endPtr == NULL) || (*endPtr != 0) || (aParams->numaNode < 0)) {
+						fprintf(stderr, "Error: NUMA node must be a nonnegative integer, 'auto' or 'none', not '%s'.\n", optarg);
+						terminate(EC_CMDLINE_ARGUMENT_ERROR);
+					}
+				}
+				break;
+
+			case OPT_ENGINE:
+				if (!strcmp(optarg, "dmcrypt")) {
+					aParams->engine = ENGINE_DMCRYPT;
+				} else if (!strcmp(optarg, "userspace")) {
+					aParams->engine = ENGINE_USERSPACE;
+				} else if (!strcmp(optarg, "splice")) {
+					aParams->engine = ENGINE_SPLICE;
+				} else {
+					fprintf(stderr, "Error: Engine must be 'dmcrypt', 'userspace' or 'splice', not '%s'.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_CRYPTOTHREADS:
+				aParams->cryptoThreads = atoi(optarg);
+				break;
+
+			case OPT_VERIFYENGINE:
+				aParams->verifyEngine = true;
+				break;
+
+			case OPT_LOGFILE:
+				aParams->logFile = optarg;
+				break;
+
+			case OPT_RECORDTRACE:
+				aParams->traceFile = optarg;
+				break;
+
+			case OPT_DRYRUN:
+				aParams->dryRun = true;
+				if (optarg && !parseDryRunLimit(optarg, aParams)) {
+					fprintf(stderr, "Error: Invalid dry run limit '%s', expected e.g. 10%%, 90s or 5m.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_BATCHIO:
+				if (!strcmp(optarg, "auto")) {
+					aParams->batchIo = BATCHIO_AUTO;
+				} else if (!strcmp(optarg, "on")) {
+					aParams->batchIo = BATCHIO_ON;
+				} else if (!strcmp(optarg, "off")) {
+					aParams->batchIo = BATCHIO_OFF;
+				} else {
+					fprintf(stderr, "Error: Batch I/O mode must be 'auto', 'on' or 'off', not '%s'.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_BATCHWINDOW:
+				if (!parseByteSize(optarg, &aParams->batchWindow)) {
+					fprintf(stderr, "Error: Cannot convert the value '%s' you passed as a batch window.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_SPILL:
+				aParams->spillFile = optarg;
+				break;
+
+			case OPT_SPILLSIZE:
+				if (!parseByteSize(optarg, &aParams->spillSize)) {
+					fprintf(stderr, "Error: Cannot convert the value '%s' you passed as a spill size.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_CIPHERBENCHMARK:
+				aParams->cipherBenchmark = true;
+				break;
+
+			case OPT_AUTOCIPHER:
+				aParams->autoCipher = true;
+				break;
+
+			case OPT_SECTORSIZE:
+				if (!strcmp(optarg, "auto")) {
+					aParams->cryptSectorSize = 0;
+				} else {
+					aParams->cryptSectorSize = atoi(optarg);
+					if ((aParams->cryptSectorSize < 512) || (aParams->cryptSectorSize > 4096) || (aParams->cryptSectorSize & (aParams->cryptSectorSize - 1))) {
+						fprintf(stderr, "Error: Sector size must be 'auto', 512, 1024, 2048 or 4096, not '%s'.\n", optarg);
+						terminate(EC_CMDLINE_ARGUMENT_ERROR);
+					}
+				}
+				break;
+
+			case OPT_DMWORKQUEUES:
+				if (!strcmp(optarg, "auto")) {
+					aParams->workqueues = WORKQUEUES_AUTO;
+				} else if (!strcmp(optarg, "on")) {
+					aParams->workqueues = WORKQUEUES_ON;
+				} else if (!strcmp(optarg, "off")) {
+					aParams->workqueues = WORKQUEUES_OFF;
+				} else {
+					fprintf(stderr, "Error: Workqueue mode must be 'auto', 'on' or 'off', not '%s'.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_FILLRANDOM:
+				aParams->fillRandom = true;
+				if (optarg && !parseFillRanges(optarg, aParams)) {
+					fprintf(stderr, "Error: Invalid ranges to fill with random data '%s', expected e.g. 10G:2G,50G:512M (at most %d ranges).\n", optarg, MAX_FILL_RANGES);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
+			case OPT_LUKSTARGET:
+				if (!strcmp(optarg, "dmcrypt")) {
+					aParams->luksTarget = LUKSTARGET_DMCRYPT;
+				} else if (!strcmp(optarg, "userspace")) {
+					aParams->luksTarget = LUKSTARGET_USERSPACE;
+				} else {
+					fprintf(stderr, "Error: LUKS target must be 'dmcrypt' or 'userspace', not '%s'.\n", optarg);
+					terminate(EC_CMDLINE_ARGUMENT_ERROR);
+				}
+				break;
+
 			case OPT_IKNOWWHATIMDOING:
 				aParams->batchMode = true;
 				break;
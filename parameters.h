@@ -25,8 +25,39 @@
 #define __PARAMETERS_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define MINBLOCKSIZE			(1024 * 1024 * 10)
+#define MAX_FILL_RANGES			16
+
+enum copyEngine_t {
+	ENGINE_DMCRYPT,						/* Write plaintext through the dm-crypt device */
+	ENGINE_USERSPACE,					/* Encrypt in user space, write ciphertext to the raw device */
+	ENGINE_SPLICE,						/* Like dmcrypt, but move the data with splice(2) */
+};
+
+enum luksTarget_t {
+	LUKSTARGET_DMCRYPT,					/* Format and open with cryptsetup, write through dm-crypt */
+	LUKSTARGET_USERSPACE,				/* Write the LUKS2 header and encrypt in luksipc, no root needed */
+};
+
+enum batchIo_t {
+	BATCHIO_AUTO,						/* Batch reads and writes if the device is on a rotational disk */
+	BATCHIO_ON,
+	BATCHIO_OFF,
+};
+
+enum cryptWorkqueues_t {
+	WORKQUEUES_AUTO,					/* Bypass dm-crypt's workqueues on non-rotational disks */
+	WORKQUEUES_ON,
+	WORKQUEUES_OFF,
+};
+
+/* Range of the LUKS device that is filled with random data */
+struct fillRange {
+	uint64_t offset;
+	uint64_t length;
+};
 
 struct conversionParameters {
 	int blocksize;
@@ -34,8 +65,14 @@ struct conversionParameters {
 	const char *readDevice;				/* Partition that data is read from (for initial conversion idential to rawDevice, but for reLUKSification maybe /dev/mapper/oldluks) */
 	const char *keyFile;
 	const char *luksFormatParams;
+	const char *luksCipher;				/* Cipher for luksFormat chosen by the benchmark, NULL = cryptsetup default */
+	int luksKeySize;					/* Key size in bits for luksCipher */
 	bool resuming;						/* Should the process resume using the given file? */
 	const char *resumeFilename;			/* Use this file for storing resume data */
+	bool recover;						/* Resume by locating the conversion boundary on disk instead of reading the resume file */
+	bool recoverZeroFill;				/* Zero the data that --recover cannot restore instead of refusing */
+	bool rollback;						/* Copy the converted part back to the plain device */
+	uint64_t checkpointInterval;		/* Keep the resume file valid, moving spans of this many bytes; 0 = off */
 
 	const char *backupFile;				/* File in which header backup is written before luksFormat */
 	bool batchMode;
@@ -43,6 +80,33 @@ struct conversionParameters {
 	int logLevel;
 	bool reluksification;
 
+	const char *jobFile;				/* Convert all devices listed in this file concurrently */
+	int maxJobs;						/* Maximum number of concurrently running conversion jobs */
+	uint64_t memoryBudget;				/* Maximum chunk memory of all concurrently running jobs, 0 = unlimited */
+	uint64_t ioRateBudget;				/* Maximum copy rate in bytes/sec (shared by all jobs), 0 = unlimited */
+	int numaNode;						/* NUMA node to place copy process and buffers on, or NUMA_NODE_AUTO/NUMA_NODE_NONE */
+	enum copyEngine_t engine;			/* How the data gets onto the LUKS device */
+	enum luksTarget_t luksTarget;		/* What creates and opens the LUKS device */
+	int cryptoThreads;					/* Encryption threads of the userspace engine, 0 = one per CPU */
+	bool verifyEngine;					/* Compare every chunk written by the userspace engine against dm-crypt */
+	const char *logFile;				/* Additionally append all log messages to this file */
+	const char *traceFile;				/* Record all I/O of the copy engine to this file */
+	bool dryRun;						/* Convert a copy-on-write overlay of the device to measure the duration */
+	double dryRunSeconds;				/* Stop the dry run after this time, 0 = no time limit */
+	double dryRunFraction;				/* Stop the dry run after this fraction of the device, 0 = no limit */
+	uint64_t dryRunOverlaySpace;		/* Free space for changes to the overlay, determined when creating it */
+	enum batchIo_t batchIo;				/* Read and write several chunks at once to save seeks */
+	uint64_t batchWindow;				/* Maximum chunk memory when batching reads and writes */
+	const char *spillFile;				/* Stage batches in this file instead of memory */
+	uint64_t spillSize;					/* Size of the spill file */
+	bool cipherBenchmark;				/* Only benchmark the ciphers and recommend one */
+	bool autoCipher;					/* Format with the cipher that performs best in the benchmark */
+	int cryptSectorSize;				/* Encryption sector size for luksFormat, 0 = automatic */
+	enum cryptWorkqueues_t workqueues;	/* Use dm-crypt's read and write workqueues */
+	bool fillRandom;					/* Fill space freed by the conversion with random data */
+	int fillRangeCount;					/* Ranges that are filled with random data as well */
+	struct fillRange fillRanges[MAX_FILL_RANGES];
+
 #ifdef DEVELOPMENT
 	struct {
 		bool slowDown;					/* Simulate slow devices */
@@ -0,0 +1,385 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "preflight.h"
+#include "sysfs.h"
+#include "logging.h"
+#include "utils.h"
+
+#define SYSFS_BLOCK_CLASS			"/sys/class/block"
+
+static unsigned int hashSlot(dev_t aDevice, int aHashSize) {
+	uint64_t hash = (uint64_t)aDevice * 0x9e3779b97f4a7c15ULL;
+	return (hash >> 32) & (aHashSize - 1);
+}
+
+static int findDevice(const struct deviceTopology *aTopology, dev_t aDevice) {
+	if (aTopology->hashSize == 0) {
+		return -1;
+	}
+	for (unsigned int slot = hashSlot(aDevice, aTopology->hashSize); aTopology->hashTable[slot]; slot = (slot + 1) & (aTopology->hashSize - 1)) {
+		int index = aTopology->hashTable[slot] - 1;
+		if (aTopology->devices[index].device == aDevice) {
+			return index;
+		}
+	}
+	return -1;
+}
+
+static void hashInsert(struct deviceTopology *aTopology, int aIndex) {
+	unsigned int slot = hashSlot(aTopology->devices[aIndex].device, aTopology->hashSize);
+	while (aTopology->hashTable[slot]) {
+		slot = (slot + 1) & (aTopology->hashSize - 1);
+	}
+	aTopology->hashTable[slot] = aIndex + 1;
+}
+
+/* Returns the index of the device with the given kernel name, which is added
+ * if it is not known yet, or -1 if out of memory */
+static int addDevice(struct deviceTopology *aTopology, dev_t aDevice, const char *aName) {
+	int index = findDevice(aTopology, aDevice);
+	if (index != -1) {
+		return index;
+	}
+
+	if (aTopology->deviceCount == aTopology->deviceCapacity) {
+		int capacity = aTopology->deviceCapacity ? (2 * aTopology->deviceCapacity) : 64;
+		struct topologyDevice *devices = realloc(aTopology->devices, capacity * sizeof(struct topologyDevice));
+		if (!devices) {
+			return -1;
+		}
+		aTopology->devices = devices;
+		aTopology->deviceCapacity = capacity;
+	}
+	index = aTopology->deviceCount;
+	struct topologyDevice *entry = &aTopology->devices[index];
+	memset(entry, 0, sizeof(struct topologyDevice));
+	entry->device = aDevice;
+	entry->parent = -1;
+	safestrcpy(entry->name, aName, sizeof(entry->name));
+
+	/* The hash table is kept at most half full */
+	if (2 * (aTopology->deviceCount + 1) > aTopology->hashSize) {
+		int hashSize = aTopology->hashSize ? (2 * aTopology->hashSize) : 256;
+		int *hashTable = calloc(hashSize, sizeof(int));
+		if (!hashTable) {
+			return -1;
+		}
+		free(aTopology->hashTable);
+		aTopology->hashTable = hashTable;
+		aTopology->hashSize = hashSize;
+		for (int i = 0; i < aTopology->deviceCount; i++) {
+			hashInsert(aTopology, i);
+		}
+	}
+	aTopology->deviceCount++;
+	hashInsert(aTopology, index);
+	return index;
+}
+
+static bool addHolder(struct deviceTopology *aTopology, int aHolder) {
+	if (aTopology->holderCount == aTopology->holderCapacity) {
+		int capacity = aTopology->holderCapacity ? (2 * aTopology->holderCapacity) : 64;
+		int *holders = realloc(aTopology->holders, capacity * sizeof(int));
+		if (!holders) {
+			return false;
+		}
+		aTopology->holders = holders;
+		aTopology->holderCapacity = capacity;
+	}
+	aTopology->holders[aTopology->holderCount++] = aHolder;
+	return true;
+}
+
+/* Reads the device number of a block device from sysfs by its kernel name */
+static bool readDeviceNumber(const char *aName, dev_t *aDevice) {
+	char path[PATH_MAX];
+	char value[32];
+	unsigned int devMajor, devMinor;
+	snprintf(path, sizeof(path), SYSFS_BLOCK_CLASS "/%s/dev", aName);
+	if (!readSysfsString(path, value, sizeof(value)) || (sscanf(value, "%u:%u", &devMajor, &devMinor) != 2)) {
+		return false;
+	}
+	*aDevice = makedev(devMajor, devMinor);
+	return true;
+}
+
+/* Kernel name of a device, for device mapper devices followed by their name
+ * (e.g. "dm-0 (vg-root)") */
+static void describeDevice(const struct topologyDevice *aDevice, char *aDescription, int aDescriptionSize) {
+	char path[PATH_MAX];
+	char dmName[128];
+	snprintf(path, sizeof(path), SYSFS_BLOCK_CLASS "/%s/dm/name", aDevice->name);
+	if (readSysfsString(path, dmName, sizeof(dmName))) {
+		snprintf(aDescription, aDescriptionSize, "%s (%s)", aDevice->name, dmName);
+	} else {
+		snprintf(aDescription, aDescriptionSize, "%s", aDevice->name);
+	}
+}
+
+/* Finds the whole disk of a partition, which is the parent directory of the
+ * partition in the sysfs device hierarchy */
+static int findPartitionParent(const struct deviceTopology *aTopology, const char *aName) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), SYSFS_BLOCK_CLASS "/%s/partition", aName);
+	if (!doesFileExist(path)) {
+		return -1;
+	}
+	snprintf(path, sizeof(path), SYSFS_BLOCK_CLASS "/%s", aName);
+	char resolvedPath[PATH_MAX];
+	if (!realpath(path, resolvedPath)) {
+		return -1;
+	}
+	char *lastSlash = strrchr(resolvedPath, '/');
+	if (!lastSlash) {
+		return -1;
+	}
+	*lastSlash = 0;
+	const char *parentName = strrchr(resolvedPath, '/');
+	dev_t parent;
+	if (!parentName || !readDeviceNumber(parentName + 1, &parent)) {
+		return -1;
+	}
+	return findDevice(aTopology, parent);
+}
+
+static bool scanBlockDevices(struct deviceTopology *aTopology) {
+	DIR *dir = opendir(SYSFS_BLOCK_CLASS);
+	if (!dir) {
+		logmsg(LLVL_ERROR, "Cannot list block devices in %s: %s\n", SYSFS_BLOCK_CLASS, strerror(errno));
+		return false;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		dev_t device;
+		if ((entry->d_name[0] == '.') || !readDeviceNumber(entry->d_name, &device)) {
+			continue;
+		}
+		if (addDevice(aTopology, device, entry->d_name) == -1) {
+			closedir(dir);
+			return false;
+		}
+	}
+	closedir(dir);
+
+	/* With all devices known, link partitions and stacked devices */
+	for (int i = 0; i < aTopology->deviceCount; i++) {
+		struct topologyDevice *device = &aTopology->devices[i];
+		device->parent = findPartitionParent(aTopology, device->name);
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), SYSFS_BLOCK_CLASS "/%s/holders", device->name);
+		device->firstHolder = aTopology->holderCount;
+		dir = opendir(path);
+		if (!dir) {
+			continue;
+		}
+		while ((entry = readdir(dir)) != NULL) {
+			dev_t holderDevice;
+			if ((entry->d_name[0] == '.') || !readDeviceNumber(entry->d_name, &holderDevice)) {
+				continue;
+			}
+			int holder = findDevice(aTopology, holderDevice);
+			if ((holder != -1) && !addHolder(aTopology, holder)) {
+				closedir(dir);
+				return false;
+			}
+		}
+		closedir(dir);
+		device->holderCount = aTopology->holderCount - device->firstHolder;
+	}
+	return true;
+}
+
+static void setUsage(struct deviceTopology *aTopology, dev_t aDevice, const char *aUsage, const char *aWhere) {
+	int index = findDevice(aTopology, aDevice);
+	if ((index != -1) && !aTopology->devices[index].usage[0]) {
+		snprintf(aTopology->devices[index].usage, sizeof(aTopology->devices[index].usage), "%s%s", aUsage, aWhere);
+	}
+}
+
+static bool scanMounts(struct deviceTopology *aTopology) {
+	FILE *f = fopen("/proc/self/mountinfo", "r");
+	if (!f) {
+		logmsg(LLVL_ERROR, "Cannot read /proc/self/mountinfo: %s\n", strerror(errno));
+		return false;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned int devMajor, devMinor;
+		char mountPoint[256];
+		if (sscanf(line, "%*d %*d %u:%u %*s %255s", &devMajor, &devMinor, mountPoint) != 3) {
+			continue;
+		}
+		dev_t device = makedev(devMajor, devMinor);
+		if (devMajor == 0) {
+			/* File systems that span several devices (e.g. btrfs) have an
+			 * anonymous device number, but name a device as their source */
+			const char *separator = strstr(line, " - ");
+			char source[1024];
+			struct stat statBuf;
+			if (!separator || (sscanf(separator + 3, "%*s %1023s", source) != 1) || (source[0] != '/') || (stat(source, &statBuf) != 0) || !S_ISBLK(statBuf.st_mode)) {
+				continue;
+			}
+			device = statBuf.st_rdev;
+		}
+		setUsage(aTopology, device, "mounted at ", mountPoint);
+	}
+	fclose(f);
+	return true;
+}
+
+static void scanSwaps(struct deviceTopology *aTopology) {
+	FILE *f = fopen("/proc/swaps", "r");
+	if (!f) {
+		/* Kernels built without swap support do not have the file */
+		return;
+	}
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		char filename[1024], type[32];
+		struct stat statBuf;
+		if ((sscanf(line, "%1023s %31s", filename, type) != 2) || strcmp(type, "partition")) {
+			/* Header line or swap file, the file system of a swap file is
+			 * mounted */
+			continue;
+		}
+		if ((stat(filename, &statBuf) == 0) && S_ISBLK(statBuf.st_mode)) {
+			setUsage(aTopology, statBuf.st_rdev, "in use as swap", "");
+		}
+	}
+	fclose(f);
+}
+
+/* Gives every whole disk the use of (the first of) its partitions */
+static void propagatePartitionUsage(struct deviceTopology *aTopology) {
+	for (int i = 0; i < aTopology->deviceCount; i++) {
+		const struct topologyDevice *partition = &aTopology->devices[i];
+		if (partition->parent == -1) {
+			continue;
+		}
+		struct topologyDevice *disk = &aTopology->devices[partition->parent];
+		if (disk->partitionUsage[0]) {
+			continue;
+		}
+		if (partition->usage[0]) {
+			snprintf(disk->partitionUsage, sizeof(disk->partitionUsage), "partition %s is %s", partition->name, partition->usage);
+		} else if (partition->holderCount > 0) {
+			char description[256];
+			describeDevice(&aTopology->devices[aTopology->holders[partition->firstHolder]], description, sizeof(description));
+			snprintf(disk->partitionUsage, sizeof(disk->partitionUsage), "partition %s is held by %s", partition->name, description);
+		}
+	}
+}
+
+/* Reads all block devices with their partitions and holders from sysfs, the
+ * mounts and the swap areas. Returns NULL on error. */
+struct deviceTopology *topologyScan(void) {
+	struct deviceTopology *topology = calloc(1, sizeof(struct deviceTopology));
+	if (!topology) {
+		logmsg(LLVL_ERROR, "Cannot allocate memory for the device topology.\n");
+		return NULL;
+	}
+	if (!scanBlockDevices(topology) || !scanMounts(topology)) {
+		topologyFree(topology);
+		return NULL;
+	}
+	scanSwaps(topology);
+	propagatePartitionUsage(topology);
+	logmsg(LLVL_DEBUG, "Device topology: %d block devices, %d stacked on others.\n", topology->deviceCount, topology->holderCount);
+	return topology;
+}
+
+void topologyFree(struct deviceTopology *aTopology) {
+	if (!aTopology) {
+		return;
+	}
+	free(aTopology->devices);
+	free(aTopology->holders);
+	free(aTopology->hashTable);
+	free(aTopology);
+}
+
+/* Determines whether a device or anything stacked on it (its partitions and
+ * the device mapper, MD or bcache devices holding it) is in use. The expected
+ * holder (e.g. the unlocked LUKS container when reLUKSifying) is not counted,
+ * 0 for none. */
+bool topologyDeviceInUse(const struct deviceTopology *aTopology, dev_t aDevice, dev_t aExpectedHolder, char *aReason, int aReasonSize) {
+	int index = findDevice(aTopology, aDevice);
+	if (index == -1) {
+		return false;
+	}
+	const struct topologyDevice *device = &aTopology->devices[index];
+	if (device->usage[0]) {
+		snprintf(aReason, aReasonSize, "%s", device->usage);
+		return true;
+	}
+	for (int i = 0; i < device->holderCount; i++) {
+		const struct topologyDevice *holder = &aTopology->devices[aTopology->holders[device->firstHolder + i]];
+		if (holder->device != aExpectedHolder) {
+			char description[256];
+			describeDevice(holder, description, sizeof(description));
+			snprintf(aReason, aReasonSize, "held by %s", description);
+			return true;
+		}
+	}
+	if (device->partitionUsage[0]) {
+		snprintf(aReason, aReasonSize, "%s", device->partitionUsage);
+		return true;
+	}
+	return false;
+}
+
+/* Like topologyDeviceInUse, but for device files. If the device cannot be
+ * checked, it is assumed to be in use for safety. */
+bool isBlockDeviceInUse(const struct deviceTopology *aTopology, const char *aBlkDevice, const char *aExpectedHolder, char *aReason, int aReasonSize) {
+	if (!aTopology) {
+		snprintf(aReason, aReasonSize, "device topology unknown");
+		return true;
+	}
+	struct stat statBuf;
+	if (stat(aBlkDevice, &statBuf) != 0) {
+		snprintf(aReason, aReasonSize, "cannot stat: %s", strerror(errno));
+		return true;
+	}
+	if (!S_ISBLK(statBuf.st_mode)) {
+		return false;
+	}
+	dev_t expectedHolder = 0;
+	struct stat holderStatBuf;
+	if (aExpectedHolder && (stat(aExpectedHolder, &holderStatBuf) == 0) && S_ISBLK(holderStatBuf.st_mode)) {
+		expectedHolder = holderStatBuf.st_rdev;
+	}
+	return topologyDeviceInUse(aTopology, statBuf.st_rdev, expectedHolder, aReason, aReasonSize);
+}
@@ -0,0 +1,59 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __PREFLIGHT_H__
+#define __PREFLIGHT_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* A block device as seen by the kernel, with what uses it directly */
+struct topologyDevice {
+	dev_t device;
+	char name[64];						/* Kernel name, e.g. sda1 or dm-0 (vg-root) */
+	char usage[288];					/* Mount point or swap, empty if not used directly */
+	char partitionUsage[384];			/* Use of one of its partitions, empty if none */
+	int parent;							/* Whole disk of a partition, -1 otherwise */
+	int firstHolder, holderCount;		/* Devices stacked on it, in holders[] */
+};
+
+/* Snapshot of all block devices, mounts, swap areas and stacked devices
+ * (device mapper, MD, bcache) of the system, taken once so that any number of
+ * devices can be checked without rescanning */
+struct deviceTopology {
+	struct topologyDevice *devices;
+	int deviceCount, deviceCapacity;
+	int *holders;						/* Indices into devices[] */
+	int holderCount, holderCapacity;
+	int *hashTable;						/* Index + 1 into devices[] by device number, 0 = empty */
+	int hashSize;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct deviceTopology *topologyScan(void);
+void topologyFree(struct deviceTopology *aTopology);
+bool topologyDeviceInUse(const struct deviceTopology *aTopology, dev_t aDevice, dev_t aExpectedHolder, char *aReason, int aReasonSize);
+bool isBlockDeviceInUse(const struct deviceTopology *aTopology, const char *aBlkDevice, const char *aExpectedHolder, char *aReason, int aReasonSize);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,38 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include "probes.h"
+
+#ifdef HAVE_USDT
+/* Semaphores of all probes, these need to be placed in the .probes section so
+ * that the tracer can find them through the SDT notes */
+#define DEFINE_PROBE_SEMAPHORE(name)		volatile unsigned short luksipc_##name##_semaphore __attribute__((section(".probes")))
+DEFINE_PROBE_SEMAPHORE(phase);
+DEFINE_PROBE_SEMAPHORE(chunk__read__start);
+DEFINE_PROBE_SEMAPHORE(chunk__read__done);
+DEFINE_PROBE_SEMAPHORE(chunk__write__start);
+DEFINE_PROBE_SEMAPHORE(chunk__write__done);
+DEFINE_PROBE_SEMAPHORE(resume__write);
+DEFINE_PROBE_SEMAPHORE(luks__format);
+DEFINE_PROBE_SEMAPHORE(luks__open);
+#endif
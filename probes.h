@@ -0,0 +1,84 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* USDT (user space statically defined tracing) probes for bpftrace, perf and
+ * SystemTap. They are compiled in automatically when <sys/sdt.h> is available
+ * (e.g. from systemtap-sdt-dev) and NO_USDT is not defined. An inactive probe
+ * is a single nop instruction; arguments that are expensive to compute (like
+ * durations) are only evaluated when the probe's semaphore shows that a
+ * tracer is attached. Probes are named provider "luksipc", see the scripts in
+ * tests/bpftrace for examples. */
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_USDT
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_ENABLED(name)					__builtin_expect(luksipc_##name##_semaphore, 0)
+#define PROBE1(name, a1)					STAP_PROBE1(luksipc, name, a1)
+#define PROBE2(name, a1, a2)				STAP_PROBE2(luksipc, name, a1, a2)
+#define PROBE3(name, a1, a2, a3)			STAP_PROBE3(luksipc, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4)		STAP_PROBE4(luksipc, name, a1, a2, a3, a4)
+
+/* Every probe needs its semaphore, which the tracer increments while it is
+ * attached */
+#define PROBE_SEMAPHORE(name)				extern volatile unsigned short luksipc_##name##_semaphore
+PROBE_SEMAPHORE(phase);
+PROBE_SEMAPHORE(chunk__read__start);
+PROBE_SEMAPHORE(chunk__read__done);
+PROBE_SEMAPHORE(chunk__write__start);
+PROBE_SEMAPHORE(chunk__write__done);
+PROBE_SEMAPHORE(resume__write);
+PROBE_SEMAPHORE(luks__format);
+PROBE_SEMAPHORE(luks__open);
+#else
+#define PROBE_ENABLED(name)					0
+/* Arguments are only referenced (not evaluated) to avoid unused warnings */
+#define PROBE1(name, a1)					do { (void)sizeof(a1); } while (0)
+#define PROBE2(name, a1, a2)				do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define PROBE3(name, a1, a2, a3)			do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define PROBE4(name, a1, a2, a3, a4)		do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); } while (0)
+#endif
+
+/* Timestamp in nanoseconds for probe durations; only called when the
+ * respective probe is enabled */
+static inline uint64_t probeTimestamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+#define PROBE_TIMER_START(name)				(PROBE_ENABLED(name) ? probeTimestamp() : 0)
+#define PROBE_TIMER_ELAPSED(start)			(probeTimestamp() - (start))
+
+#endif
@@ -26,6 +26,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/random.h>
 
 #include "random.h"
 #include "logging.h"
@@ -47,7 +48,7 @@ bool randomEvent(uint32_t aOneIn) {
 	return (xorShiftState % aOneIn) == 0;
 }
 
-bool readRandomData(void *aData, uint32_t aLength) {
+static bool readUrandom(void *aData, uint32_t aLength) {
 	const char *randomDevice = "/dev/urandom";
 	FILE *f = fopen(randomDevice, "rb");
 	if (!f) {
@@ -65,6 +66,28 @@ bool readRandomData(void *aData, uint32_t aLength) {
 	return true;
 }
 
+/* Reads from the kernel's CSPRNG with getrandom(2), which needs no file
+ * descriptor. Kernels before 3.17 lack it, /dev/urandom is read then. */
+bool readRandomData(void *aData, uint32_t aLength) {
+	uint8_t *data = (uint8_t*)aData;
+	while (aLength > 0) {
+		ssize_t result = getrandom(data, aLength, 0);
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == ENOSYS) {
+				return readUrandom(data, aLength);
+			}
+			logmsg(LLVL_ERROR, "Error reading entropy with getrandom(): %s\n", strerror(errno));
+			return false;
+		}
+		data += result;
+		aLength -= result;
+	}
+	return true;
+}
+
 bool randomHexStrCat(char *aString, int aByteLen) {
 	/* Generate hex data */
 	uint8_t rnd[aByteLen];
@@ -94,3 +117,123 @@ bool initPrng(void) {
 	return true;
 }
 
+#define CHACHA20_LANES		4
+#define ROTL32(x, n)		(((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d)	\
+	a += b; d = ROTL32(d ^ a, 16);	\
+	c += d; b = ROTL32(b ^ c, 12);	\
+	a += b; d = ROTL32(d ^ a, 8);	\
+	c += d; b = ROTL32(b ^ c, 7);
+
+/* One ChaCha20 block (64 bytes of keystream) in the original layout with a
+ * 64 bit block counter, so that a stream is never exhausted */
+static void chacha20Block(const struct csprng *aPrng, uint64_t aCounter, uint8_t *aOutput) {
+	const uint32_t input[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		aPrng->key[0], aPrng->key[1], aPrng->key[2], aPrng->key[3],
+		aPrng->key[4], aPrng->key[5], aPrng->key[6], aPrng->key[7],
+		(uint32_t)aCounter, (uint32_t)(aCounter >> 32), aPrng->nonce[0], aPrng->nonce[1],
+	};
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+	for (int i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; i++) {
+		uint32_t word = x[i] + input[i];
+		aOutput[(4 * i) + 0] = word;
+		aOutput[(4 * i) + 1] = word >> 8;
+		aOutput[(4 * i) + 2] = word >> 16;
+		aOutput[(4 * i) + 3] = word >> 24;
+	}
+}
+
+/* Four consecutive ChaCha20 blocks at once, every vector lane computes one of
+ * them. This is about twice as fast as computing them one after another. */
+typedef uint32_t u32vec_t __attribute__((vector_size(CHACHA20_LANES * sizeof(uint32_t))));
+
+static void chacha20Blocks(const struct csprng *aPrng, uint64_t aCounter, uint8_t *aOutput) {
+	u32vec_t input[16];
+	const uint32_t constants[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+	for (int i = 0; i < 4; i++) {
+		input[i] = (u32vec_t){ 0 } + constants[i];
+	}
+	for (int i = 0; i < 8; i++) {
+		input[4 + i] = (u32vec_t){ 0 } + aPrng->key[i];
+	}
+	for (int lane = 0; lane < CHACHA20_LANES; lane++) {
+		input[12][lane] = (uint32_t)(aCounter + lane);
+		input[13][lane] = (uint32_t)((aCounter + lane) >> 32);
+	}
+	input[14] = (u32vec_t){ 0 } + aPrng->nonce[0];
+	input[15] = (u32vec_t){ 0 } + aPrng->nonce[1];
+
+	u32vec_t x[16];
+	memcpy(x, input, sizeof(x));
+	for (int i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; i++) {
+		u32vec_t words = x[i] + input[i];
+		for (int lane = 0; lane < CHACHA20_LANES; lane++) {
+			uint8_t *output = aOutput + (64 * lane) + (4 * i);
+			output[0] = words[lane];
+			output[1] = words[lane] >> 8;
+			output[2] = words[lane] >> 16;
+			output[3] = words[lane] >> 24;
+		}
+	}
+}
+
+/* Keys a ChaCha20 keystream with data from the kernel's CSPRNG */
+bool csprngInit(struct csprng *aPrng) {
+	if (!readRandomData(aPrng, sizeof(struct csprng))) {
+		logmsg(LLVL_ERROR, "Failed to seed CSPRNG.\n");
+		return false;
+	}
+	return true;
+}
+
+/* Generates aLength bytes of the keystream, starting at byte aPosition. Any
+ * part of the stream can be generated independently, e.g. by several
+ * threads. */
+void csprngGenerate(const struct csprng *aPrng, uint64_t aPosition, uint8_t *aData, uint32_t aLength) {
+	uint64_t counter = aPosition / 64;
+	uint32_t skip = aPosition % 64;
+	uint8_t block[64];
+	while (aLength > 0) {
+		if ((skip == 0) && (aLength >= 64 * CHACHA20_LANES)) {
+			chacha20Blocks(aPrng, counter, aData);
+			aData += 64 * CHACHA20_LANES;
+			aLength -= 64 * CHACHA20_LANES;
+			counter += CHACHA20_LANES;
+			continue;
+		}
+		uint32_t length = 64 - skip;
+		length = (length < aLength) ? length : aLength;
+		if (length == 64) {
+			chacha20Block(aPrng, counter, aData);
+		} else {
+			chacha20Block(aPrng, counter, block);
+			memcpy(aData, block + skip, length);
+		}
+		aData += length;
+		aLength -= length;
+		counter++;
+		skip = 0;
+	}
+}
@@ -27,11 +27,19 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Key of a ChaCha20 keystream, which is used as fast CSPRNG */
+struct csprng {
+	uint32_t key[8];
+	uint32_t nonce[2];
+};
+
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool randomEvent(uint32_t aOneIn);
 bool readRandomData(void *aData, uint32_t aLength);
 bool randomHexStrCat(char *aString, int aByteLen);
 bool initPrng(void);
+bool csprngInit(struct csprng *aPrng);
+void csprngGenerate(const struct csprng *aPrng, uint64_t aPosition, uint8_t *aData, uint32_t aLength);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
@@ -0,0 +1,349 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "recover.h"
+#include "logging.h"
+#include "globals.h"
+#include "spill.h"
+
+/* Recovery without a resume file.
+ *
+ * Offset X of the LUKS (write) device is stored at X + lost on the read
+ * device, where lost is the difference of their sizes (i.e. the LUKS header
+ * size for a plain conversion). Below the boundary B, the LUKS device
+ * decrypts to the original data and the read device shows ciphertext; above
+ * it, the read device still shows the original data and the LUKS device
+ * decrypts it to garbage. Original data is usually far from random, so for
+ * every sector one of both views looks like meaningful data and the other
+ * like random data. Sectors of random original data (compressed or encrypted
+ * files) cannot be classified and are skipped.
+ *
+ * The original data of [B, B + lost) was only held in memory (it was read
+ * ahead before its place on disk got overwritten) and is lost, unless it is
+ * covered by the header backup. */
+
+enum sectorClass_t {
+	SECTOR_UNKNOWN,
+	SECTOR_CONVERTED,
+	SECTOR_PLAIN,
+	SECTOR_INCONSISTENT,
+};
+
+struct recoverScan {
+	struct conversionProcess *convProcess;
+	uint64_t size;						/* Size of the LUKS device that is converted */
+	uint64_t lostBytes;					/* Shift between LUKS and read device */
+	uint64_t sectorCount;
+	uint8_t *writeView, *readView;
+	uint64_t sectorsRead;
+};
+
+static bool readFully(struct ioBackend *aBackend, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	uint32_t done = 0;
+	while (done < aLength) {
+		ssize_t result = aBackend->readAt(aBackend, aData + done, aLength - done, aOffset + done);
+		if (result <= 0) {
+			logmsg(LLVL_ERROR, "Read of %u bytes at offset %" PRIu64 " of %s failed: %s\n", aLength - done, aOffset + done, aBackend->name, (result == 0) ? "end of device" : strerror(errno));
+			return false;
+		}
+		done += result;
+	}
+	return true;
+}
+
+static bool isMeaningfulData(const uint8_t *aData, uint32_t aLength) {
+	uint32_t histogram[256] = { 0 };
+	for (uint32_t i = 0; i < aLength; i++) {
+		histogram[aData[i]]++;
+	}
+	double entropy = 0;
+	for (int i = 0; i < 256; i++) {
+		if (histogram[i]) {
+			double p = (double)histogram[i] / aLength;
+			entropy -= p * log2(p);
+		}
+	}
+	return entropy < RECOVER_ENTROPY_THRESHOLD;
+}
+
+/* Classifies all sectors of [aFirstSector, aFirstSector + aCount) */
+static bool classifySectors(struct recoverScan *aScan, uint64_t aFirstSector, uint32_t aCount, enum sectorClass_t *aClasses) {
+	uint64_t offset = aFirstSector * RECOVER_SECTOR_SIZE;
+	uint64_t end = offset + ((uint64_t)aCount * RECOVER_SECTOR_SIZE);
+	end = (end < aScan->size) ? end : aScan->size;
+	if (!readFully(&aScan->convProcess->writeBackend, aScan->writeView, end - offset, offset)) {
+		return false;
+	}
+
+	/* The read device may end before the shifted range does */
+	uint64_t readEnd = end + aScan->lostBytes;
+	readEnd = (readEnd < aScan->convProcess->readDevSize) ? readEnd : aScan->convProcess->readDevSize;
+	uint64_t readLength = (readEnd > offset + aScan->lostBytes) ? (readEnd - offset - aScan->lostBytes) : 0;
+	if (readLength && !readFully(&aScan->convProcess->readBackend, aScan->readView, readLength, offset + aScan->lostBytes)) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < aCount; i++) {
+		uint64_t sectorOffset = (uint64_t)i * RECOVER_SECTOR_SIZE;
+		uint64_t sectorLength = end - offset - sectorOffset;
+		sectorLength = (sectorLength < RECOVER_SECTOR_SIZE) ? sectorLength : RECOVER_SECTOR_SIZE;
+		bool writeMeaningful = isMeaningfulData(aScan->writeView + sectorOffset, sectorLength);
+		bool readMeaningful = (sectorOffset + sectorLength <= readLength) && isMeaningfulData(aScan->readView + sectorOffset, sectorLength);
+		if (writeMeaningful && readMeaningful) {
+			aClasses[i] = SECTOR_INCONSISTENT;
+		} else if (writeMeaningful) {
+			aClasses[i] = SECTOR_CONVERTED;
+		} else if (readMeaningful) {
+			aClasses[i] = SECTOR_PLAIN;
+		} else {
+			aClasses[i] = SECTOR_UNKNOWN;
+		}
+	}
+	aScan->sectorsRead += aCount;
+	return true;
+}
+
+/* The boundary lies within data that has high entropy in both views. This is
+ * a limitation of the classifier, not a sign of a damaged device, so say so
+ * explicitly. */
+static void logUnclassifiableData(uint64_t aLowSector, uint64_t aHighSector) {
+	logmsg(LLVL_ERROR, "Conversion boundary lies somewhere between offsets %" PRIu64 " and %" PRIu64 " (%" PRIu64 " MiB), but the data in between has high entropy on both the LUKS and the read device and cannot be classified as converted or plain.\n", aLowSector * RECOVER_SECTOR_SIZE, aHighSector * RECOVER_SECTOR_SIZE, (aHighSector - aLowSector) * RECOVER_SECTOR_SIZE / 1024 / 1024);
+	logmsg(LLVL_ERROR, "This happens when the original data is itself random-looking (compressed, encrypted or media files, random test data) and does not mean that the device is corrupt; recovery is only possible if the point of interruption lies within low-entropy data.\n");
+}
+
+/* Looks for the first sector in [aFrom, aTo) that can be classified. aClass is
+ * SECTOR_UNKNOWN if there is none. */
+static bool findClassifiedSector(struct recoverScan *aScan, uint64_t aFrom, uint64_t aTo, enum sectorClass_t *aClass, uint64_t *aSector) {
+	enum sectorClass_t classes[RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE];
+	*aClass = SECTOR_UNKNOWN;
+	for (uint64_t sector = aFrom; sector < aTo; sector += RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE) {
+		uint32_t count = ((aTo - sector) < (RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE)) ? (aTo - sector) : (RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE);
+		if (!classifySectors(aScan, sector, count, classes)) {
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			if (classes[i] != SECTOR_UNKNOWN) {
+				*aClass = classes[i];
+				*aSector = sector + i;
+				return true;
+			}
+		}
+	}
+	return true;
+}
+
+/* Checks that no sector on either side of the boundary contradicts it, which
+ * happens if the device was not written in order (e.g. write-back caches lost
+ * on power failure). */
+static bool verifyBoundary(struct recoverScan *aScan, uint64_t aBoundary) {
+	enum sectorClass_t classes[RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE];
+	uint64_t verifySectors = RECOVER_VERIFY_SIZE / RECOVER_SECTOR_SIZE;
+	uint64_t from = (aBoundary > verifySectors) ? (aBoundary - verifySectors) : 0;
+	uint64_t to = ((aScan->sectorCount - aBoundary) > verifySectors) ? (aBoundary + verifySectors) : aScan->sectorCount;
+	int converted = 0, plain = 0;
+	for (uint64_t sector = from; sector < to; sector += RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE) {
+		uint32_t count = ((to - sector) < (RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE)) ? (to - sector) : (RECOVER_PROBE_SIZE / RECOVER_SECTOR_SIZE);
+		if (!classifySectors(aScan, sector, count, classes)) {
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			bool belowBoundary = (sector + i) < aBoundary;
+			if ((classes[i] == SECTOR_INCONSISTENT) || (belowBoundary && (classes[i] == SECTOR_PLAIN)) || (!belowBoundary && (classes[i] == SECTOR_CONVERTED))) {
+				logmsg(LLVL_ERROR, "Data at offset %" PRIu64 " contradicts a conversion boundary at offset %" PRIu64 ". The device was not written in order (e.g. because of a power failure) or is not a partially converted device.\n", (sector + i) * RECOVER_SECTOR_SIZE, aBoundary * RECOVER_SECTOR_SIZE);
+				return false;
+			}
+			converted += (classes[i] == SECTOR_CONVERTED);
+			plain += (classes[i] == SECTOR_PLAIN);
+		}
+	}
+	logmsg(LLVL_DEBUG, "Verified %d converted and %d plain sectors around the boundary.\n", converted, plain);
+	return true;
+}
+
+/* Determines the sector at which the conversion was interrupted. Sectors
+ * below lowSector are known to be converted, those at or above highSector to
+ * be plain. */
+static bool locateBoundary(struct recoverScan *aScan, uint64_t *aBoundary) {
+	uint64_t lowSector = 0, highSector = aScan->sectorCount;
+	uint64_t searchLimit = highSector;
+	enum sectorClass_t class = SECTOR_UNKNOWN;
+	uint64_t sector = 0;
+
+	/* Binary search, skipping over sectors that cannot be classified */
+	while (lowSector < searchLimit) {
+		uint64_t probeSector = lowSector + ((searchLimit - lowSector) / 2);
+		uint64_t scanLimit = ((searchLimit - probeSector) > (RECOVER_MAX_SCAN / RECOVER_SECTOR_SIZE)) ? (probeSector + (RECOVER_MAX_SCAN / RECOVER_SECTOR_SIZE)) : searchLimit;
+		if (!findClassifiedSector(aScan, probeSector, scanLimit, &class, &sector)) {
+			return false;
+		}
+		if (class == SECTOR_INCONSISTENT) {
+			logmsg(LLVL_ERROR, "Sector at offset %" PRIu64 " is readable through both the LUKS device and the read device, this is not a partially converted device.\n", sector * RECOVER_SECTOR_SIZE);
+			return false;
+		} else if (class == SECTOR_CONVERTED) {
+			if (sector >= highSector) {
+				logmsg(LLVL_ERROR, "Converted data at offset %" PRIu64 " found behind plain data at offset %" PRIu64 ", the device was not written in order.\n", sector * RECOVER_SECTOR_SIZE, highSector * RECOVER_SECTOR_SIZE);
+				return false;
+			}
+			lowSector = sector + 1;
+		} else {
+			if (class == SECTOR_PLAIN) {
+				highSector = (sector < highSector) ? sector : highSector;
+			}
+			searchLimit = probeSector;
+		}
+	}
+
+	/* Close the gap between the last converted and the first plain sector
+	 * that were found */
+	if (highSector - lowSector > RECOVER_MAX_GAP / RECOVER_SECTOR_SIZE) {
+		logUnclassifiableData(lowSector, highSector);
+		return false;
+	}
+	while (lowSector < highSector) {
+		if (!findClassifiedSector(aScan, lowSector, highSector, &class, &sector)) {
+			return false;
+		}
+		if (class == SECTOR_CONVERTED) {
+			lowSector = sector + 1;
+		} else if (class == SECTOR_UNKNOWN) {
+			break;
+		} else {
+			if (class == SECTOR_PLAIN) {
+				highSector = sector;
+			}
+			break;
+		}
+	}
+	if (class == SECTOR_INCONSISTENT) {
+		logmsg(LLVL_ERROR, "Sector at offset %" PRIu64 " is readable through both the LUKS device and the read device, this is not a partially converted device.\n", sector * RECOVER_SECTOR_SIZE);
+		return false;
+	}
+	if (lowSector != highSector) {
+		logUnclassifiableData(lowSector, highSector);
+		return false;
+	}
+
+	if (!verifyBoundary(aScan, lowSector)) {
+		return false;
+	}
+	*aBoundary = lowSector;
+	return true;
+}
+
+/* Fills the start of the buffer with the data that was only held in memory
+ * when the conversion was interrupted, taken from the spill file or the
+ * header backup. Only with --recover-zero-fill is it zeroed otherwise. */
+static bool restoreLostWindow(struct conversionParameters const *aParameters, uint64_t aReadDevSize, uint64_t aShift, uint64_t aOffset, uint8_t *aData, uint32_t aLength) {
+	if (aParameters->spillFile && spillRecoverData(aParameters->spillFile, aReadDevSize, aOffset, aData, aLength)) {
+		logmsg(LLVL_INFO, "Data at offsets %" PRIu64 " to %" PRIu64 " restored from spill file %s.\n", aOffset, aOffset + aLength, aParameters->spillFile);
+		return true;
+	}
+
+	if (!aParameters->reluksification && aParameters->backupFile && (aOffset + aLength <= HEADER_BACKUP_SIZE_BYTES)) {
+		int fd = open(aParameters->backupFile, O_RDONLY);
+		if (fd != -1) {
+			bool success = (pread(fd, aData, aLength, aOffset) == aLength);
+			close(fd);
+			if (success) {
+				logmsg(LLVL_INFO, "Data at offsets %" PRIu64 " to %" PRIu64 " restored from header backup %s.\n", aOffset, aOffset + aLength, aParameters->backupFile);
+				return true;
+			}
+		}
+		logmsg(LLVL_WARN, "Cannot read data at offset %" PRIu64 " from header backup %s.\n", aOffset, aParameters->backupFile);
+	}
+
+	if (!aParameters->recoverZeroFill) {
+		logmsg(LLVL_ERROR, "Data at LUKS device offsets %" PRIu64 " to %" PRIu64 " (%u bytes) was only held in memory when the conversion was interrupted and is lost; it is neither in a spill file nor within the first %d MiB covered by the header backup. Refusing to continue; with --recover-zero-fill, the range is zeroed and you must restore it from a backup afterwards.\n", aOffset, aOffset + aLength, aLength, HEADER_BACKUP_SIZE_BYTES / 1024 / 1024);
+		return false;
+	}
+	logmsg(LLVL_WARN, "ZEROING LOST DATA: LUKS device offsets %" PRIu64 " to %" PRIu64 " (%u bytes, raw device offsets %" PRIu64 " to %" PRIu64 ") are filled with zeros as requested by --recover-zero-fill. Restore this range from a backup after the conversion.\n", aOffset, aOffset + aLength, aLength, aOffset + aShift, aOffset + aShift + aLength);
+	memset(aData, 0, aLength);
+	return true;
+}
+
+/* Rebuilds the resume state from the device contents alone and writes it to
+ * the resume file */
+bool recoverConversionState(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess) {
+	struct recoverScan scan = {
+		.convProcess = aConvProcess,
+		.size = (aConvProcess->readDevSize < aConvProcess->writeDevSize) ? aConvProcess->readDevSize : aConvProcess->writeDevSize,
+		.lostBytes = (aConvProcess->readDevSize > aConvProcess->writeDevSize) ? (aConvProcess->readDevSize - aConvProcess->writeDevSize) : 0,
+	};
+	scan.sectorCount = (scan.size + RECOVER_SECTOR_SIZE - 1) / RECOVER_SECTOR_SIZE;
+	if (scan.lostBytes > aConvProcess->dataBuffer[0].size) {
+		logmsg(LLVL_ERROR, "Header size difference of %" PRIu64 " bytes exceeds the chunk size, cannot recover.\n", scan.lostBytes);
+		return false;
+	}
+
+	scan.writeView = malloc(RECOVER_PROBE_SIZE);
+	scan.readView = malloc(RECOVER_PROBE_SIZE);
+	if (!scan.writeView || !scan.readView) {
+		logmsg(LLVL_ERROR, "Cannot allocate recovery buffers: %s\n", strerror(errno));
+		free(scan.writeView);
+		free(scan.readView);
+		return false;
+	}
+
+	logmsg(LLVL_INFO, "Locating the conversion boundary on the device.\n");
+	uint64_t boundarySector = 0;
+	bool success = locateBoundary(&scan, &boundarySector);
+	free(scan.writeView);
+	free(scan.readView);
+	if (!success) {
+		return false;
+	}
+
+	uint64_t boundary = boundarySector * RECOVER_SECTOR_SIZE;
+	boundary = (boundary < scan.size) ? boundary : scan.size;
+	logmsg(LLVL_INFO, "Conversion was interrupted at offset %" PRIu64 " (%.1f%%), found after examining %" PRIu64 " MiB.\n", boundary, 100. * boundary / scan.size, scan.sectorsRead * RECOVER_SECTOR_SIZE / 1024 / 1024);
+
+	/* The data buffer is what the copy loop would have held at this point:
+	 * the lost window, followed by data still on the read device */
+	struct chunk *buffer = &aConvProcess->dataBuffer[0];
+	uint64_t remaining = scan.size - boundary;
+	buffer->used = (remaining < buffer->size) ? remaining : buffer->size;
+	uint32_t lostLength = (scan.lostBytes < buffer->used) ? scan.lostBytes : buffer->used;
+	if (lostLength && !restoreLostWindow(aParameters, aConvProcess->readDevSize, scan.lostBytes, boundary, buffer->data, lostLength)) {
+		return false;
+	}
+	if ((buffer->used > lostLength) && !readFully(&aConvProcess->readBackend, buffer->data + lostLength, buffer->used - lostLength, boundary + lostLength)) {
+		return false;
+	}
+	aConvProcess->outOffset = boundary;
+	aConvProcess->usedBufferIndex = 0;
+
+	if (!writeResumeFile(aConvProcess)) {
+		logmsg(LLVL_ERROR, "Cannot write recovered state to resume file.\n");
+		return false;
+	}
+	return true;
+}
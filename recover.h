@@ -0,0 +1,60 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __RECOVER_H__
+#define __RECOVER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parameters.h"
+#include "engine.h"
+
+/* Granularity in which the boundary between converted and plain data is
+ * located */
+#define RECOVER_SECTOR_SIZE				4096
+
+/* Amount of data read at once when looking for a sector that can be
+ * classified */
+#define RECOVER_PROBE_SIZE				(1024 * 1024)
+
+/* Binary search steps give up looking for a sector that can be classified
+ * after this many bytes */
+#define RECOVER_MAX_SCAN				(64 * 1024 * 1024)
+
+/* Largest region around the boundary that is scanned sector by sector */
+#define RECOVER_MAX_GAP					(1024 * 1024 * 1024)
+
+/* Region before and after the boundary that is checked for having been
+ * written in order */
+#define RECOVER_VERIFY_SIZE				(64 * 1024 * 1024)
+
+/* Sectors with less entropy (in bits per byte) are regarded as meaningful
+ * data, random data has almost 8 */
+#define RECOVER_ENTROPY_THRESHOLD		7.5
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool recoverConversionState(struct conversionParameters const *aParameters, struct conversionProcess *aConvProcess);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,222 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "rollback.h"
+#include "logging.h"
+#include "utils.h"
+#include "globals.h"
+#include "crashpoint.h"
+
+/* A rollback copies the LUKS device back to the plain device at the same
+ * offsets, i.e. the data moves towards the start of the disk by the header
+ * size. The chunk that is written therefore only ever overwrites ciphertext
+ * that has already been read, which is why the rollback runs front to back
+ * with the regular copy engine, just with read and write device swapped. It
+ * ends at the write pointer of the conversion, where the window from the
+ * conversion's resume file is written last.
+ *
+ * The rollback state is appended to the resume file, the state of the
+ * conversion (including that chunk) is kept. Writing the first chunk
+ * overwrites the LUKS header, so convert() saves it to a file beforehand and
+ * opens the LUKS device with that detached header. */
+
+/* Offset of the rollback state in the resume file, behind the state of the
+ * conversion as written by writeResumeFile() */
+static off_t rollbackStateOffset(const struct conversionProcess *aConvProcess) {
+	return RESUME_FILE_HEADER_MAGIC_LEN + aConvProcess->resumeHeaderLength + aConvProcess->resumeWindowCapacity + sizeof(aConvProcess->throughput.history);
+}
+
+/* File the LUKS header is saved to before rolling back */
+bool rollbackHeaderFile(const struct conversionParameters *aParameters, char *aBuffer, int aBufferSize) {
+	return snprintf(aBuffer, aBufferSize, "%s.header", aParameters->resumeFilename) < aBufferSize;
+}
+
+/* Saves how far the rollback got and the chunk that has been read from the
+ * LUKS device, but not yet written back */
+bool writeRollbackState(struct conversionProcess *aConvProcess) {
+	struct chunk *activeChunk = resumeWindow(aConvProcess);
+	bool success = true;
+	CRASHPOINT("rollback state write");
+	success = (lseek(aConvProcess->resumeFd, rollbackStateOffset(aConvProcess), SEEK_SET) != -1) && success;
+	success = checkedWrite(aConvProcess->resumeFd, &aConvProcess->outOffset, sizeof(uint64_t)) && success;
+	success = checkedWrite(aConvProcess->resumeFd, &activeChunk->used, sizeof(uint32_t)) && success;
+	success = checkedWrite(aConvProcess->resumeFd, activeChunk->data, activeChunk->used) && success;
+	success = (fsync(aConvProcess->resumeFd) == 0) && success;
+	logmsg(LLVL_DEBUG, "Wrote rollback state: rolled back up to offset %" PRIu64 " of %" PRIu64 ", %u bytes of data in active buffer.\n", aConvProcess->outOffset, aConvProcess->endOutOffset, activeChunk->used);
+	return success;
+}
+
+static bool readRollbackState(struct conversionProcess *aConvProcess) {
+	uint32_t windowLength = 0;
+	bool success = true;
+	success = (lseek(aConvProcess->resumeFd, rollbackStateOffset(aConvProcess), SEEK_SET) != -1) && success;
+	success = checkedRead(aConvProcess->resumeFd, &aConvProcess->outOffset, sizeof(uint64_t)) && success;
+	success = checkedRead(aConvProcess->resumeFd, &windowLength, sizeof(uint32_t)) && success;
+	success = success && (aConvProcess->outOffset + windowLength <= aConvProcess->endOutOffset);
+	success = success && loadResumeWindow(aConvProcess, windowLength);
+	if (!success) {
+		logmsg(LLVL_ERROR, "Rollback state in the resume file is unreadable or inconsistent.\n");
+	}
+	return success;
+}
+
+/* Turns the resume file of the conversion into the one of a rollback. The
+ * rollback state is written first, so that a crash leaves either a valid
+ * conversion or a valid rollback resume file behind. */
+static bool beginRollback(const struct conversionParameters *aParameters, struct conversionProcess *aConvProcess) {
+	if (!writeRollbackState(aConvProcess)) {
+		logmsg(LLVL_ERROR, "Cannot write the rollback state to the resume file %s: %s\n", aParameters->resumeFilename, strerror(errno));
+		return false;
+	}
+	char header[RESUME_FILE_HEADER_MAGIC_LEN];
+	memcpy(header, ROLLBACK_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN);
+	CRASHPOINT("rollback magic write");
+	bool success = (lseek(aConvProcess->resumeFd, 0, SEEK_SET) != -1);
+	success = success && checkedWrite(aConvProcess->resumeFd, header, sizeof(header));
+	success = success && (fsync(aConvProcess->resumeFd) == 0);
+	if (!success) {
+		logmsg(LLVL_ERROR, "Cannot mark the resume file %s as rollback: %s\n", aParameters->resumeFilename, strerror(errno));
+	}
+	return success;
+}
+
+/* Reads the resume file for a rollback. When the rollback starts, it is the
+ * resume file of the aborted conversion; the rolled back range ends at its
+ * write pointer. */
+bool rollbackPrepare(const struct conversionParameters *aParameters, struct conversionProcess *aConvProcess) {
+	char header[RESUME_FILE_HEADER_MAGIC_LEN];
+	bool continuing = (lseek(aConvProcess->resumeFd, 0, SEEK_SET) != -1) && checkedRead(aConvProcess->resumeFd, header, sizeof(header)) && (!memcmp(header, ROLLBACK_FILE_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN) || !memcmp(header, ROLLBACK_FILE_V2_HEADER_MAGIC, RESUME_FILE_HEADER_MAGIC_LEN));
+	if (!readResumeFile(aParameters, aConvProcess)) {
+		return false;
+	}
+	if (aConvProcess->checkpoint.spanEnd) {
+		logmsg(LLVL_ERROR, "Resume file %s was written while a span of the conversion was being moved (--checkpoint), continue the conversion with --resume first.\n", aParameters->resumeFilename);
+		return false;
+	}
+	struct chunk *window = resumeWindow(aConvProcess);
+
+	if (aConvProcess->readDevSize < aConvProcess->writeDevSize) {
+		logmsg(LLVL_ERROR, "LUKS device is larger than the plain device, which cannot be rolled back front to back.\n");
+		return false;
+	}
+	uint64_t stopOffset = aConvProcess->outOffset;
+	if ((window->used == 0) && (stopOffset < aConvProcess->writeDevSize)) {
+		logmsg(LLVL_ERROR, "Resume file %s holds no data for offset %" PRIu64 " (it was written before copying started), cannot roll back. Run --recover and interrupt it to get a complete resume file.\n", aParameters->resumeFilename, stopOffset);
+		return false;
+	}
+
+	/* The rollback state is stored behind the state of the conversion, which
+	 * is therefore rewritten in the current format first */
+	if (!continuing && !writeResumeFile(aConvProcess)) {
+		logmsg(LLVL_ERROR, "Cannot rewrite the resume file %s: %s\n", aParameters->resumeFilename, strerror(errno));
+		return false;
+	}
+
+	/* The window at the conversion's write pointer is written last */
+	if (window == &aConvProcess->pendingWindow) {
+		aConvProcess->rollbackTail = *window;
+		memset(window, 0, sizeof(struct chunk));
+	} else {
+		if (!allocChunk(&aConvProcess->rollbackTail, window->size)) {
+			logmsg(LLVL_ERROR, "Failed to allocate rollback chunk: %s\n", strerror(errno));
+			return false;
+		}
+		memcpy(aConvProcess->rollbackTail.data, window->data, window->used);
+		aConvProcess->rollbackTail.used = window->used;
+		window->used = 0;
+	}
+	aConvProcess->usedBufferIndex = 0;
+	aConvProcess->rollback = true;
+	aConvProcess->endOutOffset = stopOffset;
+	aConvProcess->outOffset = 0;
+
+	if (continuing) {
+		if (!readRollbackState(aConvProcess)) {
+			return false;
+		}
+		logmsg(LLVL_INFO, "Continuing rollback at offset %" PRIu64 " of %" PRIu64 " bytes.\n", aConvProcess->outOffset, aConvProcess->endOutOffset);
+		return true;
+	}
+
+	logmsg(LLVL_INFO, "Rolling back %" PRIu64 " bytes (%" PRIu64 " MiB) of converted data.\n", stopOffset, stopOffset / 1024 / 1024);
+	return beginRollback(aParameters, aConvProcess);
+}
+
+/* Swaps read and write device and reads the first chunk from the LUKS
+ * device, if no chunk was pending in the resume file */
+bool rollbackStart(struct conversionProcess *aConvProcess) {
+	struct ioBackend plainBackend = aConvProcess->readBackend;
+	aConvProcess->readBackend = aConvProcess->writeBackend;
+	aConvProcess->writeBackend = plainBackend;
+
+	struct chunk *activeChunk = &aConvProcess->dataBuffer[0];
+	uint64_t remaining = aConvProcess->endOutOffset - aConvProcess->outOffset;
+	if ((resumeWindow(aConvProcess)->used == 0) && (remaining > 0)) {
+		uint32_t bytesToRead = (remaining < activeChunk->size) ? remaining : activeChunk->size;
+		if (chunkReadFrom(activeChunk, &aConvProcess->readBackend, aConvProcess->outOffset, bytesToRead) != bytesToRead) {
+			logmsg(LLVL_ERROR, "%s: Unable to read chunk data at offset %" PRIu64 ".\n", aConvProcess->writeDevicePath, aConvProcess->outOffset);
+			activeChunk->used = 0;
+			return false;
+		}
+	}
+	aConvProcess->inOffset = aConvProcess->outOffset + resumeWindow(aConvProcess)->used;
+	return true;
+}
+
+/* Writes the chunk from the conversion's resume file, after which the plain
+ * device is complete again */
+enum copyResult_t rollbackFinish(const struct conversionParameters *aParameters, struct conversionProcess *aConvProcess) {
+	const struct chunk *tail = &aConvProcess->rollbackTail;
+	for (int try = 0; try < 10; try++) {
+		if ((chunkWriteTo(tail, &aConvProcess->writeBackend, aConvProcess->endOutOffset) == tail->used) && backendFlush(&aConvProcess->writeBackend)) {
+			logmsg(LLVL_INFO, "Rollback completed, %s holds the plain data again.\n", aParameters->readDevice);
+			return COPYRESULT_SUCCESS_FINISHED;
+		}
+	}
+
+	logmsg(LLVL_ERROR, "Error writing %u bytes at offset 0x%" PRIx64 ", shutting down.\n", tail->used, aConvProcess->endOutOffset);
+	aConvProcess->dataBuffer[aConvProcess->usedBufferIndex].used = 0;
+	if (!writeResumeFile(aConvProcess)) {
+		logmsg(LLVL_WARN, "There were errors writing the resume file %s.\n", aParameters->resumeFilename);
+		return COPYRESULT_ERROR_WRITING_RESUME_FILE;
+	}
+	return COPYRESULT_SUCCESS_RESUMABLE;
+}
+
+/* The resume file and the saved LUKS header (which contains the key slots)
+ * are of no use after a completed rollback */
+void rollbackCleanup(const struct conversionParameters *aParameters) {
+	char headerFile[256];
+	if (rollbackHeaderFile(aParameters, headerFile, sizeof(headerFile))) {
+		unlink(headerFile);
+		logmsg(LLVL_INFO, "Removed the saved LUKS header %s.\n", headerFile);
+	}
+	unlink(aParameters->resumeFilename);
+	logmsg(LLVL_INFO, "Removed resume file %s.\n", aParameters->resumeFilename);
+}
@@ -0,0 +1,578 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+/* MAP_ANONYMOUS is not part of XPG5 */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scheduler.h"
+#include "logging.h"
+#include "shutdown.h"
+#include "sysfs.h"
+#include "batchio.h"
+#include "utils.h"
+#include "exit.h"
+
+#define PROGRESS_INTERVAL_SECS			10
+
+/* Set in the forked child process to the slot in shared memory it reports to */
+static struct jobStatus *currentJobStatus;
+
+void reportJobProgress(uint64_t aOutOffset, uint64_t aEndOutOffset) {
+	if (!currentJobStatus) {
+		return;
+	}
+	if (!atomic_load_explicit(&currentJobStatus->progressValid, memory_order_relaxed)) {
+		atomic_store_explicit(&currentJobStatus->startOutOffset, aOutOffset, memory_order_relaxed);
+	}
+	atomic_store_explicit(&currentJobStatus->outOffset, aOutOffset, memory_order_relaxed);
+	atomic_store_explicit(&currentJobStatus->endOutOffset, aEndOutOffset, memory_order_relaxed);
+	atomic_store_explicit(&currentJobStatus->progressValid, true, memory_order_release);
+}
+
+bool isRunningAsJob(void) {
+	return currentJobStatus != NULL;
+}
+
+uint64_t getJobIoRateLimit(void) {
+	return currentJobStatus ? atomic_load_explicit(&currentJobStatus->ioRateLimit, memory_order_relaxed) : 0;
+}
+
+static uint64_t jobMemoryRequirement(const struct conversionJob *aJob) {
+	/* Two copy chunks are allocated per conversion (up to the batch window
+	 * when batching on a rotational disk), the userspace engine needs two
+	 * more for ciphertext and verification */
+	uint64_t copyMemory = 2 * (uint64_t)aJob->parameters.blocksize;
+	if (batchIoWanted(&aJob->parameters) && (aJob->parameters.batchWindow > copyMemory)) {
+		copyMemory = aJob->parameters.batchWindow;
+	}
+	if (aJob->parameters.engine == ENGINE_USERSPACE) {
+		copyMemory += 2 * (uint64_t)aJob->parameters.blocksize;
+	}
+	return copyMemory;
+}
+
+static void determineJobGroup(struct conversionJob *aJob, const char *aExplicitGroup) {
+	if (aExplicitGroup) {
+		safestrcpy(aJob->group, aExplicitGroup, sizeof(aJob->group));
+		return;
+	}
+
+	char diskPath[PATH_MAX];
+	if (getWholeDiskSysfsPath(aJob->parameters.rawDevice, diskPath, sizeof(diskPath))) {
+		const char *diskName = strrchr(diskPath, '/');
+		safestrcpy(aJob->group, diskName ? diskName + 1 : diskPath, sizeof(aJob->group));
+	} else {
+		safestrcpy(aJob->group, aJob->parameters.rawDevice, sizeof(aJob->group));
+	}
+}
+
+/* Name of the state that is recorded for a job in the job file. A job that is
+ * pending but has to be resumed was aborted in an earlier run. */
+static const char *jobStateName(const struct conversionJob *aJob) {
+	switch (aJob->state) {
+		case JOBSTATE_PENDING:
+			return aJob->parameters.resuming ? "aborted" : "pending";
+
+		case JOBSTATE_RUNNING:
+			return "running";
+
+		case JOBSTATE_FINISHED:
+			if (aJob->needsRecovery) {
+				return "recover";
+			} else if (aJob->exitCode == EC_SUCCESS) {
+				return "done";
+			} else if (aJob->exitCode == EC_COPY_ABORTED_RESUME_FILE_WRITTEN) {
+				return "aborted";
+			}
+			return "failed";
+	}
+	return "failed";
+}
+
+/* Sets up a job according to the state recorded in the job file. Jobs that
+ * are done or need attention are not run again; a job without a recorded
+ * state is resumed if --resume was given. A job that was still running when
+ * luksipc was killed is resumed if --checkpoint kept its resume file valid;
+ * otherwise only --recover can continue it. */
+static bool applyJobState(struct conversionParameters const *aParameters, int aLineNo, struct conversionJob *aJob, const char *aState) {
+	aJob->state = JOBSTATE_PENDING;
+	if (!aState) {
+		return true;
+	}
+	if (!strcmp(aState, "pending")) {
+		aJob->parameters.resuming = false;
+	} else if (!strcmp(aState, "aborted")) {
+		aJob->parameters.resuming = true;
+	} else if (!strcmp(aState, "done")) {
+		logmsg(LLVL_INFO, "Conversion of %s is done already, skipping it.\n", aJob->parameters.rawDevice);
+		aJob->state = JOBSTATE_FINISHED;
+		aJob->exitCode = EC_SUCCESS;
+	} else if (!strcmp(aState, "running") && aJob->parameters.checkpointInterval && doesFileExist(aJob->parameters.resumeFilename)) {
+		logmsg(LLVL_INFO, "Conversion of %s was still running when luksipc was killed, resuming it from its checkpointed resume file %s.\n", aJob->parameters.rawDevice, aJob->parameters.resumeFilename);
+		aJob->parameters.resuming = true;
+	} else if (!strcmp(aState, "running") || !strcmp(aState, "recover")) {
+		logmsg(LLVL_ERROR, "%s:%d: Conversion of %s was still running when luksipc was killed and its resume file %s was not kept valid with --checkpoint. It needs recovery: continue it on its own with --recover, then set state=done.\n", aParameters->jobFile, aLineNo, aJob->parameters.rawDevice, aJob->parameters.resumeFilename);
+		aJob->state = JOBSTATE_FINISHED;
+		aJob->exitCode = EC_CONVERSION_JOB_FAILED;
+		aJob->needsRecovery = true;
+	} else if (!strcmp(aState, "failed")) {
+		logmsg(LLVL_ERROR, "%s:%d: Conversion of %s failed in an earlier run and is not retried. Check the device, then set state=pending if nothing was converted yet or state=aborted if its resume file was written.\n", aParameters->jobFile, aLineNo, aJob->parameters.rawDevice);
+		aJob->state = JOBSTATE_FINISHED;
+		aJob->exitCode = EC_CONVERSION_JOB_FAILED;
+	} else {
+		logmsg(LLVL_ERROR, "%s:%d: Unknown job state '%s', expected pending, running, aborted, recover, done or failed.\n", aParameters->jobFile, aLineNo, aState);
+		return false;
+	}
+	return true;
+}
+
+/* Reads the job file. Each non-empty line that does not start with '#'
+ * describes one conversion:
+ *   DEVICE KEYFILE RESUMEFILE BACKUPFILE [GROUP] [state=STATE]
+ * GROUP identifies the spindle or controller the device sits on; if omitted,
+ * it is derived from the whole disk the device belongs to. STATE is recorded
+ * by luksipc while it runs the jobs (see writeJobStates()). Returns the number
+ * of jobs read or -1 on error. */
+int readJobFile(struct conversionParameters const *aParameters, struct conversionJob *aJobs, int aMaxJobs) {
+	FILE *f = fopen(aParameters->jobFile, "r");
+	if (!f) {
+		logmsg(LLVL_ERROR, "Cannot open job file %s: %s\n", aParameters->jobFile, strerror(errno));
+		return -1;
+	}
+
+	int jobCount = 0;
+	int lineNo = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		lineNo++;
+		line[strcspn(line, "\r\n")] = 0;
+
+		char *start = line + strspn(line, " \t");
+		if ((*start == 0) || (*start == '#')) {
+			continue;
+		}
+
+		if (jobCount >= aMaxJobs) {
+			logmsg(LLVL_ERROR, "%s:%d: Too many jobs, at most %d are supported.\n", aParameters->jobFile, lineNo, aMaxJobs);
+			freeJobs(aJobs, jobCount);
+			fclose(f);
+			return -1;
+		}
+
+		struct conversionJob *job = &aJobs[jobCount];
+		memset(job, 0, sizeof(struct conversionJob));
+		job->lineBuffer = strdup(start);
+		if (!job->lineBuffer) {
+			logmsg(LLVL_ERROR, "strdup of job file line failed: %s\n", strerror(errno));
+			freeJobs(aJobs, jobCount);
+			fclose(f);
+			return -1;
+		}
+
+		char *tokens[5] = { 0 };
+		int tokenCount = 0;
+		const char *state = NULL;
+		bool tooManyTokens = false;
+		char *savePtr = NULL;
+		char *token = strtok_r(job->lineBuffer, " \t", &savePtr);
+		while (token) {
+			if (!strncmp(token, JOBFILE_STATE_PREFIX, strlen(JOBFILE_STATE_PREFIX))) {
+				state = token + strlen(JOBFILE_STATE_PREFIX);
+			} else if (tokenCount < 5) {
+				tokens[tokenCount++] = token;
+			} else {
+				tooManyTokens = true;
+			}
+			token = strtok_r(NULL, " \t", &savePtr);
+		}
+		if ((tokenCount < 4) || tooManyTokens) {
+			logmsg(LLVL_ERROR, "%s:%d: Expected 'DEVICE KEYFILE RESUMEFILE BACKUPFILE [GROUP] [state=STATE]', got %d fields.\n", aParameters->jobFile, lineNo, tooManyTokens ? 6 : tokenCount);
+			free(job->lineBuffer);
+			freeJobs(aJobs, jobCount);
+			fclose(f);
+			return -1;
+		}
+
+		/* Every job inherits the global parameters and overrides the
+		 * device-specific ones */
+		job->parameters = *aParameters;
+		job->parameters.jobFile = NULL;
+		job->parameters.rawDevice = tokens[0];
+		job->parameters.readDevice = tokens[0];
+		job->parameters.keyFile = tokens[1];
+		job->parameters.resumeFilename = tokens[2];
+		job->parameters.backupFile = tokens[3];
+		job->lineNo = lineNo;
+		determineJobGroup(job, tokens[4]);
+		if (!applyJobState(aParameters, lineNo, job, state)) {
+			free(job->lineBuffer);
+			freeJobs(aJobs, jobCount);
+			fclose(f);
+			return -1;
+		}
+
+		for (int i = 0; i < jobCount; i++) {
+			if (!strcmp(aJobs[i].parameters.rawDevice, job->parameters.rawDevice)) {
+				logmsg(LLVL_ERROR, "%s:%d: Device %s is listed more than once.\n", aParameters->jobFile, lineNo, job->parameters.rawDevice);
+				free(job->lineBuffer);
+				freeJobs(aJobs, jobCount);
+				fclose(f);
+				return -1;
+			}
+		}
+
+		logmsg(LLVL_DEBUG, "Job %d: device %s, keyfile %s, resume file %s, backup file %s, group %s, %s\n", jobCount, job->parameters.rawDevice, job->parameters.keyFile, job->parameters.resumeFilename, job->parameters.backupFile, job->group, jobStateName(job));
+		jobCount++;
+	}
+	fclose(f);
+
+	if (jobCount == 0) {
+		logmsg(LLVL_ERROR, "Job file %s does not contain any jobs.\n", aParameters->jobFile);
+		return -1;
+	}
+	return jobCount;
+}
+
+/* Removes a state=STATE field from a job file line */
+static void removeStateField(char *aLine) {
+	char *field = aLine;
+	while ((field = strstr(field, JOBFILE_STATE_PREFIX))) {
+		if ((field == aLine) || (field[-1] == ' ') || (field[-1] == '\t')) {
+			char *end = field + strcspn(field, " \t");
+			memmove(field, end, strlen(end) + 1);
+		} else {
+			field++;
+		}
+	}
+	size_t length = strlen(aLine);
+	while ((length > 0) && ((aLine[length - 1] == ' ') || (aLine[length - 1] == '\t'))) {
+		aLine[--length] = 0;
+	}
+}
+
+/* Records the state of every job in the job file, so that running luksipc
+ * with the same job file again skips the jobs that are done, resumes the
+ * aborted ones and starts the pending ones from scratch. The file is replaced
+ * atomically; all other lines are kept as they are. */
+static void writeJobStates(struct conversionParameters const *aParameters, const struct conversionJob *aJobs, int aJobCount) {
+	char tmpFilename[PATH_MAX];
+	if (snprintf(tmpFilename, sizeof(tmpFilename), "%s.tmp", aParameters->jobFile) >= (int)sizeof(tmpFilename)) {
+		logmsg(LLVL_WARN, "Job file name %s too long, cannot record job states.\n", aParameters->jobFile);
+		return;
+	}
+
+	FILE *in = fopen(aParameters->jobFile, "r");
+	if (!in) {
+		logmsg(LLVL_WARN, "Cannot open job file %s to record job states: %s\n", aParameters->jobFile, strerror(errno));
+		return;
+	}
+	struct stat statBuf;
+	FILE *out = (fstat(fileno(in), &statBuf) == 0) ? fopen(tmpFilename, "w") : NULL;
+	if (!out) {
+		logmsg(LLVL_WARN, "Cannot create %s to record job states: %s\n", tmpFilename, strerror(errno));
+		fclose(in);
+		return;
+	}
+	fchmod(fileno(out), statBuf.st_mode & 07777);
+
+	int lineNo = 0;
+	int jobIndex = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), in)) {
+		lineNo++;
+		if ((jobIndex < aJobCount) && (aJobs[jobIndex].lineNo == lineNo)) {
+			line[strcspn(line, "\r\n")] = 0;
+			removeStateField(line);
+			fprintf(out, "%s\t" JOBFILE_STATE_PREFIX "%s\n", line, jobStateName(&aJobs[jobIndex]));
+			jobIndex++;
+		} else {
+			fputs(line, out);
+		}
+	}
+	fclose(in);
+
+	bool success = (fflush(out) == 0) && (fsync(fileno(out)) == 0);
+	success = (fclose(out) == 0) && success;
+	if (!success || (rename(tmpFilename, aParameters->jobFile) == -1)) {
+		logmsg(LLVL_WARN, "Cannot record job states in %s: %s\n", aParameters->jobFile, strerror(errno));
+		unlink(tmpFilename);
+	}
+}
+
+void freeJobs(struct conversionJob *aJobs, int aJobCount) {
+	for (int i = 0; i < aJobCount; i++) {
+		free(aJobs[i].lineBuffer);
+		aJobs[i].lineBuffer = NULL;
+	}
+}
+
+static bool isGroupBusy(const struct conversionJob *aJobs, int aJobCount, const char *aGroup) {
+	for (int i = 0; i < aJobCount; i++) {
+		if ((aJobs[i].state == JOBSTATE_RUNNING) && (!strcmp(aJobs[i].group, aGroup))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool startJob(struct conversionJob *aJob, conversionFunction_t aConvert) {
+	pid_t pid = fork();
+	if (pid == -1) {
+		logmsg(LLVL_ERROR, "Cannot fork conversion process for %s: %s\n", aJob->parameters.rawDevice, strerror(errno));
+		return false;
+	}
+	if (pid == 0) {
+		/* Child: convert() never returns, it terminates the process with the
+		 * appropriate exit code */
+		currentJobStatus = aJob->status;
+		initAsyncLogging(NULL);
+		aConvert(&aJob->parameters);
+		exit(EC_UNSPECIFIED_ERROR);
+	}
+	logmsg(LLVL_INFO, "Started conversion of %s (group %s) as PID %d\n", aJob->parameters.rawDevice, aJob->group, pid);
+	aJob->pid = pid;
+	aJob->state = JOBSTATE_RUNNING;
+	return true;
+}
+
+/* Returns true if the state of any job changed */
+static bool startEligibleJobs(struct conversionParameters const *aParameters, struct conversionJob *aJobs, int aJobCount, conversionFunction_t aConvert) {
+	bool stateChanged = false;
+	int runningCount = 0;
+	uint64_t memoryInUse = 0;
+	for (int i = 0; i < aJobCount; i++) {
+		if (aJobs[i].state == JOBSTATE_RUNNING) {
+			runningCount++;
+			memoryInUse += jobMemoryRequirement(&aJobs[i]);
+		}
+	}
+
+	for (int i = 0; i < aJobCount; i++) {
+		struct conversionJob *job = &aJobs[i];
+		if (job->state != JOBSTATE_PENDING) {
+			continue;
+		}
+		if (runningCount >= aParameters->maxJobs) {
+			break;
+		}
+		if (isGroupBusy(aJobs, aJobCount, job->group)) {
+			continue;
+		}
+		uint64_t memoryRequired = jobMemoryRequirement(job);
+		if (aParameters->memoryBudget && (memoryInUse + memoryRequired > aParameters->memoryBudget)) {
+			if (runningCount > 0) {
+				continue;
+			}
+			logmsg(LLVL_WARN, "Job for %s requires %" PRIu64 " MiB which exceeds the memory budget of %" PRIu64 " MiB, running it on its own.\n", job->parameters.rawDevice, memoryRequired / 1024 / 1024, aParameters->memoryBudget / 1024 / 1024);
+		}
+		stateChanged = true;
+		if (!startJob(job, aConvert)) {
+			job->state = JOBSTATE_FINISHED;
+			job->exitCode = EC_UNSPECIFIED_ERROR;
+			continue;
+		}
+		runningCount++;
+		memoryInUse += memoryRequired;
+	}
+	return stateChanged;
+}
+
+/* The I/O rate budget is split evenly among all currently running jobs */
+static void distributeIoRate(struct conversionParameters const *aParameters, struct conversionJob *aJobs, int aJobCount) {
+	int runningCount = 0;
+	for (int i = 0; i < aJobCount; i++) {
+		runningCount += (aJobs[i].state == JOBSTATE_RUNNING);
+	}
+	for (int i = 0; i < aJobCount; i++) {
+		atomic_store_explicit(&aJobs[i].status->ioRateLimit, (runningCount && aParameters->ioRateBudget) ? (aParameters->ioRateBudget / runningCount) : 0, memory_order_relaxed);
+	}
+}
+
+/* Returns true if any job finished */
+static bool reapFinishedJobs(struct conversionJob *aJobs, int aJobCount) {
+	bool stateChanged = false;
+	while (true) {
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid <= 0) {
+			break;
+		}
+		for (int i = 0; i < aJobCount; i++) {
+			if ((aJobs[i].state == JOBSTATE_RUNNING) && (aJobs[i].pid == pid)) {
+				aJobs[i].state = JOBSTATE_FINISHED;
+				aJobs[i].exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : EC_UNSPECIFIED_ERROR;
+				logmsg((aJobs[i].exitCode == EC_SUCCESS) ? LLVL_INFO : LLVL_WARN, "Conversion of %s (PID %d) finished with exit code %d.\n", aJobs[i].parameters.rawDevice, pid, aJobs[i].exitCode);
+				stateChanged = true;
+				break;
+			}
+		}
+	}
+	return stateChanged;
+}
+
+static void showAggregatedProgress(struct conversionJob *aJobs, int aJobCount, double aStartTime) {
+	int counts[3] = { 0 };
+	uint64_t totalDone = 0, totalSize = 0, copiedSinceStart = 0;
+	for (int i = 0; i < aJobCount; i++) {
+		counts[aJobs[i].state]++;
+		if (atomic_load_explicit(&aJobs[i].status->progressValid, memory_order_acquire)) {
+			uint64_t outOffset = atomic_load_explicit(&aJobs[i].status->outOffset, memory_order_relaxed);
+			totalDone += outOffset;
+			totalSize += atomic_load_explicit(&aJobs[i].status->endOutOffset, memory_order_relaxed);
+			copiedSinceStart += outOffset - atomic_load_explicit(&aJobs[i].status->startOutOffset, memory_order_relaxed);
+		}
+	}
+
+	double runtimeSeconds = getTime() - aStartTime;
+	int runtimeSecondsInteger = (int)runtimeSeconds;
+	double copySpeedBytesPerSecond = (runtimeSeconds > 1) ? ((double)copiedSinceStart / runtimeSeconds) : 0;
+	uint64_t remainingBytes = totalSize - totalDone;
+	int remainingSecsInteger = 0;
+	if (copySpeedBytesPerSecond > 10) {
+		double remainingSecs = (double)remainingBytes / copySpeedBytesPerSecond;
+		if (remainingSecs < (100 * 3600)) {
+			remainingSecsInteger = (int)remainingSecs;
+		}
+	}
+
+	logmsg(LLVL_INFO, "%2d:%02d: "
+					"jobs %d/%d/%d (pending/running/done)   "
+					"%5.1f%%   "
+					"%7" PRIu64 " MiB / %" PRIu64 " MiB   "
+					"%5.1f MiB/s   "
+					"Left: "
+					"%7" PRIu64 " MiB "
+					"%2d:%02d h:m"
+					"\n",
+						runtimeSecondsInteger / 3600, runtimeSecondsInteger % 3600 / 60,
+						counts[JOBSTATE_PENDING], counts[JOBSTATE_RUNNING], counts[JOBSTATE_FINISHED],
+						totalSize ? (100.0 * (double)totalDone / (double)totalSize) : 0.0,
+						totalDone / 1024 / 1024,
+						totalSize / 1024 / 1024,
+						copySpeedBytesPerSecond / 1024. / 1024.,
+						remainingBytes / 1024 / 1024,
+						remainingSecsInteger / 3600, remainingSecsInteger % 3600 / 60
+	);
+}
+
+static enum terminationCode_t aggregateExitCode(const struct conversionJob *aJobs, int aJobCount) {
+	bool anyFailed = false, anyResumable = false;
+	for (int i = 0; i < aJobCount; i++) {
+		if (aJobs[i].state != JOBSTATE_FINISHED) {
+			/* Never started because shutdown was requested; the job file
+			 * says whether a rerun starts or resumes it */
+			anyResumable = true;
+		} else if (aJobs[i].exitCode == EC_COPY_ABORTED_RESUME_FILE_WRITTEN) {
+			anyResumable = true;
+		} else if (aJobs[i].needsRecovery) {
+			logmsg(LLVL_ERROR, "Conversion of %s needs to be continued with --recover.\n", aJobs[i].parameters.rawDevice);
+			anyFailed = true;
+		} else if (aJobs[i].exitCode != EC_SUCCESS) {
+			logmsg(LLVL_ERROR, "Conversion of %s failed with exit code %d.\n", aJobs[i].parameters.rawDevice, aJobs[i].exitCode);
+			anyFailed = true;
+		}
+	}
+	if (anyFailed) {
+		return EC_CONVERSION_JOB_FAILED;
+	} else if (anyResumable) {
+		return EC_COPY_ABORTED_RESUME_FILE_WRITTEN;
+	}
+	return EC_SUCCESS;
+}
+
+/* Runs all conversion jobs, each in its own forked process. At most maxJobs
+ * run concurrently, never two of the same group, and only as many as the
+ * memory budget permits. Returns the aggregated termination code. */
+int runConversionJobs(struct conversionParameters const *aParameters, struct conversionJob *aJobs, int aJobCount, conversionFunction_t aConvert) {
+	struct jobStatus *sharedStatus = mmap(NULL, sizeof(struct jobStatus) * aJobCount, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sharedStatus == MAP_FAILED) {
+		logmsg(LLVL_ERROR, "Cannot allocate shared job status memory: %s\n", strerror(errno));
+		return EC_UNSPECIFIED_ERROR;
+	}
+	memset(sharedStatus, 0, sizeof(struct jobStatus) * aJobCount);
+	for (int i = 0; i < aJobCount; i++) {
+		aJobs[i].status = &sharedStatus[i];
+	}
+
+	logmsg(LLVL_INFO, "Scheduling %d conversion jobs, at most %d concurrently.\n", aJobCount, aParameters->maxJobs);
+	writeJobStates(aParameters, aJobs, aJobCount);
+	double startTime = getTime();
+	double lastShowTime = startTime;
+	bool signalsForwarded = false;
+	while (true) {
+		bool stateChanged = reapFinishedJobs(aJobs, aJobCount);
+
+		if (!receivedSigQuit()) {
+			stateChanged = startEligibleJobs(aParameters, aJobs, aJobCount, aConvert) || stateChanged;
+		} else if (!signalsForwarded) {
+			/* Children usually got the signal from the terminal already, but
+			 * not if only the scheduler was signalled */
+			logmsg(LLVL_INFO, "Not starting any more jobs, waiting for running conversions to shut down.\n");
+			for (int i = 0; i < aJobCount; i++) {
+				if (aJobs[i].state == JOBSTATE_RUNNING) {
+					kill(aJobs[i].pid, SIGTERM);
+				}
+			}
+			signalsForwarded = true;
+		}
+		if (stateChanged) {
+			writeJobStates(aParameters, aJobs, aJobCount);
+		}
+		distributeIoRate(aParameters, aJobs, aJobCount);
+
+		int runningCount = 0, pendingCount = 0;
+		for (int i = 0; i < aJobCount; i++) {
+			runningCount += (aJobs[i].state == JOBSTATE_RUNNING);
+			pendingCount += (aJobs[i].state == JOBSTATE_PENDING);
+		}
+		if ((runningCount == 0) && ((pendingCount == 0) || receivedSigQuit())) {
+			break;
+		}
+
+		double now = getTime();
+		if (now - lastShowTime >= PROGRESS_INTERVAL_SECS) {
+			showAggregatedProgress(aJobs, aJobCount, startTime);
+			lastShowTime = now;
+		}
+		usleep(250 * 1000);
+	}
+	showAggregatedProgress(aJobs, aJobCount, startTime);
+
+	enum terminationCode_t result = aggregateExitCode(aJobs, aJobCount);
+	munmap(sharedStatus, sizeof(struct jobStatus) * aJobCount);
+	return result;
+}
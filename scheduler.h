@@ -0,0 +1,78 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "parameters.h"
+
+#define MAX_CONVERSION_JOBS				64
+#define JOBFILE_STATE_PREFIX			"state="
+
+enum jobState_t {
+	JOBSTATE_PENDING,
+	JOBSTATE_RUNNING,
+	JOBSTATE_FINISHED,
+};
+
+/* Lives in memory shared between the scheduler and the forked conversion
+ * processes; the child reports its progress, the scheduler hands out the I/O
+ * rate share. The fields are only ever accessed atomically, so that neither
+ * side can see a torn value. */
+struct jobStatus {
+	_Atomic uint64_t startOutOffset;
+	_Atomic uint64_t outOffset;
+	_Atomic uint64_t endOutOffset;
+	atomic_bool progressValid;			/* Published after the offsets */
+	_Atomic uint64_t ioRateLimit;		/* Bytes per second, 0 = unlimited */
+};
+
+struct conversionJob {
+	struct conversionParameters parameters;
+	char group[64];						/* Jobs of the same group (spindle/controller) are never run concurrently */
+	char *lineBuffer;					/* Owns the strings that parameters point to */
+	int lineNo;							/* Line of the job file the job was read from */
+	enum jobState_t state;
+	pid_t pid;
+	int exitCode;
+	bool needsRecovery;					/* Killed without a valid resume file, must be continued with --recover */
+	struct jobStatus *status;
+};
+
+typedef void (*conversionFunction_t)(struct conversionParameters const *aParameters);
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void reportJobProgress(uint64_t aOutOffset, uint64_t aEndOutOffset);
+bool isRunningAsJob(void);
+uint64_t getJobIoRateLimit(void);
+int readJobFile(struct conversionParameters const *aParameters, struct conversionJob *aJobs, int aMaxJobs);
+void freeJobs(struct conversionJob *aJobs, int aJobCount);
+int runConversionJobs(struct conversionParameters const *aParameters, struct conversionJob *aJobs, int aJobCount, conversionFunction_t aConvert);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -36,7 +36,7 @@ static volatile bool quit = false;
 static void signalInterrupt(int aSignal) {
 	(void)aSignal;
 	quit = true;
-	logmsg(LLVL_CRITICAL, "Shutdown requested by user interrupt, please be patient...\n");
+	logmsgSignalSafe(LLVL_CRITICAL, "Shutdown requested by user interrupt, please be patient...\n");
 }
 
 bool receivedSigQuit(void) {
@@ -47,6 +47,10 @@ void issueSigQuit(void) {
 	quit = true;
 }
 
+void clearSigQuit(void) {
+	quit = false;
+}
+
 bool initSignalHandlers(void) {
 	struct sigaction action;
 	memset(&action, 0, sizeof(struct sigaction));
@@ -29,6 +29,7 @@
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool receivedSigQuit(void);
 void issueSigQuit(void);
+void clearSigQuit(void);
 bool initSignalHandlers(void);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
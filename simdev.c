@@ -0,0 +1,214 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+
+#include "simdev.h"
+#include "logging.h"
+
+/* A simulated block device that lives in memory. Every I/O advances a
+ * simulated clock by its service time, so the performance of the copy engine
+ * can be measured deterministically (for a given seed) without real devices.
+ * The service time of an I/O is its latency plus the transfer time. Large
+ * I/Os are split into requests of maxRequestSize bytes like the block layer
+ * does; the device only reaches its full throughput if at least queueDepth
+ * of those requests are in flight at the same time. */
+
+void simDeviceDefaultConfig(struct simDeviceConfig *aConfig, uint64_t aSize) {
+	memset(aConfig, 0, sizeof(struct simDeviceConfig));
+	aConfig->size = aSize;
+	aConfig->seed = 1;
+	aConfig->throughput = 150e6;
+	aConfig->latency = 100e-6;
+	aConfig->latencyDistribution = SIMLAT_CONSTANT;
+	aConfig->maxRequestSize = 512 * 1024;
+	aConfig->queueDepth = 1;
+}
+
+struct simDevice *simDeviceCreate(const struct simDeviceConfig *aConfig) {
+	struct simDevice *device = calloc(1, sizeof(struct simDevice));
+	if (!device) {
+		return NULL;
+	}
+	device->config = *aConfig;
+	device->prngState = aConfig->seed;
+	device->data = calloc(1, aConfig->size);
+	if (!device->data) {
+		free(device);
+		return NULL;
+	}
+	return device;
+}
+
+void simDeviceFree(struct simDevice *aDevice) {
+	if (aDevice) {
+		free(aDevice->data);
+		free(aDevice);
+	}
+}
+
+/* SplitMix64, deterministic for a given seed */
+uint64_t simRandom(struct simDevice *aDevice) {
+	uint64_t z = (aDevice->prngState += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double simRandomDouble(struct simDevice *aDevice) {
+	return (simRandom(aDevice) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool simDeviceAddFault(struct simDevice *aDevice, enum simFaultType_t aType, uint64_t aStart, uint64_t aEnd, double aProbability) {
+	if (aDevice->config.faultCount >= SIMDEV_MAX_FAULTS) {
+		return false;
+	}
+	aDevice->config.faults[aDevice->config.faultCount++] = (struct simFault) {
+		.type = aType,
+		.start = aStart,
+		.end = aEnd,
+		.probability = aProbability,
+	};
+	return true;
+}
+
+static double sampleLatency(struct simDevice *aDevice) {
+	switch (aDevice->config.latencyDistribution) {
+		case SIMLAT_UNIFORM:
+			return 2 * aDevice->config.latency * simRandomDouble(aDevice);
+
+		case SIMLAT_EXPONENTIAL:
+			return -aDevice->config.latency * log(1 - simRandomDouble(aDevice));
+
+		case SIMLAT_CONSTANT:
+		default:
+			return aDevice->config.latency;
+	}
+}
+
+static void advanceClock(struct simDevice *aDevice, uint32_t aLength) {
+	uint32_t requestSize = aDevice->config.maxRequestSize ? aDevice->config.maxRequestSize : aLength;
+	uint32_t requestCount = (aLength + requestSize - 1) / requestSize;
+	int queueDepth = (aDevice->config.queueDepth > 0) ? aDevice->config.queueDepth : 1;
+	uint32_t inFlight = (requestCount < (uint32_t)queueDepth) ? requestCount : (uint32_t)queueDepth;
+	if (inFlight < 1) {
+		inFlight = 1;
+	}
+
+	double bandwidth = aDevice->config.throughput * inFlight / queueDepth;
+	double serviceTime = sampleLatency(aDevice) + ((bandwidth > 0) ? (aLength / bandwidth) : 0);
+	aDevice->clock += serviceTime;
+	if (aDevice->config.realTime) {
+		usleep((useconds_t)(serviceTime * 1e6));
+	}
+}
+
+static bool injectFault(struct simDevice *aDevice, enum simFaultType_t aType, uint64_t aOffset, uint32_t aLength) {
+	for (int i = 0; i < aDevice->config.faultCount; i++) {
+		const struct simFault *fault = &aDevice->config.faults[i];
+		if ((fault->type == aType) && (aOffset < fault->end) && (aOffset + aLength > fault->start)) {
+			if (simRandomDouble(aDevice) < fault->probability) {
+				aDevice->stats.faults++;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* Clips an I/O to the end of the device, returns the number of bytes that
+ * can be transferred */
+static uint32_t clipLength(struct simDevice *aDevice, uint64_t aOffset, uint32_t aLength) {
+	if (aOffset >= aDevice->config.size) {
+		return 0;
+	}
+	if (aOffset + aLength > aDevice->config.size) {
+		return aDevice->config.size - aOffset;
+	}
+	return aLength;
+}
+
+static ssize_t simReadAt(struct ioBackend *aBackend, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct simDevice *device = (struct simDevice*)aBackend->context;
+	aOffset += aBackend->offset;
+	aLength = clipLength(device, aOffset, aLength);
+
+	advanceClock(device, aLength);
+	if (injectFault(device, SIMFAULT_READ_ERROR, aOffset, aLength)) {
+		errno = EIO;
+		return -1;
+	}
+	memcpy(aData, device->data + aOffset, aLength);
+	device->stats.reads++;
+	device->stats.bytesRead += aLength;
+	return aLength;
+}
+
+static ssize_t simWriteAt(struct ioBackend *aBackend, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct simDevice *device = (struct simDevice*)aBackend->context;
+	aOffset += aBackend->offset;
+	uint32_t length = clipLength(device, aOffset, aLength);
+	if (length < aLength) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	advanceClock(device, aLength);
+	if (injectFault(device, SIMFAULT_WRITE_ERROR, aOffset, aLength)) {
+		errno = EIO;
+		return -1;
+	}
+	if ((device->config.tornWriteProbability > 0) && (simRandomDouble(device) < device->config.tornWriteProbability)) {
+		/* Only some of the sectors make it to the disk before the write
+		 * fails (e.g. power loss or a dying cable) */
+		uint32_t sectors = aLength / 512;
+		uint32_t tornLength = sectors ? (simRandom(device) % sectors) * 512 : 0;
+		memcpy(device->data + aOffset, aData, tornLength);
+		device->stats.tornWrites++;
+		device->stats.bytesWritten += tornLength;
+		errno = EIO;
+		return -1;
+	}
+	memcpy(device->data + aOffset, aData, aLength);
+	device->stats.writes++;
+	device->stats.bytesWritten += aLength;
+	return aLength;
+}
+
+/* Initializes a backend that performs I/O on the simulated device. All
+ * offsets are relative to aOffset, which allows two overlapping views of the
+ * same device like the plain and the LUKS device during conversion. */
+void initSimBackend(struct ioBackend *aBackend, struct simDevice *aDevice, uint64_t aOffset) {
+	memset(aBackend, 0, sizeof(struct ioBackend));
+	aBackend->name = "sim";
+	aBackend->readAt = simReadAt;
+	aBackend->writeAt = simWriteAt;
+	aBackend->fd = -1;
+	aBackend->offset = aOffset;
+	aBackend->context = aDevice;
+}
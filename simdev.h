@@ -0,0 +1,86 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __SIMDEV_H__
+#define __SIMDEV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chunk.h"
+
+#define SIMDEV_MAX_FAULTS			16
+
+enum simLatencyDistribution_t {
+	SIMLAT_CONSTANT,
+	SIMLAT_UNIFORM,					/* Uniform between 0 and twice the mean */
+	SIMLAT_EXPONENTIAL,
+};
+
+enum simFaultType_t {
+	SIMFAULT_READ_ERROR,
+	SIMFAULT_WRITE_ERROR,
+};
+
+struct simFault {
+	enum simFaultType_t type;
+	uint64_t start, end;			/* Affected byte range [start, end) */
+	double probability;				/* Chance that an I/O touching the range fails */
+};
+
+struct simDeviceConfig {
+	uint64_t size;
+	uint64_t seed;
+	double throughput;				/* Bytes per second with a full queue */
+	double latency;					/* Mean latency per I/O in seconds */
+	enum simLatencyDistribution_t latencyDistribution;
+	uint32_t maxRequestSize;		/* I/Os are split into requests of at most this size */
+	int queueDepth;					/* Requests in flight that are needed for full throughput */
+	struct simFault faults[SIMDEV_MAX_FAULTS];
+	int faultCount;
+	double tornWriteProbability;	/* Chance that a write fails after a random number of sectors */
+	bool realTime;					/* Actually sleep for the simulated service time */
+};
+
+struct simDevice {
+	struct simDeviceConfig config;
+	uint8_t *data;
+	uint64_t prngState;
+	double clock;					/* Simulated time in seconds */
+	struct {
+		uint64_t reads, writes;
+		uint64_t bytesRead, bytesWritten;
+		uint64_t faults, tornWrites;
+	} stats;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void simDeviceDefaultConfig(struct simDeviceConfig *aConfig, uint64_t aSize);
+struct simDevice *simDeviceCreate(const struct simDeviceConfig *aConfig);
+void simDeviceFree(struct simDevice *aDevice);
+uint64_t simRandom(struct simDevice *aDevice);
+bool simDeviceAddFault(struct simDevice *aDevice, enum simFaultType_t aType, uint64_t aStart, uint64_t aEnd, double aProbability);
+void initSimBackend(struct ioBackend *aBackend, struct simDevice *aDevice, uint64_t aOffset);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
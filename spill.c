@@ -0,0 +1,249 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include "spill.h"
+#include "logging.h"
+
+_Static_assert(sizeof(struct spillFileHeader) == 32, "spill file header must not contain padding");
+_Static_assert(sizeof(struct spillSlotHeader) == 24, "spill slot header must not contain padding");
+
+static uint64_t slotPosition(uint32_t aChunkSize, int aSlot) {
+	return SPILL_HEADER_SIZE + (uint64_t)aSlot * (SPILL_HEADER_SIZE + aChunkSize);
+}
+
+/* Word-wise multiplicative hash; detects torn and stale slots, it is not
+ * meant to be cryptographically strong */
+static uint64_t spillChecksum(uint64_t aOffset, const uint8_t *aData, uint32_t aLength) {
+	uint64_t hash = 0xcbf29ce484222325ULL ^ aOffset ^ ((uint64_t)aLength << 32);
+	uint32_t i;
+	for (i = 0; i + sizeof(uint64_t) <= aLength; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, aData + i, sizeof(uint64_t));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < aLength; i++) {
+		hash = (hash ^ aData[i]) * 0x100000001b3ULL;
+	}
+	return hash ^ (hash >> 32);
+}
+
+static bool fullPwrite(int aFd, const void *aData, size_t aLength, uint64_t aOffset) {
+	const uint8_t *data = (const uint8_t*)aData;
+	while (aLength > 0) {
+		ssize_t written = pwrite(aFd, data, aLength, aOffset);
+		if (written <= 0) {
+			if ((written == -1) && (errno == EINTR)) {
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		aLength -= written;
+		aOffset += written;
+	}
+	return true;
+}
+
+static bool fullPread(int aFd, void *aData, size_t aLength, uint64_t aOffset) {
+	uint8_t *data = (uint8_t*)aData;
+	while (aLength > 0) {
+		ssize_t bytesRead = pread(aFd, data, aLength, aOffset);
+		if (bytesRead <= 0) {
+			if ((bytesRead == -1) && (errno == EINTR)) {
+				continue;
+			}
+			return false;
+		}
+		data += bytesRead;
+		aLength -= bytesRead;
+		aOffset += bytesRead;
+	}
+	return true;
+}
+
+/* Creates the spill file with as many slots of aChunkSize as fit into
+ * aSpillSize. The space is allocated up front so that a full file system
+ * cannot interrupt the copy. Returns NULL on error. */
+struct spillFile *spillCreate(const char *aFilename, uint32_t aChunkSize, uint64_t aSpillSize, uint64_t aDeviceSize) {
+	int slotCount = (aSpillSize - SPILL_HEADER_SIZE) / (SPILL_HEADER_SIZE + aChunkSize);
+	if ((aSpillSize <= SPILL_HEADER_SIZE) || (slotCount < 3)) {
+		logmsg(LLVL_ERROR, "Spill size of %" PRIu64 " MiB holds less than three chunks of %u MiB.\n", aSpillSize / 1024 / 1024, aChunkSize / 1024 / 1024);
+		return NULL;
+	}
+
+	struct spillFile *spill = calloc(1, sizeof(struct spillFile));
+	if (!spill) {
+		return NULL;
+	}
+	spill->filename = strdup(aFilename);
+	spill->chunkSize = aChunkSize;
+	spill->slotCount = slotCount;
+	spill->deviceSize = aDeviceSize;
+	spill->fd = open(aFilename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (!spill->filename || (spill->fd == -1)) {
+		logmsg(LLVL_ERROR, "Cannot create spill file %s: %s\n", aFilename, strerror(errno));
+		free(spill->filename);
+		free(spill);
+		return NULL;
+	}
+
+	int result = posix_fallocate(spill->fd, 0, slotPosition(aChunkSize, slotCount));
+	if (result != 0) {
+		logmsg(LLVL_ERROR, "Cannot allocate %" PRIu64 " MiB for spill file %s: %s\n", slotPosition(aChunkSize, slotCount) / 1024 / 1024, aFilename, strerror(result));
+		spillClose(spill, true);
+		return NULL;
+	}
+
+	struct spillFileHeader header = {
+		.version = SPILL_FILE_VERSION,
+		.chunkSize = aChunkSize,
+		.slotCount = slotCount,
+		.deviceSize = aDeviceSize,
+	};
+	memcpy(header.magic, SPILL_FILE_MAGIC, sizeof(header.magic));
+	if (!fullPwrite(spill->fd, &header, sizeof(header), 0)) {
+		logmsg(LLVL_ERROR, "Cannot write header of spill file %s: %s\n", aFilename, strerror(errno));
+		spillClose(spill, true);
+		return NULL;
+	}
+	logmsg(LLVL_INFO, "Spilling read-ahead data to %s, %d chunks (%" PRIu64 " MiB).\n", aFilename, slotCount, (uint64_t)slotCount * aChunkSize / 1024 / 1024);
+	return spill;
+}
+
+/* Stores the chunk that was read from aOffset in a slot */
+bool spillStore(struct spillFile *aSpill, int aSlot, const struct chunk *aChunk, uint64_t aOffset) {
+	struct spillSlotHeader slotHeader = {
+		.offset = aOffset,
+		.length = aChunk->used,
+		.checksum = spillChecksum(aOffset, aChunk->data, aChunk->used),
+	};
+	uint64_t position = slotPosition(aSpill->chunkSize, aSlot);
+	if (!fullPwrite(aSpill->fd, aChunk->data, aChunk->used, position + SPILL_HEADER_SIZE) || !fullPwrite(aSpill->fd, &slotHeader, sizeof(slotHeader), position)) {
+		logmsg(LLVL_ERROR, "Cannot write slot %d of spill file %s: %s\n", aSlot, aSpill->filename, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static bool loadSlot(int aFd, uint32_t aChunkSize, int aSlot, struct spillSlotHeader *aSlotHeader, uint8_t *aData) {
+	uint64_t position = slotPosition(aChunkSize, aSlot);
+	if (!fullPread(aFd, aSlotHeader, sizeof(struct spillSlotHeader), position) || (aSlotHeader->length > aChunkSize)) {
+		return false;
+	}
+	if (!fullPread(aFd, aData, aSlotHeader->length, position + SPILL_HEADER_SIZE)) {
+		return false;
+	}
+	return spillChecksum(aSlotHeader->offset, aData, aSlotHeader->length) == aSlotHeader->checksum;
+}
+
+/* Loads the chunk read from aOffset back from a slot. Fails if the slot holds
+ * a different chunk or its checksum does not match. */
+bool spillLoad(struct spillFile *aSpill, int aSlot, struct chunk *aChunk, uint64_t aOffset) {
+	struct spillSlotHeader slotHeader;
+	if (!loadSlot(aSpill->fd, aSpill->chunkSize, aSlot, &slotHeader, aChunk->data) || (slotHeader.offset != aOffset) || (slotHeader.length > aChunk->size)) {
+		logmsg(LLVL_WARN, "Slot %d of spill file %s does not hold a valid copy of offset %" PRIu64 ".\n", aSlot, aSpill->filename, aOffset);
+		return false;
+	}
+	aChunk->used = slotHeader.length;
+	return true;
+}
+
+/* Spilled data must be on stable storage before the copy overwrites the
+ * device area it came from, otherwise --recover cannot rely on it */
+bool spillSync(struct spillFile *aSpill) {
+	if (fdatasync(aSpill->fd) == -1) {
+		logmsg(LLVL_ERROR, "Cannot sync spill file %s: %s\n", aSpill->filename, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void spillClose(struct spillFile *aSpill, bool aRemove) {
+	if (aSpill->fd != -1) {
+		close(aSpill->fd);
+	}
+	if (aRemove) {
+		unlink(aSpill->filename);
+	}
+	free(aSpill->filename);
+	free(aSpill);
+}
+
+/* Copies the data of the read device at aOffset from the spill file of an
+ * interrupted conversion, possibly assembled from several slots. Returns
+ * false unless all of it is found in valid slots. */
+bool spillRecoverData(const char *aFilename, uint64_t aDeviceSize, uint64_t aOffset, uint8_t *aData, uint32_t aLength) {
+	int fd = open(aFilename, O_RDONLY);
+	if (fd == -1) {
+		logmsg(LLVL_WARN, "Cannot open spill file %s: %s\n", aFilename, strerror(errno));
+		return false;
+	}
+	struct spillFileHeader header;
+	if (!fullPread(fd, &header, sizeof(header), 0) || memcmp(header.magic, SPILL_FILE_MAGIC, sizeof(header.magic)) || (header.version != SPILL_FILE_VERSION) || (header.deviceSize != aDeviceSize)) {
+		logmsg(LLVL_WARN, "%s is not a spill file of this device.\n", aFilename);
+		close(fd);
+		return false;
+	}
+	uint8_t *slotData = malloc(header.chunkSize);
+	if (!slotData) {
+		close(fd);
+		return false;
+	}
+
+	uint32_t recovered = 0;
+	bool progress = true;
+	while ((recovered < aLength) && progress) {
+		progress = false;
+		uint64_t wanted = aOffset + recovered;
+		for (uint32_t slot = 0; slot < header.slotCount; slot++) {
+			struct spillSlotHeader slotHeader;
+			if (!fullPread(fd, &slotHeader, sizeof(slotHeader), slotPosition(header.chunkSize, slot))) {
+				break;
+			}
+			if ((slotHeader.offset > wanted) || (wanted >= slotHeader.offset + slotHeader.length)) {
+				continue;
+			}
+			if (loadSlot(fd, header.chunkSize, slot, &slotHeader, slotData)) {
+				uint32_t length = slotHeader.offset + slotHeader.length - wanted;
+				length = (length < aLength - recovered) ? length : (aLength - recovered);
+				memcpy(aData + recovered, slotData + (wanted - slotHeader.offset), length);
+				recovered += length;
+				progress = true;
+				break;
+			}
+		}
+	}
+	free(slotData);
+	close(fd);
+	return recovered == aLength;
+}
@@ -0,0 +1,75 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chunk.h"
+
+#define SPILL_FILE_MAGIC				"LUKSIPCS"
+#define SPILL_FILE_VERSION				1
+#define SPILL_DEFAULT_SIZE				(4ULL * 1024 * 1024 * 1024)
+
+/* The file header and every slot header occupy one page, so that the chunk
+ * data stays page aligned */
+#define SPILL_HEADER_SIZE				4096
+
+/* A spill file consists of this header followed by slots of one slot header
+ * and one chunk each, all in host byte order */
+struct spillFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t chunkSize;
+	uint32_t slotCount;
+	uint32_t reserved;
+	uint64_t deviceSize;			/* Size of the read device */
+};
+
+struct spillSlotHeader {
+	uint64_t offset;				/* Offset of the chunk on the read device */
+	uint32_t length;
+	uint32_t reserved;
+	uint64_t checksum;				/* Covers offset, length and data */
+};
+
+struct spillFile {
+	int fd;
+	char *filename;
+	uint32_t chunkSize;
+	int slotCount;
+	uint64_t deviceSize;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct spillFile *spillCreate(const char *aFilename, uint32_t aChunkSize, uint64_t aSpillSize, uint64_t aDeviceSize);
+bool spillStore(struct spillFile *aSpill, int aSlot, const struct chunk *aChunk, uint64_t aOffset);
+bool spillLoad(struct spillFile *aSpill, int aSlot, struct chunk *aChunk, uint64_t aOffset);
+bool spillSync(struct spillFile *aSpill);
+void spillClose(struct spillFile *aSpill, bool aRemove);
+bool spillRecoverData(const char *aFilename, uint64_t aDeviceSize, uint64_t aOffset, uint8_t *aData, uint32_t aLength);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
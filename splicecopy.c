@@ -0,0 +1,125 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include "splicecopy.h"
+#include "logging.h"
+
+bool splicePipeCreate(struct splicePipe *aPipe, uint32_t aCapacity) {
+	int fds[2];
+	if (pipe(fds) == -1) {
+		logmsg(LLVL_WARN, "Cannot create pipe for splicing: %s\n", strerror(errno));
+		return false;
+	}
+	aPipe->readFd = fds[0];
+	aPipe->writeFd = fds[1];
+
+	/* Raising the capacity above /proc/sys/fs/pipe-max-size requires
+	 * CAP_SYS_RESOURCE, a smaller pipe only means more system calls */
+	if (fcntl(aPipe->writeFd, F_SETPIPE_SZ, aCapacity) == -1) {
+		logmsg(LLVL_DEBUG, "Cannot raise pipe capacity to %u bytes: %s\n", aCapacity, strerror(errno));
+	}
+	int capacity = fcntl(aPipe->writeFd, F_GETPIPE_SZ);
+	if (capacity <= 0) {
+		logmsg(LLVL_WARN, "Cannot determine pipe capacity: %s\n", strerror(errno));
+		splicePipeClose(aPipe);
+		return false;
+	}
+	aPipe->capacity = capacity;
+	return true;
+}
+
+void splicePipeClose(struct splicePipe *aPipe) {
+	close(aPipe->readFd);
+	close(aPipe->writeFd);
+	aPipe->readFd = -1;
+	aPipe->writeFd = -1;
+}
+
+/* Data left over in the pipe after a failed splice would end up at the wrong
+ * offset, so the pipe is replaced by an empty one */
+static void splicePipeReset(struct splicePipe *aPipe) {
+	int savedErrno = errno;
+	uint32_t capacity = aPipe->capacity;
+	splicePipeClose(aPipe);
+	if (!splicePipeCreate(aPipe, capacity)) {
+		aPipe->capacity = 0;
+	}
+	errno = savedErrno;
+}
+
+/* Copies aLength bytes from aInFd to aOutFd without them passing through user
+ * space. Returns the number of bytes written or -1 on error with errno set;
+ * EINVAL means that one of the file descriptors does not support splicing. */
+ssize_t spliceRange(struct splicePipe *aPipe, int aInFd, uint64_t aInOffset, int aOutFd, uint64_t aOutOffset, uint32_t aLength) {
+	if (aPipe->capacity == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	loff_t inOffset = aInOffset;
+	loff_t outOffset = aOutOffset;
+	uint32_t moved = 0;
+	while (moved < aLength) {
+		/* The pipe is drained after every fill, since its capacity is counted
+		 * in pages and an unaligned range needs one page more than its
+		 * length. Splicing into a full pipe would block forever. */
+		ssize_t filled = splice(aInFd, &inOffset, aPipe->writeFd, NULL, aLength - moved, SPLICE_F_MOVE);
+		if ((filled == -1) && (errno == EINTR)) {
+			continue;
+		}
+		if (filled <= 0) {
+			if (filled == 0) {
+				errno = EIO;
+			}
+			splicePipeReset(aPipe);
+			return -1;
+		}
+
+		ssize_t drained = 0;
+		while (drained < filled) {
+			ssize_t result = splice(aPipe->readFd, NULL, aOutFd, &outOffset, filled - drained, SPLICE_F_MOVE);
+			if ((result == -1) && (errno == EINTR)) {
+				continue;
+			}
+			if (result <= 0) {
+				if (result == 0) {
+					errno = EIO;
+				}
+				logmsg(LLVL_WARN, "Spliced only %u of %u bytes to offset 0x%" PRIx64 ": %s\n", moved + (uint32_t)drained, aLength, aOutOffset, strerror(errno));
+				splicePipeReset(aPipe);
+				return -1;
+			}
+			drained += result;
+		}
+		moved += filled;
+	}
+	return moved;
+}
@@ -0,0 +1,48 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __SPLICECOPY_H__
+#define __SPLICECOPY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Pipe capacity requested for splicing, the kernel default (64 kiB) is used
+ * if it cannot be raised */
+#define SPLICE_PIPE_SIZE				(1024 * 1024)
+
+/* Data spliced from the read device into the pipe are only references to the
+ * page cache, from the pipe they go to the write device */
+struct splicePipe {
+	int readFd, writeFd;
+	uint32_t capacity;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool splicePipeCreate(struct splicePipe *aPipe, uint32_t aCapacity);
+void splicePipeClose(struct splicePipe *aPipe);
+ssize_t spliceRange(struct splicePipe *aPipe, int aInFd, uint64_t aInOffset, int aOutFd, uint64_t aOutOffset, uint32_t aLength);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
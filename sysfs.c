@@ -0,0 +1,159 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "sysfs.h"
+#include "logging.h"
+#include "utils.h"
+
+/* Determines the canonical sysfs directory of a block device, e.g.
+ * /sys/devices/pci0000:00/.../block/sda/sda1 for /dev/sda1. For regular files
+ * (images), the block device of the file system they reside on is used. */
+bool getBlockDeviceSysfsPath(const char *aDevice, char *aPath, int aPathSize) {
+	struct stat statBuf;
+	if (stat(aDevice, &statBuf) != 0) {
+		logmsg(LLVL_DEBUG, "Cannot stat %s to determine sysfs path: %s\n", aDevice, strerror(errno));
+		return false;
+	}
+	dev_t device;
+	if (S_ISBLK(statBuf.st_mode)) {
+		device = statBuf.st_rdev;
+	} else if (S_ISREG(statBuf.st_mode)) {
+		device = statBuf.st_dev;
+	} else {
+		logmsg(LLVL_DEBUG, "%s is neither a block device nor a regular file, no sysfs path available.\n", aDevice);
+		return false;
+	}
+
+	char devPath[64];
+	snprintf(devPath, sizeof(devPath), "/sys/dev/block/%u:%u", major(device), minor(device));
+
+	char resolvedPath[PATH_MAX];
+	if (!realpath(devPath, resolvedPath)) {
+		logmsg(LLVL_DEBUG, "Cannot resolve sysfs path %s: %s\n", devPath, strerror(errno));
+		return false;
+	}
+	return safestrcpy(aPath, resolvedPath, aPathSize);
+}
+
+/* Returns the sysfs directory of the whole disk the given device resides on.
+ * For partitions, this is the parent directory; for device mapper devices
+ * that have exactly one underlying device (e.g. linear or crypt targets), the
+ * slave is followed. Everything else is regarded as a whole disk itself. */
+bool getWholeDiskSysfsPath(const char *aDevice, char *aPath, int aPathSize) {
+	if (!getBlockDeviceSysfsPath(aDevice, aPath, aPathSize)) {
+		return false;
+	}
+
+	for (int depth = 0; depth < 8; depth++) {
+		char subPath[PATH_MAX];
+		snprintf(subPath, sizeof(subPath), "%s/partition", aPath);
+		if (doesFileExist(subPath)) {
+			char *lastSlash = strrchr(aPath, '/');
+			if (lastSlash) {
+				*lastSlash = 0;
+			}
+			return true;
+		}
+
+		/* Follow the only slave, if there is exactly one */
+		snprintf(subPath, sizeof(subPath), "%s/slaves", aPath);
+		DIR *dir = opendir(subPath);
+		if (!dir) {
+			return true;
+		}
+		char slaveName[256] = { 0 };
+		int slaveCount = 0;
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.') {
+				continue;
+			}
+			slaveCount++;
+			safestrcpy(slaveName, entry->d_name, sizeof(slaveName));
+		}
+		closedir(dir);
+		if (slaveCount != 1) {
+			return true;
+		}
+
+		char slavePath[PATH_MAX + 256];
+		snprintf(slavePath, sizeof(slavePath), "%s/slaves/%s", aPath, slaveName);
+		char resolvedPath[PATH_MAX];
+		if (!realpath(slavePath, resolvedPath)) {
+			return true;
+		}
+		if (!safestrcpy(aPath, resolvedPath, aPathSize)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Reads the first line of a sysfs (or procfs) attribute, stripping the
+ * trailing newline. */
+bool readSysfsString(const char *aPath, char *aBuffer, int aBufferSize) {
+	FILE *f = fopen(aPath, "r");
+	if (!f) {
+		return false;
+	}
+	bool success = (fgets(aBuffer, aBufferSize, f) != NULL);
+	fclose(f);
+	if (success) {
+		aBuffer[strcspn(aBuffer, "\n")] = 0;
+	}
+	return success;
+}
+
+bool readSysfsInteger(const char *aPath, long *aValue) {
+	char buffer[64];
+	if (!readSysfsString(aPath, buffer, sizeof(buffer))) {
+		return false;
+	}
+	char *endPtr = NULL;
+	*aValue = strtol(buffer, &endPtr, 10);
+	return (endPtr != buffer);
+}
+
+/* Determines whether the disk the given device resides on has rotating
+ * platters (i.e. seeking is expensive). Returns false if unknown. */
+bool isRotationalDevice(const char *aDevice) {
+	char path[PATH_MAX];
+	if (!getWholeDiskSysfsPath(aDevice, path, sizeof(path))) {
+		return false;
+	}
+	char attributePath[PATH_MAX + 32];
+	snprintf(attributePath, sizeof(attributePath), "%s/queue/rotational", path);
+	long rotational;
+	return readSysfsInteger(attributePath, &rotational) && (rotational == 1);
+}
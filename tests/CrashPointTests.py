@@ -0,0 +1,38 @@
+from TestEngine import LUKSIPCTest
+
+class CrashPointLUKSIPCTest(LUKSIPCTest):
+	"""Kills luksipc at one specific crash point (see crashpoint.h) and then
+	either continues the conversion (when the device was already formatted) or
+	restarts it from scratch. In both cases the plain data must end up intact
+	in the LUKS container. A killed luksipc writes no resume file, so the
+	conversion is continued with --recover; the plain data therefore has low
+	entropy, like text files, so that the point of interruption can be found.
+	With checkpoint set, luksipc runs with --checkpoint and keeps the resume
+	file valid by itself, so random data is converted and the conversion is
+	continued with --resume."""
+	def __init__(self, testengine, assumptions, crashpoint, checkpoint = False):
+		LUKSIPCTest.__init__(self, testengine, assumptions)
+		self._crashpoint = crashpoint
+		self._checkpoint = checkpoint
+
+	def run(self):
+		params = self.prepare_device(low_entropy = not self._checkpoint)
+
+		returncode = self._engine.luksify(environment = { "LUKSIPC_CRASHPOINT": str(self._crashpoint) }, success_codes = [ 0, -9 ])
+		if returncode == 0:
+			# Crash point was never reached, nothing to resume
+			self.verify_container(params)
+			return
+
+		if self._engine.is_luks():
+			self._engine.verify_hdrbackup_file(params.backup_header_hash)
+			if self._checkpoint:
+				returncode = self._engine.luksify(resume = True, success_codes = [ 0 ])
+			else:
+				returncode = self._engine.luksify(recover = True, success_codes = [ 0 ])
+		else:
+			# Crashed before luksFormat, the plain data must be untouched
+			self._engine.verify_device(self._engine._destroy_dev, params.plain_data_pattern)
+			self._engine.cleanup_files()
+			returncode = self._engine.luksify(success_codes = [ 0 ])
+		self.verify_container(params)
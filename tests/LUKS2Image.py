@@ -0,0 +1,139 @@
+#!/usr/bin/python3
+#
+#	Reads LUKS2 images written by luksipc's userspace LUKS target without
+#	cryptsetup or device mapper, so that tests can verify a conversion
+#	unprivileged. This is an independent implementation of the parts of the
+#	LUKS2 on-disk format that luksipc uses (PBKDF2 keyslot, LUKS1 anti-forensic
+#	splitter, aes-xts-plain64); the ciphers come from OpenSSL's libcrypto.
+
+import json
+import struct
+import base64
+import hashlib
+import ctypes
+import ctypes.util
+
+class LUKS2Image(object):
+	_HEADER_MAGIC = b"LUKS\xba\xbe"
+	_BINARY_HEADER_SIZE = 4096
+
+	_libcrypto = None
+
+	def __init__(self, filename):
+		self._filename = filename
+		with open(filename, "rb") as f:
+			header = f.read(self._BINARY_HEADER_SIZE)
+			if header[0 : 6] != self._HEADER_MAGIC:
+				raise Exception("%s is not a LUKS device." % (filename))
+			(version, header_size) = struct.unpack(">HQ", header[6 : 16])
+			if version != 2:
+				raise Exception("%s is LUKS version %d, not LUKS2." % (filename, version))
+			f.seek(0)
+			header = bytearray(f.read(header_size))
+		checksum = bytes(header[0x1c0 : 0x1c0 + 32])
+		header[0x1c0 : 0x1c0 + 64] = bytes(64)
+		if hashlib.sha256(header).digest() != checksum:
+			raise Exception("%s: LUKS2 header checksum mismatch." % (filename))
+		self._metadata = json.loads(header[self._BINARY_HEADER_SIZE : ].rstrip(b"\x00").decode())
+		self._volume_key = None
+
+	@property
+	def metadata(self):
+		return self._metadata
+
+	@property
+	def segment(self):
+		return self._metadata["segments"]["0"]
+
+	@classmethod
+	def _xts(cls, key, data, first_iv, iv_step, sector_size, encrypt = False):
+		if cls._libcrypto is None:
+			libcrypto = ctypes.CDLL(ctypes.util.find_library("crypto"))
+			libcrypto.EVP_get_cipherbyname.restype = ctypes.c_void_p
+			libcrypto.EVP_get_cipherbyname.argtypes = [ ctypes.c_char_p ]
+			libcrypto.EVP_CIPHER_CTX_new.restype = ctypes.c_void_p
+			libcrypto.EVP_CIPHER_CTX_free.argtypes = [ ctypes.c_void_p ]
+			libcrypto.EVP_CipherInit_ex.argtypes = [ ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int ]
+			libcrypto.EVP_CipherUpdate.argtypes = [ ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(ctypes.c_int), ctypes.c_char_p, ctypes.c_int ]
+			cls._libcrypto = libcrypto
+		libcrypto = cls._libcrypto
+
+		cipher = libcrypto.EVP_get_cipherbyname(b"aes-256-xts" if (len(key) == 64) else b"aes-128-xts")
+		ctx = libcrypto.EVP_CIPHER_CTX_new()
+		outbuf = ctypes.create_string_buffer(sector_size)
+		outlen = ctypes.c_int()
+		result = bytearray()
+		try:
+			libcrypto.EVP_CipherInit_ex(ctx, cipher, None, key, None, int(encrypt))
+			for (sector, offset) in enumerate(range(0, len(data), sector_size)):
+				iv = struct.pack("<QQ", first_iv + (sector * iv_step), 0)
+				libcrypto.EVP_CipherInit_ex(ctx, None, None, None, iv, -1)
+				libcrypto.EVP_CipherUpdate(ctx, outbuf, ctypes.byref(outlen), data[offset : offset + sector_size], sector_size)
+				result += outbuf.raw
+		finally:
+			libcrypto.EVP_CIPHER_CTX_free(ctx)
+		return bytes(result)
+
+	@staticmethod
+	def _af_merge(split_key, key_size, stripes, hashname):
+		digest_size = hashlib.new(hashname).digest_size
+		def diffuse(data):
+			result = bytearray()
+			for (block, offset) in enumerate(range(0, len(data), digest_size)):
+				chunk = data[offset : offset + digest_size]
+				result += hashlib.new(hashname, struct.pack(">I", block) + chunk).digest()[ : len(chunk)]
+			return bytes(result)
+
+		accu = bytes(key_size)
+		for stripe in range(stripes - 1):
+			accu = diffuse(bytes(x ^ y for (x, y) in zip(accu, split_key[stripe * key_size : (stripe + 1) * key_size])))
+		return bytes(x ^ y for (x, y) in zip(accu, split_key[(stripes - 1) * key_size : ]))
+
+	def unlock(self, passphrase):
+		"""Derives the volume key from keyslot 0 and checks it against the
+		digest. Raises an exception if the passphrase is wrong."""
+		keyslot = self._metadata["keyslots"]["0"]
+		kdf = keyslot["kdf"]
+		af = keyslot["af"]
+		area = keyslot["area"]
+		if (kdf["type"] != "pbkdf2") or (af["type"] != "luks1") or (area["encryption"] != "aes-xts-plain64"):
+			raise Exception("Unsupported keyslot: %s" % (str(keyslot)))
+
+		key_size = keyslot["key_size"]
+		split_size = key_size * af["stripes"]
+		with open(self._filename, "rb") as f:
+			f.seek(int(area["offset"]))
+			ciphertext = f.read((split_size + 511) // 512 * 512)
+		area_key = hashlib.pbkdf2_hmac(kdf["hash"], passphrase, base64.b64decode(kdf["salt"]), kdf["iterations"], area["key_size"])
+		split_key = self._xts(area_key, ciphertext, 0, 1, 512)[ : split_size]
+		volume_key = self._af_merge(split_key, key_size, af["stripes"], af["hash"])
+
+		digest = self._metadata["digests"]["0"]
+		expected = base64.b64decode(digest["digest"])
+		if hashlib.pbkdf2_hmac(digest["hash"], volume_key, base64.b64decode(digest["salt"]), digest["iterations"], len(expected)) != expected:
+			raise Exception("%s: Passphrase does not unlock keyslot 0." % (self._filename))
+		self._volume_key = volume_key
+
+	def decrypt_to(self, output_filename, chunk_size = 4 * 1024 * 1024):
+		"""Writes the plaintext of the whole data segment to a file, i.e. what
+		cryptsetup luksOpen would show as the unlocked device."""
+		assert(self._volume_key is not None)
+		segment = self.segment
+		if segment["encryption"] != "aes-xts-plain64":
+			raise Exception("Unsupported segment encryption %s." % (segment["encryption"]))
+		sector_size = segment["sector_size"]
+		iv = int(segment["iv_tweak"])
+		with open(self._filename, "rb") as f, open(output_filename, "wb") as outf:
+			f.seek(int(segment["offset"]))
+			while True:
+				data = f.read(chunk_size)
+				data = data[ : len(data) // sector_size * sector_size]
+				if len(data) == 0:
+					break
+				outf.write(self._xts(self._volume_key, data, iv, sector_size // 512, sector_size))
+				iv += len(data) // 512
+
+	@classmethod
+	def is_luks(cls, filename):
+		with open(filename, "rb") as f:
+			return f.read(len(cls._HEADER_MAGIC)) == cls._HEADER_MAGIC
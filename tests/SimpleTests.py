@@ -22,6 +22,22 @@ class AbortedLUKSIPCTest(LUKSIPCTest):
 		self.verify_container(params)
 	
 
+class RollbackLUKSIPCTest(LUKSIPCTest):
+	def run(self):
+		params = self.prepare_device()
+
+		returncode = self._engine.luksify(abort = 20)
+		if returncode == 0:
+			# Finished before it could be aborted, nothing to roll back
+			self.verify_container(params)
+			return
+
+		returncode = self._engine.luksify(abort = random.randint(2, 10), rollback = True)
+		while returncode == 2:
+			returncode = self._engine.luksify(abort = random.randint(2, 10), rollback = True)
+		self._engine.verify_device(self._engine._destroy_dev, params.plain_data_pattern)
+
+
 class IOErrorLUKSIPCTest(LUKSIPCTest):
 	def run(self):
 		params = self.prepare_device()
@@ -9,6 +9,9 @@ import signal
 import time
 import sys
 import datetime
+import shutil
+
+from LUKS2Image import LUKS2Image
 
 _DEFAULTS = {
 	"hdrbackup_file":		"data/backup.img",
@@ -17,7 +20,7 @@ _DEFAULTS = {
 }
 
 class LUKSIPCTest(object):
-	_PreTestParameters = collections.namedtuple("PreTestParameters", [ "seed", "plain_data_hash", "backup_header_hash", "source", "expected_sizediff", "devsize_pre", "devsize_post" ])
+	_PreTestParameters = collections.namedtuple("PreTestParameters", [ "seed", "plain_data_pattern", "backup_header_hash", "source", "expected_sizediff", "devsize_pre", "devsize_post" ])
 	def __init__(self, testengine, assumptions):
 		self._engine = testengine
 		self._assumptions = assumptions
@@ -28,11 +31,12 @@ class LUKSIPCTest(object):
 	def run(self):
 		raise Exception(NotImplemented)
 
-	def prepare_device(self, expected_sizediff = None):
-		"""Prepare a plain device (no LUKS) with a PRNG pattern. Hash the
-		device excluding the trailing part that is going to be cut away by
-		LUKSification and also hash the part that is going to be in the header
-		backup (128 MiB). Typically called to test LUKSification."""
+	def prepare_device(self, expected_sizediff = None, low_entropy = False):
+		"""Prepare a plain device (no LUKS) with a PRNG pattern, excluding the
+		trailing part that is going to be cut away by LUKSification, and hash
+		the part that is going to be in the header backup (128 MiB). Typically
+		called to test LUKSification. A low entropy pattern is needed when the
+		conversion is continued with --recover."""
 		if expected_sizediff is None:
 			expected_sizediff = self["default_luks_hdr_size"]
 
@@ -40,16 +44,19 @@ class LUKSIPCTest(object):
 		devsize_post = devsize_pre + expected_sizediff
 
 		seed = random.randint(0, 0xffffffff)
-		plain_data_hash = self._engine.patternize_rawdev(expected_sizediff, seed)
+		if low_entropy:
+			# The part that is cut away otherwise still holds ciphertext of the
+			# previous test, in which --recover could not find the boundary
+			self._engine.scrub_device_tail(expected_sizediff)
+		plain_data_pattern = self._engine.patternize_rawdev(expected_sizediff, seed, low_entropy = low_entropy)
 		backup_header_hash = self._engine.hash_rawdev(total_size = self["default_backup_hdr_size"])
-		return self._PreTestParameters(seed = seed, plain_data_hash = plain_data_hash, backup_header_hash = backup_header_hash, source = "plain", expected_sizediff = expected_sizediff, devsize_pre = devsize_pre, devsize_post = devsize_post)
+		return self._PreTestParameters(seed = seed, plain_data_pattern = plain_data_pattern, backup_header_hash = backup_header_hash, source = "plain", expected_sizediff = expected_sizediff, devsize_pre = devsize_pre, devsize_post = devsize_post)
 
 	def prepare_luksdevice(self, luksformat_params = None, expected_sizediff = 0):
-		"""Prepare a LUKS device and fill the plain part of the device with a
-		PRNG pattern.  Hash the whole plain data of the LUKS device container
-		(unlocked) and hash the part of the raw device that is going to end up
-		in the header backup (128 MiB). Typically called to test
-		reLUKSification."""
+		"""Prepare a LUKS device and fill the whole plain part of the device
+		(unlocked) with a PRNG pattern. Hash the part of the raw device that is
+		going to end up in the header backup (128 MiB). Typically called to
+		test reLUKSification."""
 		if luksformat_params is None:
 			luksformat_params = [ ]
 
@@ -58,24 +65,26 @@ class LUKSIPCTest(object):
 		try:
 			container = self._engine.luksOpen()
 			devsize_pre = self._engine._getsizeof(container.unlockedblkdev)
-			plain_data_hash = self._engine.patternize_device(container.unlockedblkdev, seed = seed)
+			plain_data_pattern = self._engine.patternize_device(container.unlockedblkdev, seed = seed)
 		finally:
 			self._engine.luksClose(container)
 
 		devsize_post = devsize_pre + expected_sizediff
 		backup_header_hash = self._engine.hash_rawdev(total_size = self["default_backup_hdr_size"])
-		return self._PreTestParameters(seed = seed, plain_data_hash = plain_data_hash, backup_header_hash = backup_header_hash, source = "luks", expected_sizediff = expected_sizediff, devsize_pre = devsize_pre, devsize_post = devsize_post)
+		return self._PreTestParameters(seed = seed, plain_data_pattern = plain_data_pattern, backup_header_hash = backup_header_hash, source = "luks", expected_sizediff = expected_sizediff, devsize_pre = devsize_pre, devsize_post = devsize_post)
 
 	def verify_container(self, pretestparams):
 		"""Verify the container integrity against the parameters that were
 		determined at generation from the prepare_xyz() function by checking
-		the MD5SUM of the (unlocked) device."""
+		the PRNG pattern of the (unlocked) device."""
 		self._engine.verify_file(_DEFAULTS["hdrbackup_file"], pretestparams.backup_header_hash)
+		if self._engine.luks_target == "userspace":
+			self._engine.verify_header_with_cryptsetup()
 
-		# Verify initial luksification worked by decrypting and verifying hash
+		# Verify initial luksification worked by decrypting and verifying pattern
 		container = self._engine.luksOpen()
 		try:
-			self._engine.verify_device(container.unlockedblkdev, pretestparams.plain_data_hash)
+			self._engine.verify_device(container.unlockedblkdev, pretestparams.plain_data_pattern)
 		finally:
 			self._engine.luksClose(container)
 
@@ -85,9 +94,11 @@ class LUKSIPCTest(object):
 
 class TestEngine(object):
 	_OpenLUKSContainer = collections.namedtuple("OpenLUKSContainer", [ "rawdatablkdev", "unlockedblkdev", "keyfile", "dmname" ])
+	_Pattern = collections.namedtuple("Pattern", [ "seed", "length", "low_entropy" ])
 
-	def __init__(self, destroy_data_dev, luksipc_binary, logdir, additional_params):
+	def __init__(self, destroy_data_dev, luksipc_binary, logdir, additional_params, luks_target = "dmcrypt"):
 		self._destroy_dev = destroy_data_dev
+		self._luks_target = luks_target
 		self._luksipc_bin = luksipc_binary
 		self._logdir = logdir
 		if not self._logdir.endswith("/"):
@@ -100,8 +111,8 @@ class TestEngine(object):
 			os.makedirs("data/")
 		except FileExistsError:
 			pass
-		self._patternizer_bin = "prng/prng_crc64"
-		self._rawdevsize = self._getsizeof(self._destroy_dev)
+		self._patternizer_bin = "prng/prng_pattern"
+		self._rawdevsize = self._getsizeof(self._destroy_dev) if os.path.exists(self._destroy_dev) else 0
 		self._total_log = open(self._logdir + "summary.txt", "a")
 		self._lastlogfile = self._get_lastlogfile()
 		self._additional_params = additional_params
@@ -138,6 +149,10 @@ class TestEngine(object):
 	def rawdevsize(self):
 		return self._rawdevsize
 
+	@property
+	def luks_target(self):
+		return self._luks_target
+
 	@staticmethod
 	def _randstr(length):
 		return "".join(random.choice(string.ascii_lowercase) for i in range(length))
@@ -154,6 +169,7 @@ class TestEngine(object):
 		self._lastlogfile += 1
 		filename = "%s%04d.log" % (self._logdir, self._lastlogfile)
 		f = open(filename, "w")
+		self._last_logfilename = filename
 		print("%s" % (purpose), file = f)
 		print("=" * 120, file = f)
 		self._log("Execute: %s -> %s" % (purpose, filename))
@@ -188,6 +204,8 @@ class TestEngine(object):
 		return self.hash_device(self._destroy_dev, exclude_bytes, total_size)
 
 	def verify_device(self, blkdevname, expect_hash, exclude_bytes = 0, total_size = None):
+		if isinstance(expect_hash, self._Pattern):
+			return self.verify_device_pattern(blkdevname, expect_hash)
 		self._log("Verification of hash of block device %s" % (blkdevname))
 		calc_hash = self.hash_device(blkdevname, exclude_bytes, total_size)
 		if calc_hash == expect_hash:
@@ -197,6 +215,23 @@ class TestEngine(object):
 			self._log(msg)
 			raise Exception(msg)
 
+	def verify_device_pattern(self, blkdevname, pattern):
+		self._log("Verification of pattern of block device %s (seed %d, length %d)" % (blkdevname, pattern.seed, pattern.length))
+		cmd = [ self._patternizer_bin, "verify", "-q", "-l", str(pattern.length) ]
+		if pattern.low_entropy:
+			cmd += [ "--low-entropy" ]
+		proc = subprocess.Popen(cmd + [ blkdevname, str(pattern.seed) ], stdout = subprocess.PIPE)
+		output = proc.communicate()[0].decode()
+		if proc.returncode == 0:
+			self._log("PASS: '%s' has the correct pattern (seed %d)." % (blkdevname, pattern.seed))
+		else:
+			if output.startswith("MISMATCH "):
+				msg = "FAIL: %s does not contain the pattern with seed %d, first mismatch at offset %s." % (blkdevname, pattern.seed, output.split()[1])
+			else:
+				msg = "FAIL: could not verify pattern of %s (return code %d)." % (blkdevname, proc.returncode)
+			self._log(msg)
+			raise Exception(msg)
+
 	def verify_file(self, filename, expect_hash):
 		self._log("Verification of hash of file %s" % (filename))
 		f = open(filename, "rb")
@@ -224,34 +259,37 @@ class TestEngine(object):
 
 	def scrub_device_hdr(self):
 		self._log("Scrubbing raw device header")
-		self._execute_sync([ "dd", "if=/dev/zero", "of=" + self._destroy_dev, "bs=1M", "count=32" ])
+		self._execute_sync([ "dd", "if=/dev/zero", "of=" + self._destroy_dev, "bs=1M", "count=32", "conv=notrunc" ])
 
-	def patternize_device(self, device, exclude_bytes = 0, seed = 0):
+	def scrub_device_tail(self, length):
+		self._log("Scrubbing last %d bytes of raw device" % (length))
+		with open(self._destroy_dev, "r+b") as f:
+			f.seek(self._rawdevsize - length)
+			f.write(bytes(length))
+
+	def patternize_device(self, device, exclude_bytes = 0, seed = 0, low_entropy = False):
 		pattern_size = self._getsizeof(device) - exclude_bytes
-		self._log("Patternizing %s with seed %d for %d bytes (%.1f MiB)" % (device, seed, pattern_size, pattern_size / 1024 / 1024))
+		self._log("Patternizing %s with seed %d for %d bytes (%.1f MiB)%s" % (device, seed, pattern_size, pattern_size / 1024 / 1024, ", low entropy" if low_entropy else ""))
 		assert(pattern_size > 0)
-		proc = subprocess.Popen([ self._patternizer_bin, str(pattern_size), str(seed) ], stdout = subprocess.PIPE)
-		datahash = hashlib.md5()
-		outfile = open(device, "wb")
-		while True:
-			data = proc.stdout.read(1024 * 1024)
-			datahash.update(data)
-			outfile.write(data)
-			if len(data) == 0:
-				break
-		outfile.close()
-		datahash = datahash.hexdigest()
-		self._log("Patternized %s (excluded %d): %s" % (device, exclude_bytes, datahash))
-		return datahash
+		cmd = [ self._patternizer_bin, "write", "-q", "-l", str(pattern_size) ]
+		if low_entropy:
+			cmd += [ "--low-entropy" ]
+		subprocess.check_call(cmd + [ device, str(seed) ])
+		self._log("Patternized %s (excluded %d)" % (device, exclude_bytes))
+		return self._Pattern(seed = seed, length = pattern_size, low_entropy = low_entropy)
 
-	def patternize_rawdev(self, exclude_bytes = 0, seed = 0):
-		return self.patternize_device(self._destroy_dev, exclude_bytes = exclude_bytes, seed = seed)
+	def patternize_rawdev(self, exclude_bytes = 0, seed = 0, low_entropy = False):
+		return self.patternize_device(self._destroy_dev, exclude_bytes = exclude_bytes, seed = seed, low_entropy = low_entropy)
 
 	def _execute_sync(self, cmd, **kwargs):
 		success_codes = kwargs.get("success_codes", [ 0 ])
 		cmd_str = " ".join(cmd)
 		logfile = self._get_log_file(cmd_str)
-		proc = subprocess.Popen(cmd, stdout = logfile, stderr = logfile)
+		env = None
+		if "environment" in kwargs:
+			env = dict(os.environ)
+			env.update(kwargs["environment"])
+		proc = subprocess.Popen(cmd, stdout = logfile, stderr = logfile, env = env)
 		if "abort" in kwargs:
 			time.sleep(kwargs["abort"])
 			os.kill(proc.pid, signal.SIGHUP)
@@ -268,7 +306,7 @@ class TestEngine(object):
 
 	def cleanup_files(self):
 		self._log("Cleanup all files")
-		for filename in [ _DEFAULTS["hdrbackup_file"], _DEFAULTS["key_file"], _DEFAULTS["resume_file"] ]:
+		for filename in [ _DEFAULTS["hdrbackup_file"], _DEFAULTS["key_file"], _DEFAULTS["resume_file"], _DEFAULTS["resume_file"] + ".tmp" ]:
 			try:
 				os.unlink(filename)
 			except FileNotFoundError:
@@ -283,8 +321,14 @@ class TestEngine(object):
 		cmd += [ "--keyfile", _DEFAULTS["key_file"] ]
 		cmd += [ "--backupfile", _DEFAULTS["hdrbackup_file"] ]
 		cmd += [ "--resume-file", _DEFAULTS["resume_file"] ]
+		if self._luks_target != "dmcrypt":
+			cmd += [ "--luks-target=%s" % (self._luks_target) ]
 		if "resume" in kwargs:
 			cmd += [ "--resume" ]
+		if "rollback" in kwargs:
+			cmd += [ "--rollback" ]
+		if "recover" in kwargs:
+			cmd += [ "--recover" ]
 		if "unlockedcontainer" in kwargs:
 			cmd += [ "--readdev", kwargs["unlockedcontainer"].unlockedblkdev ]
 		cmd += self._additional_params
@@ -298,18 +342,56 @@ class TestEngine(object):
 			else:
 				success_codes = [ 0, 2 ]
 
-		if "abort" not in kwargs:
-			return self._execute_sync(cmd, success_codes = success_codes)
-		else:
-			return self._execute_sync(cmd, abort = kwargs["abort"], success_codes = success_codes)
+		exec_kwargs = { "success_codes": success_codes }
+		for key in [ "abort", "environment" ]:
+			if key in kwargs:
+				exec_kwargs[key] = kwargs[key]
+		return self._execute_sync(cmd, **exec_kwargs)
+
+	def count_crashpoints(self, **kwargs):
+		"""Performs a LUKSification with crash point counting enabled (luksipc
+		needs to be built with -DDEVELOPMENT) and returns the number of crash
+		points that were passed."""
+		self.luksify(environment = { "LUKSIPC_CRASHPOINT": "0" }, **kwargs)
+		for line in open(self._last_logfilename):
+			if line.startswith("luksipc crash points passed: "):
+				return int(line.split(":")[1])
+		raise Exception("luksipc did not report crash points, is it a DEVELOPMENT build?")
+
+	def verify_header_with_cryptsetup(self):
+		"""Checks that cryptsetup accepts the LUKS2 header that luksipc wrote
+		itself and that the key file unlocks it. Neither needs root or device
+		mapper; skipped if cryptsetup is not installed."""
+		if shutil.which("cryptsetup") is None:
+			self._log("cryptsetup not installed, not checking the LUKS2 header of %s with it" % (self._destroy_dev))
+			return
+		self._execute_sync([ "cryptsetup", "luksDump", "--disable-locks", self._destroy_dev ])
+		self._execute_sync([ "cryptsetup", "open", "--test-passphrase", "--disable-locks", "--key-file", _DEFAULTS["key_file"], self._destroy_dev ])
+		self._log("PASS: cryptsetup accepts the LUKS2 header of %s and the key file unlocks it." % (self._destroy_dev))
+
+	def is_luks(self):
+		if self._luks_target == "userspace":
+			return LUKS2Image.is_luks(self._destroy_dev)
+		return subprocess.call([ "cryptsetup", "isLuks", self._destroy_dev ]) == 0
 
 	def luksOpen(self):
 		dmname = self._randstr(8)
+		if self._luks_target == "userspace":
+			# No device mapper, decrypt the whole image into a file instead
+			plainfile = "/dev/shm/luksipc_unlocked_" + dmname
+			self._log("Decrypting %s to %s" % (self._destroy_dev, plainfile))
+			image = LUKS2Image(self._destroy_dev)
+			image.unlock(open(_DEFAULTS["key_file"], "rb").read())
+			image.decrypt_to(plainfile)
+			return self._OpenLUKSContainer(rawdatablkdev = self._destroy_dev, dmname = None, keyfile = _DEFAULTS["key_file"], unlockedblkdev = plainfile)
 		cmd = [ "cryptsetup", "luksOpen", self._destroy_dev, dmname, "-d", _DEFAULTS["key_file"] ]
 		self._execute_sync(cmd)
 		return self._OpenLUKSContainer(rawdatablkdev = self._destroy_dev, dmname = dmname, keyfile = _DEFAULTS["key_file"], unlockedblkdev = "/dev/mapper/" + dmname)
 
 	def luksClose(self, openlukscontainer):
+		if openlukscontainer.dmname is None:
+			os.unlink(openlukscontainer.unlockedblkdev)
+			return
 		self._execute_sync([ "cryptsetup", "luksClose", openlukscontainer.dmname ])
 
 	def luksFormat(self, params = None):
@@ -324,6 +406,14 @@ class TestEngine(object):
 	def finished_testcase(self, tcname, verdict):
 		self._log(("=" * 60) + " " + tcname + " " + verdict + " " + ("=" * 60))
 
+	def setup_imagefile(self, imgsize):
+		assert(self._luks_target == "userspace")
+		self._log("Resetting image file %s to %d bytes (%.1f MiB)" % (self._destroy_dev, imgsize, imgsize / 1024 / 1024))
+		f = open(self._destroy_dev, "w")
+		f.truncate(imgsize)
+		f.close()
+		self._rawdevsize = self._getsizeof(self._destroy_dev)
+
 	def setup_loopdev(self, ldsize):
 		assert(self._destroy_dev.startswith("/dev/loop"))
 		self._log("Resetting loop device %s to %d bytes (%.1f MiB = %d kiB + %d)" % (self._destroy_dev, ldsize, ldsize / 1024 / 1024, ldsize // 1024, ldsize % 1024))
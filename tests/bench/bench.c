@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "engine.h"
+#include "chunk.h"
+#include "exec.h"
+#include "luks.h"
+#include "loop.h"
+#include "utils.h"
+#include "logging.h"
+#include "shutdown.h"
+
+#define MiB					(1024 * 1024)
+#define MAX_RESULTS			64
+#define MAX_REPETITIONS		32
+
+#ifndef BUILD_REVISION
+#define BUILD_REVISION		"unknown"
+#endif
+
+struct benchOptions {
+	const char *directory;
+	const char *outputFilename;
+	uint64_t imageSize;
+	int repetitions;
+	bool verbose;
+};
+
+struct benchResult {
+	char name[64];
+	double value;
+	const char *unit;
+	bool higherIsBetter;
+	const char *skipReason;		/* Non-NULL if the scenario could not run */
+};
+
+static struct benchResult results[MAX_RESULTS];
+static int resultCount;
+
+static void addResult(const char *aName, double aValue, const char *aUnit, bool aHigherIsBetter) {
+	if (resultCount >= MAX_RESULTS) {
+		return;
+	}
+	struct benchResult *result = &results[resultCount++];
+	snprintf(result->name, sizeof(result->name), "%s", aName);
+	result->value = aValue;
+	result->unit = aUnit;
+	result->higherIsBetter = aHigherIsBetter;
+	fprintf(stderr, "%-36s %12.3f %s\n", aName, aValue, aUnit);
+}
+
+static void addSkipped(const char *aName, const char *aReason) {
+	if (resultCount >= MAX_RESULTS) {
+		return;
+	}
+	struct benchResult *result = &results[resultCount++];
+	snprintf(result->name, sizeof(result->name), "%s", aName);
+	result->skipReason = aReason;
+	fprintf(stderr, "%-36s skipped: %s\n", aName, aReason);
+}
+
+static int compareDouble(const void *aValue1, const void *aValue2) {
+	double value1 = *(const double*)aValue1;
+	double value2 = *(const double*)aValue2;
+	return (value1 > value2) - (value1 < value2);
+}
+
+/* Median of all repetitions, robust against single outliers */
+static double median(double *aValues, int aCount) {
+	qsort(aValues, aCount, sizeof(double), compareDouble);
+	return (aCount % 2) ? aValues[aCount / 2] : ((aValues[aCount / 2 - 1] + aValues[aCount / 2]) / 2);
+}
+
+static bool createImage(const char *aFilename, uint64_t aSize) {
+	int fd = open(aFilename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot create %s: %s\n", aFilename, strerror(errno));
+		return false;
+	}
+
+	/* Real data instead of a sparse file, holes would be read much faster */
+	uint8_t *buffer = malloc(MiB);
+	if (!buffer) {
+		close(fd);
+		return false;
+	}
+	for (int i = 0; i < MiB; i++) {
+		buffer[i] = i * 0x9d;
+	}
+	bool success = true;
+	for (uint64_t written = 0; success && (written < aSize); written += MiB) {
+		success = checkedWrite(fd, buffer, MiB);
+	}
+	free(buffer);
+	success = (fsync(fd) == 0) && success;
+	close(fd);
+	return success;
+}
+
+/* Copies the whole device with startDataCopy() like convert() does, but
+ * without a header offset (read and write go to the same device and
+ * offsets). Returns the throughput in MiB/s or a negative value on error. */
+static double benchmarkCopy(const char *aDevice, uint32_t aBlocksize) {
+	struct conversionParameters parameters;
+	memset(&parameters, 0, sizeof(parameters));
+	parameters.blocksize = aBlocksize;
+	parameters.safetyChecks = true;
+
+	struct conversionProcess convProcess;
+	memset(&convProcess, 0, sizeof(convProcess));
+	convProcess.resumeFd = -1;
+	convProcess.readDevFd = open(aDevice, O_RDWR);
+	convProcess.writeDevFd = open(aDevice, O_RDWR);
+	if ((convProcess.readDevFd == -1) || (convProcess.writeDevFd == -1)) {
+		fprintf(stderr, "Cannot open %s: %s\n", aDevice, strerror(errno));
+		return -1;
+	}
+	initFdBackend(&convProcess.readBackend, convProcess.readDevFd);
+	initFdBackend(&convProcess.writeBackend, convProcess.writeDevFd);
+	convProcess.readDevSize = getDiskSizeOfFd(convProcess.readDevFd);
+	convProcess.writeDevSize = convProcess.readDevSize;
+	convProcess.endOutOffset = convProcess.writeDevSize;
+	for (int i = 0; i < 2; i++) {
+		if (!allocChunk(&convProcess.dataBuffer[i], aBlocksize)) {
+			fprintf(stderr, "Cannot allocate chunk.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	double startTime = getTime();
+	enum copyResult_t result = COPYRESULT_ERROR_WRITING_RESUME_FILE;
+	if (chunkReadFrom(&convProcess.dataBuffer[0], &convProcess.readBackend, 0, aBlocksize) > 0) {
+		convProcess.inOffset = convProcess.dataBuffer[0].used;
+		result = startDataCopy(&parameters, &convProcess);
+	}
+	bool synced = (fsync(convProcess.writeDevFd) == 0);
+	double runtime = getTime() - startTime;
+
+	for (int i = 0; i < 2; i++) {
+		freeChunk(&convProcess.dataBuffer[i]);
+	}
+	close(convProcess.readDevFd);
+	close(convProcess.writeDevFd);
+	if ((result != COPYRESULT_SUCCESS_FINISHED) || !synced) {
+		return -1;
+	}
+	return (double)convProcess.writeDevSize / MiB / runtime;
+}
+
+static void benchmarkCopySweep(const struct benchOptions *aOptions, const char *aPrefix, const char *aDevice) {
+	const uint32_t blocksizes[] = { 256 * 1024, 1 * MiB, 4 * MiB, 16 * MiB, 64 * MiB };
+	for (unsigned int i = 0; i < sizeof(blocksizes) / sizeof(blocksizes[0]); i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "%s_copy_chunk_%ukiB", aPrefix, blocksizes[i] / 1024);
+		double values[MAX_REPETITIONS];
+		for (int j = 0; j < aOptions->repetitions; j++) {
+			values[j] = benchmarkCopy(aDevice, blocksizes[i]);
+			if (values[j] < 0) {
+				addSkipped(name, "copy failed");
+				return;
+			}
+		}
+		addResult(name, median(values, aOptions->repetitions), "MiB/s", true);
+	}
+}
+
+/* Cost of one checkpoint as written on every graceful shutdown, including
+ * the fsync() */
+static void benchmarkResumeCheckpoint(const struct benchOptions *aOptions, const char *aFilename, uint32_t aBlocksize) {
+	char name[64];
+	snprintf(name, sizeof(name), "resume_checkpoint_%ukiB", aBlocksize / 1024);
+
+	struct conversionProcess convProcess;
+	memset(&convProcess, 0, sizeof(convProcess));
+	convProcess.resumeFd = open(aFilename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (convProcess.resumeFd == -1) {
+		addSkipped(name, "cannot create resume file");
+		return;
+	}
+	if (!allocChunk(&convProcess.dataBuffer[0], aBlocksize)) {
+		fprintf(stderr, "Cannot allocate chunk.\n");
+		exit(EXIT_FAILURE);
+	}
+	convProcess.dataBuffer[0].used = aBlocksize;
+
+	const int checkpointsPerRepetition = 20;
+	double values[MAX_REPETITIONS];
+	for (int i = 0; i < aOptions->repetitions; i++) {
+		double startTime = getTime();
+		for (int j = 0; j < checkpointsPerRepetition; j++) {
+			convProcess.outOffset += aBlocksize;
+			if (!writeResumeFile(&convProcess)) {
+				addSkipped(name, "writing resume file failed");
+				goto cleanup;
+			}
+		}
+		values[i] = (getTime() - startTime) / checkpointsPerRepetition * 1e3;
+	}
+	addResult(name, median(values, aOptions->repetitions), "ms", false);
+
+cleanup:
+	freeChunk(&convProcess.dataBuffer[0]);
+	close(convProcess.resumeFd);
+	unlink(aFilename);
+}
+
+/* Latency of forking and waiting for an external tool like cryptsetup or
+ * dmsetup, measured with a trivial command */
+static void benchmarkExec(const struct benchOptions *aOptions) {
+	const char *arguments[] = {
+		"true",
+		NULL
+	};
+	const int execsPerRepetition = 100;
+	double values[MAX_REPETITIONS];
+	for (int i = 0; i < aOptions->repetitions; i++) {
+		double startTime = getTime();
+		for (int j = 0; j < execsPerRepetition; j++) {
+			struct execResult_t execResult = execGetReturnCode(arguments);
+			if (!execResult.success || (execResult.returnCode != 0)) {
+				addSkipped("exec_latency", "executing 'true' failed");
+				return;
+			}
+		}
+		values[i] = (getTime() - startTime) / execsPerRepetition * 1e6;
+	}
+	addResult("exec_latency", median(values, aOptions->repetitions), "us", false);
+}
+
+static void benchmarkAlias(const struct benchOptions *aOptions, const char *aDevice) {
+	double values[MAX_REPETITIONS];
+	for (int i = 0; i < aOptions->repetitions; i++) {
+		double startTime = getTime();
+		char *alias = dmCreateDynamicAlias(aDevice, "bench");
+		if (!alias) {
+			addSkipped("dm_alias_setup_teardown", "device mapper alias cannot be created");
+			return;
+		}
+		bool removed = dmRemove(alias + strlen("/dev/mapper/"));
+		free(alias);
+		if (!removed) {
+			addSkipped("dm_alias_setup_teardown", "device mapper alias cannot be removed");
+			return;
+		}
+		values[i] = (getTime() - startTime) * 1e3;
+	}
+	addResult("dm_alias_setup_teardown", median(values, aOptions->repetitions), "ms", false);
+}
+
+static void benchmarkHeaderBackup(const struct benchOptions *aOptions, const char *aDevice, const char *aBackupFilename) {
+	uint64_t deviceSize = getDiskSizeOfPath(aDevice);
+	double values[MAX_REPETITIONS];
+	for (int i = 0; i < aOptions->repetitions; i++) {
+		double startTime = getTime();
+		if (!backupDeviceHeader(aDevice, deviceSize, aBackupFilename)) {
+			addSkipped("header_backup", "header backup failed");
+			unlink(aBackupFilename);
+			return;
+		}
+		double runtime = getTime() - startTime;
+		values[i] = (double)getDiskSizeOfPath(aBackupFilename) / MiB / runtime;
+	}
+	unlink(aBackupFilename);
+	addResult("header_backup", median(values, aOptions->repetitions), "MiB/s", true);
+}
+
+static bool writeJson(const struct benchOptions *aOptions) {
+	FILE *f = aOptions->outputFilename ? fopen(aOptions->outputFilename, "w") : stdout;
+	if (!f) {
+		fprintf(stderr, "Cannot open %s: %s\n", aOptions->outputFilename, strerror(errno));
+		return false;
+	}
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"revision\": \"%s\",\n", BUILD_REVISION);
+	fprintf(f, "\t\"image_size\": %lu,\n", (unsigned long)aOptions->imageSize);
+	fprintf(f, "\t\"repetitions\": %d,\n", aOptions->repetitions);
+	fprintf(f, "\t\"results\": [\n");
+	for (int i = 0; i < resultCount; i++) {
+		const struct benchResult *result = &results[i];
+		if (result->skipReason) {
+			fprintf(f, "\t\t{ \"name\": \"%s\", \"skipped\": \"%s\" }", result->name, result->skipReason);
+		} else {
+			fprintf(f, "\t\t{ \"name\": \"%s\", \"value\": %.6f, \"unit\": \"%s\", \"higher_is_better\": %s }", result->name, result->value, result->unit, result->higherIsBetter ? "true" : "false");
+		}
+		fprintf(f, "%s\n", (i == resultCount - 1) ? "" : ",");
+	}
+	fprintf(f, "\t]\n");
+	fprintf(f, "}\n");
+	if (f != stdout) {
+		fclose(f);
+	}
+	return true;
+}
+
+static void syntax(const char *aName) {
+	fprintf(stderr, "%s (-d, --directory=DIR) (-s, --size=BYTES) (-r, --repetitions=N) (-o, --output=FILE) (-v)\n", aName);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Runs the luksipc microbenchmarks on an image file in DIR (default /dev/shm) and\n");
+	fprintf(stderr, "writes the results as JSON. Scenarios that need a loop device or the device\n");
+	fprintf(stderr, "mapper are skipped if these are unavailable (e.g. when not running as root).\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	struct benchOptions options = {
+		.directory = "/dev/shm",
+		.imageSize = 256 * MiB,
+		.repetitions = 3,
+	};
+
+	struct option longOptions[] = {
+		{ "directory", 1, NULL, 'd' },
+		{ "size", 1, NULL, 's' },
+		{ "repetitions", 1, NULL, 'r' },
+		{ "output", 1, NULL, 'o' },
+		{ "verbose", 0, NULL, 'v' },
+		{ 0 }
+	};
+	int character;
+	while ((character = getopt_long(argc, argv, "d:s:r:o:v", longOptions, NULL)) != -1) {
+		switch (character) {
+			case 'd': options.directory = optarg; break;
+			case 's':
+				if (!parseByteSize(optarg, &options.imageSize) || (options.imageSize < 64 * MiB) || (options.imageSize % MiB)) {
+					fprintf(stderr, "Image size must be a multiple of 1 MiB and at least 64 MiB.\n");
+					syntax(argv[0]);
+				}
+				break;
+			case 'r': options.repetitions = atoi(optarg); break;
+			case 'o': options.outputFilename = optarg; break;
+			case 'v': options.verbose = true; break;
+			default: syntax(argv[0]);
+		}
+	}
+	if ((options.repetitions < 1) || (options.repetitions > MAX_REPETITIONS)) {
+		fprintf(stderr, "Repetitions must be between 1 and %d.\n", MAX_REPETITIONS);
+		syntax(argv[0]);
+	}
+	setLogLevel(options.verbose ? LLVL_DEBUG : LLVL_CRITICAL);
+
+	char imageFilename[256], resumeFilename[256], backupFilename[256];
+	snprintf(imageFilename, sizeof(imageFilename), "%s/luksipc_bench_%d.img", options.directory, getpid());
+	snprintf(resumeFilename, sizeof(resumeFilename), "%s/luksipc_bench_%d_resume.bin", options.directory, getpid());
+	snprintf(backupFilename, sizeof(backupFilename), "%s/luksipc_bench_%d_backup.img", options.directory, getpid());
+	if (!createImage(imageFilename, options.imageSize)) {
+		unlink(imageFilename);
+		return EXIT_FAILURE;
+	}
+
+	benchmarkCopySweep(&options, "file", imageFilename);
+	benchmarkResumeCheckpoint(&options, resumeFilename, 4 * MiB);
+	benchmarkResumeCheckpoint(&options, resumeFilename, 64 * MiB);
+	benchmarkExec(&options);
+	benchmarkHeaderBackup(&options, imageFilename, backupFilename);
+
+	/* Scenarios on a loop device (root only) */
+	const char *loopDevice = (geteuid() == 0) ? loopAttach(imageFilename) : NULL;
+	if (loopDevice) {
+		benchmarkCopySweep(&options, "loop", loopDevice);
+		benchmarkAlias(&options, loopDevice);
+	} else {
+		const char *reason = (geteuid() == 0) ? "cannot attach loop device" : "requires root";
+		addSkipped("loop_copy", reason);
+		addSkipped("dm_alias_setup_teardown", reason);
+	}
+	unlink(imageFilename);
+
+	return writeJson(&options) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
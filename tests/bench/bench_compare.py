@@ -0,0 +1,56 @@
+#!/usr/bin/python3
+#
+#	Compares luksipc benchmark results against a stored baseline and exits
+#	with a nonzero status if any scenario regressed by more than the given
+#	tolerance.
+
+import sys
+import json
+import argparse
+
+parser = argparse.ArgumentParser(description = "Compare luksipc benchmark results against a baseline.")
+parser.add_argument("-t", "--tolerance", metavar = "percent", type = float, default = 10, help = "Allowed regression in percent before a scenario is considered failed. Defaults to %(default).0f%%.")
+parser.add_argument("baseline", help = "JSON file with the baseline results")
+parser.add_argument("results", help = "JSON file with the current results")
+args = parser.parse_args()
+
+def load_results(filename):
+	with open(filename) as f:
+		data = json.load(f)
+	return data, { result["name"]: result for result in data["results"] }
+
+(baseline_data, baseline) = load_results(args.baseline)
+(current_data, current) = load_results(args.results)
+print("Baseline %s, current %s, tolerance %.1f%%" % (baseline_data["revision"], current_data["revision"], args.tolerance))
+if baseline_data["image_size"] != current_data["image_size"]:
+	print("Warning: image sizes differ (%d vs. %d bytes), results may not be comparable." % (baseline_data["image_size"], current_data["image_size"]))
+
+regressions = 0
+for (name, result) in sorted(current.items()):
+	reference = baseline.get(name)
+	if "skipped" in result:
+		print("%-36s skipped (%s)" % (name, result["skipped"]))
+		continue
+	if (reference is None) or ("skipped" in reference):
+		print("%-36s %12.3f %-5s  no baseline" % (name, result["value"], result["unit"]))
+		continue
+
+	# Positive change is always an improvement
+	change = (result["value"] - reference["value"]) / reference["value"] * 100
+	if not result["higher_is_better"]:
+		change = -change
+	if change < -args.tolerance:
+		verdict = "REGRESSION"
+		regressions += 1
+	elif change > args.tolerance:
+		verdict = "improved"
+	else:
+		verdict = "ok"
+	print("%-36s %12.3f %-5s  baseline %12.3f  %+6.1f%%  %s" % (name, result["value"], result["unit"], reference["value"], change, verdict))
+
+for name in sorted(set(baseline) - set(current)):
+	print("%-36s missing in current results" % (name))
+
+if regressions > 0:
+	print("%d scenario(s) regressed by more than %.1f%%." % (regressions, args.tolerance))
+	sys.exit(1)
@@ -0,0 +1,398 @@
+/* O_DIRECT is a GNU extension */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/fs.h>
+
+/* Seekable test pattern: the 64-bit little endian word at byte offset 8 * i
+ * is splitmix64(seed + (i + 1) * GOLDEN_GAMMA). Every offset can therefore be
+ * generated or verified independently of all others, in parallel and with
+ * SIMD (every lane computes one word). */
+
+#define GOLDEN_GAMMA			0x9e3779b97f4a7c15ULL
+#define IO_BLOCK_SIZE				(4 * 1024 * 1024)
+#define DIRECT_IO_ALIGNMENT		4096
+#define MAX_THREADS				256
+#define VECTOR_LANES			4
+
+typedef uint64_t u64vec_t __attribute__((vector_size(VECTOR_LANES * sizeof(uint64_t))));
+
+enum mode_t {
+	MODE_WRITE,
+	MODE_VERIFY,
+};
+
+struct options {
+	enum mode_t mode;
+	const char *filename;
+	uint64_t seed;
+	uint64_t offset;
+	uint64_t length;
+	int threads;
+	bool direct;
+	bool quiet;
+	bool lowEntropy;
+};
+
+struct job {
+	const struct options *options;
+	int directFd;						/* -1 if O_DIRECT is unavailable */
+	int bufferedFd;
+	atomic_uint_fast64_t nextBlock;
+	uint64_t blockCount;
+	atomic_uint_fast64_t firstMismatch;	/* Absolute offset, UINT64_MAX if none */
+	atomic_bool ioError;
+};
+
+/* Passed by reference since passing wide vectors by value depends on the
+ * target's ABI */
+static inline void splitmixVector(u64vec_t *aZ) {
+	u64vec_t z = *aZ;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	*aZ = z ^ (z >> 31);
+}
+
+static inline uint64_t splitmix(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Generates aWordCount words of the pattern, starting at word index aFirstWord */
+static void generateWords(uint64_t *aBuffer, uint64_t aSeed, uint64_t aFirstWord, uint64_t aWordCount) {
+	uint64_t i = 0;
+	u64vec_t lanes;
+	for (int lane = 0; lane < VECTOR_LANES; lane++) {
+		lanes[lane] = aSeed + (aFirstWord + lane + 1) * GOLDEN_GAMMA;
+	}
+	const u64vec_t step = (u64vec_t){ 0 } + VECTOR_LANES * GOLDEN_GAMMA;
+	for (; i + VECTOR_LANES <= aWordCount; i += VECTOR_LANES) {
+		u64vec_t words = lanes;
+		splitmixVector(&words);
+		memcpy(aBuffer + i, &words, sizeof(words));
+		lanes += step;
+	}
+	for (; i < aWordCount; i++) {
+		aBuffer[i] = splitmix(aSeed + (aFirstWord + i + 1) * GOLDEN_GAMMA);
+	}
+}
+
+/* Generates the pattern bytes for the absolute range [aOffset, aOffset +
+ * aLength) into aData. aScratch must hold aLength + 16 bytes. */
+static void generatePattern(uint8_t *aData, uint8_t *aScratch, uint64_t aSeed, uint64_t aOffset, uint32_t aLength) {
+	uint64_t firstWord = aOffset / 8;
+	uint32_t skip = aOffset % 8;
+	if (skip == 0) {
+		uint64_t wordCount = aLength / 8;
+		generateWords((uint64_t*)aData, aSeed, firstWord, wordCount);
+		if (aLength % 8) {
+			uint64_t lastWord = splitmix(aSeed + (firstWord + wordCount + 1) * GOLDEN_GAMMA);
+			memcpy(aData + wordCount * 8, &lastWord, aLength % 8);
+		}
+	} else {
+		uint64_t wordCount = (skip + aLength + 7) / 8;
+		generateWords((uint64_t*)aScratch, aSeed, firstWord, wordCount);
+		memcpy(aData, aScratch + skip, aLength);
+	}
+}
+
+/* Maps every byte of the pattern to one of 16 letters (4 bits of entropy per
+ * byte), so that it can be told apart from ciphertext like text files can */
+static void reduceEntropy(uint8_t *aData, uint32_t aLength) {
+	for (uint32_t i = 0; i < aLength; i++) {
+		aData[i] = 'a' + (aData[i] & 0x0f);
+	}
+}
+
+static bool fullPwrite(int aFd, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	while (aLength > 0) {
+		ssize_t written = pwrite(aFd, aData, aLength, aOffset);
+		if (written <= 0) {
+			if ((written == -1) && (errno == EINTR)) {
+				continue;
+			}
+			fprintf(stderr, "Write of %u bytes at offset %lu failed: %s\n", aLength, (unsigned long)aOffset, (written == 0) ? "end of device" : strerror(errno));
+			return false;
+		}
+		aData += written;
+		aLength -= written;
+		aOffset += written;
+	}
+	return true;
+}
+
+static bool fullPread(int aFd, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	while (aLength > 0) {
+		ssize_t bytesRead = pread(aFd, aData, aLength, aOffset);
+		if (bytesRead <= 0) {
+			if ((bytesRead == -1) && (errno == EINTR)) {
+				continue;
+			}
+			fprintf(stderr, "Read of %u bytes at offset %lu failed: %s\n", aLength, (unsigned long)aOffset, (bytesRead == 0) ? "end of device" : strerror(errno));
+			return false;
+		}
+		aData += bytesRead;
+		aLength -= bytesRead;
+		aOffset += bytesRead;
+	}
+	return true;
+}
+
+static int chooseFd(const struct job *aJob, uint64_t aOffset, uint32_t aLength) {
+	bool aligned = ((aOffset % DIRECT_IO_ALIGNMENT) == 0) && ((aLength % DIRECT_IO_ALIGNMENT) == 0);
+	return (aligned && (aJob->directFd != -1)) ? aJob->directFd : aJob->bufferedFd;
+}
+
+static void reportMismatch(struct job *aJob, uint64_t aOffset) {
+	uint_fast64_t current = atomic_load(&aJob->firstMismatch);
+	while ((aOffset < current) && !atomic_compare_exchange_weak(&aJob->firstMismatch, &current, aOffset));
+}
+
+static void *worker(void *aJob) {
+	struct job *job = (struct job*)aJob;
+	const struct options *options = job->options;
+	uint8_t *pattern = NULL, *readBuffer = NULL, *scratch = NULL;
+	if (posix_memalign((void**)&pattern, DIRECT_IO_ALIGNMENT, IO_BLOCK_SIZE) || posix_memalign((void**)&readBuffer, DIRECT_IO_ALIGNMENT, IO_BLOCK_SIZE) || posix_memalign((void**)&scratch, DIRECT_IO_ALIGNMENT, IO_BLOCK_SIZE + 16)) {
+		fprintf(stderr, "Cannot allocate buffers.\n");
+		atomic_store(&job->ioError, true);
+		return NULL;
+	}
+
+	while (!atomic_load(&job->ioError)) {
+		uint64_t block = atomic_fetch_add(&job->nextBlock, 1);
+		if (block >= job->blockCount) {
+			break;
+		}
+
+		uint64_t offset = options->offset + block * IO_BLOCK_SIZE;
+		uint32_t length = ((block + 1) * IO_BLOCK_SIZE > options->length) ? (options->length - block * IO_BLOCK_SIZE) : IO_BLOCK_SIZE;
+		if (offset >= atomic_load(&job->firstMismatch)) {
+			/* An earlier mismatch was found already */
+			continue;
+		}
+
+		generatePattern(pattern, scratch, options->seed, offset, length);
+		if (options->lowEntropy) {
+			reduceEntropy(pattern, length);
+		}
+		int fd = chooseFd(job, offset, length);
+		if (options->mode == MODE_WRITE) {
+			if (!fullPwrite(fd, pattern, length, offset)) {
+				atomic_store(&job->ioError, true);
+			}
+		} else {
+			if (!fullPread(fd, readBuffer, length, offset)) {
+				atomic_store(&job->ioError, true);
+			} else if (memcmp(pattern, readBuffer, length)) {
+				for (uint32_t i = 0; i < length; i++) {
+					if (pattern[i] != readBuffer[i]) {
+						reportMismatch(job, offset + i);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	free(pattern);
+	free(readBuffer);
+	free(scratch);
+	return NULL;
+}
+
+static uint64_t getSizeOfFd(int aFd) {
+	struct stat statBuf;
+	if (fstat(aFd, &statBuf) == -1) {
+		return 0;
+	}
+	if (S_ISBLK(statBuf.st_mode)) {
+		uint64_t size;
+		return (ioctl(aFd, BLKGETSIZE64, &size) == -1) ? 0 : size;
+	}
+	return statBuf.st_size;
+}
+
+static bool parseSize(const char *aString, uint64_t *aValue) {
+	char *endPtr;
+	errno = 0;
+	*aValue = strtoull(aString, &endPtr, 0);
+	if ((errno != 0) || (endPtr == aString)) {
+		return false;
+	}
+	switch (*endPtr) {
+		case 'T':	*aValue *= 1024;	// fall-through
+		case 'G':	*aValue *= 1024;	// fall-through
+		case 'M':	*aValue *= 1024;	// fall-through
+		case 'k':	*aValue *= 1024; endPtr++;	break;
+		case 0: break;
+		default: return false;
+	}
+	return *endPtr == 0;
+}
+
+static double getTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (1e-6 * tv.tv_usec);
+}
+
+static void syntax(const char *aName) {
+	fprintf(stderr, "%s [write|verify] [FILE] [SEED] (-l, --length=BYTES) (-o, --offset=BYTES)\n", aName);
+	fprintf(stderr, "    (-t, --threads=N) (--no-direct) (--low-entropy) (-q, --quiet)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Writes a seekable pseudorandom pattern to FILE or verifies that FILE contains it.\n");
+	fprintf(stderr, "The pattern at any offset only depends on the seed and the offset. By default,\n");
+	fprintf(stderr, "the whole file (or device) starting at the given offset is used. Writes use\n");
+	fprintf(stderr, "O_DIRECT where possible. Verification reports the first mismatching offset and\n");
+	fprintf(stderr, "exits with status 1 if there is a mismatch. With --low-entropy, every byte is\n");
+	fprintf(stderr, "one of 16 letters, so that luksipc --recover can classify the data.\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	struct options options = {
+		.threads = sysconf(_SC_NPROCESSORS_ONLN),
+		.direct = true,
+	};
+	bool lengthGiven = false;
+
+	struct option longOptions[] = {
+		{ "length", 1, NULL, 'l' },
+		{ "offset", 1, NULL, 'o' },
+		{ "threads", 1, NULL, 't' },
+		{ "no-direct", 0, NULL, 'D' },
+		{ "low-entropy", 0, NULL, 'E' },
+		{ "quiet", 0, NULL, 'q' },
+		{ "help", 0, NULL, 'h' },
+		{ 0 }
+	};
+	int character;
+	while ((character = getopt_long(argc, argv, "l:o:t:qh", longOptions, NULL)) != -1) {
+		switch (character) {
+			case 'l':
+				if (!parseSize(optarg, &options.length)) {
+					syntax(argv[0]);
+				}
+				lengthGiven = true;
+				break;
+
+			case 'o':
+				if (!parseSize(optarg, &options.offset)) {
+					syntax(argv[0]);
+				}
+				break;
+
+			case 't':
+				options.threads = atoi(optarg);
+				break;
+
+			case 'D':
+				options.direct = false;
+				break;
+
+			case 'E':
+				options.lowEntropy = true;
+				break;
+
+			case 'q':
+				options.quiet = true;
+				break;
+
+			default:
+				syntax(argv[0]);
+		}
+	}
+	if (argc - optind != 3) {
+		syntax(argv[0]);
+	}
+	if (!strcmp(argv[optind], "write")) {
+		options.mode = MODE_WRITE;
+	} else if (!strcmp(argv[optind], "verify")) {
+		options.mode = MODE_VERIFY;
+	} else {
+		syntax(argv[0]);
+	}
+	options.filename = argv[optind + 1];
+	options.seed = strtoull(argv[optind + 2], NULL, 0);
+	if (options.threads < 1) {
+		options.threads = 1;
+	} else if (options.threads > MAX_THREADS) {
+		options.threads = MAX_THREADS;
+	}
+
+	int openFlags = (options.mode == MODE_WRITE) ? O_WRONLY : O_RDONLY;
+	struct job job = {
+		.options = &options,
+		.directFd = -1,
+		.firstMismatch = UINT64_MAX,
+	};
+	job.bufferedFd = open(options.filename, openFlags);
+	if (job.bufferedFd == -1) {
+		fprintf(stderr, "Cannot open %s: %s\n", options.filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (options.direct) {
+		/* Not all file systems support O_DIRECT, buffered I/O is used then */
+		job.directFd = open(options.filename, openFlags | O_DIRECT);
+	}
+
+	if (!lengthGiven) {
+		uint64_t size = getSizeOfFd(job.bufferedFd);
+		options.length = (size > options.offset) ? (size - options.offset) : 0;
+	}
+	job.blockCount = (options.length + IO_BLOCK_SIZE - 1) / IO_BLOCK_SIZE;
+
+	double startTime = getTime();
+	pthread_t threads[MAX_THREADS];
+	int threadCount = 0;
+	for (int i = 0; i < options.threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, &job) == 0) {
+			threadCount++;
+		} else if (threadCount == 0) {
+			fprintf(stderr, "Cannot start worker thread.\n");
+			return EXIT_FAILURE;
+		}
+	}
+	for (int i = 0; i < threadCount; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if ((options.mode == MODE_WRITE) && (fdatasync(job.bufferedFd) == -1)) {
+		fprintf(stderr, "Flushing %s failed: %s\n", options.filename, strerror(errno));
+		atomic_store(&job.ioError, true);
+	}
+	double runtime = getTime() - startTime;
+	if (job.directFd != -1) {
+		close(job.directFd);
+	}
+	close(job.bufferedFd);
+
+	if (atomic_load(&job.ioError)) {
+		return EXIT_FAILURE;
+	}
+
+	uint64_t firstMismatch = atomic_load(&job.firstMismatch);
+	if (firstMismatch != UINT64_MAX) {
+		printf("MISMATCH %lu\n", (unsigned long)firstMismatch);
+		fprintf(stderr, "%s: first mismatch at offset %lu (0x%lx)\n", options.filename, (unsigned long)firstMismatch, (unsigned long)firstMismatch);
+		return 1;
+	}
+	if (!options.quiet) {
+		fprintf(stderr, "%s %lu bytes at offset %lu with seed %lu in %.2f s (%.0f MiB/s, %d thread%s, %s)\n", (options.mode == MODE_WRITE) ? "Wrote" : "Verified", (unsigned long)options.length, (unsigned long)options.offset, (unsigned long)options.seed, runtime, (runtime > 0) ? (options.length / runtime / 1024 / 1024) : 0, threadCount, (threadCount == 1) ? "" : "s", (job.directFd != -1) ? "direct I/O" : "buffered I/O");
+	}
+	return 0;
+}
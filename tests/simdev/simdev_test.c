@@ -0,0 +1,764 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "simdev.h"
+#include "shutdown.h"
+#include "logging.h"
+#include "trace.h"
+#include "throughput.h"
+#include "recover.h"
+#include "spill.h"
+#include "rollback.h"
+#include "fillrandom.h"
+
+#define MiB					(1024 * 1024)
+
+struct scenario {
+	const char *name;
+	uint64_t deviceSize;
+	uint32_t headerSize;			/* Size difference of plain and LUKS device */
+	uint32_t blocksize;
+	uint64_t seed;
+	double tornWriteProbability;
+	double readErrorProbability;
+	enum simLatencyDistribution_t latencyDistribution;
+	int queueDepth;
+	int batchChunks;				/* Chunks per batch, 0 = alternate reads and writes */
+	uint64_t spillSize;				/* Stage batches in a spill file of this size, 0 = in memory */
+	enum copyEngine_t engine;
+	uint32_t resumeBlocksize;		/* Resumed runs alternate between both chunk sizes, 0 = keep it */
+};
+
+struct scenarioResult {
+	bool success;
+	int runs;						/* Number of (resumed) conversion runs */
+	double simulatedTime;
+	struct simDevice *device;
+};
+
+static void fillPattern(uint8_t *aData, uint64_t aLength, uint64_t aSeed) {
+	uint64_t state = aSeed;
+	for (uint64_t i = 0; i < aLength; i += sizeof(uint64_t)) {
+		uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= (z >> 31);
+		memcpy(aData + i, &z, sizeof(uint64_t));
+	}
+}
+
+/* Runs one conversion (or resumed conversion) of the simulated device just
+ * like convert() does after the LUKS device has been opened */
+static enum copyResult_t runConversion(struct conversionParameters const *aParameters, struct simDevice *aDevice, uint32_t aHeaderSize, int aResumeFd, const uint8_t *aOriginalHeader, struct ioTrace *aTrace, int aBatchChunks, uint64_t aSpillSize) {
+	struct conversionProcess convProcess;
+	memset(&convProcess, 0, sizeof(convProcess));
+	convProcess.resumeFd = aResumeFd;
+	convProcess.readDevSize = aDevice->config.size;
+	convProcess.writeDevSize = aDevice->config.size - aHeaderSize;
+	initSimBackend(&convProcess.readBackend, aDevice, 0);
+	initSimBackend(&convProcess.writeBackend, aDevice, aHeaderSize);
+	if (aTrace) {
+		traceAttach(aTrace, &convProcess.readBackend, TRACEDEV_READ);
+		traceAttach(aTrace, &convProcess.writeBackend, TRACEDEV_WRITE);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (!allocChunk(&convProcess.dataBuffer[i], aParameters->blocksize)) {
+			fprintf(stderr, "Cannot allocate chunk.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!aParameters->resuming) {
+		/* The first chunk is read before luksFormat overwrites it */
+		memcpy(convProcess.dataBuffer[0].data, aOriginalHeader, aParameters->blocksize);
+		convProcess.dataBuffer[0].used = aParameters->blocksize;
+		if (!writeResumeFile(&convProcess)) {
+			fprintf(stderr, "Cannot write initial resume file.\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(aDevice->data, 0xaa, aHeaderSize);
+	} else if (!readResumeFile(aParameters, &convProcess)) {
+		fprintf(stderr, "Cannot read resume file.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	convProcess.usedBufferIndex = 0;
+	convProcess.endOutOffset = convProcess.writeDevSize;
+	convProcess.inOffset = resumeWindow(&convProcess)->used + convProcess.outOffset;
+	convProcess.batchChunks = aBatchChunks;
+	if (aSpillSize) {
+		convProcess.spill = spillCreate("/tmp/simdev_spill.bin", aParameters->blocksize, aSpillSize, convProcess.readDevSize);
+		if (!convProcess.spill) {
+			fprintf(stderr, "Cannot create spill file.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	enum copyResult_t result = startDataCopy(aParameters, &convProcess);
+	if (convProcess.spill) {
+		spillClose(convProcess.spill, true);
+	}
+	for (int i = 0; i < 2; i++) {
+		freeChunk(&convProcess.dataBuffer[i]);
+	}
+	freeChunk(&convProcess.pendingWindow);
+	return result;
+}
+
+static struct scenarioResult runScenario(const struct scenario *aScenario) {
+	struct scenarioResult result = { 0 };
+
+	struct simDeviceConfig config;
+	simDeviceDefaultConfig(&config, aScenario->deviceSize);
+	config.seed = aScenario->seed;
+	config.latencyDistribution = aScenario->latencyDistribution;
+	config.queueDepth = aScenario->queueDepth;
+	config.tornWriteProbability = aScenario->tornWriteProbability;
+	struct simDevice *device = simDeviceCreate(&config);
+	if (!device) {
+		fprintf(stderr, "Cannot create simulated device.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (aScenario->readErrorProbability > 0) {
+		simDeviceAddFault(device, SIMFAULT_READ_ERROR, 0, aScenario->deviceSize, aScenario->readErrorProbability);
+	}
+
+	uint8_t *original = malloc(aScenario->deviceSize);
+	fillPattern(original, aScenario->deviceSize, aScenario->seed);
+	memcpy(device->data, original, aScenario->deviceSize);
+
+	char resumeFilename[] = "/tmp/simdev_resume_XXXXXX";
+	int resumeFd = mkstemp(resumeFilename);
+	if (resumeFd == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	unlink(resumeFilename);
+
+	struct conversionParameters parameters;
+	memset(&parameters, 0, sizeof(parameters));
+	parameters.blocksize = aScenario->blocksize;
+	parameters.safetyChecks = true;
+	parameters.engine = aScenario->engine;
+
+	enum copyResult_t copyResult;
+	do {
+		clearSigQuit();
+		if (aScenario->resumeBlocksize) {
+			parameters.blocksize = (result.runs % 2) ? aScenario->resumeBlocksize : aScenario->blocksize;
+		}
+		copyResult = runConversion(&parameters, device, aScenario->headerSize, resumeFd, original, NULL, aScenario->batchChunks, aScenario->spillSize);
+		parameters.resuming = true;
+		result.runs++;
+	} while ((copyResult == COPYRESULT_SUCCESS_RESUMABLE) && (result.runs < 10000));
+	close(resumeFd);
+
+	/* The LUKS device must contain exactly the original plain data */
+	result.success = (copyResult == COPYRESULT_SUCCESS_FINISHED) && !memcmp(device->data + aScenario->headerSize, original, aScenario->deviceSize - aScenario->headerSize);
+	result.simulatedTime = device->clock;
+	result.device = device;
+	free(original);
+	return result;
+}
+
+static bool checkScenario(const struct scenario *aScenario) {
+	struct scenarioResult result = runScenario(aScenario);
+	fprintf(stderr, "%-32s %s  %5d run%s  %8.3f s simulated  %7.1f MiB/s  %4lu faults  %4lu torn writes\n",
+			aScenario->name, result.success ? "PASS" : "FAIL", result.runs, (result.runs == 1) ? " " : "s",
+			result.simulatedTime, (double)(aScenario->deviceSize - aScenario->headerSize) / result.simulatedTime / MiB,
+			(unsigned long)result.device->stats.faults, (unsigned long)result.device->stats.tornWrites);
+	simDeviceFree(result.device);
+	return result.success;
+}
+
+/* Two runs with the same seed must take exactly the same simulated time */
+static bool checkDeterminism(void) {
+	struct scenario scenario = {
+		.name = "determinism",
+		.deviceSize = 64 * MiB,
+		.headerSize = 2 * MiB,
+		.blocksize = 4 * MiB,
+		.seed = 1234,
+		.tornWriteProbability = 0.05,
+		.latencyDistribution = SIMLAT_EXPONENTIAL,
+		.queueDepth = 4,
+	};
+	struct scenarioResult result1 = runScenario(&scenario);
+	struct scenarioResult result2 = runScenario(&scenario);
+	bool success = result1.success && result2.success && (result1.runs == result2.runs) && (result1.simulatedTime == result2.simulatedTime);
+	fprintf(stderr, "%-32s %s  %.6f s / %.6f s\n", scenario.name, success ? "PASS" : "FAIL", result1.simulatedTime, result2.simulatedTime);
+	simDeviceFree(result1.device);
+	simDeviceFree(result2.device);
+	return success;
+}
+
+/* A recorded I/O trace must contain exactly the I/O the device has seen */
+static bool checkTraceRecording(void) {
+	const uint64_t deviceSize = 64 * MiB;
+	const uint32_t headerSize = 2 * MiB;
+	struct simDeviceConfig config;
+	simDeviceDefaultConfig(&config, deviceSize);
+	struct simDevice *device = simDeviceCreate(&config);
+	uint8_t *original = malloc(deviceSize);
+	fillPattern(original, deviceSize, 8);
+	memcpy(device->data, original, deviceSize);
+
+	char resumeFilename[] = "/tmp/simdev_resume_XXXXXX";
+	char traceFilename[] = "/tmp/simdev_trace_XXXXXX";
+	int resumeFd = mkstemp(resumeFilename);
+	int traceFd = mkstemp(traceFilename);
+	if ((resumeFd == -1) || (traceFd == -1)) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	unlink(resumeFilename);
+	close(traceFd);
+
+	struct conversionParameters parameters;
+	memset(&parameters, 0, sizeof(parameters));
+	parameters.blocksize = 4 * MiB;
+	parameters.safetyChecks = true;
+
+	struct traceFileHeader header = {
+		.readDevSize = deviceSize,
+		.writeDevSize = deviceSize - headerSize,
+		.blocksize = parameters.blocksize,
+	};
+	struct ioTrace *trace = traceCreate(traceFilename, &header);
+	clearSigQuit();
+	enum copyResult_t copyResult = runConversion(&parameters, device, headerSize, resumeFd, original, trace, 0, 0);
+	bool success = (copyResult == COPYRESULT_SUCCESS_FINISHED) && traceClose(trace);
+	close(resumeFd);
+
+	uint64_t count = 0;
+	uint64_t reads = 0, writes = 0, bytesRead = 0, bytesWritten = 0, lastTimestamp = 0;
+	struct traceRecord *records = traceLoad(traceFilename, &header, &count);
+	unlink(traceFilename);
+	success = success && records && (header.readDevSize == deviceSize) && (header.writeDevSize == deviceSize - headerSize);
+	for (uint64_t i = 0; success && (i < count); i++) {
+		if (records[i].timestamp < lastTimestamp) {
+			success = false;
+		}
+		lastTimestamp = records[i].timestamp;
+		if ((records[i].op == TRACEOP_READ) && (records[i].device == TRACEDEV_READ)) {
+			reads++;
+			bytesRead += records[i].result;
+		} else if ((records[i].op == TRACEOP_WRITE) && (records[i].device == TRACEDEV_WRITE)) {
+			writes++;
+			bytesWritten += records[i].result;
+		} else {
+			success = false;
+		}
+	}
+	success = success && (reads == device->stats.reads) && (writes == device->stats.writes) && (bytesRead == device->stats.bytesRead) && (bytesWritten == device->stats.bytesWritten);
+	fprintf(stderr, "%-32s %s  %lu operations recorded\n", "trace recording", success ? "PASS" : "FAIL", (unsigned long)count);
+	free(records);
+	free(original);
+	simDeviceFree(device);
+	return success;
+}
+
+/* Converts a regular file that serves as plain and (shifted by the header
+ * size) as LUKS device, which unlike the simulated device can be spliced.
+ * The first run stops after one chunk and leaves a resume file. */
+static enum copyResult_t runSplicedConversion(struct conversionParameters const *aParameters, int aFd, uint32_t aHeaderSize, int aResumeFd, const uint8_t *aOriginalHeader, uint64_t aDeviceSize) {
+	struct conversionProcess convProcess;
+	memset(&convProcess, 0, sizeof(convProcess));
+	convProcess.resumeFd = aResumeFd;
+	convProcess.readDevSize = aDeviceSize;
+	convProcess.writeDevSize = aDeviceSize - aHeaderSize;
+	initFdBackend(&convProcess.readBackend, aFd);
+	initFdBackend(&convProcess.writeBackend, aFd);
+	convProcess.writeBackend.offset = aHeaderSize;
+	for (int i = 0; i < 2; i++) {
+		if (!allocChunk(&convProcess.dataBuffer[i], aParameters->blocksize)) {
+			fprintf(stderr, "Cannot allocate chunk.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!aParameters->resuming) {
+		memcpy(convProcess.dataBuffer[0].data, aOriginalHeader, aParameters->blocksize);
+		convProcess.dataBuffer[0].used = aParameters->blocksize;
+		uint8_t *luksHeader = malloc(aHeaderSize);
+		memset(luksHeader, 0xaa, aHeaderSize);
+		if (pwrite(aFd, luksHeader, aHeaderSize, 0) != aHeaderSize) {
+			perror("pwrite");
+			exit(EXIT_FAILURE);
+		}
+		free(luksHeader);
+		convProcess.dryRunDeadline = 1;
+	} else if (!readResumeFile(aParameters, &convProcess)) {
+		fprintf(stderr, "Cannot read resume file.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	convProcess.usedBufferIndex = 0;
+	convProcess.endOutOffset = convProcess.writeDevSize;
+	convProcess.inOffset = resumeWindow(&convProcess)->used + convProcess.outOffset;
+	enum copyResult_t result = startDataCopy(aParameters, &convProcess);
+	if ((result == COPYRESULT_DRY_RUN_LIMIT_REACHED) && writeResumeFile(&convProcess)) {
+		result = COPYRESULT_SUCCESS_RESUMABLE;
+	}
+	for (int i = 0; i < 2; i++) {
+		freeChunk(&convProcess.dataBuffer[i]);
+	}
+	freeChunk(&convProcess.pendingWindow);
+	return result;
+}
+
+static bool checkSplice(void) {
+	const uint64_t deviceSize = 64 * MiB + 4096;
+	const uint32_t headerSize = MiB / 2 + 512;
+	uint8_t *original = malloc(deviceSize);
+	fillPattern(original, deviceSize, 13);
+
+	char deviceFilename[] = "/tmp/simdev_splice_XXXXXX";
+	char resumeFilename[] = "/tmp/simdev_resume_XXXXXX";
+	int fd = mkstemp(deviceFilename);
+	int resumeFd = mkstemp(resumeFilename);
+	if ((fd == -1) || (resumeFd == -1)) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	unlink(deviceFilename);
+	unlink(resumeFilename);
+	if (pwrite(fd, original, deviceSize, 0) != (ssize_t)deviceSize) {
+		perror("pwrite");
+		exit(EXIT_FAILURE);
+	}
+
+	struct conversionParameters parameters;
+	memset(&parameters, 0, sizeof(parameters));
+	parameters.blocksize = 4 * MiB;
+	parameters.safetyChecks = true;
+	parameters.engine = ENGINE_SPLICE;
+
+	clearSigQuit();
+	bool success = (runSplicedConversion(&parameters, fd, headerSize, resumeFd, original, deviceSize) == COPYRESULT_SUCCESS_RESUMABLE);
+	parameters.resuming = true;
+	success = success && (runSplicedConversion(&parameters, fd, headerSize, resumeFd, original, deviceSize) == COPYRESULT_SUCCESS_FINISHED);
+
+	uint8_t *converted = malloc(deviceSize);
+	success = success && (pread(fd, converted, deviceSize, 0) == (ssize_t)deviceSize);
+	success = success && !memcmp(converted + headerSize, original, deviceSize - headerSize);
+	fprintf(stderr, "%-32s %s\n", "spliced file", success ? "PASS" : "FAIL");
+	close(resumeFd);
+	close(fd);
+	free(converted);
+	free(original);
+	return success;
+}
+
+/* Stands in for dm-crypt: the data is XORed with a keystream that depends on
+ * the offset, so that plain data read through it looks random */
+static uint8_t keystreamByte(uint64_t aOffset) {
+	uint64_t z = (aOffset / 8) * 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= (z >> 31);
+	return z >> ((aOffset % 8) * 8);
+}
+
+static ssize_t cipherReadAt(struct ioBackend *aBackend, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct ioBackend *inner = aBackend->context;
+	ssize_t result = inner->readAt(inner, aData, aLength, aOffset);
+	for (ssize_t i = 0; i < result; i++) {
+		aData[i] ^= keystreamByte(aOffset + i);
+	}
+	return result;
+}
+
+static ssize_t cipherWriteAt(struct ioBackend *aBackend, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct ioBackend *inner = aBackend->context;
+	uint8_t *encrypted = malloc(aLength);
+	for (uint32_t i = 0; i < aLength; i++) {
+		encrypted[i] = aData[i] ^ keystreamByte(aOffset + i);
+	}
+	ssize_t result = inner->writeAt(inner, encrypted, aLength, aOffset);
+	free(encrypted);
+	return result;
+}
+
+/* Simulates a conversion that was killed at aBoundary without writing a
+ * resume file, recovers its state from the device and completes it. The
+ * plain data contains a region of random data, in which the boundary cannot
+ * be located. With aHighEntropy, all of the plain data is random; recovery
+ * must then refuse without touching the device or the resume file. Data that
+ * is lost is only zeroed with aZeroFill (--recover-zero-fill). */
+static bool checkRecoveryAt(uint64_t aBoundary, bool aZeroFill, bool aSpill, bool aHighEntropy, bool aExpectRecovery) {
+	const uint64_t deviceSize = 64 * MiB;
+	const uint32_t headerSize = 2 * MiB;
+	const uint64_t backupSize = 8 * MiB;
+	struct simDeviceConfig config;
+	simDeviceDefaultConfig(&config, deviceSize);
+	struct simDevice *device = simDeviceCreate(&config);
+	uint8_t *original = malloc(deviceSize);
+	fillPattern(original, deviceSize, 9);
+	for (uint64_t i = 0; i < deviceSize; i++) {
+		if (!aHighEntropy && ((i < 30 * MiB) || (i >= 34 * MiB))) {
+			original[i] = 'a' + (original[i] % 16);
+		}
+	}
+
+	/* Converted part, then the unchanged plain part */
+	memset(device->data, 0xaa, headerSize);
+	for (uint64_t i = 0; i < aBoundary; i++) {
+		device->data[headerSize + i] = original[i] ^ keystreamByte(i);
+	}
+	memcpy(device->data + headerSize + aBoundary, original + headerSize + aBoundary, deviceSize - headerSize - aBoundary);
+	uint8_t *interrupted = malloc(deviceSize);
+	memcpy(interrupted, device->data, deviceSize);
+
+	char resumeFilename[] = "/tmp/simdev_resume_XXXXXX";
+	char backupFilename[] = "/tmp/simdev_backup_XXXXXX";
+	int resumeFd = mkstemp(resumeFilename);
+	int backupFd = mkstemp(backupFilename);
+	if ((resumeFd == -1) || (backupFd == -1) || (write(backupFd, original, backupSize) != (ssize_t)backupSize)) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	unlink(resumeFilename);
+	close(backupFd);
+
+	struct conversionParameters parameters;
+	memset(&parameters, 0, sizeof(parameters));
+	parameters.blocksize = 4 * MiB;
+	parameters.safetyChecks = true;
+	parameters.recoverZeroFill = aZeroFill;
+	parameters.backupFile = backupFilename;
+
+	/* The chunk at the boundary and the one after it, as the copy loop
+	 * would have spilled them */
+	char spillFilename[] = "/tmp/simdev_spill_XXXXXX";
+	if (aSpill) {
+		close(mkstemp(spillFilename));
+		struct spillFile *spill = spillCreate(spillFilename, parameters.blocksize, 16 * MiB, deviceSize);
+		struct chunk spillChunk = { .data = original, .size = parameters.blocksize };
+		for (int i = 0; spill && (i < 2); i++) {
+			uint64_t offset = ((aBoundary / parameters.blocksize) + i) * parameters.blocksize;
+			spillChunk.data = original + offset;
+			spillChunk.used = parameters.blocksize;
+			spillStore(spill, i + 1, &spillChunk, offset);
+		}
+		if (spill) {
+			spillClose(spill, false);
+		}
+		parameters.spillFile = spillFilename;
+	}
+
+	struct conversionProcess convProcess;
+	memset(&convProcess, 0, sizeof(convProcess));
+	struct ioBackend rawWriteBackend;
+	convProcess.resumeFd = resumeFd;
+	convProcess.readDevSize = deviceSize;
+	convProcess.writeDevSize = deviceSize - headerSize;
+	initSimBackend(&convProcess.readBackend, device, 0);
+	initSimBackend(&rawWriteBackend, device, headerSize);
+	convProcess.writeBackend = (struct ioBackend) {
+		.name = "cipher",
+		.readAt = cipherReadAt,
+		.writeAt = cipherWriteAt,
+		.flush = rawWriteBackend.flush,
+		.context = &rawWriteBackend,
+	};
+	for (int i = 0; i < 2; i++) {
+		if (!allocChunk(&convProcess.dataBuffer[i], parameters.blocksize)) {
+			fprintf(stderr, "Cannot allocate chunk.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bool recovered = recoverConversionState(&parameters, &convProcess);
+	bool success = (recovered == aExpectRecovery);
+	if (recovered) {
+		success = success && (convProcess.outOffset == aBoundary);
+		convProcess.endOutOffset = convProcess.writeDevSize;
+		convProcess.inOffset = resumeWindow(&convProcess)->used + convProcess.outOffset;
+		clearSigQuit();
+		success = success && (startDataCopy(&parameters, &convProcess) == COPYRESULT_SUCCESS_FINISHED);
+
+		/* Everything but the data that was only held in memory must be
+		 * restored; that is recovered from the backup if it covers it */
+		uint64_t lostEnd = aBoundary + headerSize;
+		bool fromBackup = (lostEnd <= backupSize) || aSpill;
+		for (uint64_t i = 0; success && (i < deviceSize - headerSize); i++) {
+			uint8_t expected = ((i >= aBoundary) && (i < lostEnd) && !fromBackup) ? 0 : original[i];
+			success = ((device->data[headerSize + i] ^ keystreamByte(i)) == expected);
+		}
+	} else {
+		success = success && !memcmp(device->data, interrupted, deviceSize);
+		success = success && (lseek(resumeFd, 0, SEEK_END) == 0);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "recovery at %.2f MiB%s", (double)aBoundary / MiB, aSpill ? " (spill)" : (aHighEntropy ? " (random)" : (aZeroFill ? " (zeroed)" : "")));
+	fprintf(stderr, "%-32s %s  %s\n", name, success ? "PASS" : "FAIL", recovered ? "recovered" : "refused");
+	for (int i = 0; i < 2; i++) {
+		freeChunk(&convProcess.dataBuffer[i]);
+	}
+	close(resumeFd);
+	unlink(backupFilename);
+	if (aSpill) {
+		unlink(spillFilename);
+	}
+	free(interrupted);
+	free(original);
+	simDeviceFree(device);
+	return success;
+}
+
+static bool checkRecovery(void) {
+	bool success = true;
+	success = checkRecoveryAt(0, false, false, false, true) && success;
+	success = checkRecoveryAt(4 * MiB, false, false, false, true) && success;
+	success = checkRecoveryAt(20 * MiB, false, false, false, false) && success;
+	success = checkRecoveryAt(20 * MiB + 12 * 1024, true, false, false, true) && success;
+	success = checkRecoveryAt(31 * MiB, true, false, false, false) && success;
+	success = checkRecoveryAt(62 * MiB, true, false, false, true) && success;
+	success = checkRecoveryAt(22 * MiB + 12 * 1024, false, true, false, true) && success;
+	success = checkRecoveryAt(20 * MiB, true, false, true, false) && success;
+	return success;
+}
+
+/* Runs one (continued) rollback of the simulated device just like convert()
+ * does after the LUKS device has been opened */
+static enum copyResult_t runRollback(struct conversionParameters const *aParameters, struct simDevice *aDevice, uint32_t aHeaderSize, int aResumeFd) {
+	struct conversionProcess convProcess;
+	memset(&convProcess, 0, sizeof(convProcess));
+	convProcess.resumeFd = aResumeFd;
+	convProcess.readDevSize = aDevice->config.size;
+	convProcess.writeDevSize = aDevice->config.size - aHeaderSize;
+	initSimBackend(&convProcess.readBackend, aDevice, 0);
+	initSimBackend(&convProcess.writeBackend, aDevice, aHeaderSize);
+	for (int i = 0; i < 2; i++) {
+		if (!allocChunk(&convProcess.dataBuffer[i], aParameters->blocksize)) {
+			fprintf(stderr, "Cannot allocate chunk.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!rollbackPrepare(aParameters, &convProcess) || !rollbackStart(&convProcess)) {
+		fprintf(stderr, "Cannot start rollback.\n");
+		exit(EXIT_FAILURE);
+	}
+	enum copyResult_t result = startDataCopy(aParameters, &convProcess);
+	if (result == COPYRESULT_SUCCESS_FINISHED) {
+		result = rollbackFinish(aParameters, &convProcess);
+	}
+	for (int i = 0; i < 2; i++) {
+		freeChunk(&convProcess.dataBuffer[i]);
+	}
+	freeChunk(&convProcess.rollbackTail);
+	freeChunk(&convProcess.pendingWindow);
+	return result;
+}
+
+/* Aborts a conversion at a read error and rolls it back, which takes several
+ * runs if writes are torn. The plain device must be exactly as before the
+ * conversion, including the part luksFormat overwrote. The rollback runs
+ * alternate between the chunk size of the conversion and aBlocksize. */
+static bool checkRollback(const char *aName, uint32_t aHeaderSize, double aTornWriteProbability, uint32_t aBlocksize) {
+	const uint64_t deviceSize = 64 * MiB;
+	struct simDeviceConfig config;
+	simDeviceDefaultConfig(&config, deviceSize);
+	config.seed = 13;
+	struct simDevice *device = simDeviceCreate(&config);
+	uint8_t *original = malloc(deviceSize);
+	fillPattern(original, deviceSize, 13);
+	memcpy(device->data, original, deviceSize);
+
+	char resumeFilename[] = "/tmp/simdev_resume_XXXXXX";
+	int resumeFd = mkstemp(resumeFilename);
+	if (resumeFd == -1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	unlink(resumeFilename);
+
+	struct conversionParameters parameters;
+	memset(&parameters, 0, sizeof(parameters));
+	parameters.blocksize = 4 * MiB;
+	parameters.safetyChecks = true;
+
+	simDeviceAddFault(device, SIMFAULT_READ_ERROR, 30 * MiB, 30 * MiB + 1, 1);
+	clearSigQuit();
+	bool success = (runConversion(&parameters, device, aHeaderSize, resumeFd, original, NULL, 0, 0) == COPYRESULT_SUCCESS_RESUMABLE);
+	device->config.faultCount = 0;
+	device->config.tornWriteProbability = aTornWriteProbability;
+
+	parameters.resuming = true;
+	parameters.rollback = true;
+	enum copyResult_t copyResult = COPYRESULT_SUCCESS_RESUMABLE;
+	int runs = 0;
+	while (success && (copyResult == COPYRESULT_SUCCESS_RESUMABLE) && (runs < 1000)) {
+		clearSigQuit();
+		parameters.blocksize = (runs % 2) ? (4 * MiB) : aBlocksize;
+		copyResult = runRollback(&parameters, device, aHeaderSize, resumeFd);
+		runs++;
+	}
+	success = success && (copyResult == COPYRESULT_SUCCESS_FINISHED) && !memcmp(device->data, original, deviceSize);
+
+	fprintf(stderr, "%-32s %s  %4d runs  %5lu torn writes\n", aName, success ? "PASS" : "FAIL", runs, (unsigned long)device->stats.tornWrites);
+	close(resumeFd);
+	free(original);
+	simDeviceFree(device);
+	return success;
+}
+
+/* The random fill must write the ChaCha20 keystream (RFC 8439, test vector
+ * A.1 #1 for the all-zero key) for exactly the given range of the device */
+static bool checkRandomFill(void) {
+	static const uint8_t testVector[64] = {
+		0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+		0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+		0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+		0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86,
+	};
+	struct csprng prng;
+	memset(&prng, 0, sizeof(prng));
+	uint8_t block[64];
+	csprngGenerate(&prng, 0, block, sizeof(block));
+	bool success = !memcmp(block, testVector, sizeof(testVector));
+	csprngGenerate(&prng, 40, block, 24);
+	success = success && !memcmp(block, testVector + 40, 24);
+
+	const uint64_t deviceSize = 16 * MiB;
+	const uint64_t fillOffset = 3 * MiB + 100;
+	const uint64_t fillLength = 5 * MiB + 12345;
+	struct simDeviceConfig config;
+	simDeviceDefaultConfig(&config, deviceSize);
+	struct simDevice *device = simDeviceCreate(&config);
+	uint8_t *original = malloc(deviceSize);
+	uint8_t *expected = malloc(fillLength);
+	fillPattern(original, deviceSize, 16);
+	memcpy(device->data, original, deviceSize);
+
+	struct ioBackend target;
+	initSimBackend(&target, device, 0);
+	struct chunk buffers[2];
+	for (int i = 0; i < 2; i++) {
+		if (!allocChunk(&buffers[i], 1 * MiB)) {
+			fprintf(stderr, "Cannot allocate chunk.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	prng.key[0] = 16;
+	clearSigQuit();
+	success = fillRandomRange(&target, &prng, fillOffset, fillLength, buffers, 3) && success;
+	csprngGenerate(&prng, fillOffset, expected, fillLength);
+	success = success && !memcmp(device->data + fillOffset, expected, fillLength);
+	success = success && !memcmp(device->data, original, fillOffset);
+	success = success && !memcmp(device->data + fillOffset + fillLength, original + fillOffset + fillLength, deviceSize - fillOffset - fillLength);
+
+	fprintf(stderr, "%-32s %s\n", "random fill", success ? "PASS" : "FAIL");
+	for (int i = 0; i < 2; i++) {
+		freeChunk(&buffers[i]);
+	}
+	free(expected);
+	free(original);
+	simDeviceFree(device);
+	return success;
+}
+
+/* Copy rate of a synthetic hard disk, which is fastest on the outer tracks at
+ * the start of the disk and gets slower towards the end */
+static double syntheticDiskRate(uint64_t aOffset, uint64_t aDeviceSize) {
+	return (200. - 120. * (double)aOffset / (double)aDeviceSize) * MiB;
+}
+
+/* After copying the first third of a disk with decreasing throughput, the ETA
+ * must take the slower remainder into account */
+static bool checkThroughputModel(void) {
+	const uint64_t deviceSize = 1024 * MiB;
+	const uint64_t chunkSize = MiB;
+	const uint64_t measuredEnd = 342 * MiB;
+	struct throughputModel model;
+	memset(&model, 0, sizeof(model));
+	throughputInit(&model, deviceSize);
+
+	double now = 1000;
+	throughputStartTiming(&model, now);
+	for (uint64_t offset = 0; offset < measuredEnd; offset += chunkSize) {
+		now += chunkSize / syntheticDiskRate(offset, deviceSize);
+		throughputUpdate(&model, offset, chunkSize, now);
+	}
+	double actualRemaining = 0;
+	for (uint64_t offset = measuredEnd; offset < deviceSize; offset += chunkSize) {
+		actualRemaining += chunkSize / syntheticDiskRate(offset, deviceSize);
+	}
+	double projectedRemaining = throughputRemainingSeconds(&model, measuredEnd, deviceSize);
+	double averageRemaining = (deviceSize - measuredEnd) / (measuredEnd / (now - 1000));
+	double error = projectedRemaining / actualRemaining - 1;
+
+	bool success = (error > -0.02) && (error < 0.02);
+	fprintf(stderr, "%-32s %s  projected %.1f s, actual %.1f s, average rate %.1f s\n", "throughput model", success ? "PASS" : "FAIL", projectedRemaining, actualRemaining, averageRemaining);
+	return success;
+}
+
+int main(int argc, char **argv) {
+	setLogLevel(((argc > 1) && !strcmp(argv[1], "-v")) ? LLVL_DEBUG : LLVL_CRITICAL);
+
+	const struct scenario scenarios[] = {
+		{ .name = "clean", .deviceSize = 64 * MiB, .headerSize = 2 * MiB, .blocksize = 4 * MiB, .seed = 1, .queueDepth = 1 },
+		{ .name = "unaligned size", .deviceSize = 64 * MiB + 4096, .headerSize = 2 * MiB + 512, .blocksize = 4 * MiB, .seed = 2, .queueDepth = 1 },
+		{ .name = "deep queue", .deviceSize = 64 * MiB, .headerSize = 2 * MiB, .blocksize = 4 * MiB, .seed = 3, .queueDepth = 32 },
+		{ .name = "exponential latency", .deviceSize = 64 * MiB, .headerSize = 2 * MiB, .blocksize = 4 * MiB, .seed = 4, .queueDepth = 4, .latencyDistribution = SIMLAT_EXPONENTIAL },
+		{ .name = "torn writes", .deviceSize = 64 * MiB, .headerSize = 2 * MiB, .blocksize = 4 * MiB, .seed = 5, .queueDepth = 1, .tornWriteProbability = 0.2 },
+		{ .name = "read errors", .deviceSize = 64 * MiB, .headerSize = 2 * MiB, .blocksize = 4 * MiB, .seed = 6, .queueDepth = 1, .readErrorProbability = 0.2 },
+		{ .name = "torn writes and read errors", .deviceSize = 64 * MiB, .headerSize = 4 * MiB, .blocksize = 4 * MiB, .seed = 7, .queueDepth = 1, .tornWriteProbability = 0.3, .readErrorProbability = 0.3 },
+		{ .name = "batched", .deviceSize = 64 * MiB, .headerSize = 2 * MiB, .blocksize = 4 * MiB, .seed = 8, .queueDepth = 1, .batchChunks = 5 },
+		{ .name = "batched unaligned size", .deviceSize = 64 * MiB + 4096, .headerSize = 2 * MiB + 512, .blocksize = 4 * MiB, .seed = 9, .queueDepth = 1, .batchChunks = 3 },
+		{ .name = "batched torn writes and errors", .deviceSize = 64 * MiB, .headerSize = 4 * MiB, .blocksize = 4 * MiB, .seed = 10, .queueDepth = 1, .tornWriteProbability = 0.3, .readErrorProbability = 0.3, .batchChunks = 6 },
+		{ .name = "spilled", .deviceSize = 64 * MiB + 4096, .headerSize = 2 * MiB + 512, .blocksize = 4 * MiB, .seed = 11, .queueDepth = 1, .spillSize = 40 * MiB },
+		{ .name = "spilled torn writes and errors", .deviceSize = 64 * MiB, .headerSize = 4 * MiB, .blocksize = 4 * MiB, .seed = 12, .queueDepth = 1, .tornWriteProbability = 0.3, .readErrorProbability = 0.3, .spillSize = 24 * MiB },
+		{ .name = "spliced torn writes and errors", .deviceSize = 64 * MiB + 4096, .headerSize = 2 * MiB + 512, .blocksize = 4 * MiB, .seed = 13, .queueDepth = 1, .tornWriteProbability = 0.3, .readErrorProbability = 0.3, .engine = ENGINE_SPLICE },
+		{ .name = "retuned chunk size", .deviceSize = 64 * MiB + 4096, .headerSize = 1 * MiB + 512, .blocksize = 4 * MiB, .seed = 14, .queueDepth = 1, .tornWriteProbability = 0.3, .readErrorProbability = 0.3, .resumeBlocksize = 1 * MiB + 4096 },
+		{ .name = "retuned chunk size (batched)", .deviceSize = 64 * MiB, .headerSize = 2 * MiB, .blocksize = 2 * MiB, .seed = 15, .queueDepth = 1, .tornWriteProbability = 0.3, .readErrorProbability = 0.3, .batchChunks = 4, .resumeBlocksize = 6 * MiB },
+	};
+
+	int failures = 0;
+	for (unsigned int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		if (!checkScenario(&scenarios[i])) {
+			failures++;
+		}
+	}
+	if (!checkDeterminism()) {
+		failures++;
+	}
+	if (!checkTraceRecording()) {
+		failures++;
+	}
+	if (!checkThroughputModel()) {
+		failures++;
+	}
+	if (!checkSplice()) {
+		failures++;
+	}
+	if (!checkRecovery()) {
+		failures++;
+	}
+	if (!checkRandomFill()) {
+		failures++;
+	}
+	if (!checkRollback("rollback", 2 * MiB, 0, 4 * MiB)) {
+		failures++;
+	}
+	if (!checkRollback("rollback torn writes", 4 * MiB - 4096, 0.3, 4 * MiB)) {
+		failures++;
+	}
+	if (!checkRollback("rollback retuned chunk size", 2 * MiB, 0.3, 2 * MiB + 4096)) {
+		failures++;
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d test(s) failed.\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
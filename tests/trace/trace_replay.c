@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "chunk.h"
+#include "simdev.h"
+#include "utils.h"
+#include "logging.h"
+#include "parameters.h"
+
+#define MiB					(1024 * 1024)
+#define TRACEOP_COUNT		3
+
+struct replayOptions {
+	bool print;
+	bool keepTiming;
+	bool simulate;
+	double throughput;
+	double latency;
+	int queueDepth;
+	const char *traceFilename;
+	const char *target;
+};
+
+/* Latencies (in seconds) and volume of one kind of operation */
+struct opStats {
+	uint64_t count, errors, bytes;
+	double *latencies;
+	double busyTime;
+};
+
+static const char *opNames[TRACEOP_COUNT] = {
+	[TRACEOP_READ] = "read",
+	[TRACEOP_WRITE] = "write",
+	[TRACEOP_FLUSH] = "flush",
+};
+
+static const char *engineName(uint32_t aEngine) {
+	switch (aEngine) {
+		case ENGINE_DMCRYPT:
+			return "dm-crypt";
+		case ENGINE_USERSPACE:
+			return "userspace";
+		case ENGINE_SPLICE:
+			return "splice";
+	}
+	return "unknown";
+}
+
+static bool initStats(struct opStats *aStats, uint64_t aMaxCount) {
+	memset(aStats, 0, sizeof(struct opStats));
+	aStats->latencies = malloc((aMaxCount ? aMaxCount : 1) * sizeof(double));
+	return aStats->latencies != NULL;
+}
+
+static void addStats(struct opStats *aStats, const struct traceRecord *aRecord, ssize_t aResult, double aLatency) {
+	aStats->latencies[aStats->count++] = aLatency;
+	aStats->busyTime += aLatency;
+	if (aResult < 0) {
+		aStats->errors++;
+	} else if (aRecord->op != TRACEOP_FLUSH) {
+		aStats->bytes += aResult;
+	}
+}
+
+static int compareDouble(const void *aValue1, const void *aValue2) {
+	double value1 = *(const double*)aValue1;
+	double value2 = *(const double*)aValue2;
+	return (value1 > value2) - (value1 < value2);
+}
+
+static double percentile(struct opStats *aStats, double aPercentile) {
+	if (!aStats->count) {
+		return 0;
+	}
+	qsort(aStats->latencies, aStats->count, sizeof(double), compareDouble);
+	uint64_t index = aPercentile * (aStats->count - 1) / 100;
+	return aStats->latencies[index];
+}
+
+static double getMonotonicTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (1e-9 * ts.tv_nsec);
+}
+
+static void printRecords(const struct traceRecord *aRecords, uint64_t aCount) {
+	printf("# time [s]  device op     offset          length   latency [us]  result\n");
+	for (uint64_t i = 0; i < aCount; i++) {
+		const struct traceRecord *record = &aRecords[i];
+		printf("%12.6f  %-6s %-6s 0x%012" PRIx64 " %9u %12u  %d\n", record->timestamp * 1e-9, (record->device == TRACEDEV_READ) ? "read" : "write",
+				(record->op < TRACEOP_COUNT) ? opNames[record->op] : "?", record->offset, record->length, record->latency, record->result);
+	}
+}
+
+/* Opens the replay target, which is grown to the size of the traced disk if
+ * it is a regular file */
+static int openTarget(const char *aFilename, uint64_t aSize) {
+	int fd = open(aFilename, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", aFilename, strerror(errno));
+		return -1;
+	}
+	struct stat statBuf;
+	if ((fstat(fd, &statBuf) == 0) && S_ISREG(statBuf.st_mode) && ((uint64_t)statBuf.st_size < aSize)) {
+		if (ftruncate(fd, aSize) == -1) {
+			fprintf(stderr, "%s: cannot grow to %" PRIu64 " bytes: %s\n", aFilename, aSize, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	uint64_t targetSize = lseek(fd, 0, SEEK_END);
+	if (targetSize < aSize) {
+		fprintf(stderr, "%s: %" PRIu64 " bytes are too small for the traced disk of %" PRIu64 " bytes.\n", aFilename, targetSize, aSize);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool replay(const struct replayOptions *aOptions, const struct traceFileHeader *aHeader, const struct traceRecord *aRecords, uint64_t aCount, struct opStats *aStats) {
+	/* The LUKS device is shifted by the header size on the same disk */
+	uint64_t headerSize = (aHeader->readDevSize > aHeader->writeDevSize) ? (aHeader->readDevSize - aHeader->writeDevSize) : 0;
+	uint32_t maxLength = aHeader->blocksize;
+	for (uint64_t i = 0; i < aCount; i++) {
+		if (aRecords[i].length > maxLength) {
+			maxLength = aRecords[i].length;
+		}
+	}
+
+	struct ioBackend backend;
+	struct simDevice *device = NULL;
+	int fd = -1;
+	if (aOptions->simulate) {
+		struct simDeviceConfig config;
+		simDeviceDefaultConfig(&config, aHeader->readDevSize);
+		if (aOptions->throughput > 0) {
+			config.throughput = aOptions->throughput;
+		}
+		if (aOptions->latency > 0) {
+			config.latency = aOptions->latency;
+		}
+		if (aOptions->queueDepth > 0) {
+			config.queueDepth = aOptions->queueDepth;
+		}
+		device = simDeviceCreate(&config);
+		if (!device) {
+			fprintf(stderr, "Cannot create simulated device of %" PRIu64 " bytes.\n", aHeader->readDevSize);
+			return false;
+		}
+		initSimBackend(&backend, device, 0);
+	} else {
+		fd = openTarget(aOptions->target, aHeader->readDevSize);
+		if (fd == -1) {
+			return false;
+		}
+		initFdBackend(&backend, fd);
+	}
+
+	struct chunk buffer;
+	if (!allocChunk(&buffer, maxLength)) {
+		fprintf(stderr, "Cannot allocate %u bytes of I/O buffer.\n", maxLength);
+		simDeviceFree(device);
+		if (fd != -1) {
+			close(fd);
+		}
+		return false;
+	}
+
+	double startTime = getMonotonicTime();
+	for (uint64_t i = 0; i < aCount; i++) {
+		const struct traceRecord *record = &aRecords[i];
+		if (record->op >= TRACEOP_COUNT) {
+			continue;
+		}
+		if (aOptions->keepTiming) {
+			/* Do not issue the operation earlier than it was recorded */
+			double issueTime = record->timestamp * 1e-9;
+			if (device) {
+				if (device->clock < issueTime) {
+					device->clock = issueTime;
+				}
+			} else {
+				double delay = issueTime - (getMonotonicTime() - startTime);
+				if (delay > 0) {
+					usleep(delay * 1e6);
+				}
+			}
+		}
+
+		uint64_t offset = record->offset + ((record->device == TRACEDEV_WRITE) ? headerSize : 0);
+		double opStartTime = device ? device->clock : getMonotonicTime();
+		ssize_t result;
+		if (record->op == TRACEOP_READ) {
+			result = chunkReadFrom(&buffer, &backend, offset, record->length);
+		} else if (record->op == TRACEOP_WRITE) {
+			buffer.used = record->length;
+			result = chunkWriteTo(&buffer, &backend, offset);
+		} else {
+			result = backendFlush(&backend) ? 1 : -1;
+		}
+		double latency = (device ? device->clock : getMonotonicTime()) - opStartTime;
+		addStats(&aStats[record->op], record, result, latency);
+	}
+
+	freeChunk(&buffer);
+	simDeviceFree(device);
+	if (fd != -1) {
+		close(fd);
+	}
+	return true;
+}
+
+static void printComparison(struct opStats *aRecorded, struct opStats *aReplayed) {
+	printf("%-6s %8s %10s | %-32s | %-32s\n", "", "", "", "recorded", "replayed");
+	printf("%-6s %8s %10s | %10s %10s %10s | %10s %10s %10s\n", "op", "count", "MiB", "p50 [ms]", "p99 [ms]", "MiB/s", "p50 [ms]", "p99 [ms]", "MiB/s");
+	for (int op = 0; op < TRACEOP_COUNT; op++) {
+		if (!aRecorded[op].count) {
+			continue;
+		}
+		double recordedRate = aRecorded[op].busyTime ? (aRecorded[op].bytes / aRecorded[op].busyTime / MiB) : 0;
+		double replayedRate = aReplayed[op].busyTime ? (aReplayed[op].bytes / aReplayed[op].busyTime / MiB) : 0;
+		printf("%-6s %8" PRIu64 " %10.1f | %10.3f %10.3f %10.1f | %10.3f %10.3f %10.1f\n", opNames[op], aRecorded[op].count, (double)aRecorded[op].bytes / MiB,
+				1e3 * percentile(&aRecorded[op], 50), 1e3 * percentile(&aRecorded[op], 99), recordedRate,
+				1e3 * percentile(&aReplayed[op], 50), 1e3 * percentile(&aReplayed[op], 99), replayedRate);
+		if (aRecorded[op].errors || aReplayed[op].errors) {
+			printf("%-6s %" PRIu64 " errors recorded, %" PRIu64 " errors replayed\n", "", aRecorded[op].errors, aReplayed[op].errors);
+		}
+	}
+	double recordedTime = 0, replayedTime = 0;
+	for (int op = 0; op < TRACEOP_COUNT; op++) {
+		recordedTime += aRecorded[op].busyTime;
+		replayedTime += aReplayed[op].busyTime;
+	}
+	printf("Time spent in I/O: %.3f s recorded, %.3f s replayed\n", recordedTime, replayedTime);
+}
+
+static void syntax(const char *aName) {
+	fprintf(stderr, "%s (-p, --print) (-t, --timing) (-s, --simulate) (--throughput=BYTES)\n", aName);
+	fprintf(stderr, "    (--latency=MS) (--queue-depth=N) TRACEFILE (TARGET)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Replays an I/O trace recorded with luksipc --record-trace against TARGET (an image\n");
+	fprintf(stderr, "file or block device, WHICH IS OVERWRITTEN) or, with --simulate, against a\n");
+	fprintf(stderr, "simulated device, and compares recorded and replayed latencies. Operations are\n");
+	fprintf(stderr, "issued back to back unless --timing is given, which keeps the recorded issue\n");
+	fprintf(stderr, "times. --print only dumps the trace.\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	struct replayOptions options = { 0 };
+	enum { OPT_THROUGHPUT = 0x1000, OPT_LATENCY, OPT_QUEUEDEPTH };
+	struct option longOptions[] = {
+		{ "print", 0, NULL, 'p' },
+		{ "timing", 0, NULL, 't' },
+		{ "simulate", 0, NULL, 's' },
+		{ "throughput", 1, NULL, OPT_THROUGHPUT },
+		{ "latency", 1, NULL, OPT_LATENCY },
+		{ "queue-depth", 1, NULL, OPT_QUEUEDEPTH },
+		{ 0 }
+	};
+	int character;
+	while ((character = getopt_long(argc, argv, "pts", longOptions, NULL)) != -1) {
+		switch (character) {
+			case 'p': options.print = true; break;
+			case 't': options.keepTiming = true; break;
+			case 's': options.simulate = true; break;
+			case OPT_THROUGHPUT: {
+				uint64_t throughput;
+				if (!parseByteSize(optarg, &throughput)) {
+					syntax(argv[0]);
+				}
+				options.throughput = throughput;
+				break;
+			}
+			case OPT_LATENCY: options.latency = atof(optarg) / 1e3; break;
+			case OPT_QUEUEDEPTH: options.queueDepth = atoi(optarg); break;
+			default: syntax(argv[0]);
+		}
+	}
+	if (optind >= argc) {
+		syntax(argv[0]);
+	}
+	options.traceFilename = argv[optind++];
+	options.target = (optind < argc) ? argv[optind++] : NULL;
+	if ((optind != argc) || (!options.print && !options.simulate && !options.target) || (options.simulate && options.target)) {
+		syntax(argv[0]);
+	}
+	setLogLevel(LLVL_ERROR);
+
+	struct traceFileHeader header;
+	uint64_t count;
+	struct traceRecord *records = traceLoad(options.traceFilename, &header, &count);
+	if (!records) {
+		return EXIT_FAILURE;
+	}
+	if (options.print) {
+		printRecords(records, count);
+		free(records);
+		return EXIT_SUCCESS;
+	}
+
+	fprintf(stderr, "%s: %" PRIu64 " operations, read device %" PRIu64 " MiB, write device %" PRIu64 " MiB, chunk size %u MiB, %s engine\n",
+			options.traceFilename, count, header.readDevSize / MiB, header.writeDevSize / MiB, header.blocksize / MiB, engineName(header.engine));
+	struct opStats recorded[TRACEOP_COUNT], replayed[TRACEOP_COUNT];
+	for (int op = 0; op < TRACEOP_COUNT; op++) {
+		if (!initStats(&recorded[op], count) || !initStats(&replayed[op], count)) {
+			fprintf(stderr, "Cannot allocate memory for statistics.\n");
+			return EXIT_FAILURE;
+		}
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		if (records[i].op < TRACEOP_COUNT) {
+			addStats(&recorded[records[i].op], &records[i], records[i].result, records[i].latency * 1e-6);
+		}
+	}
+
+	bool success = replay(&options, &header, records, count, replayed);
+	if (success) {
+		printComparison(recorded, replayed);
+	}
+	for (int op = 0; op < TRACEOP_COUNT; op++) {
+		free(recorded[op].latencies);
+		free(replayed[op].latencies);
+	}
+	free(records);
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,164 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "throughput.h"
+#include "logging.h"
+
+/* Zones for which less than this fraction was copied are too noisy to be used
+ * on their own */
+#define MIN_MEASURED_FRACTION			0.1
+
+/* Prepares the model for a device of the given size. A history that was
+ * restored from the resume file before is kept. */
+void throughputInit(struct throughputModel *aModel, uint64_t aDeviceSize) {
+	aModel->deviceSize = aDeviceSize;
+	aModel->lastUpdateTime = 0;
+	aModel->currentRate = 0;
+	memcpy(aModel->history.magic, THROUGHPUT_HISTORY_MAGIC, sizeof(aModel->history.magic));
+}
+
+void throughputStartTiming(struct throughputModel *aModel, double aNow) {
+	aModel->lastUpdateTime = aNow;
+}
+
+static uint64_t zoneStart(const struct throughputModel *aModel, int aZone) {
+	return aModel->deviceSize * aZone / THROUGHPUT_ZONES;
+}
+
+static int zoneOf(const struct throughputModel *aModel, uint64_t aOffset) {
+	int zone = (aModel->deviceSize > 0) ? (aOffset * THROUGHPUT_ZONES / aModel->deviceSize) : 0;
+	return (zone < THROUGHPUT_ZONES) ? zone : (THROUGHPUT_ZONES - 1);
+}
+
+/* Accounts a chunk of aLength bytes at aOffset that was copied since the
+ * last update. Bytes and time are split among the zones the chunk covers. */
+void throughputUpdate(struct throughputModel *aModel, uint64_t aOffset, uint64_t aLength, double aNow) {
+	double elapsed = aNow - aModel->lastUpdateTime;
+	aModel->lastUpdateTime = aNow;
+	if ((elapsed <= 0) || (aLength == 0) || (aModel->deviceSize == 0)) {
+		return;
+	}
+
+	uint64_t end = aOffset + aLength;
+	for (int zone = zoneOf(aModel, aOffset); (zone < THROUGHPUT_ZONES) && (zoneStart(aModel, zone) < end); zone++) {
+		uint64_t from = (aOffset > zoneStart(aModel, zone)) ? aOffset : zoneStart(aModel, zone);
+		uint64_t to = (end < zoneStart(aModel, zone + 1)) ? end : zoneStart(aModel, zone + 1);
+		if (zone == THROUGHPUT_ZONES - 1) {
+			to = end;
+		}
+		if (to > from) {
+			aModel->history.zoneBytes[zone] += to - from;
+			aModel->history.zoneSeconds[zone] += elapsed * (to - from) / aLength;
+		}
+	}
+
+	double rate = aLength / elapsed;
+	if (aModel->currentRate <= 0) {
+		aModel->currentRate = rate;
+	} else {
+		double alpha = 1 - exp(-elapsed / THROUGHPUT_EWMA_SECONDS);
+		aModel->currentRate += alpha * (rate - aModel->currentRate);
+	}
+}
+
+/* Measured rate of a zone in bytes/sec or 0 if it was not measured well
+ * enough */
+double throughputZoneRate(const struct throughputModel *aModel, int aZone) {
+	uint64_t zoneSize = zoneStart(aModel, aZone + 1) - zoneStart(aModel, aZone);
+	if ((aModel->history.zoneSeconds[aZone] <= 0) || (aModel->history.zoneBytes[aZone] < MIN_MEASURED_FRACTION * zoneSize)) {
+		return 0;
+	}
+	return aModel->history.zoneBytes[aZone] / aModel->history.zoneSeconds[aZone];
+}
+
+/* Projects the time needed to copy [aOffset, aEndOffset) in seconds, or
+ * returns a negative value if nothing has been measured yet */
+double throughputRemainingSeconds(const struct throughputModel *aModel, uint64_t aOffset, uint64_t aEndOffset) {
+	/* Least squares fit of the rate over the zone index, weighted by the
+	 * number of bytes that were measured */
+	double sumWeight = 0, sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+	double minRate = 0, maxRate = 0;
+	int measuredZones = 0;
+	for (int zone = 0; zone < THROUGHPUT_ZONES; zone++) {
+		double rate = throughputZoneRate(aModel, zone);
+		if (rate <= 0) {
+			continue;
+		}
+		double weight = aModel->history.zoneBytes[zone];
+		sumWeight += weight;
+		sumX += weight * zone;
+		sumY += weight * rate;
+		sumXX += weight * zone * zone;
+		sumXY += weight * zone * rate;
+		minRate = ((measuredZones == 0) || (rate < minRate)) ? rate : minRate;
+		maxRate = (rate > maxRate) ? rate : maxRate;
+		measuredZones++;
+	}
+	if (measuredZones == 0) {
+		return (aModel->currentRate > 0) ? ((aEndOffset - aOffset) / aModel->currentRate) : -1;
+	}
+
+	double slope = 0, intercept = sumY / sumWeight;
+	double denominator = (sumWeight * sumXX) - (sumX * sumX);
+	if ((measuredZones >= 2) && (denominator > 0)) {
+		slope = ((sumWeight * sumXY) - (sumX * sumY)) / denominator;
+		intercept = (sumY - (slope * sumX)) / sumWeight;
+	}
+
+	double seconds = 0;
+	for (int zone = zoneOf(aModel, aOffset); (zone < THROUGHPUT_ZONES) && (zoneStart(aModel, zone) < aEndOffset); zone++) {
+		uint64_t from = (aOffset > zoneStart(aModel, zone)) ? aOffset : zoneStart(aModel, zone);
+		uint64_t to = (aEndOffset < zoneStart(aModel, zone + 1)) ? aEndOffset : zoneStart(aModel, zone + 1);
+		if (to <= from) {
+			continue;
+		}
+		double rate = throughputZoneRate(aModel, zone);
+		if (rate <= 0) {
+			/* Extrapolated, but never faster than any measured zone and never
+			 * slower than a quarter of the slowest one */
+			rate = intercept + (slope * zone);
+			rate = (rate > maxRate) ? maxRate : rate;
+			rate = (rate < minRate / 4) ? (minRate / 4) : rate;
+		}
+		seconds += (to - from) / rate;
+	}
+	return seconds;
+}
+
+/* Reads the throughput history at the current position of a resume file.
+ * Resume files of older versions do not contain it, in which case the history
+ * is cleared. */
+bool throughputLoadHistory(int aFd, struct throughputHistory *aHistory) {
+	bool success = (read(aFd, aHistory, sizeof(struct throughputHistory)) == sizeof(struct throughputHistory));
+	if (!success || memcmp(aHistory->magic, THROUGHPUT_HISTORY_MAGIC, sizeof(aHistory->magic))) {
+		logmsg(LLVL_DEBUG, "Resume file contains no throughput history.\n");
+		memset(aHistory, 0, sizeof(struct throughputHistory));
+		return false;
+	}
+	return true;
+}
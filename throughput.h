@@ -0,0 +1,62 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __THROUGHPUT_H__
+#define __THROUGHPUT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define THROUGHPUT_ZONES				100
+#define THROUGHPUT_HISTORY_MAGIC		"LUKSIPCZ"
+#define THROUGHPUT_EWMA_SECONDS			30
+
+/* Measured copy rate of every zone (1% of the device); persisted at the end
+ * of the resume file so that the model survives an interruption */
+struct throughputHistory {
+	char magic[8];
+	uint64_t zoneBytes[THROUGHPUT_ZONES];
+	double zoneSeconds[THROUGHPUT_ZONES];
+};
+
+/* Throughput model for the ETA. Because disks (especially spinning ones) do
+ * not copy at the same rate everywhere, the remaining time is projected from
+ * the rates of the zones that were already measured and, for the zones that
+ * were not, from a linear fit of the measured rates over the position. */
+struct throughputModel {
+	uint64_t deviceSize;
+	double lastUpdateTime;
+	double currentRate;					/* Exponentially weighted moving average in bytes/sec */
+	struct throughputHistory history;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void throughputInit(struct throughputModel *aModel, uint64_t aDeviceSize);
+void throughputStartTiming(struct throughputModel *aModel, double aNow);
+void throughputUpdate(struct throughputModel *aModel, uint64_t aOffset, uint64_t aLength, double aNow);
+double throughputZoneRate(const struct throughputModel *aModel, int aZone);
+double throughputRemainingSeconds(const struct throughputModel *aModel, uint64_t aOffset, uint64_t aEndOffset);
+bool throughputLoadHistory(int aFd, struct throughputHistory *aHistory);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,202 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "trace.h"
+#include "logging.h"
+#include "utils.h"
+
+_Static_assert(sizeof(struct traceFileHeader) == 48, "trace file header must not contain padding");
+_Static_assert(sizeof(struct traceRecord) == 32, "trace record must not contain padding");
+
+uint64_t traceTimestamp(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+static bool traceFlushBuffer(struct ioTrace *aTrace) {
+	if (aTrace->bufferedRecords && !aTrace->writeError) {
+		if (!checkedWrite(aTrace->fd, aTrace->records, aTrace->bufferedRecords * sizeof(struct traceRecord))) {
+			logmsg(LLVL_ERROR, "Writing I/O trace failed, no further operations are recorded.\n");
+			aTrace->writeError = true;
+		}
+	}
+	aTrace->bufferedRecords = 0;
+	return !aTrace->writeError;
+}
+
+struct ioTrace *traceCreate(const char *aFilename, const struct traceFileHeader *aHeader) {
+	struct ioTrace *trace = calloc(1, sizeof(struct ioTrace));
+	if (!trace) {
+		return NULL;
+	}
+	trace->records = malloc(TRACE_BUFFER_RECORDS * sizeof(struct traceRecord));
+	if (!trace->records) {
+		free(trace);
+		return NULL;
+	}
+	trace->fd = open(aFilename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (trace->fd == -1) {
+		logmsg(LLVL_ERROR, "Cannot create I/O trace file %s: %s\n", aFilename, strerror(errno));
+		free(trace->records);
+		free(trace);
+		return NULL;
+	}
+
+	struct traceFileHeader header = *aHeader;
+	memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_FILE_VERSION;
+	header.recordSize = sizeof(struct traceRecord);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.startTime = ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+	if (!checkedWrite(trace->fd, &header, sizeof(header))) {
+		close(trace->fd);
+		free(trace->records);
+		free(trace);
+		return NULL;
+	}
+	trace->startTime = traceTimestamp();
+	return trace;
+}
+
+/* Records one operation that was issued at aIssueTime (see traceTimestamp)
+ * and has just completed */
+void traceRecordOp(struct ioTrace *aTrace, enum traceDevice_t aDevice, enum traceOp_t aOp, uint64_t aOffset, uint32_t aLength, ssize_t aResult, uint64_t aIssueTime) {
+	uint64_t latency = (traceTimestamp() - aIssueTime) / 1000;
+	struct traceRecord *record = &aTrace->records[aTrace->bufferedRecords++];
+	memset(record, 0, sizeof(struct traceRecord));
+	record->timestamp = aIssueTime - aTrace->startTime;
+	record->offset = aOffset;
+	record->length = aLength;
+	record->latency = (latency > UINT32_MAX) ? UINT32_MAX : latency;
+	record->result = (aResult < 0) ? -1 : aResult;
+	record->op = aOp;
+	record->device = aDevice;
+	aTrace->totalRecords++;
+	if (aTrace->bufferedRecords == TRACE_BUFFER_RECORDS) {
+		traceFlushBuffer(aTrace);
+	}
+}
+
+static ssize_t traceReadAt(struct ioBackend *aBackend, uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct traceTap *tap = (struct traceTap*)aBackend->context;
+	uint64_t issueTime = traceTimestamp();
+	ssize_t result = tap->inner.readAt(&tap->inner, aData, aLength, aOffset);
+	traceRecordOp(tap->trace, tap->device, TRACEOP_READ, aOffset, aLength, result, issueTime);
+	return result;
+}
+
+static ssize_t traceWriteAt(struct ioBackend *aBackend, const uint8_t *aData, uint32_t aLength, uint64_t aOffset) {
+	struct traceTap *tap = (struct traceTap*)aBackend->context;
+	uint64_t issueTime = traceTimestamp();
+	ssize_t result = tap->inner.writeAt(&tap->inner, aData, aLength, aOffset);
+	traceRecordOp(tap->trace, tap->device, TRACEOP_WRITE, aOffset, aLength, result, issueTime);
+	return result;
+}
+
+static bool traceFlush(struct ioBackend *aBackend) {
+	struct traceTap *tap = (struct traceTap*)aBackend->context;
+	uint64_t issueTime = traceTimestamp();
+	bool success = backendFlush(&tap->inner);
+	traceRecordOp(tap->trace, tap->device, TRACEOP_FLUSH, 0, 0, success ? 1 : -1, issueTime);
+	return success;
+}
+
+/* Wraps an initialized backend so that all operations on it are recorded.
+ * The original backend is moved into the trace, which therefore needs to
+ * outlive the backend. */
+void traceAttach(struct ioTrace *aTrace, struct ioBackend *aBackend, enum traceDevice_t aDevice) {
+	struct traceTap *tap = &aTrace->taps[aDevice];
+	tap->inner = *aBackend;
+	tap->trace = aTrace;
+	tap->device = aDevice;
+
+	memset(aBackend, 0, sizeof(struct ioBackend));
+	aBackend->name = "trace";
+	aBackend->readAt = traceReadAt;
+	aBackend->writeAt = traceWriteAt;
+	aBackend->flush = traceFlush;
+	aBackend->fd = tap->inner.fd;
+	aBackend->context = tap;
+}
+
+bool traceClose(struct ioTrace *aTrace) {
+	bool success = traceFlushBuffer(aTrace);
+	success = (close(aTrace->fd) == 0) && success;
+	logmsg(LLVL_INFO, "Recorded %" PRIu64 " I/O operations in trace file.\n", aTrace->totalRecords);
+	free(aTrace->records);
+	free(aTrace);
+	return success;
+}
+
+/* Reads a complete trace file into memory. Returns the records, which need
+ * to be freed by the caller, or NULL on error. */
+struct traceRecord *traceLoad(const char *aFilename, struct traceFileHeader *aHeader, uint64_t *aRecordCount) {
+	FILE *f = fopen(aFilename, "rb");
+	if (!f) {
+		logmsg(LLVL_ERROR, "Cannot open I/O trace file %s: %s\n", aFilename, strerror(errno));
+		return NULL;
+	}
+	if (fread(aHeader, sizeof(struct traceFileHeader), 1, f) != 1) {
+		logmsg(LLVL_ERROR, "%s: cannot read trace header.\n", aFilename);
+		fclose(f);
+		return NULL;
+	}
+	if (memcmp(aHeader->magic, TRACE_FILE_MAGIC, sizeof(aHeader->magic)) || (aHeader->version != TRACE_FILE_VERSION) || (aHeader->recordSize != sizeof(struct traceRecord))) {
+		logmsg(LLVL_ERROR, "%s: not a luksipc I/O trace of version %d.\n", aFilename, TRACE_FILE_VERSION);
+		fclose(f);
+		return NULL;
+	}
+
+	uint64_t capacity = TRACE_BUFFER_RECORDS;
+	struct traceRecord *records = malloc(capacity * sizeof(struct traceRecord));
+	*aRecordCount = 0;
+	while (records) {
+		size_t count = fread(records + *aRecordCount, sizeof(struct traceRecord), capacity - *aRecordCount, f);
+		*aRecordCount += count;
+		if (*aRecordCount < capacity) {
+			break;
+		}
+		capacity *= 2;
+		struct traceRecord *grown = realloc(records, capacity * sizeof(struct traceRecord));
+		if (!grown) {
+			free(records);
+		}
+		records = grown;
+	}
+	fclose(f);
+	if (!records) {
+		logmsg(LLVL_ERROR, "%s: cannot allocate memory for trace records.\n", aFilename);
+	}
+	return records;
+}
@@ -0,0 +1,100 @@
+/*
+	luksipc - Tool to convert block devices to LUKS in-place.
+	Copyright (C) 2011-2015 Johannes Bauer
+
+	This file is part of luksipc.
+
+	luksipc is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; this program is ONLY licensed under
+	version 3 of the License, later versions are explicitly excluded.
+
+	luksipc is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with luksipc; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+	Johannes Bauer <JohannesBauer@gmx.de>
+*/
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "chunk.h"
+
+#define TRACE_FILE_MAGIC				"LUKSIPCT"
+#define TRACE_FILE_VERSION				1
+#define TRACE_BUFFER_RECORDS			4096
+
+enum traceOp_t {
+	TRACEOP_READ,
+	TRACEOP_WRITE,
+	TRACEOP_FLUSH,
+};
+
+enum traceDevice_t {
+	TRACEDEV_READ,					/* Plain (or old LUKS) device */
+	TRACEDEV_WRITE,					/* New LUKS device, shifted by the header size on the same disk */
+};
+
+/* A trace file consists of this header followed by fixed size records, both
+ * in host byte order */
+struct traceFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t readDevSize, writeDevSize;
+	uint32_t blocksize;
+	uint32_t engine;				/* enum copyEngine_t */
+	uint64_t startTime;				/* Wall clock time in ns since the epoch */
+};
+
+struct traceRecord {
+	uint64_t timestamp;				/* Issue time in ns since the start of the trace */
+	uint64_t offset;
+	uint32_t length;
+	uint32_t latency;				/* Microseconds */
+	int32_t result;					/* Bytes transferred (1 for a successful flush), -1 on error */
+	uint8_t op;						/* enum traceOp_t */
+	uint8_t device;					/* enum traceDevice_t */
+	uint8_t reserved[2];
+};
+
+struct ioTrace;
+
+/* Sits in between an I/O backend and the copy engine and records every
+ * operation */
+struct traceTap {
+	struct ioBackend inner;
+	struct ioTrace *trace;
+	enum traceDevice_t device;
+};
+
+struct ioTrace {
+	int fd;
+	uint64_t startTime;				/* Monotonic clock in ns */
+	struct traceRecord *records;
+	unsigned int bufferedRecords;
+	uint64_t totalRecords;
+	bool writeError;
+	struct traceTap taps[2];
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+uint64_t traceTimestamp(void);
+struct ioTrace *traceCreate(const char *aFilename, const struct traceFileHeader *aHeader);
+void traceRecordOp(struct ioTrace *aTrace, enum traceDevice_t aDevice, enum traceOp_t aOp, uint64_t aOffset, uint32_t aLength, ssize_t aResult, uint64_t aIssueTime);
+void traceAttach(struct ioTrace *aTrace, struct ioBackend *aBackend, enum traceDevice_t aDevice);
+bool traceClose(struct ioTrace *aTrace);
+struct traceRecord *traceLoad(const char *aFilename, struct traceFileHeader *aHeader, uint64_t *aRecordCount);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
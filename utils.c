@@ -22,6 +22,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <sys/time.h>
@@ -53,7 +54,18 @@ bool safestrcpy(char *aDest, const char *aSrc, size_t aDestArraySize) {
 	return success;
 }
 
+/* Returns the size of a block device or regular file in bytes or 0 on
+ * error */
 uint64_t getDiskSizeOfFd(int aFd) {
+	struct stat statBuf;
+	if (fstat(aFd, &statBuf) == -1) {
+		perror("fstat getDiskSizeOfFd");
+		return 0;
+	}
+	if (S_ISREG(statBuf.st_mode)) {
+		return statBuf.st_size;
+	}
+
 	uint64_t result;
 	if (ioctl(aFd, BLKGETSIZE64, &result) == -1) {
 		perror("ioctl BLKGETSIZE64");
@@ -62,18 +74,57 @@ uint64_t getDiskSizeOfFd(int aFd) {
 	return result;
 }
 
+/* Determines the logical and physical block size of a block device. Regular
+ * files are treated like a device with 512 byte sectors. */
+bool getBlockSizesOfFd(int aFd, int *aLogical, int *aPhysical) {
+	struct stat statBuf;
+	if (fstat(aFd, &statBuf) == -1) {
+		return false;
+	}
+	if (S_ISREG(statBuf.st_mode)) {
+		*aLogical = 512;
+		*aPhysical = 512;
+		return true;
+	}
+
+	unsigned int physical;
+	if ((ioctl(aFd, BLKSSZGET, aLogical) == -1) || (ioctl(aFd, BLKPBSZGET, &physical) == -1)) {
+		return false;
+	}
+	*aPhysical = physical;
+	return true;
+}
+
 uint64_t getDiskSizeOfPath(const char *aPath) {
 	uint64_t diskSize;
 	int fd = open(aPath, O_RDONLY);
 	if (fd == -1) {
 		perror("open getDiskSizeOfPath");
-		diskSize = 0;
+		return 0;
 	}
 	diskSize = getDiskSizeOfFd(fd);
 	close(fd);
 	return diskSize;
 }
 
+bool checkedWrite(int aFd, void *aData, int aLength) {
+	ssize_t result = write(aFd, aData, aLength);
+	if (result != aLength) {
+		logmsg(LLVL_ERROR, "Error while trying to write %d bytes to file with FD #%d: only %ld bytes written: %s\n", aLength, aFd, result, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool checkedRead(int aFd, void *aData, int aLength) {
+	ssize_t result = read(aFd, aData, aLength);
+	if (result != aLength) {
+		logmsg(LLVL_ERROR, "Error while trying to read %d bytes from file with FD #%d: only %ld bytes read: %s\n", aLength, aFd, result, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
 double getTime(void) {
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
@@ -85,3 +136,33 @@ bool doesFileExist(const char *aFilename) {
 	int statResult = stat(aFilename, &statBuf);
 	return statResult == 0;
 }
+
+/* Parses a byte count with an optional binary suffix (k, M, G, T), e.g.
+ * "512M" or "1G". Negative values and values that do not fit into 64 bits
+ * are rejected. */
+bool parseByteSize(const char *aString, uint64_t *aValue) {
+	if (aString[strspn(aString, " \t")] == '-') {
+		/* strtoull() would negate them */
+		return false;
+	}
+	char *endPtr = NULL;
+	errno = 0;
+	unsigned long long value = strtoull(aString, &endPtr, 10);
+	if ((errno != 0) || (endPtr == aString)) {
+		return false;
+	}
+	uint64_t multiplier = 1;
+	switch (*endPtr) {
+		case 't': case 'T':	multiplier *= 1024;	// fall-through
+		case 'g': case 'G':	multiplier *= 1024;	// fall-through
+		case 'm': case 'M':	multiplier *= 1024;	// fall-through
+		case 'k': case 'K':	multiplier *= 1024; endPtr++;	break;
+		case 0: break;
+		default: return false;
+	}
+	if ((*endPtr != 0) || (value > UINT64_MAX / multiplier)) {
+		return false;
+	}
+	*aValue = value * multiplier;
+	return true;
+}
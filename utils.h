@@ -31,8 +31,12 @@
 bool safestrcpy(char *aDest, const char *aSrc, size_t aDestArraySize);
 uint64_t getDiskSizeOfFd(int aFd);
 uint64_t getDiskSizeOfPath(const char *aPath);
+bool getBlockSizesOfFd(int aFd, int *aLogical, int *aPhysical);
+bool checkedWrite(int aFd, void *aData, int aLength);
+bool checkedRead(int aFd, void *aData, int aLength);
 double getTime(void);
 bool doesFileExist(const char *aFilename);
+bool parseByteSize(const char *aString, uint64_t *aValue);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif